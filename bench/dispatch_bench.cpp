@@ -0,0 +1,78 @@
+// Virtual vs tagged dispatch on the init_render() scene.
+//
+// usage: dispatch_bench [width] [samples]
+// Renders the same scene single threaded through polymorphic_scene (bvh_node and the
+// material/texture virtuals) and through compiled_scene (flat BVH, switch dispatch),
+// reporting time and, where the kernel allows it, hardware counters.
+
+#include <iostream>
+#include <vector>
+
+#include "raytracer.h"
+#include "perf_counters.h"
+
+template <class scene_type>
+static double render_once(const scene_type& world, const camera& view, int width, int height, int samples,
+	perf_counters& counters, double& mean)
+{
+	double sum = 0;
+	double start = seconds_now();
+	counters.start();
+	for (int j = 0; j < height; j++) {
+		for (int i = 0; i < width; i++) {
+			color pixel_color(0, 0, 0);
+			for (int s = 0; s < samples; s++) {
+				auto u = (i + random_double()) / (width - 1);
+				auto v = (j + random_double()) / (height - 1);
+				pixel_color += ray_color(view.get_ray(u, v), world, max_depth);
+			}
+			sum += pixel_color.x() + pixel_color.y() + pixel_color.z();
+		}
+	}
+	counters.stop();
+	mean = sum / (3.0 * width * height * samples);
+	return seconds_now() - start;
+}
+
+static void report(const char* label, double seconds, double paths, const perf_counters& counters, double mean) {
+	std::cout << label << ": " << seconds << "s, " << paths / seconds * 1e-6 << " Mpaths/s, mean " << mean;
+	for (int e = 0; e < perf_counters::event_count; e++) {
+		auto ev = static_cast<perf_counters::event>(e);
+		std::cout << ", " << perf_counters::name(ev) << " ";
+		if (counters.available(ev))
+			std::cout << counters.value(ev);
+		else
+			std::cout << "n/a";
+	}
+	std::cout << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	int width = argc > 1 ? atoi(argv[1]) : 200;
+	int samples = argc > 2 ? atoi(argv[2]) : 8;
+	int height = static_cast<int>(width / aspect_ratio);
+
+	raytracer rt;
+	hittable_list world = rt.init_render();
+	camera view;
+	view.init(point3(13, 2, 3), point3(0), vup, 20.0, aspect_ratio, 0.1, 10.0, 0.0, 1.0);
+
+	double start = seconds_now();
+	bvh_node bvh(world, 0.0, 1.0);
+	double bvh_time = seconds_now() - start;
+	start = seconds_now();
+	compiled_scene scene;
+	scene.compile(world, 0.0, 1.0);
+	double compile_time = seconds_now() - start;
+	std::cout << world.objects.size() << " objects, bvh_node build " << bvh_time << "s, compile "
+		<< compile_time << "s (" << scene.nodes.size() << " nodes, " << scene.materials.size() << " materials)\n";
+
+	perf_counters counters;
+	double paths = double(width) * height * samples;
+	double mean;
+	double t = render_once(polymorphic_scene{ bvh }, view, width, height, samples, counters, mean);
+	report("virtual", t, paths, counters, mean);
+	t = render_once(scene, view, width, height, samples, counters, mean);
+	report("compiled", t, paths, counters, mean);
+	return 0;
+}
@@ -0,0 +1,175 @@
+// Sampling efficiency of direct lighting from an environment map.
+//
+// usage: env_bench [map.hdr | -] [width] [reference samples] [target rmse]
+// Without a file (or with -) a procedural sky with a small bright sun is used. Diffuse
+// spheres on a diffuse ground are lit by the map alone, one bounce, with the shadow ray
+// traced: each strategy below doubles its samples per pixel until the RMSE of the
+// displayed (gamma 2) image against a reference drops below the target, and reports the
+// time. The reference uses the map table with MIS at the given sample count. Single threaded.
+
+#include <iostream>
+#include <vector>
+
+#include "raytracer.h"
+
+enum strategy { uniform_hemisphere, cosine_weighted, map_table, map_table_mis, strategy_count };
+
+// procedural sun and sky: a bluish gradient above the horizon, dark ground below
+static shared_ptr<environment_map> sun_sky() {
+	const int w = 512, h = 256;
+	const vec3 sun = unit_vector(vec3(-0.6, 0.7, 0.4));
+	const double sun_cos = cos(degrees_to_radians(1.5));
+	std::vector<float> rgb(size_t(w) * h * 3);
+	for (int y = 0; y < h; y++) {
+		double theta = pi * (y + 0.5) / h;
+		for (int x = 0; x < w; x++) {
+			double phi = 2 * pi * (x + 0.5) / w - pi;
+			vec3 d(sin(theta) * cos(phi), cos(theta), -sin(theta) * sin(phi));
+			color c = d.y() > 0 ? (1 - d.y()) * color(0.7, 0.8, 0.9) + d.y() * color(0.2, 0.35, 0.7) : color(0.1, 0.09, 0.08);
+			if (dot(d, sun) > sun_cos)
+				c = color(2000, 1800, 1500);
+			for (int k = 0; k < 3; k++)
+				rgb[(size_t(y) * w + x) * 3 + k] = static_cast<float>(c[k]);
+		}
+	}
+	auto map = make_shared<environment_map>();
+	map->set_pixels(w, h, std::move(rgb));
+	return map;
+}
+
+static color direct_light(const ray& r, const compiled_scene& world, int method) {
+	hit_record rec;
+	if (!world.hit(r, 0.001, infinity, rec))
+		return world.background(r);
+	ray scattered;
+	color albedo;
+	if (!world.scatter(r, rec, albedo, scattered))
+		return color(0, 0, 0);
+
+	const vec3& n = rec.normal;
+	// diffuse reflection of the map from direction wi sampled with density pdf
+	auto estimate = [&](const vec3& wi, double pdf) {
+		double cos_theta = dot(wi, n);
+		ray shadow(rec.p, wi, r.time());
+		if (pdf <= 0 || cos_theta <= 0 || world.occluded(shadow, 0.001, infinity))
+			return color(0, 0, 0);
+		return albedo / pi * world.background(shadow) * cos_theta / pdf;
+	};
+
+	switch (method) {
+	case uniform_hemisphere: {
+		vec3 wi = random_unit_vector();
+		if (dot(wi, n) < 0)
+			wi = -wi;
+		return estimate(wi, 1 / (2 * pi));
+	}
+	case cosine_weighted: {
+		vec3 wi = unit_vector(n + random_unit_vector());
+		return estimate(wi, dot(wi, n) / pi);
+	}
+	case map_table: {
+		double pdf;
+		vec3 wi = world.env.sample(pdf);
+		return estimate(wi, pdf);
+	}
+	default: {
+		double pdf;
+		vec3 wi = world.env.sample(pdf);
+		color result = estimate(wi, pdf) * power_heuristic(pdf, fmax(0.0, dot(wi, n)) / pi);
+		wi = unit_vector(n + random_unit_vector());
+		pdf = dot(wi, n) / pi;
+		return result + estimate(wi, pdf) * power_heuristic(pdf, world.env.pdf(wi));
+	}
+	}
+}
+
+static double render_image(const compiled_scene& world, const camera& view, int width, int height, int samples, int method,
+	std::vector<color>& image)
+{
+	image.assign(size_t(width) * height, color(0, 0, 0));
+	double start = seconds_now();
+	for (int j = 0; j < height; j++) {
+		for (int i = 0; i < width; i++) {
+			color pixel_color(0, 0, 0);
+			for (int s = 0; s < samples; s++) {
+				auto u = (i + random_double()) / (width - 1);
+				auto v = (j + random_double()) / (height - 1);
+				pixel_color += direct_light(view.get_ray(u, v), world, method);
+			}
+			image[size_t(j) * width + i] = pixel_color / samples;
+		}
+	}
+	return seconds_now() - start;
+}
+
+static double mean(const std::vector<color>& a) {
+	double sum = 0;
+	for (const auto& c : a)
+		sum += c.x() + c.y() + c.z();
+	return sum / (3.0 * a.size());
+}
+
+static double display_rmse(const std::vector<color>& a, const std::vector<color>& b) {
+	double sum = 0;
+	for (size_t i = 0; i < a.size(); i++) {
+		for (int c = 0; c < 3; c++) {
+			double x = clamp(sqrt(a[i][c]), 0.0, 1.0), y = clamp(sqrt(b[i][c]), 0.0, 1.0);
+			sum += (x - y) * (x - y);
+		}
+	}
+	return sqrt(sum / (3.0 * a.size()));
+}
+
+int main(int argc, char* argv[]) {
+	std::string path = argc > 1 ? argv[1] : "-";
+	int width = argc > 2 ? atoi(argv[2]) : 96;
+	int reference_samples = argc > 3 ? atoi(argv[3]) : 1024;
+	double target = argc > 4 ? atof(argv[4]) : 0.03;
+	const int max_samples = 4096;
+
+	shared_ptr<environment_map> map;
+	if (path == "-") {
+		map = sun_sky();
+	}
+	else {
+		map = make_shared<environment_map>();
+		if (!map->load(path))
+			return 1;
+	}
+
+	hittable_list world;
+	world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(color(0.5, 0.5, 0.5))));
+	world.add(make_shared<sphere>(point3(-2.2, 1, 0), 1, make_shared<lambertian>(color(0.7, 0.3, 0.2))));
+	world.add(make_shared<sphere>(point3(0, 1, 0), 1, make_shared<lambertian>(color(0.8, 0.8, 0.8))));
+	world.add(make_shared<sphere>(point3(2.2, 1, 0), 1, make_shared<lambertian>(color(0.2, 0.4, 0.7))));
+	int height = static_cast<int>(width / aspect_ratio);
+	camera view;
+	view.init(point3(0, 2.5, 9), point3(0, 0.8, 0), vup, 30.0, double(width) / height, 0.0, 10.0, 0.0, 1.0);
+
+	compiled_scene scene;
+	scene.compile(world, 0.0, 1.0);
+	scene.env.map = map;
+	std::cout << "map " << map->width << "x" << map->height << ", image " << width << "x" << height << "\n";
+
+	std::vector<color> reference, image;
+	double t = render_image(scene, view, width, height, reference_samples, map_table_mis, reference);
+	std::cout << "reference: " << reference_samples << " spp in " << t << "s, mean " << mean(reference) << "\n";
+
+	const char* names[strategy_count] = { "uniform hemisphere", "cosine weighted", "map table", "map table + cosine mis" };
+	for (int method = 0; method < strategy_count; method++) {
+		double total = 0, rmse = 0;
+		int samples = 1;
+		for (; samples <= max_samples; samples *= 2) {
+			total += render_image(scene, view, width, height, samples, method, image);
+			rmse = display_rmse(image, reference);
+			if (rmse < target)
+				break;
+		}
+		std::cout << names[method] << " (mean " << mean(image) << "): ";
+		if (rmse < target)
+			std::cout << samples << " spp reach rmse " << rmse << ", " << total << "s including the smaller counts\n";
+		else
+			std::cout << "rmse " << rmse << " at " << max_samples << " spp, target not reached in " << total << "s\n";
+	}
+	return 0;
+}
@@ -0,0 +1,103 @@
+// Time to a noise level with and without next event estimation.
+//
+// usage: light_bench [pic_id] [width] [reference samples] [target rmse]
+// pic_id 6 is the Cornell box, 7 the field of small lamps. A reference is rendered with the
+// light BVH at the given sample count; each light sampling mode then doubles its samples
+// per pixel until the RMSE of the displayed (gamma 2) image against the reference drops
+// below the target, and the time that took is reported. Single threaded.
+
+#include <iostream>
+#include <vector>
+
+#include "raytracer.h"
+
+static double render_image(const compiled_scene& world, const camera& view, int width, int height, int samples,
+	std::vector<color>& image)
+{
+	image.assign(size_t(width) * height, color(0, 0, 0));
+	double start = seconds_now();
+	for (int j = 0; j < height; j++) {
+		for (int i = 0; i < width; i++) {
+			color pixel_color(0, 0, 0);
+			for (int s = 0; s < samples; s++) {
+				auto u = (i + random_double()) / (width - 1);
+				auto v = (j + random_double()) / (height - 1);
+				pixel_color += ray_color(view.get_ray(u, v), world, max_depth);
+			}
+			image[size_t(j) * width + i] = pixel_color / samples;
+		}
+	}
+	return seconds_now() - start;
+}
+
+static double mean(const std::vector<color>& a) {
+	double sum = 0;
+	for (const auto& c : a)
+		sum += c.x() + c.y() + c.z();
+	return sum / (3.0 * a.size());
+}
+
+static double display_rmse(const std::vector<color>& a, const std::vector<color>& b) {
+	double sum = 0;
+	for (size_t i = 0; i < a.size(); i++) {
+		for (int c = 0; c < 3; c++) {
+			double x = clamp(sqrt(a[i][c]), 0.0, 1.0), y = clamp(sqrt(b[i][c]), 0.0, 1.0);
+			sum += (x - y) * (x - y);
+		}
+	}
+	return sqrt(sum / (3.0 * a.size()));
+}
+
+int main(int argc, char* argv[]) {
+	int scene_id = argc > 1 ? atoi(argv[1]) : 6;
+	int width = argc > 2 ? atoi(argv[2]) : 100;
+	int reference_samples = argc > 3 ? atoi(argv[3]) : 1024;
+	double target = argc > 4 ? atof(argv[4]) : 0.03;
+	const int max_samples = 4096;
+
+	raytracer rt;
+	hittable_list world;
+	camera view;
+	int height;
+	if (scene_id == 7) {
+		world = rt.light_field();
+		height = static_cast<int>(width / aspect_ratio);
+		view.init(point3(0, 14, 18), point3(0, 0, 0), vup, 40.0, double(width) / height, 0.0, 10.0, 0.0, 1.0);
+	}
+	else {
+		world = rt.cornell_box();
+		height = width;
+		view.init(point3(278, 278, -800), point3(278, 278, 0), vup, 40.0, 1.0, 0.0, 10.0, 0.0, 1.0);
+	}
+
+	compiled_scene scene;
+	scene.compile(world, 0.0, 1.0);
+	scene.env.sky = false;
+	std::cout << scene.prims.size() << " prims, " << scene.lights.size() << " lights, " << width << "x" << height << "\n";
+
+	std::vector<color> reference, image;
+	scene.sample_lights = true;
+	scene.lights.use_bvh = true;
+	double t = render_image(scene, view, width, height, reference_samples, reference);
+	std::cout << "reference: " << reference_samples << " spp in " << t << "s, mean " << mean(reference) << "\n";
+
+	const char* names[3] = { "bsdf only", "uniform light", "light bvh" };
+	for (int mode = 0; mode < 3; mode++) {
+		scene.sample_lights = mode > 0;
+		scene.lights.use_bvh = mode == 2;
+		double total = 0, rmse = 0;
+		int samples = 1;
+		for (; samples <= max_samples; samples *= 2) {
+			total += render_image(scene, view, width, height, samples, image);
+			rmse = display_rmse(image, reference);
+			if (rmse < target)
+				break;
+		}
+		std::cout << names[mode] << " (mean " << mean(image) << "): ";
+		if (rmse < target)
+			std::cout << samples << " spp reach rmse " << rmse << ", " << total << "s including the smaller counts\n";
+		else
+			std::cout << "rmse " << rmse << " at " << max_samples << " spp, target not reached in " << total << "s\n";
+	}
+	return 0;
+}
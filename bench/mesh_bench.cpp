@@ -0,0 +1,166 @@
+// Triangle mesh benchmark: OBJ loading, mesh BVH build and SIMD vs scalar intersection.
+//
+// usage: mesh_bench [segments] [file.obj]
+// Without a file a displaced torus with 2 * segments^2 triangles is written to the
+// temp directory first (segments defaults to 1000, i.e. two million triangles).
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "rtweekend.h"
+#include "obj_loader.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start) {
+	return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static void write_torus(const std::string& path, int segments) {
+	std::ofstream out(path, std::ios::binary);
+	std::vector<char> buffer(1 << 20);
+	out.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+
+	char line[128];
+	for (int i = 0; i < segments; i++) {
+		double a = 2 * pi * i / segments;
+		for (int j = 0; j < segments; j++) {
+			double b = 2 * pi * j / segments;
+			double r = 0.4 + 0.02 * sin(13 * a) * sin(17 * b);
+			double x = (1.0 + r * cos(b)) * cos(a);
+			double y = r * sin(b);
+			double z = (1.0 + r * cos(b)) * sin(a);
+			int n = snprintf(line, sizeof(line), "v %.6f %.6f %.6f\n", x, y, z);
+			out.write(line, n);
+		}
+	}
+	for (int i = 0; i < segments; i++) {
+		for (int j = 0; j < segments; j++) {
+			int v00 = i * segments + j + 1;
+			int v01 = i * segments + (j + 1) % segments + 1;
+			int v10 = ((i + 1) % segments) * segments + j + 1;
+			int v11 = ((i + 1) % segments) * segments + (j + 1) % segments + 1;
+			int n = snprintf(line, sizeof(line), "f %d %d %d\nf %d %d %d\n", v00, v10, v11, v00, v11, v01);
+			out.write(line, n);
+		}
+	}
+}
+
+int main(int argc, char* argv[]) {
+	int segments = argc > 1 ? atoi(argv[1]) : 1000;
+	std::string path;
+	if (argc > 2) {
+		path = argv[2];
+	}
+	else {
+		path = (std::filesystem::temp_directory_path() / ("mesh_bench_" + std::to_string(segments) + ".obj")).string();
+		if (!std::filesystem::exists(path)) {
+			auto start = bench_clock::now();
+			write_torus(path, segments);
+			std::cout << "wrote " << path << " in " << seconds_since(start) << "s" << std::endl;
+		}
+	}
+
+	// loading, single threaded and on all hardware threads
+	unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+	auto start = bench_clock::now();
+	auto mesh = load_obj(path, 1);
+	double load_single = seconds_since(start);
+	if (!mesh)
+		return 1;
+	start = bench_clock::now();
+	mesh = load_obj(path, threads);
+	double load_multi = seconds_since(start);
+	std::cout << "triangles: " << mesh->triangle_count() << ", vertices: " << mesh->positions.size() << "\n";
+	std::cout << "obj load, 1 thread: " << load_single << "s, " << threads << " threads: " << load_multi << "s\n";
+
+	start = bench_clock::now();
+	triangle_mesh tri_mesh(mesh, nullptr);
+	std::cout << "bvh build: " << seconds_since(start) << "s, " << tri_mesh.node_count() << " nodes\n";
+
+	aabb box;
+	tri_mesh.bounding_box(0, 0, box);
+	point3 center = 0.5 * (box.getMin() + box.getMax());
+	double extent = (box.getMax() - box.getMin()).length();
+
+	// primary rays from a pinhole looking at the mesh from above and to the side
+	const int width = 512, height = 512;
+	point3 eye = center + extent * vec3(0.6, 0.8, 0.9);
+	vec3 w = unit_vector(eye - center);
+	vec3 u = unit_vector(cross(vec3(0, 1, 0), w));
+	vec3 v = cross(w, u);
+	std::vector<ray> rays;
+	rays.reserve(width * height);
+	for (int j = 0; j < height; j++) {
+		for (int i = 0; i < width; i++) {
+			double s = (i + 0.5) / width - 0.5, t = (j + 0.5) / height - 0.5;
+			rays.push_back(ray(eye, -w + 0.8 * s * u + 0.8 * t * v));
+		}
+	}
+
+	hit_record rec;
+	int hits = 0;
+	start = bench_clock::now();
+	for (const auto& r : rays)
+		hits += tri_mesh.hit(r, 0.001, infinity, rec);
+	double closest_time = seconds_since(start);
+	int blocked = 0;
+	start = bench_clock::now();
+	for (const auto& r : rays)
+		blocked += tri_mesh.occluded(r, 0.001, infinity);
+	double any_time = seconds_since(start);
+	std::cout << "closest hit: " << rays.size() / closest_time * 1e-6 << " Mrays/s (" << hits << " hits)\n";
+	std::cout << "any hit: " << rays.size() / any_time * 1e-6 << " Mrays/s (" << blocked << " blocked)\n";
+
+	// kernel only: the same packets and rays through the SIMD and scalar Moller-Trumbore
+	std::vector<triangle4> packets;
+	size_t tri_count = std::min<size_t>(mesh->triangle_count(), 1 << 16);
+	for (size_t base = 0; base < tri_count; base += 4) {
+		triangle4 packet = {};
+		for (int k = 0; k < 4 && base + k < tri_count; k++) {
+			const int* corner = &mesh->position_indices[3 * (base + k)];
+			const point3& a = mesh->positions[corner[0]];
+			const point3& b = mesh->positions[corner[1]];
+			const point3& c = mesh->positions[corner[2]];
+			for (int axis = 0; axis < 3; axis++) {
+				packet.v0[axis][k] = static_cast<float>(a[axis]);
+				packet.e1[axis][k] = static_cast<float>(b[axis] - a[axis]);
+				packet.e2[axis][k] = static_cast<float>(c[axis] - a[axis]);
+			}
+			packet.id[k] = static_cast<int>(base + k);
+		}
+		packets.push_back(packet);
+	}
+
+	const int kernel_rays = 64;
+	double kernel_time[2] = {};
+	long long kernel_hits[2] = {};
+	for (int variant = 0; variant < 2; variant++) {
+		start = bench_clock::now();
+		for (int k = 0; k < kernel_rays; k++) {
+			const ray& r = rays[(k * 7919) % rays.size()];
+			float o[3] = { (float)r.origin().x(), (float)r.origin().y(), (float)r.origin().z() };
+			float d[3] = { (float)r.direction().x(), (float)r.direction().y(), (float)r.direction().z() };
+			for (const auto& packet : packets) {
+				float t_max = std::numeric_limits<float>::infinity(), bu, bv;
+				int lane = variant == 0 ? triangle_mesh::intersect(packet, o, d, 0.001f, t_max, bu, bv)
+					: triangle_mesh::intersect_scalar(packet, o, d, 0.001f, t_max, bu, bv);
+				kernel_hits[variant] += lane >= 0;
+			}
+		}
+		kernel_time[variant] = seconds_since(start);
+	}
+	double tests = double(kernel_rays) * packets.size() * 4;
+	std::cout << "triangle kernel, simd: " << tests / kernel_time[0] * 1e-6 << " Mtests/s, scalar: "
+		<< tests / kernel_time[1] * 1e-6 << " Mtests/s";
+	if (kernel_hits[0] != kernel_hits[1])
+		std::cout << " (hit count mismatch " << kernel_hits[0] << " vs " << kernel_hits[1] << ")";
+	std::cout << std::endl;
+
+	return 0;
+}
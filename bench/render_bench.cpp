@@ -0,0 +1,536 @@
+// End-to-end renders of the reference scenes.
+//
+// usage: render_bench [--scenes a,b,...] [--width pixels] [--samples count] [--threads 1,2,4,...]
+//                     [--references dir] [--update] [--tolerance rmse] [--format text|csv|json] [--out file]
+//                     [--trace file] [--heatmaps dir] [--bvh] [--tile-size pixels]
+//                     [--tile-order columns|hilbert|spiral] [--no-split] [--numa 0,1,2]
+//                     [--serve address [--min-workers n] [--farm-tile pixels] [--sample-chunk samples]]
+//        render_bench --worker address [--threads n] [--numa mode]
+// Renders each scene headless through raytracer::render() in one full resolution pass,
+// once per thread count (and numa mode), and reports the scene build, trace and denoise time apart, with
+// Mrays/s and paths/s of the trace, its tail (from 95% of the tiles done to all of them)
+// and the speedup over the first thread count, plus the ray counters (bvh work per ray,
+// hit ratio, how paths end, rays per bounce). The
+// random sequence is reseeded before every render and each sample draws from its own
+// (seed, pixel, sample, bounce) stream, so an image repeats bit for bit across runs and
+// thread counts. Each image is compared to the stored reference of the same scene, size
+// and sample count (RMSE of the displayed 8-bit values in [0, 1]). --update writes every
+// reference from the first run's image and compares the other runs to it; without it a
+// missing reference fails the scene instead of being made up from the image under test.
+// The default tolerance of 0 asks for identical images, a small one allows for references
+// made by another compiler or with different floating point contraction. The exit status
+// is 2 when a run is above it or has no reference. CTest runs the small scenes against the
+// references in tests/references this way (the render_golden test).
+// The renderer's own log is silenced, progress goes to stderr. Built with RT_PROFILE,
+// --trace writes the profiling zones of all runs as a Chrome trace and prints their totals.
+// --heatmaps writes the cost heatmaps (bvh nodes, primitive tests, samples, tile time) of
+// each run as <dir>/<scene>_<threads>t_<kind>.ppm and .pfm. --bvh prints the depth, leaf
+// sizes, SAH cost, overlap and size of each scene's BVH to stderr. The tile options set
+// tileSize, tile_order and split_tiles (the defaults: automatic, hilbert, split).
+// --numa runs every thread count once per numa_placement mode (0 unpinned, 1 pinned, 2
+// pinned with per node scene copies and frame buffer bands), which with the default
+// thread counts up to the whole machine gives the scaling across sockets; the nodes
+// found are printed first.
+// --serve renders each scene over worker processes instead (src/distributed.h): it listens
+// on address (a port, host:port or unix:/path), hands out farm-tile sized tiles (64 by
+// default) of sample-chunk samples (all by default) once min-workers workers are connected,
+// and compares the assembled image to the reference like any other run. The tile sums come
+// back as floats, which can move a displayed value by one step against a local render, so
+// give it a small tolerance. --worker connects to a coordinator (waiting up to 30s for it
+// to come up), renders its tiles with the first of --threads and --numa and exits when the
+// coordinator is done. On one machine:
+//     render_bench --serve unix:/tmp/farm --min-workers 2 --tolerance 0.002 &
+//     render_bench --worker unix:/tmp/farm --threads 2 & render_bench --worker unix:/tmp/farm --threads 2
+//
+// scenes: book (init_render), two_sphere, cornell, light_field, forest (10000 tree
+// instances) and spheres (a scene file of 250000 random spheres written to the temp dir).
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include "raytracer.h"
+#include "distributed.h"
+
+static const unsigned seed = 20240613;
+
+struct reference_scene {
+	const char* name;
+	int pic;
+	std::function<bool()> setup;	//sets the globals the picture reads, false if it cannot
+};
+
+struct run_result {
+	std::string scene;
+	int threads = 0;
+	int numa = 0;			//numa_placement
+	int workers = 0;		//processes of a distributed run, 0 for a local one
+	render_stats stats;
+	double rmse = -1;		//-1 without a reference
+	bool stored = false;	//this image became the reference
+	bool missing = false;	//no reference and no --update
+};
+
+static bool write_spheres(const std::string& path, int count) {
+	if (std::filesystem::exists(path))
+		return true;
+	FILE* f = fopen(path.c_str(), "w");
+	if (!f) {
+		std::cerr << "render_bench: cannot write " << path << "\n";
+		return false;
+	}
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	auto rand = [&](double lo, double hi) { return lo + (hi - lo) * uniform(rng); };
+	fprintf(f, "{\n\t\"camera\": { \"lookfrom\": [0, 40, 120], \"lookat\": [0, 0, 0], \"vfov\": 40 },\n\t\"materials\": [\n");
+	const int material_count = 16;
+	for (int m = 0; m < material_count; m++)
+		fprintf(f, "\t\t{ \"name\": \"m%d\", \"type\": \"lambertian\", \"albedo\": [%.4f, %.4f, %.4f] },\n", m, rand(0.1, 0.9), rand(0.1, 0.9), rand(0.1, 0.9));
+	fprintf(f, "\t\t{ \"name\": \"ground\", \"type\": \"lambertian\", \"albedo\": [0.5, 0.5, 0.5] }\n\t],\n\t\"objects\": [\n");
+	fprintf(f, "\t\t{ \"type\": \"sphere\", \"center\": [0, -10000, 0], \"radius\": 10000, \"material\": \"ground\" },\n");
+	for (int i = 0; i < count; i++) {
+		double x = rand(-100, 100), y = rand(0, 20), z = rand(-100, 100), r = rand(0.1, 0.4);
+		fprintf(f, "\t\t{ \"type\": \"sphere\", \"center\": [%.5f, %.5f, %.5f], \"radius\": %.4f, \"material\": %d }%s\n",
+			x, y, z, r, static_cast<int>(rand(0, material_count)), i + 1 < count ? "," : "");
+	}
+	fprintf(f, "\t]\n}\n");
+	return fclose(f) == 0;
+}
+
+static std::vector<reference_scene> reference_scenes() {
+	return {
+		{ "book", 1, [] { return true; } },
+		{ "two_sphere", 2, [] { return true; } },
+		{ "cornell", 6, [] { return true; } },
+		{ "light_field", 7, [] { return true; } },
+		{ "forest", 4, [] {
+			forest_size = 100;
+			forest_spacing = 3.0f;
+			forest_rotation = 0.0f;
+			return true;
+		} },
+		{ "spheres", 8, [] {
+			std::string path = (std::filesystem::temp_directory_path() / "render_bench_spheres.json").string();
+			snprintf(scene_path, sizeof(scene_path), "%s", path.c_str());
+			return write_spheres(path, 250000);
+		} },
+	};
+}
+
+// binary PPM, top row first, of the RGB of an RGBA raytracer image (whose first row is the bottom)
+static bool write_ppm(const std::string& path, const std::vector<uint8_t>& pixels, int width, int height) {
+	std::ofstream f(path, std::ios::binary);
+	f << "P6\n" << width << " " << height << "\n255\n";
+	for (int j = height - 1; j >= 0; j--) {
+		for (int i = 0; i < width; i++)
+			f.write(reinterpret_cast<const char*>(&pixels[(size_t(j) * width + i) * 4]), 3);
+	}
+	return bool(f);
+}
+
+static bool read_ppm(const std::string& path, std::vector<uint8_t>& rgb, int& width, int& height) {
+	std::ifstream f(path, std::ios::binary);
+	std::string magic;
+	int max_value = 0;
+	if (!(f >> magic >> width >> height >> max_value) || magic != "P6" || max_value != 255)
+		return false;
+	f.get();
+	rgb.resize(size_t(width) * height * 3);
+	return bool(f.read(reinterpret_cast<char*>(rgb.data()), rgb.size()));
+}
+
+static double display_rmse(const std::vector<uint8_t>& pixels, const std::vector<uint8_t>& reference, int width, int height) {
+	double sum = 0;
+	for (int j = 0; j < height; j++) {
+		for (int i = 0; i < width; i++) {
+			const uint8_t* a = &pixels[(size_t(height - 1 - j) * width + i) * 4];
+			const uint8_t* b = &reference[(size_t(j) * width + i) * 3];
+			for (int c = 0; c < 3; c++) {
+				double d = (a[c] - b[c]) / 255.0;
+				sum += d * d;
+			}
+		}
+	}
+	return sqrt(sum / (3.0 * width * height));
+}
+
+static std::vector<std::string> split(const std::string& list) {
+	std::vector<std::string> items;
+	std::stringstream in(list);
+	std::string item;
+	while (std::getline(in, item, ','))
+		if (!item.empty())
+			items.push_back(item);
+	return items;
+}
+
+static void write_text(std::ostream& out, const std::vector<run_result>& results, double tolerance) {
+	double base = 0;
+	for (size_t k = 0; k < results.size(); k++) {
+		const run_result& r = results[k];
+		const render_stats& s = r.stats;
+		if (k == 0 || results[k - 1].scene != r.scene)
+			base = s.trace_seconds;
+		out << r.scene << ", ";
+		if (r.workers > 0)
+			out << r.workers << " workers";
+		else
+			out << r.threads << " threads" << (r.numa ? ", numa " + std::to_string(r.numa) : "");
+		out << ": build " << s.build_seconds << "s, trace " << s.trace_seconds
+			<< "s (x" << base / s.trace_seconds << "), " << s.rays / s.trace_seconds * 1e-6 << " Mrays/s, "
+			<< s.paths / s.trace_seconds << " paths/s, tail " << s.tail_seconds << "s";
+		if (r.stored)
+			out << ", stored as reference";
+		else if (r.missing)
+			out << ", NO REFERENCE";
+		else if (r.rmse >= 0)
+			out << ", rmse " << r.rmse << (r.rmse <= tolerance ? "" : " ABOVE TOLERANCE");
+		out << "\n";
+		if (r.workers > 0)
+			continue;	//the workers keep their counters
+		std::ostringstream counters;
+		write_ray_stats(counters, s.counters);
+		std::string line;
+		std::istringstream lines(counters.str());
+		while (std::getline(lines, line))
+			out << "    " << line << "\n";
+	}
+}
+
+static void write_csv(std::ostream& out, const std::vector<run_result>& results) {
+	out << "scene,threads,numa,workers,build_s,trace_s,tail_s,denoise_s,rays,paths,mrays_per_s,paths_per_s,rmse,shadow_rays,hits,"
+		"box_tests_per_ray,node_visits_per_ray,primitive_tests_per_ray,roulette_kills,depth_limit,rays_by_depth\n";
+	for (const run_result& r : results) {
+		const render_stats& s = r.stats;
+		const ray_stats& c = s.counters;
+		double rays = s.rays > 0 ? double(s.rays) : 1.0;
+		out << r.scene << "," << r.threads << "," << r.numa << "," << r.workers << "," << s.build_seconds << "," << s.trace_seconds << "," << s.tail_seconds << ","
+			<< s.denoise_seconds << ","
+			<< s.rays << "," << s.paths << "," << s.rays / s.trace_seconds * 1e-6 << "," << s.paths / s.trace_seconds << ",";
+		if (r.rmse >= 0)
+			out << r.rmse;
+		out << "," << c.shadow_rays << "," << c.hits << "," << c.box_tests / rays << "," << c.node_visits / rays << ","
+			<< c.primitive_tests / rays << "," << c.roulette_kills << "," << c.depth_limit << ",";
+		for (int d = 0; d < ray_stats::depth_buckets; d++)
+			out << (d ? ";" : "") << c.rays_by_depth[d];	//one field, bounce 0 first
+		out << "\n";
+	}
+}
+
+static void write_json(std::ostream& out, const std::vector<run_result>& results, int width, int height, int samples, double tolerance) {
+	out << "{\n\t\"benchmark\": \"render_bench\",\n\t\"seed\": " << seed << ",\n\t\"width\": " << width << ",\n\t\"height\": " << height
+		<< ",\n\t\"samples\": " << samples << ",\n\t\"tolerance\": " << tolerance << ",\n\t\"runs\": [\n";
+	for (size_t k = 0; k < results.size(); k++) {
+		const run_result& r = results[k];
+		const render_stats& s = r.stats;
+		out << "\t\t{ \"scene\": \"" << r.scene << "\", \"threads\": " << r.threads << ", \"numa\": " << r.numa << ", \"workers\": " << r.workers << ", \"build_s\": " << s.build_seconds
+			<< ", \"trace_s\": " << s.trace_seconds << ", \"tail_s\": " << s.tail_seconds << ", \"denoise_s\": " << s.denoise_seconds << ", \"rays\": " << s.rays
+			<< ", \"paths\": " << s.paths << ", \"mrays_per_s\": " << s.rays / s.trace_seconds * 1e-6
+			<< ", \"paths_per_s\": " << s.paths / s.trace_seconds << ", \"rmse\": ";
+		if (r.rmse >= 0)
+			out << r.rmse;
+		else
+			out << "null";
+		const ray_stats& c = s.counters;
+		double rays = s.rays > 0 ? double(s.rays) : 1.0;
+		out << ", \"shadow_rays\": " << c.shadow_rays << ", \"hits\": " << c.hits << ", \"box_tests_per_ray\": " << c.box_tests / rays
+			<< ", \"node_visits_per_ray\": " << c.node_visits / rays << ", \"primitive_tests_per_ray\": " << c.primitive_tests / rays
+			<< ", \"roulette_kills\": " << c.roulette_kills << ", \"depth_limit\": " << c.depth_limit << ", \"rays_by_depth\": [";
+		for (int d = 0; d < ray_stats::depth_buckets; d++)
+			out << (d ? ", " : "") << c.rays_by_depth[d];
+		out << "] }" << (k + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "\t]\n}\n";
+}
+
+// the RGBA image of the color sums of a distributed run, as raytracer::write_color() makes it
+static void sums_to_pixels(const std::vector<double>& sums, int samples, std::vector<uint8_t>& pixels) {
+	for (size_t k = 0; k < sums.size() / 3; k++) {
+		for (int c = 0; c < 3; c++)
+			pixels[k * 4 + c] = static_cast<uint8_t>(256 * clamp(sqrt(sums[k * 3 + c] / samples), 0.0, 0.999));
+		pixels[k * 4 + 3] = 255;
+	}
+}
+
+// Renders the tiles of a coordinator until it is done with this process.
+static int run_worker(const std::string& address) {
+	std::ostringstream log;
+	std::streambuf* console = std::cout.rdbuf(log.rdbuf());
+	progressive = false;
+	temporal_reprojection = false;
+	use_scene_cache = false;
+	raytracer rt;
+	int tiles = 0;
+	auto setup = [&](const farm_job& job) {
+		std::vector<reference_scene> scenes = reference_scenes();
+		auto scene = std::find_if(scenes.begin(), scenes.end(), [&](const reference_scene& s) { return job.scene == s.name; });
+		if (scene == scenes.end())
+			return false;
+		pic_id = scene->pic;
+		if (!scene->setup())
+			return false;
+		image_width = job.width;
+		image_height = job.height;
+		samples_per_pixel = job.samples;
+		seed_random(job.seed);
+		rt.invalidate_scene();	//built by the first tile, from the coordinator's seed
+		std::cerr << "worker: job " << job.id << ", " << job.scene << std::endl;
+		return true;
+	};
+	auto render = [&](const farm_job&, const farm_tile& t, std::vector<float>& rgb, long long& rays, long long& paths) {
+		render_stats s = rt.render_region(t.x0, t.y0, t.x1, t.y1, t.first_sample, t.samples, rgb);
+		rays = s.rays;
+		paths = s.paths;
+		tiles++;
+		log.str("");
+	};
+	std::string error;
+	bool ok = run_tile_worker(address, render_threads, 30.0, setup, render, error);
+	std::cout.rdbuf(console);
+	if (!ok)
+		std::cerr << "render_bench: " << error << "\n";
+	else
+		std::cerr << "worker: " << tiles << " tiles rendered" << std::endl;
+	return ok ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+	std::vector<std::string> names;
+	std::vector<int> thread_counts, numa_modes;
+	int width = 320, samples = 16;
+	std::string references = "render_references", format = "text", out_path, trace_path, heatmaps, serve, worker;
+	int min_workers = 1, farm_tile_size = 64, sample_chunk = 0;
+	bool update = false, report_bvh = false;
+	double tolerance = 0;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if (arg == "--scenes" && has_value)
+			names = split(argv[++i]);
+		else if (arg == "--width" && has_value)
+			width = std::max(16, atoi(argv[++i]));
+		else if (arg == "--samples" && has_value)
+			samples = std::max(1, atoi(argv[++i]));
+		else if (arg == "--threads" && has_value) {
+			for (const std::string& t : split(argv[++i]))
+				thread_counts.push_back(std::max(1, atoi(t.c_str())));
+		}
+		else if (arg == "--references" && has_value)
+			references = argv[++i];
+		else if (arg == "--update")
+			update = true;
+		else if (arg == "--bvh")
+			report_bvh = true;
+		else if (arg == "--tile-size" && has_value)
+			tileSize = std::max(0, atoi(argv[++i]));
+		else if (arg == "--tile-order" && has_value) {
+			std::string order = argv[++i];
+			tile_order = order == "columns" ? tile_order_columns : order == "spiral" ? tile_order_spiral : tile_order_hilbert;
+		}
+		else if (arg == "--no-split")
+			split_tiles = false;
+		else if (arg == "--numa" && has_value) {
+			for (const std::string& m : split(argv[++i]))
+				numa_modes.push_back(std::max(0, std::min(2, atoi(m.c_str()))));
+		}
+		else if (arg == "--serve" && has_value)
+			serve = argv[++i];
+		else if (arg == "--worker" && has_value)
+			worker = argv[++i];
+		else if (arg == "--min-workers" && has_value)
+			min_workers = std::max(1, atoi(argv[++i]));
+		else if (arg == "--farm-tile" && has_value)
+			farm_tile_size = std::max(1, atoi(argv[++i]));
+		else if (arg == "--sample-chunk" && has_value)
+			sample_chunk = std::max(0, atoi(argv[++i]));
+		else if (arg == "--tolerance" && has_value)
+			tolerance = atof(argv[++i]);
+		else if (arg == "--format" && has_value)
+			format = argv[++i];
+		else if (arg == "--out" && has_value)
+			out_path = argv[++i];
+		else if (arg == "--trace" && has_value)
+			trace_path = argv[++i];
+		else if (arg == "--heatmaps" && has_value)
+			heatmaps = argv[++i];
+		else {
+			std::cerr << "usage: render_bench [--scenes a,b,...] [--width pixels] [--samples count] [--threads 1,2,4,...]\n"
+				"                    [--references dir] [--update] [--tolerance rmse] [--format text|csv|json] [--out file]\n"
+				"                    [--trace file] [--heatmaps dir] [--bvh] [--tile-size pixels]\n"
+				"                    [--tile-order columns|hilbert|spiral] [--no-split] [--numa 0,1,2]\n"
+				"                    [--serve address [--min-workers n] [--farm-tile pixels] [--sample-chunk samples]]\n"
+				"       render_bench --worker address [--threads n] [--numa mode]\n";
+			return 1;
+		}
+	}
+	if (format != "text" && format != "csv" && format != "json") {
+		std::cerr << "render_bench: unknown format " << format << "\n";
+		return 1;
+	}
+	if (!trace_path.empty() && !profiling_enabled) {
+		std::cerr << "render_bench: --trace needs a build with RT_PROFILE set\n";
+		return 1;
+	}
+	if (!worker.empty()) {
+		render_threads = thread_counts.empty() ? 0 : thread_counts[0];	//0: every core
+		numa_placement = numa_modes.empty() ? numa_placement : numa_modes[0];
+		return run_worker(worker);
+	}
+	if (thread_counts.empty()) {
+		int hardware = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+		for (int t = 1; t < hardware; t *= 2)
+			thread_counts.push_back(t);
+		thread_counts.push_back(hardware);
+	}
+	if (numa_modes.empty())
+		numa_modes.push_back(numa_placement);
+	const numa_topology& topology = numa_nodes();
+	std::cerr << "numa: " << topology.nodes() << (topology.nodes() == 1 ? " node" : " nodes") << " of";
+	for (const auto& cpus : topology.node_cpus)
+		std::cerr << " " << cpus.size();
+	std::cerr << " cpus" << std::endl;
+
+	std::vector<reference_scene> scenes;
+	for (const reference_scene& scene : reference_scenes()) {
+		if (names.empty() || std::find(names.begin(), names.end(), scene.name) != names.end())
+			scenes.push_back(scene);
+	}
+	if (scenes.empty()) {
+		std::cerr << "render_bench: no such scene\n";
+		return 1;
+	}
+	tile_coordinator coordinator;
+	if (!serve.empty()) {
+		std::string error;
+		if (!coordinator.listen(serve, error)) {
+			std::cerr << "render_bench: " << error << "\n";
+			return 1;
+		}
+		coordinator.waiting = [](int connected, int wanted) {
+			std::cerr << "waiting for workers: " << connected << " of " << wanted << std::endl;
+		};
+		thread_counts.assign(1, 0);	//one run per scene, on the workers
+		numa_modes.assign(1, 0);
+	}
+	std::error_code ec;
+	std::filesystem::create_directories(references, ec);
+	if (!heatmaps.empty())
+		std::filesystem::create_directories(heatmaps, ec);
+
+	image_width = width;
+	image_height = static_cast<int>(width / aspect_ratio);
+	samples_per_pixel = samples;
+	progressive = false;
+	temporal_reprojection = false;
+	use_scene_cache = false;	//the build time is the build, not a file mapping
+	std::vector<uint8_t> pixels(size_t(image_width) * image_height * 4);
+
+	std::ostringstream log;
+	std::streambuf* console = std::cout.rdbuf(log.rdbuf());
+	std::vector<run_result> results;
+	raytracer rt;
+	for (const reference_scene& scene : scenes) {
+		pic_id = scene.pic;
+		if (!scene.setup())
+			continue;
+		std::ostringstream file;
+		file << references << "/" << scene.name << "_" << image_width << "x" << image_height << "_" << samples << ".ppm";
+		std::string reference_path = file.str();
+		std::vector<uint8_t> reference;
+		int rw = 0, rh = 0;
+		bool have_reference = !update && read_ppm(reference_path, reference, rw, rh) && rw == image_width && rh == image_height;
+
+		for (size_t k = 0; k < thread_counts.size() * numa_modes.size(); k++) {
+			run_result r;
+			r.scene = scene.name;
+			if (!serve.empty()) {
+				farm_job job;
+				job.id = static_cast<uint32_t>(results.size() + 1);
+				job.scene = scene.name;
+				job.width = image_width;
+				job.height = image_height;
+				job.samples = samples;
+				job.seed = seed;
+				std::vector<double> sums;
+				farm_stats fs = coordinator.run(job, farm_tile_size, sample_chunk, min_workers, sums);
+				sums_to_pixels(sums, samples, pixels);
+				r.workers = r.threads = fs.workers;
+				r.stats.trace_seconds = fs.seconds;
+				r.stats.rays = fs.rays;
+				r.stats.paths = fs.paths;
+				std::cerr << scene.name << ": " << fs.tiles << " tiles from " << fs.workers << " workers, " << fs.requeued
+					<< " requeued, " << fs.duplicated << " duplicated" << std::endl;
+			}
+			else {
+				numa_placement = numa_modes[k / thread_counts.size()];
+				render_threads = thread_counts[k % thread_counts.size()];
+				seed_random(seed);
+				rt.invalidate_scene();	//every run builds the same scene from the same seed
+				rt.render(pixels.data());
+				rt.wait();
+				log.str("");
+				r.threads = render_threads;
+				r.numa = numa_placement;
+				r.stats = rt.last_stats();
+			}
+			if (!heatmaps.empty() && serve.empty())
+				rt.save_heatmaps(heatmaps + "/" + scene.name + "_" + std::to_string(r.threads) + "t" + (r.numa ? "_numa" + std::to_string(r.numa) : ""));
+			if (have_reference) {
+				r.rmse = display_rmse(pixels, reference, image_width, image_height);
+			}
+			else if (!update) {
+				r.missing = true;
+				if (k == 0)
+					std::cerr << "render_bench: no reference " << reference_path << ", --update stores one" << std::endl;
+			}
+			else if (k == 0) {
+				r.stored = write_ppm(reference_path, pixels, image_width, image_height);
+				if (!r.stored)
+					std::cerr << "render_bench: cannot write " << reference_path << "\n";
+				have_reference = read_ppm(reference_path, reference, rw, rh);	//the other runs must match it
+			}
+			results.push_back(r);
+			std::cerr << scene.name << ", " << (r.workers > 0 ? std::to_string(r.workers) + " workers" : std::to_string(r.threads) + " threads, numa " + std::to_string(r.numa))
+				<< ": " << r.stats.build_seconds << "s build, "
+				<< r.stats.trace_seconds << "s trace" << std::endl;
+		}
+		if (report_bvh) {
+			double start = seconds_now();
+			bvh_quality q = rt.scene_bvh_quality();
+			std::cerr << scene.name << " ";
+			write_bvh_quality(std::cerr, q);
+			std::cerr << "(analyzed in " << seconds_now() - start << "s)" << std::endl;
+		}
+	}
+	std::cout.rdbuf(console);
+	if (!trace_path.empty() && write_profile_trace(trace_path)) {
+		std::cerr << "trace written to " << trace_path << ", zones:\n";
+		write_profile_summary(std::cerr);
+	}
+
+	std::ofstream out_file;
+	if (!out_path.empty()) {
+		out_file.open(out_path);
+		if (!out_file) {
+			std::cerr << "render_bench: cannot write " << out_path << "\n";
+			return 1;
+		}
+	}
+	std::ostream& out = out_path.empty() ? std::cout : out_file;
+	if (format == "json")
+		write_json(out, results, image_width, image_height, samples, tolerance);
+	else if (format == "csv")
+		write_csv(out, results);
+	else
+		write_text(out, results, tolerance);
+
+	bool ok = true;
+	for (const run_result& r : results)
+		ok = ok && !r.missing && r.rmse <= tolerance;
+	return ok ? 0 : 2;
+}
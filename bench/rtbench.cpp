@@ -0,0 +1,395 @@
+// Microbenchmarks of the intersection, traversal and sampling kernels.
+//
+// usage: rtbench [--format csv|json] [--out file] [--filter text] [--rays count] [--time seconds] [--trials count]
+// Each kernel runs over a pre-generated set of rays: "primary" are the camera rays of a
+// 256-wide image (coherent), "diffuse" start at the first hits and leave in cosine
+// distributed directions (incoherent). The scene, the ray sets and the sample positions
+// come from a std::mt19937 with a fixed seed, so every run times the same work; the
+// checksum column changes only when a kernel computes something different. A trial repeats
+// the set until it has run for time / trials seconds; the minimum and median ns per call
+// over the trials are reported, plus cycles per call when the kernel exposes the counter.
+// Single threaded. Material scatter and camera::get_ray draw from random_double(), which
+// is seeded with the same value, so their checksums repeat for the same --filter.
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "raytracer.h"
+#include "perf_counters.h"
+
+static const unsigned seed = 20240613;
+static volatile double result_sink;		//keeps the timed loops from being optimized away
+
+struct ray_set {
+	const char* name = "";
+	std::vector<ray> rays;
+	std::vector<hit_record> hits;	//first hit of each ray that hits the scene
+	std::vector<ray> hit_rays;		//the ray of each entry of hits
+};
+
+struct bench_result {
+	std::string name;
+	std::string rays;
+	long long calls = 0;
+	double ns_min = 0, ns_median = 0;
+	double cycles = -1;			//per call, -1 if unavailable
+	double checksum = 0;
+};
+
+struct bench_options {
+	double seconds = 0.5;
+	int trials = 5;
+	std::string filter;
+};
+
+// the random sphere field of the book cover on the seeded generator, some of the small
+// diffuse spheres moving
+static hittable_list seeded_scene(std::mt19937& rng, std::vector<shared_ptr<sphere>>& spheres,
+	std::vector<shared_ptr<moving_sphere>>& moving)
+{
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	auto rand = [&](double lo, double hi) { return lo + (hi - lo) * uniform(rng); };
+	auto rand_color = [&](double lo, double hi) { return color(rand(lo, hi), rand(lo, hi), rand(lo, hi)); };
+
+	hittable_list world;
+	auto add = [&](point3 center, double radius, shared_ptr<material> m) {
+		auto s = make_shared<sphere>(center, radius, m);
+		spheres.push_back(s);
+		world.add(s);
+	};
+	add(point3(0, -1000, 0), 1000, make_shared<lambertian>(color(0.5, 0.5, 0.5)));
+	for (int a = -11; a < 11; a++) {
+		for (int b = -11; b < 11; b++) {
+			double choose = uniform(rng);
+			point3 center(a + 0.9 * uniform(rng), 0.2, b + 0.9 * uniform(rng));
+			if ((center - point3(4, 0.2, 0)).length() <= 0.9)
+				continue;
+			if (choose < 0.8) {
+				auto m = make_shared<lambertian>(rand_color(0, 1) * rand_color(0, 1));
+				if (choose < 0.4) {
+					auto s = make_shared<moving_sphere>(center, center + vec3(0, rand(0, 0.5), 0), 0.0, 1.0, 0.2, m);
+					moving.push_back(s);
+					world.add(s);
+				}
+				else {
+					add(center, 0.2, m);
+				}
+			}
+			else if (choose < 0.95) {
+				add(center, 0.2, make_shared<metal>(rand_color(0.5, 1), rand(0, 0.5)));
+			}
+			else {
+				add(center, 0.2, make_shared<dielectric>(1.5));
+			}
+		}
+	}
+	add(point3(0, 1, 0), 1.0, make_shared<dielectric>(1.5));
+	add(point3(-4, 1, 0), 1.0, make_shared<lambertian>(color(0.4, 0.2, 0.1)));
+	add(point3(4, 1, 0), 1.0, make_shared<metal>(color(0.7, 0.6, 0.5), 0.0));
+	return world;
+}
+
+static vec3 random_cosine(std::mt19937& rng, const vec3& n) {
+	std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+	for (;;) {
+		vec3 p(uniform(rng), uniform(rng), uniform(rng));
+		double l = p.length_squared();
+		if (l > 1e-6 && l < 1) {
+			vec3 d = n + p / sqrt(l);
+			if (!d.near_zero())
+				return d;
+		}
+	}
+}
+
+static void record_hits(const bvh_node& bvh, ray_set& set) {
+	for (const ray& r : set.rays) {
+		hit_record rec;
+		if (bvh.hit(r, 0.001, infinity, rec)) {
+			set.hits.push_back(rec);
+			set.hit_rays.push_back(r);
+		}
+	}
+}
+
+// Times body, which makes calls kernel calls per invocation and returns a checksum.
+template <class F>
+static void run(const char* name, const char* rays, long long calls, const bench_options& options,
+	perf_counters& counters, std::vector<bench_result>& results, F&& body)
+{
+	if (!options.filter.empty() && std::string(name).find(options.filter) == std::string::npos)
+		return;
+	bench_result result;
+	result.name = name;
+	result.rays = rays;
+	result.checksum = body();	//warm up, and the checksum of one pass
+	std::vector<double> ns;
+	double best_cycles = -1;
+	for (int trial = 0; trial < options.trials; trial++) {
+		long long repeats = 0;
+		double sink = 0;
+		counters.start();
+		double start = seconds_now(), elapsed = 0;
+		do {
+			sink += body();
+			repeats++;
+			elapsed = seconds_now() - start;
+		} while (elapsed < options.seconds / options.trials);
+		counters.stop();
+		result_sink = sink;
+		double per_call = double(repeats) * calls;
+		ns.push_back(elapsed * 1e9 / per_call);
+		result.calls += static_cast<long long>(per_call);
+		if (counters.available(perf_counters::cycles)) {
+			double c = counters.value(perf_counters::cycles) / per_call;
+			best_cycles = best_cycles < 0 ? c : std::min(best_cycles, c);
+		}
+	}
+	std::sort(ns.begin(), ns.end());
+	result.ns_min = ns.front();
+	result.ns_median = ns[ns.size() / 2];
+	result.cycles = best_cycles;
+	results.push_back(result);
+	std::cerr << name << " (" << rays << "): " << result.ns_min << " ns" << std::endl;
+}
+
+static std::string json_string(const std::string& s) {
+	std::string out = "\"";
+	for (char c : s) {
+		if (c == '"' || c == '\\')
+			out += '\\';
+		out += c;
+	}
+	return out + "\"";
+}
+
+static void write_csv(std::ostream& out, const std::vector<bench_result>& results) {
+	out << "name,rays,calls,ns_min,ns_median,mcalls_per_s,cycles,checksum\n";
+	out.precision(6);
+	for (const auto& r : results) {
+		out << r.name << "," << r.rays << "," << r.calls << "," << r.ns_min << "," << r.ns_median << ","
+			<< 1e3 / r.ns_min << ",";
+		if (r.cycles >= 0)
+			out << r.cycles;
+		out << "," << std::setprecision(17) << r.checksum << std::setprecision(6) << "\n";
+	}
+}
+
+static void write_json(std::ostream& out, const std::vector<bench_result>& results, const bench_options& options, size_t ray_count) {
+	out.precision(6);
+	out << "{\n\t\"benchmark\": \"rtbench\",\n\t\"seed\": " << seed << ",\n\t\"rays\": " << ray_count
+		<< ",\n\t\"trials\": " << options.trials << ",\n";
+#ifdef __VERSION__
+	out << "\t\"compiler\": " << json_string(__VERSION__) << ",\n";
+#endif
+	out << "\t\"results\": [\n";
+	for (size_t i = 0; i < results.size(); i++) {
+		const auto& r = results[i];
+		out << "\t\t{ \"name\": " << json_string(r.name) << ", \"rays\": " << json_string(r.rays) << ", \"calls\": " << r.calls
+			<< ", \"ns_min\": " << r.ns_min << ", \"ns_median\": " << r.ns_median << ", \"mcalls_per_s\": " << 1e3 / r.ns_min
+			<< ", \"cycles\": ";
+		if (r.cycles >= 0)
+			out << r.cycles;
+		else
+			out << "null";
+		out << ", \"checksum\": " << std::setprecision(17) << r.checksum << std::setprecision(6) << " }"
+			<< (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "\t]\n}\n";
+}
+
+int main(int argc, char* argv[]) {
+	bench_options options;
+	std::string format = "csv", out_path;
+	size_t ray_count = 1 << 16;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if (arg == "--format" && has_value)
+			format = argv[++i];
+		else if (arg == "--out" && has_value)
+			out_path = argv[++i];
+		else if (arg == "--filter" && has_value)
+			options.filter = argv[++i];
+		else if (arg == "--rays" && has_value)
+			ray_count = std::max(1, atoi(argv[++i]));
+		else if (arg == "--time" && has_value)
+			options.seconds = atof(argv[++i]);
+		else if (arg == "--trials" && has_value)
+			options.trials = std::max(1, atoi(argv[++i]));
+		else {
+			std::cerr << "usage: rtbench [--format csv|json] [--out file] [--filter text] [--rays count] [--time seconds] [--trials count]\n";
+			return 1;
+		}
+	}
+	if (format != "csv" && format != "json") {
+		std::cerr << "rtbench: unknown format " << format << "\n";
+		return 1;
+	}
+
+	std::mt19937 rng(seed);
+	seed_random(seed);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	std::vector<shared_ptr<sphere>> spheres;
+	std::vector<shared_ptr<moving_sphere>> moving;
+	hittable_list world = seeded_scene(rng, spheres, moving);
+	bvh_node bvh(world, 0.0, 1.0);
+	compiled_scene scene;
+	scene.compile(world, 0.0, 1.0);
+	std::vector<aabb> boxes;
+	for (const auto& object : world.objects) {
+		aabb box;
+		if (object->bounding_box(0.0, 1.0, box))
+			boxes.push_back(box);
+	}
+
+	// sample positions for camera::get_ray, in scanline order over a 256-wide image
+	const int width = 256, height = static_cast<int>(width / aspect_ratio);
+	camera view, pinhole;
+	view.init(point3(13, 2, 3), point3(0), vup, 20.0, double(width) / height, 0.1, 10.0, 0.0, 1.0);
+	pinhole.init(point3(13, 2, 3), point3(0), vup, 20.0, double(width) / height, 0.0, 10.0);
+	std::vector<std::pair<double, double>> samples(ray_count);
+	for (size_t k = 0; k < ray_count; k++) {
+		size_t pixel = k % (size_t(width) * height);
+		samples[k] = { (pixel % width + uniform(rng)) / (width - 1), (pixel / width + uniform(rng)) / (height - 1) };
+	}
+
+	ray_set primary, diffuse;
+	primary.name = "primary";
+	diffuse.name = "diffuse";
+	for (size_t k = 0; k < ray_count; k++) {
+		// the shutter time comes from rng so the set does not depend on random_double()
+		ray r = pinhole.get_ray(samples[k].first, samples[k].second);
+		primary.rays.emplace_back(r.origin(), r.direction(), uniform(rng));
+	}
+	record_hits(bvh, primary);
+	for (size_t k = 0; diffuse.rays.size() < ray_count && !primary.hits.empty(); k++) {
+		const hit_record& rec = primary.hits[k % primary.hits.size()];
+		diffuse.rays.emplace_back(rec.p, random_cosine(rng, rec.normal), uniform(rng));
+	}
+	record_hits(bvh, diffuse);
+	std::cerr << world.objects.size() << " objects, " << ray_count << " rays per set, " << primary.hits.size()
+		<< " primary and " << diffuse.hits.size() << " diffuse hits" << std::endl;
+
+	perf_counters counters;
+	std::vector<bench_result> results;
+	for (ray_set* set : { &primary, &diffuse }) {
+		const std::vector<ray>& rays = set->rays;
+		long long n = static_cast<long long>(rays.size());
+		run("aabb::hit", set->name, n, options, counters, results, [&] {
+			double hits = 0;
+			for (size_t k = 0; k < rays.size(); k++)
+				hits += boxes[k % boxes.size()].hit(rays[k], 0.001, infinity);
+			return hits;
+		});
+		run("sphere::hit", set->name, n, options, counters, results, [&] {
+			double sum = 0;
+			hit_record rec;
+			for (size_t k = 0; k < rays.size(); k++) {
+				if (spheres[k % spheres.size()]->hit(rays[k], 0.001, infinity, rec))
+					sum += rec.t;
+			}
+			return sum;
+		});
+		run("moving_sphere::hit", set->name, n, options, counters, results, [&] {
+			double sum = 0;
+			hit_record rec;
+			for (size_t k = 0; k < rays.size(); k++) {
+				if (moving[k % moving.size()]->hit(rays[k], 0.001, infinity, rec))
+					sum += rec.t;
+			}
+			return sum;
+		});
+		run("bvh_node::hit", set->name, n, options, counters, results, [&] {
+			double sum = 0;
+			hit_record rec;
+			for (const ray& r : rays) {
+				if (bvh.hit(r, 0.001, infinity, rec))
+					sum += rec.t;
+			}
+			return sum;
+		});
+		run("bvh_node::occluded", set->name, n, options, counters, results, [&] {
+			double hits = 0;
+			for (const ray& r : rays)
+				hits += bvh.occluded(r, 0.001, infinity);
+			return hits;
+		});
+		run("compiled_scene::hit", set->name, n, options, counters, results, [&] {
+			double sum = 0;
+			hit_record rec;
+			for (const ray& r : rays) {
+				if (scene.hit(r, 0.001, infinity, rec))
+					sum += rec.t;
+			}
+			return sum;
+		});
+	}
+
+	long long n = static_cast<long long>(samples.size());
+	run("camera::get_ray", "samples", n, options, counters, results, [&] {
+		double sum = 0;
+		for (const auto& s : samples)
+			sum += view.get_ray(s.first, s.second).direction().x();
+		return sum;
+	});
+	run("camera::get_ray+differentials", "samples", n, options, counters, results, [&] {
+		double sum = 0;
+		for (const auto& s : samples)
+			sum += view.get_ray(s.first, s.second, 1.0 / width, 1.0 / height).rx_direction.x();
+		return sum;
+	});
+
+	// every material on the same primary hits, so the numbers differ only by the material
+	struct named_material { const char* name; shared_ptr<material> m; };
+	named_material materials[] = {
+		{ "lambertian::scatter", make_shared<lambertian>(color(0.5, 0.5, 0.5)) },
+		{ "metal::scatter", make_shared<metal>(color(0.7, 0.6, 0.5), 0.3) },
+		{ "dielectric::scatter", make_shared<dielectric>(1.5) },
+		{ "diffuse_light::scatter", make_shared<diffuse_light>(color(4, 4, 4)) },
+	};
+	for (const auto& entry : materials) {
+		const material& m = *entry.m;
+		long long hit_count = static_cast<long long>(primary.hits.size());
+		if (hit_count == 0)
+			break;
+		run(entry.name, primary.name, hit_count, options, counters, results, [&] {
+			double sum = 0;
+			color attenuation;
+			ray scattered;
+			for (size_t k = 0; k < primary.hits.size(); k++) {
+				if (m.scatter(primary.hit_rays[k], primary.hits[k], attenuation, scattered))
+					sum += scattered.direction().y() + attenuation.x();
+				else
+					sum += m.emitted(primary.hit_rays[k], primary.hits[k]).x();
+			}
+			return sum;
+		});
+	}
+
+	run("random_double", "-", n, options, counters, results, [&] {
+		double sum = 0;
+		for (long long k = 0; k < n; k++)
+			sum += random_double();
+		return sum;
+	});
+
+	std::ofstream file;
+	if (!out_path.empty()) {
+		file.open(out_path);
+		if (!file) {
+			std::cerr << "rtbench: cannot write " << out_path << "\n";
+			return 1;
+		}
+	}
+	std::ostream& out = out_path.empty() ? std::cout : file;
+	if (format == "json")
+		write_json(out, results, options, ray_count);
+	else
+		write_csv(out, results);
+	return 0;
+}
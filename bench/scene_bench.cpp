@@ -0,0 +1,104 @@
+// Scene file loading speed.
+//
+// usage: scene_bench [spheres]
+// Writes a JSON scene with the given number of small random spheres (default one million)
+// to the temp directory, converts it to the binary form, and loads each into a compiled
+// scene. Reported separately: reading the file into the prim arrays, and the BVH and light
+// tree build of compiled_scene::finish(). Last, the compiled binary scene is written to the
+// scene cache and mapped back, which is what a second run of the renderer does; a batch of
+// random rays checks that the mapped scene hits the same prims.
+
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+
+#include "raytracer.h"
+
+static void load(const std::string& path, const char* label, compiled_scene& scene) {
+	compiled_scene_builder builder(scene);
+	double start = seconds_now();
+	if (!read_scene_file(path, builder))
+		return;
+	double read = seconds_now() - start;
+	start = seconds_now();
+	scene.finish();
+	double build = seconds_now() - start;
+	std::cout << label << ": " << std::filesystem::file_size(path) / (1 << 20) << "MB, read " << read << "s, bvh "
+		<< build << "s, " << scene.prims.size() << " prims\n";
+}
+
+static std::vector<double> hit_distances(const compiled_scene& scene, const std::vector<ray>& rays) {
+	std::vector<double> t;
+	for (const ray& r : rays) {
+		hit_record rec;
+		t.push_back(scene.hit(r, 0.001, infinity, rec) ? rec.t : -1);
+	}
+	return t;
+}
+
+int main(int argc, char* argv[]) {
+	long long count = argc > 1 ? atoll(argv[1]) : 1000000;
+	auto dir = std::filesystem::temp_directory_path();
+	std::string json = (dir / "scene_bench.json").string();
+	std::string binary = (dir / "scene_bench.rtsb").string();
+
+	FILE* f = fopen(json.c_str(), "w");
+	if (!f) {
+		std::cerr << "cannot write " << json << "\n";
+		return 1;
+	}
+	double start = seconds_now();
+	fprintf(f, "{\n\t\"camera\": { \"lookfrom\": [0, 40, 120], \"lookat\": [0, 0, 0], \"vfov\": 40 },\n");
+	fprintf(f, "\t\"materials\": [\n");
+	const int material_count = 16;
+	for (int m = 0; m < material_count; m++) {
+		color c = color::random(0.1, 0.9);
+		fprintf(f, "\t\t{ \"name\": \"m%d\", \"type\": \"lambertian\", \"albedo\": [%.4f, %.4f, %.4f] },\n", m, c.x(), c.y(), c.z());
+	}
+	fprintf(f, "\t\t{ \"name\": \"glass\", \"type\": \"dielectric\", \"ir\": 1.5 }\n\t],\n\t\"objects\": [\n");
+	double extent = 100;
+	for (long long i = 0; i < count; i++) {
+		fprintf(f, "\t\t{ \"type\": \"sphere\", \"center\": [%.5f, %.5f, %.5f], \"radius\": %.4f, \"material\": %d }%s\n",
+			random_double(-extent, extent), random_double(0, 20), random_double(-extent, extent), random_double(0.02, 0.1),
+			random_int(0, material_count), i + 1 < count ? "," : "");
+	}
+	fprintf(f, "\t]\n}\n");
+	fclose(f);
+	std::cout << "wrote " << count << " spheres in " << seconds_now() - start << "s\n";
+
+	start = seconds_now();
+	if (!write_scene_binary(json, binary))
+		return 1;
+	std::cout << "converted to binary in " << seconds_now() - start << "s\n";
+
+	{
+		compiled_scene scene;
+		load(json, "json", scene);
+	}
+	compiled_scene scene;
+	load(binary, "binary", scene);
+
+	compiled_scene_builder unused(scene);
+	uint64_t key = 0;
+	std::string cache = scene_cache::cache_path(binary, key);
+	start = seconds_now();
+	if (!scene_cache::save(cache, key, scene, unused))
+		return 1;
+	std::cout << "scene cache: wrote " << std::filesystem::file_size(cache) / (1 << 20) << "MB in " << seconds_now() - start << "s";
+	compiled_scene cached;
+	compiled_scene_builder view(cached);
+	start = seconds_now();
+	if (!scene_cache::load(cache, key, cached, view))
+		return 1;
+	std::cout << ", mapped in " << seconds_now() - start << "s, " << cached.prims.size() << " prims\n";
+	std::vector<ray> rays;
+	for (int i = 0; i < 10000; i++)
+		rays.emplace_back(point3(random_double(-100, 100), 30, random_double(-100, 100)), vec3(random_double(-0.3, 0.3), -1, random_double(-0.3, 0.3)));
+	bool same = hit_distances(scene, rays) == hit_distances(cached, rays);
+	std::cout << "probe rays " << (same ? "hit the same" : "DIFFER") << "\n";
+	std::filesystem::remove(cache);
+
+	std::filesystem::remove(json);
+	std::filesystem::remove(binary);
+	return 0;
+}
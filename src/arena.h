@@ -0,0 +1,162 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Heap instrumentation hook. Compiled with RT_TRACK_ALLOCATIONS the global operator
+// new/delete are replaced to count allocations and track live/peak bytes; otherwise the
+// counters stay at zero. Only define it in executables built from a single source file.
+struct heap_counters {
+	std::atomic<long long> allocations{ 0 };
+	std::atomic<long long> live_bytes{ 0 };
+	std::atomic<long long> peak_bytes{ 0 };
+
+	void reset_peak() { peak_bytes = live_bytes.load(); }
+};
+
+inline heap_counters& heap_stats() {
+	static heap_counters counters;
+	return counters;
+}
+
+#ifdef RT_TRACK_ALLOCATIONS
+namespace alloc_detail {
+	//each block is prefixed with its size so delete can update the live byte count
+	const size_t header = alignof(std::max_align_t);
+
+	inline void* tracked_alloc(size_t size) {
+		char* p = static_cast<char*>(std::malloc(size + header));
+		if (!p)
+			throw std::bad_alloc();
+		*reinterpret_cast<size_t*>(p) = size;
+		auto& stats = heap_stats();
+		stats.allocations++;
+		long long live = stats.live_bytes += size;
+		long long peak = stats.peak_bytes;
+		while (live > peak && !stats.peak_bytes.compare_exchange_weak(peak, live)) {}
+		return p + header;
+	}
+
+	inline void tracked_free(void* ptr) {
+		if (!ptr)
+			return;
+		char* p = static_cast<char*>(ptr) - header;
+		heap_stats().live_bytes -= static_cast<long long>(*reinterpret_cast<size_t*>(p));
+		std::free(p);
+	}
+}
+
+void* operator new(size_t size) { return alloc_detail::tracked_alloc(size); }
+void* operator new[](size_t size) { return alloc_detail::tracked_alloc(size); }
+void operator delete(void* p) noexcept { alloc_detail::tracked_free(p); }
+void operator delete[](void* p) noexcept { alloc_detail::tracked_free(p); }
+void operator delete(void* p, size_t) noexcept { alloc_detail::tracked_free(p); }
+void operator delete[](void* p, size_t) noexcept { alloc_detail::tracked_free(p); }
+#endif
+
+// Bump allocator owned by a scene. Primitives, materials, textures and BVH nodes are
+// carved out of large blocks and released together by reset(), instead of one heap
+// allocation (plus shared_ptr control block) per object. Not thread safe: scenes are
+// built on one thread.
+class scene_arena {
+public:
+	explicit scene_arena(size_t block_size = 256 * 1024) : block_size(block_size) {}
+	~scene_arena() { reset(); }
+
+	scene_arena(const scene_arena&) = delete;
+	scene_arena& operator=(const scene_arena&) = delete;
+
+	void* allocate(size_t size, size_t align) {
+		size_t offset = blocks.empty() ? 0 : align_offset(blocks.back(), used, align);
+		if (blocks.empty() || offset + size > capacity) {
+			size_t bytes = size + align > block_size ? size + align : block_size;
+			blocks.push_back(static_cast<char*>(::operator new(bytes)));
+			capacity = bytes;
+			reserved += bytes;
+			offset = align_offset(blocks.back(), 0, align);
+		}
+		used = offset + size;
+		allocations++;
+		return blocks.back() + offset;
+	}
+
+	//bulk free. Every object placed in the arena must already be destroyed.
+	void reset() {
+		for (char* block : blocks)
+			::operator delete(block);
+		blocks.clear();
+		used = capacity = 0;
+		reserved = 0;
+		allocations = 0;
+	}
+
+	size_t allocation_count() const { return allocations; }
+	size_t bytes_reserved() const { return reserved; }
+	size_t block_count() const { return blocks.size(); }
+
+	//arena used by scene_make_shared on this thread, null for the regular heap
+	static scene_arena*& current() {
+		static thread_local scene_arena* active = nullptr;
+		return active;
+	}
+
+private:
+	static size_t align_offset(const char* block, size_t offset, size_t align) {
+		size_t address = reinterpret_cast<size_t>(block) + offset;
+		return offset + ((align - address % align) % align);
+	}
+
+	size_t block_size;
+	std::vector<char*> blocks;
+	size_t used = 0;
+	size_t capacity = 0;
+	size_t reserved = 0;
+	size_t allocations = 0;
+};
+
+// Makes arena the target of scene_make_shared until the end of the scope; pass
+// nullptr to build long lived objects on the heap in the middle of a scene build.
+class arena_scope {
+public:
+	explicit arena_scope(scene_arena* arena) : previous(scene_arena::current()) { scene_arena::current() = arena; }
+	~arena_scope() { scene_arena::current() = previous; }
+
+	arena_scope(const arena_scope&) = delete;
+	arena_scope& operator=(const arena_scope&) = delete;
+
+private:
+	scene_arena* previous;
+};
+
+// std allocator over a scene_arena; deallocation is a no-op, memory returns on reset().
+template <class T>
+struct arena_allocator {
+	using value_type = T;
+
+	explicit arena_allocator(scene_arena* a) : arena(a) {}
+	template <class U>
+	arena_allocator(const arena_allocator<U>& other) : arena(other.arena) {}
+
+	T* allocate(size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T))); }
+	void deallocate(T*, size_t) {}
+
+	template <class U>
+	bool operator==(const arena_allocator<U>& other) const { return arena == other.arena; }
+	template <class U>
+	bool operator!=(const arena_allocator<U>& other) const { return arena != other.arena; }
+
+	scene_arena* arena;
+};
+
+// make_shared that places the object and its control block in the current scene arena.
+template <class T, class... Args>
+std::shared_ptr<T> scene_make_shared(Args&&... args) {
+	if (scene_arena* arena = scene_arena::current())
+		return std::allocate_shared<T>(arena_allocator<T>(arena), std::forward<Args>(args)...);
+	return std::make_shared<T>(std::forward<Args>(args)...);
+}
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <algorithm>
+
 #include "rtweekend.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "ray_stats.h"
 
 class bvh_node : public hittable {
 public:
@@ -19,11 +22,17 @@ public:
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+	using hittable::occluded;
 
 public:
 	shared_ptr<hittable> left;
 	shared_ptr<hittable> right;
 	aabb box;
+	bool leaf = false;	//left and right are scene objects rather than bvh_nodes
+
+private:
+	void build(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end, double time0, double time1);
 };
 
 
@@ -53,9 +62,14 @@ bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
 }
 
 bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-	if (!box.hit(r, t_min, t_max)) {
+	ray_stats& stats = thread_ray_stats();
+	stats.box_tests++;
+	if (!left || !box.hit(r, t_min, t_max)) {
 		return false;
 	}
+	stats.node_visits++;
+	if (leaf)
+		stats.primitive_tests += left == right ? 1 : 2;
 
 
 	bool hit_left = left->hit(r, t_min, t_max, rec);
@@ -64,18 +78,40 @@ bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 	return hit_left || hit_right;
 }
 
+//any-hit traversal: the first child that reports a blocker ends the query
+bool bvh_node::occluded(const ray& r, double t_min, double t_max) const {
+	ray_stats& stats = thread_ray_stats();
+	stats.box_tests++;
+	if (!left || !box.hit(r, t_min, t_max)) {
+		return false;
+	}
+	stats.node_visits++;
+	if (leaf)
+		stats.primitive_tests += left == right ? 1 : 2;
+	return left->occluded(r, t_min, t_max) || (right != left && right->occluded(r, t_min, t_max));
+}
+
 bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& src_objects,
 	size_t start, size_t end, double time0, double time1) {
-	auto objects = src_objects;
+	auto objects = src_objects;	//copied once, the recursion sorts this copy in place
+	build(objects, start, end, time0, time1);
+}
+
+void bvh_node::build(std::vector<shared_ptr<hittable>>& objects,
+	size_t start, size_t end, double time0, double time1) {
 	int axis = random_int(0,2);	//
 	// Ӧĺ
 	auto comparator = (axis == 0) ? box_x_compare :
 		(axis == 1) ? box_y_compare : box_z_compare;
 	size_t object_span = end - start;	//listймhittableӶ
+	if (object_span == 0)	//empty world: no children, hit() misses everything
+		return;
 	if (object_span == 1) {	//бֻһԪ.ԪطҶӽڵ
+		leaf = true;
 		left = right = objects[start];
 	}
 	else if (object_span == 2) {	//ԪأҸһ
+		leaf = true;
 		if (comparator(objects[start] , objects[start + 1])) {	//Ƚ ָ
 			left = objects[start];
 			right = objects[start + 1];
@@ -88,8 +124,12 @@ bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& src_objects,
 	else {
 		std::sort(objects.begin() + start, objects.begin() + end , comparator );
 		auto mid = start + object_span / 2;
-		left = make_shared<bvh_node>(objects , start,mid,time0,time1);
-		right = make_shared<bvh_node>(objects , mid,end,time0,time1);
+		auto left_node = scene_make_shared<bvh_node>();
+		auto right_node = scene_make_shared<bvh_node>();
+		left_node->build(objects, start, mid, time0, time1);
+		right_node->build(objects, mid, end, time0, time1);
+		left = left_node;
+		right = right_node;
 	}
 
 	aabb box_left, box_right;
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <algorithm>
+#include <ostream>
+#include <vector>
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "bvh_node.h"
+#include "flat_bvh.h"
+#include "camera.h"
+
+// Quality measures of a built BVH, to compare builders on the same scene. Both tree
+// layouts (bvh_node and the flat nodes of compiled_scene and triangle_mesh) are first
+// copied into a bvh_outline, which the analysis and the wireframe overlay read.
+//
+// The SAH cost weighs each node by its surface area relative to the root's, with a
+// traversal and a primitive test costing 1 each, as the flat builder's split cost does.
+// EPO (effective primitive overlap, Aila, Karras and Laine 2013) is the fraction of the
+// primitives' surface that lies inside nodes they do not belong to, weighted by the cost
+// of those nodes; here primitives are stood in for by their bounding boxes. Sibling
+// overlap sums the area of the intersection of each inner node's two children. Objects
+// below a leaf (a mesh, an instance) count as one primitive.
+
+// One node in the order the tree is stored, root first and the left child right after its parent.
+struct bvh_outline_node {
+	aabb box;
+	int depth = 0;
+	int right = -1;		//inner: index of the right child, -1 for a leaf
+	int first = 0;		//primitives of the subtree are [first, first + count) of prim_boxes
+	int count = 0;
+};
+
+struct bvh_outline {
+	std::vector<bvh_outline_node> nodes;
+	std::vector<aabb> prim_boxes;	//in leaf order
+	size_t node_bytes = 0;			//size of one node of the tree this was copied from
+};
+
+struct bvh_quality {
+	static const int leaf_size_buckets = 17;	//the last bucket holds every larger leaf
+
+	long long nodes = 0, leaves = 0, primitives = 0;
+	int depth = 0;						//of the deepest leaf, the root at 0
+	double mean_leaf_depth = 0;
+	long long leaf_sizes[leaf_size_buckets] = {};	//leaves by primitive count
+	double sah_cost = 0;
+	double epo = 0;
+	double sibling_overlap = 0;			//relative to the root's area
+	size_t bytes = 0;					//nodes only
+};
+
+namespace bvh_quality_detail {
+
+	inline double half_area(const aabb& b) {
+		vec3 d = b._max - b._min;
+		return d.x() * d.y() + d.y() * d.z() + d.z() * d.x();
+	}
+
+	// Area of a clipped to b, 0 unless they share volume; a flat box (a quad) only needs to
+	// cross b, not to be thick along its flat axis.
+	inline double clipped_area(const aabb& a, const aabb& b) {
+		aabb c;
+		for (int k = 0; k < 3; k++) {
+			c._min.e[k] = fmax(a._min[k], b._min[k]);
+			c._max.e[k] = fmin(a._max[k], b._max[k]);
+			double extent = c._max[k] - c._min[k];
+			if (extent < 0 || (extent == 0 && a._max[k] > a._min[k]))
+				return 0;
+		}
+		return half_area(c);
+	}
+
+	inline int outline(const bvh_node& node, int depth, double time0, double time1, bvh_outline& out) {
+		int index = static_cast<int>(out.nodes.size());
+		out.nodes.push_back(bvh_outline_node());
+		out.nodes[index].box = node.box;
+		out.nodes[index].depth = depth;
+		out.nodes[index].first = static_cast<int>(out.prim_boxes.size());
+		if (!node.left) {
+			// empty world
+		}
+		else if (node.leaf) {
+			aabb box;
+			node.left->bounding_box(time0, time1, box);
+			out.prim_boxes.push_back(box);
+			if (node.right != node.left) {
+				node.right->bounding_box(time0, time1, box);
+				out.prim_boxes.push_back(box);
+			}
+		}
+		else {
+			outline(static_cast<const bvh_node&>(*node.left), depth + 1, time0, time1, out);
+			int right = outline(static_cast<const bvh_node&>(*node.right), depth + 1, time0, time1, out);
+			out.nodes[index].right = right;
+		}
+		out.nodes[index].count = static_cast<int>(out.prim_boxes.size()) - out.nodes[index].first;
+		return index;
+	}
+
+	inline int outline(const flat_bvh_node* nodes, int node, int depth, bvh_outline& out) {
+		const flat_bvh_node& n = nodes[node];
+		int index = static_cast<int>(out.nodes.size());
+		out.nodes.push_back(bvh_outline_node());
+		out.nodes[index].box = aabb(point3(n.bmin[0], n.bmin[1], n.bmin[2]), point3(n.bmax[0], n.bmax[1], n.bmax[2]));
+		out.nodes[index].depth = depth;
+		if (n.count >= 0) {
+			out.nodes[index].first = n.offset;
+			out.nodes[index].count = n.count;
+			return index;
+		}
+		outline(nodes, node + 1, depth + 1, out);
+		int right = outline(nodes, n.offset, depth + 1, out);
+		out.nodes[index].right = right;
+		out.nodes[index].first = out.nodes[index + 1].first;
+		out.nodes[index].count = out.nodes[right].first + out.nodes[right].count - out.nodes[index].first;
+		return index;
+	}
+
+	// cost weighted area of prim_boxes[p] inside the nodes below index it is not part of
+	inline double outside_overlap(const bvh_outline& tree, int index, int p) {
+		const bvh_outline_node& n = tree.nodes[index];
+		double area = clipped_area(tree.prim_boxes[p], n.box);
+		if (area <= 0)
+			return 0;	//children lie inside their parent
+		bool own = p >= n.first && p < n.first + n.count;
+		double sum = own ? 0 : area * (n.right < 0 ? n.count : 1);
+		if (n.right >= 0)
+			sum += outside_overlap(tree, index + 1, p) + outside_overlap(tree, n.right, p);
+		return sum;
+	}
+}
+
+inline bvh_outline outline_bvh(const bvh_node& root, double time0, double time1) {
+	bvh_outline out;
+	out.node_bytes = sizeof(bvh_node);
+	bvh_quality_detail::outline(root, 0, time0, time1, out);
+	return out;
+}
+
+// prim_box(i) is the box of the i-th primitive in leaf order.
+template <typename F>
+bvh_outline outline_bvh(const flat_bvh_node* nodes, size_t count, size_t prims, F prim_box) {
+	bvh_outline out;
+	out.node_bytes = sizeof(flat_bvh_node);
+	if (count == 0)
+		return out;
+	out.nodes.reserve(count);
+	bvh_quality_detail::outline(nodes, 0, 0, out);
+	out.prim_boxes.reserve(prims);
+	for (size_t i = 0; i < prims; i++)
+		out.prim_boxes.push_back(prim_box(i));
+	return out;
+}
+
+inline bvh_quality analyze_bvh(const bvh_outline& tree) {
+	using namespace bvh_quality_detail;
+	bvh_quality q;
+	if (tree.nodes.empty())
+		return q;
+	q.nodes = static_cast<long long>(tree.nodes.size());
+	q.primitives = static_cast<long long>(tree.prim_boxes.size());
+	q.bytes = tree.nodes.size() * tree.node_bytes;
+	double root_area = half_area(tree.nodes[0].box);
+	double scale = root_area > 0 ? 1.0 / root_area : 0.0;
+	long long depth_sum = 0;
+	for (const bvh_outline_node& n : tree.nodes) {
+		double area = half_area(n.box) * scale;
+		if (n.right < 0) {
+			q.leaves++;
+			q.depth = std::max(q.depth, n.depth);
+			depth_sum += n.depth;
+			q.leaf_sizes[std::min(n.count, bvh_quality::leaf_size_buckets - 1)]++;
+			q.sah_cost += area * n.count;
+		}
+		else {
+			q.sah_cost += area;
+			const aabb& left = tree.nodes[&n - tree.nodes.data() + 1].box;
+			q.sibling_overlap += clipped_area(left, tree.nodes[n.right].box) * scale;
+		}
+	}
+	q.mean_leaf_depth = q.leaves > 0 ? double(depth_sum) / q.leaves : 0.0;
+
+	double prim_area = 0, outside = 0;
+	for (int p = 0; p < static_cast<int>(tree.prim_boxes.size()); p++) {
+		prim_area += half_area(tree.prim_boxes[p]);
+		outside += outside_overlap(tree, 0, p);
+	}
+	q.epo = prim_area > 0 ? outside / prim_area : 0.0;
+	return q;
+}
+
+inline void write_bvh_quality(std::ostream& out, const bvh_quality& q) {
+	out << "bvh: " << q.nodes << " nodes (" << q.bytes / 1024 << "KB), " << q.leaves << " leaves over " << q.primitives
+		<< " primitives, depth " << q.depth << " (leaves at " << q.mean_leaf_depth << " on average)\n";
+	out << "bvh cost: sah " << q.sah_cost << ", epo " << q.epo << ", sibling overlap " << q.sibling_overlap << "\n";
+	out << "leaves by size:";
+	int last = bvh_quality::leaf_size_buckets - 1;
+	while (last > 0 && q.leaf_sizes[last] == 0)
+		last--;
+	for (int s = 0; s <= last; s++)
+		out << " " << q.leaf_sizes[s];
+	out << (last == bvh_quality::leaf_size_buckets - 1 ? " (last one and larger)\n" : "\n");
+}
+
+namespace bvh_quality_detail {
+
+	inline void plot(uint8_t* rgba, int width, int height, int x, int y, const uint8_t c[3]) {
+		if (x < 0 || y < 0 || x >= width || y >= height)
+			return;
+		uint8_t* p = rgba + (size_t(y) * width + x) * 4;
+		p[0] = c[0];
+		p[1] = c[1];
+		p[2] = c[2];
+	}
+
+	// the edge a-b, cut where it goes behind the camera
+	inline void draw_edge(const camera& cam, point3 a, point3 b, uint8_t* rgba, int width, int height, const uint8_t c[3]) {
+		double s0, t0, s1, t1;
+		bool in_a = cam.project(a, s0, t0), in_b = cam.project(b, s1, t1);
+		if (!in_a && !in_b)
+			return;
+		if (!in_a || !in_b) {
+			point3 inside = in_a ? a : b, outside = in_a ? b : a;
+			for (int k = 0; k < 24; k++) {
+				point3 mid = 0.5 * (inside + outside);
+				double s, t;
+				if (cam.project(mid, s, t))
+					inside = mid;
+				else
+					outside = mid;
+			}
+			(in_a ? b : a) = inside;
+			cam.project(a, s0, t0);
+			cam.project(b, s1, t1);
+		}
+		double x0 = s0 * (width - 1), y0 = t0 * (height - 1), x1 = s1 * (width - 1), y1 = t1 * (height - 1);
+		// an edge that grazes the camera projects to a huge line, keep the part near the image
+		double limit = 4.0 * (width + height);
+		if (fabs(x0) > limit || fabs(y0) > limit || fabs(x1) > limit || fabs(y1) > limit)
+			return;
+		int steps = static_cast<int>(fmax(fabs(x1 - x0), fabs(y1 - y0))) + 1;
+		for (int k = 0; k <= steps; k++) {
+			double f = double(k) / steps;
+			plot(rgba, width, height, static_cast<int>(x0 + f * (x1 - x0) + 0.5), static_cast<int>(y0 + f * (y1 - y0) + 0.5), c);
+		}
+	}
+}
+
+// Draws the boxes of the nodes at depth (leaves above it included, so the boxes cover every
+// primitive) as white lines into an rgba image whose first row is the bottom one.
+inline void draw_bvh_boxes(const bvh_outline& tree, int depth, const camera& cam, uint8_t* rgba, int width, int height) {
+	static const uint8_t white[3] = { 255, 255, 255 };
+	for (const bvh_outline_node& n : tree.nodes) {
+		if (n.depth > depth || (n.depth < depth && n.right >= 0))
+			continue;
+		point3 corner[8];
+		for (int k = 0; k < 8; k++)
+			corner[k] = point3(k & 1 ? n.box._max.x() : n.box._min.x(), k & 2 ? n.box._max.y() : n.box._min.y(),
+				k & 4 ? n.box._max.z() : n.box._min.z());
+		for (int k = 0; k < 8; k++) {
+			for (int axis = 1; axis < 8; axis <<= 1) {
+				if (!(k & axis))
+					bvh_quality_detail::draw_edge(cam, corner[k], corner[k | axis], rgba, width, height, white);
+			}
+		}
+	}
+}
@@ -49,6 +49,35 @@ public:
         );
     }
 
+    // Same ray plus differentials towards the samples ds and dt further along the image.
+    // The offset rays go through the same lens point so depth of field keeps its footprint.
+    ray get_ray(double s, double t, double ds, double dt) const {
+        vec3 rd = lens_radius * random_in_unit_disk();
+        vec3 offset = u * rd.x() + v * rd.y();
+        point3 from = origin + offset;
+        point3 target = lower_left_corner + s * horizontal + t * vertical;
+
+        ray r(from, target - from, random_double(time0, time1));
+        r.set_differentials(from, unit_vector(target + ds * horizontal - from),
+            from, unit_vector(target + dt * vertical - from));
+        return r;
+    }
+
+    // Image coordinates (s, t) of the ray from the lens center through p, the inverse of
+    // get_ray() without depth of field. False if p is not in front of the camera.
+    bool project(const point3& p, double& s, double& t) const {
+        vec3 d = p - origin;
+        double along = -dot(d, w);
+        if (along <= 0)
+            return false;
+        vec3 on_plane = origin + d * (-dot(lower_left_corner - origin, w) / along) - lower_left_corner;
+        s = dot(on_plane, horizontal) / horizontal.length_squared();
+        t = dot(on_plane, vertical) / vertical.length_squared();
+        return true;
+    }
+
+    point3 position() const { return origin; }
+
 private:
     point3 origin;
     point3 lower_left_corner;
@@ -58,4 +87,48 @@ private:
     double lens_radius;
     double time0, time1;    //time1time2֮ shutter open/close times
 };
+
+// Interactive navigation. Each function moves the look-at pair in place; up is the vup the
+// camera is initialised with.
+
+// v turned by angle radians around the unit axis (Rodrigues' formula)
+inline vec3 rotate_around(const vec3& v, const vec3& axis, double angle) {
+    return cos(angle) * v + sin(angle) * cross(axis, v) + (1 - cos(angle)) * dot(axis, v) * axis;
+}
+
+// Orbit: lookfrom swings around lookat, yaw about up and pitch about the camera's right
+// axis. Pitch stops short of looking straight along up.
+inline void orbit_camera(point3& lookfrom, const point3& lookat, const vec3& up, double yaw, double pitch) {
+    vec3 axis = unit_vector(up);
+    vec3 offset = rotate_around(lookfrom - lookat, axis, yaw);
+    vec3 right = unit_vector(cross(axis, offset));
+    vec3 pitched = rotate_around(offset, right, pitch);
+    if (fabs(dot(unit_vector(pitched), axis)) < 0.99)
+        offset = pitched;
+    lookfrom = lookat + offset;
+}
+
+// Fly mode turn: lookat swings around lookfrom.
+inline void turn_camera(const point3& lookfrom, point3& lookat, const vec3& up, double yaw, double pitch) {
+    point3 eye = lookat;
+    orbit_camera(eye, lookfrom, up, yaw, pitch);
+    lookat = eye;
+}
+
+// Moves both points along the view direction, the camera's right axis and up, in scene units.
+inline void move_camera(point3& lookfrom, point3& lookat, const vec3& up, double forward, double right, double lift) {
+    vec3 w = unit_vector(lookat - lookfrom);
+    vec3 u = unit_vector(cross(w, up));
+    vec3 step = forward * w + right * u + lift * unit_vector(up);
+    lookfrom += step;
+    lookat += step;
+}
+
+// Moves lookfrom towards lookat by a fraction of their distance, away for negative amounts.
+inline void dolly_camera(point3& lookfrom, const point3& lookat, double amount) {
+    vec3 offset = lookfrom - lookat;
+    double scale = fmax(1 - amount, 0.05);
+    if (offset.length() * scale > 1e-3)
+        lookfrom = lookat + scale * offset;
+}
 #endif
\ No newline at end of file
@@ -0,0 +1,728 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh_node.h"
+#include "sphere.h"
+#include "moving_sphere.h"
+#include "mapped_file.h"
+#include "quad.h"
+#include "material.h"
+#include "texture.h"
+#include "flat_bvh.h"
+#include "ray_stats.h"
+#include "lights.h"
+
+// Closed-set scene representation the renderer traverses. The polymorphic classes stay
+// the authoring API; compile() flattens them into tagged structs in plain arrays, so BVH
+// leaves, scatter() and texture lookups dispatch with a switch instead of virtual calls.
+// Types outside the closed set are kept as "generic" entries and called through their virtuals.
+
+enum prim_kind : int { prim_sphere, prim_moving_sphere, prim_quad, prim_generic };
+enum material_kind : int { mat_lambertian, mat_metal, mat_dielectric, mat_light, mat_generic };
+enum texture_kind : int { tex_solid, tex_checker, tex_image, tex_generic };
+
+struct compiled_prim {
+	int kind;
+	int material;	//index into materials (not used by generic prims)
+	int object;		//generic: index into objects, quad: index into quads
+	int light;		//index into lights, -1 if not a sampled light
+	point3 center;	//center at time0
+	vec3 velocity;	//moving sphere: center motion per unit of time
+	double time0;
+	double radius;
+
+	point3 center_at(double time) const { return center + (time - time0) * velocity; }
+};
+
+struct compiled_quad {
+	point3 Q;
+	vec3 u, v;
+	vec3 normal;
+	vec3 w;		//see intersect_parallelogram
+	double D;
+};
+
+struct compiled_material {
+	int kind;
+	int texture;	//lambertian albedo, light emission
+	int object;		//generic: index into generic_materials
+	int pad;
+	color albedo;	//metal
+	double fuzz;	//metal
+	double ir;		//dielectric
+};
+
+struct compiled_texture {
+	int kind;
+	int odd, even;	//checker children
+	int object;		//generic: index into generic_textures, image: texture_cache handle
+	color value;	//solid
+};
+
+// Read-only array that lives either in one of the scene's vectors or in a mapped cache file.
+template <typename T>
+struct array_view {
+	const T* data = nullptr;
+	size_t count = 0;
+
+	const T& operator[](size_t i) const { return data[i]; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	const T* begin() const { return data; }
+	const T* end() const { return data + count; }
+};
+
+class compiled_scene {
+public:
+	compiled_scene() {}
+	compiled_scene(const compiled_scene&) = delete;	//the views point into this object
+	compiled_scene& operator=(const compiled_scene&) = delete;
+
+	void clear();
+	void compile(const hittable_list& world, double time0, double time1);
+	// Copies o into arrays of this scene's own, allocated by the calling thread (and so, by
+	// first touch, on its NUMA node); generic objects, materials and textures stay shared.
+	void copy_from(const compiled_scene& o);
+
+	// Incremental construction, used by compile() and the scene file loader: clear(), add
+	// materials and primitives, then finish() builds the BVH and the light tree.
+	int add_material(const shared_ptr<material>& m);
+	void add_sphere(const point3& center, double radius, int material);
+	void add_moving_sphere(const point3& center0, const point3& center1, double t0, double t1, double radius, int material,
+		double time0, double time1);
+	void add_quad(const point3& Q, const vec3& u, const vec3& v, int material);
+	// Lists and bvh_nodes are flattened, spheres become tagged prims, anything else is generic.
+	void add_object(const shared_ptr<hittable>& object, double time0, double time1);
+	void finish();
+
+	bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+	bool occluded(const ray& r, double t_min, double t_max) const;
+	int occluded(const ray* rays, int count, double t_min, double t_max, bool* blocked = nullptr) const {
+		int n = 0;
+		for (int i = 0; i < count; i++) {
+			bool b = occluded(rays[i], t_min, t_max);
+			if (blocked) blocked[i] = b;
+			n += b;
+		}
+		return n;
+	}
+	bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const;
+	color emitted(const ray& r_in, const hit_record& rec) const;
+	double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const;
+	color texture_value(int index, double u, double v, const point3& p, const texture_footprint& footprint = texture_footprint()) const;
+	aabb prim_box(size_t index, double time0, double time1) const;	//of prims[index] over the shutter interval
+
+	const light_set* light_list() const { return sample_lights && !lights.empty() ? &lights : nullptr; }
+	int light_index(const hit_record& rec) const { return rec.light; }
+	color background(const ray& r) const { return env.value(r); }
+	const environment* environment_light() const { return sample_lights && env.sampled() ? &env : nullptr; }
+
+public:
+	// Set by finish() or by scene_cache::load(), which points them into the cache file.
+	array_view<compiled_prim> prims;	//in BVH leaf order
+	array_view<flat_bvh_node> nodes;
+	array_view<compiled_quad> quads;
+
+	std::vector<compiled_material> materials;
+	std::vector<compiled_texture> textures;
+
+	std::vector<shared_ptr<hittable>> objects;
+	std::vector<shared_ptr<material>> generic_materials;
+	std::vector<shared_ptr<material>> material_sources;	//what each entry of materials was compiled from
+	std::vector<shared_ptr<texture>> generic_textures;
+
+	light_set lights;			//emissive spheres and quads, collected by compile()
+	bool sample_lights = true;	//next event estimation, otherwise lights are only hit by chance
+	environment env;
+
+private:
+	void add_prim(compiled_prim& prim, const aabb& box);
+	int add_texture(const shared_ptr<texture>& t);
+	static bool sphere_root(const ray& r, const point3& center, double radius, double t_min, double t_max, double& root);
+
+	template <typename T>
+	static array_view<T> view(const std::vector<T>& v) { return array_view<T>{ v.data(), v.size() }; }
+
+	std::vector<compiled_prim> prim_storage;
+	std::vector<flat_bvh_node> node_storage;
+	std::vector<compiled_quad> quad_storage;
+	shared_ptr<const mapped_file> mapping;	//backs the views after a cache load
+
+	std::vector<bvh_build_ref> refs;	//one per prim until finish()
+	std::unordered_map<const material*, int> material_ids;
+	std::unordered_map<const texture*, int> texture_ids;
+
+	friend class scene_cache;
+};
+
+// Adapter with the same interface over the authoring hittables, used to compare the two paths.
+struct polymorphic_scene {
+	const hittable& root;
+
+	bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const { return root.hit(r, t_min, t_max, rec); }
+	bool occluded(const ray& r, double t_min, double t_max) const { return root.occluded(r, t_min, t_max); }
+	int occluded(const ray* rays, int count, double t_min, double t_max, bool* blocked = nullptr) const {
+		return root.occluded(rays, count, t_min, t_max, blocked);
+	}
+	bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const {
+		return rec.mat_ptr->scatter(r_in, rec, attenuation, scattered);
+	}
+	color emitted(const ray& r_in, const hit_record& rec) const { return rec.mat_ptr->emitted(r_in, rec); }
+	double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
+		return rec.mat_ptr->scattering_pdf(r_in, rec, scattered);
+	}
+
+	const light_set* lights = nullptr;
+	const environment* env = nullptr;
+	bool sample_lights = true;
+
+	const light_set* light_list() const { return lights && !lights->empty() ? lights : nullptr; }
+	int light_index(const hit_record& rec) const { return lights->find(rec); }
+	color background(const ray& r) const { return env ? env->value(r) : environment().value(r); }
+	const environment* environment_light() const { return sample_lights && env && env->sampled() ? env : nullptr; }
+};
+
+void compiled_scene::clear() {
+	prims = array_view<compiled_prim>();
+	nodes = array_view<flat_bvh_node>();
+	quads = array_view<compiled_quad>();
+	prim_storage.clear();
+	node_storage.clear();
+	quad_storage.clear();
+	mapping.reset();
+	materials.clear();
+	textures.clear();
+	objects.clear();
+	generic_materials.clear();
+	material_sources.clear();
+	generic_textures.clear();
+	lights.clear();
+	refs.clear();
+	material_ids.clear();
+	texture_ids.clear();
+}
+
+void compiled_scene::copy_from(const compiled_scene& o) {
+	clear();
+	prim_storage.assign(o.prims.begin(), o.prims.end());
+	node_storage.assign(o.nodes.begin(), o.nodes.end());
+	quad_storage.assign(o.quads.begin(), o.quads.end());
+	prims = view(prim_storage);
+	nodes = view(node_storage);
+	quads = view(quad_storage);
+	materials = o.materials;
+	textures = o.textures;
+	objects = o.objects;
+	generic_materials = o.generic_materials;
+	material_sources = o.material_sources;
+	generic_textures = o.generic_textures;
+	lights = o.lights;
+	sample_lights = o.sample_lights;
+	env = o.env;
+}
+
+void compiled_scene::compile(const hittable_list& world, double time0, double time1) {
+	clear();
+	for (const auto& object : world.objects)
+		add_object(object, time0, time1);
+	finish();
+}
+
+void compiled_scene::finish() {
+	build_flat_bvh(refs, 4, node_storage);
+	lights.build();
+
+	std::vector<compiled_prim> ordered(prim_storage.size());
+	for (size_t i = 0; i < refs.size(); i++)
+		ordered[i] = prim_storage[refs[i].id];
+	prim_storage.swap(ordered);
+	prims = view(prim_storage);
+	nodes = view(node_storage);
+	quads = view(quad_storage);
+
+	refs.clear();
+	refs.shrink_to_fit();
+	material_ids.clear();
+	texture_ids.clear();
+}
+
+void compiled_scene::add_sphere(const point3& center, double radius, int material) {
+	compiled_prim prim = {};
+	prim.kind = prim_sphere;
+	prim.center = center;
+	prim.radius = radius;
+	prim.material = material;
+	prim.light = materials[material].kind == mat_light ? lights.add_sphere(center, radius, material_sources[material].get()) : -1;
+	vec3 r(radius, radius, radius);
+	add_prim(prim, aabb(center - r, center + r));
+}
+
+void compiled_scene::add_moving_sphere(const point3& center0, const point3& center1, double t0, double t1, double radius,
+	int material, double time0, double time1)
+{
+	compiled_prim prim = {};
+	prim.kind = prim_moving_sphere;
+	prim.center = center0;
+	prim.velocity = (center1 - center0) / (t1 - t0);
+	prim.time0 = t0;
+	prim.radius = radius;
+	prim.material = material;
+	prim.light = -1;
+	vec3 r(radius, radius, radius);
+	point3 a = prim.center_at(time0), b = prim.center_at(time1);
+	add_prim(prim, surrounding_box(aabb(a - r, a + r), aabb(b - r, b + r)));
+}
+
+void compiled_scene::add_quad(const point3& Q, const vec3& u, const vec3& v, int material) {
+	::quad shape(Q, u, v, nullptr);
+	compiled_quad q = { Q, u, v, shape.normal, shape.w, shape.D };
+	compiled_prim prim = {};
+	prim.kind = prim_quad;
+	prim.material = material;
+	prim.object = static_cast<int>(quad_storage.size());
+	prim.light = materials[material].kind == mat_light ? lights.add_quad(Q, u, v, material_sources[material].get()) : -1;
+	quad_storage.push_back(q);
+	aabb box;
+	shape.bounding_box(0, 1, box);
+	add_prim(prim, box);
+}
+
+void compiled_scene::add_object(const shared_ptr<hittable>& object, double time0, double time1) {
+	if (auto list = dynamic_cast<const hittable_list*>(object.get())) {
+		for (const auto& child : list->objects)
+			add_object(child, time0, time1);
+		return;
+	}
+	if (auto node = dynamic_cast<const bvh_node*>(object.get())) {
+		add_object(node->left, time0, time1);
+		if (node->right != node->left)
+			add_object(node->right, time0, time1);
+		return;
+	}
+	if (auto s = dynamic_cast<const sphere*>(object.get())) {
+		add_sphere(s->center, s->radius, add_material(s->mat_ptr));
+		return;
+	}
+	if (auto m = dynamic_cast<const moving_sphere*>(object.get())) {
+		add_moving_sphere(m->center0, m->center1, m->time0, m->time1, m->radius, add_material(m->mat_ptr), time0, time1);
+		return;
+	}
+	if (auto q = dynamic_cast<const ::quad*>(object.get())) {
+		add_quad(q->Q, q->u, q->v, add_material(q->mat_ptr));
+		return;
+	}
+
+	compiled_prim prim = {};
+	prim.kind = prim_generic;
+	prim.material = -1;
+	prim.object = static_cast<int>(objects.size());
+	objects.push_back(object);
+	prim.light = lights.add(*object);
+	aabb box;
+	if (!object->bounding_box(time0, time1, box))
+		box = aabb(point3(-1e30, -1e30, -1e30), point3(1e30, 1e30, 1e30));
+	add_prim(prim, box);
+}
+
+aabb compiled_scene::prim_box(size_t index, double time0, double time1) const {
+	const compiled_prim& prim = prims[index];
+	aabb box(point3(-1e30, -1e30, -1e30), point3(1e30, 1e30, 1e30));
+	vec3 r(prim.radius, prim.radius, prim.radius);
+	switch (prim.kind) {
+	case prim_sphere:
+		box = aabb(prim.center - r, prim.center + r);
+		break;
+	case prim_moving_sphere: {
+		point3 a = prim.center_at(time0), b = prim.center_at(time1);
+		box = surrounding_box(aabb(a - r, a + r), aabb(b - r, b + r));
+		break;
+	}
+	case prim_quad: {
+		const compiled_quad& q = quads[prim.object];
+		::quad(q.Q, q.u, q.v, nullptr).bounding_box(time0, time1, box);
+		break;
+	}
+	default:
+		objects[prim.object]->bounding_box(time0, time1, box);
+	}
+	return box;
+}
+
+void compiled_scene::add_prim(compiled_prim& prim, const aabb& box) {
+	bvh_build_ref ref;
+	for (int k = 0; k < 3; k++) {
+		ref.bmin[k] = static_cast<float>(box._min[k]);
+		ref.bmax[k] = static_cast<float>(box._max[k]);
+		ref.centroid[k] = 0.5f * (ref.bmin[k] + ref.bmax[k]);
+	}
+	ref.id = static_cast<int>(prim_storage.size());
+	refs.push_back(ref);
+	prim_storage.push_back(prim);
+}
+
+int compiled_scene::add_material(const shared_ptr<material>& m) {
+	auto found = material_ids.find(m.get());
+	if (found != material_ids.end())
+		return found->second;
+
+	compiled_material cm = {};
+	if (auto l = dynamic_cast<const lambertian*>(m.get())) {
+		cm.kind = mat_lambertian;
+		cm.texture = add_texture(l->albedo);
+	}
+	else if (auto me = dynamic_cast<const metal*>(m.get())) {
+		cm.kind = mat_metal;
+		cm.albedo = me->albedo;
+		cm.fuzz = me->fuzz;
+	}
+	else if (auto d = dynamic_cast<const dielectric*>(m.get())) {
+		cm.kind = mat_dielectric;
+		cm.ir = d->ir;
+	}
+	else if (auto e = dynamic_cast<const diffuse_light*>(m.get())) {
+		cm.kind = mat_light;
+		cm.texture = add_texture(e->emit);
+	}
+	else {
+		cm.kind = mat_generic;
+		cm.object = static_cast<int>(generic_materials.size());
+		generic_materials.push_back(m);
+	}
+
+	int index = static_cast<int>(materials.size());
+	materials.push_back(cm);
+	material_sources.push_back(m);
+	material_ids[m.get()] = index;
+	return index;
+}
+
+int compiled_scene::add_texture(const shared_ptr<texture>& t) {
+	auto found = texture_ids.find(t.get());
+	if (found != texture_ids.end())
+		return found->second;
+
+	compiled_texture ct = {};
+	if (dynamic_cast<const solid_color*>(t.get())) {
+		ct.kind = tex_solid;
+		ct.value = t->value(0, 0, point3(0));
+	}
+	else if (auto c = dynamic_cast<const checker_texture*>(t.get())) {
+		ct.kind = tex_checker;
+		ct.odd = add_texture(c->odd);
+		ct.even = add_texture(c->even);
+	}
+	else if (auto i = dynamic_cast<const image_texture*>(t.get())) {
+		ct.kind = tex_image;
+		ct.object = i->handle;
+	}
+	else {
+		ct.kind = tex_generic;
+		ct.object = static_cast<int>(generic_textures.size());
+		generic_textures.push_back(t);
+	}
+
+	int index = static_cast<int>(textures.size());
+	textures.push_back(ct);
+	texture_ids[t.get()] = index;
+	return index;
+}
+
+inline bool compiled_scene::sphere_root(const ray& r, const point3& center, double radius, double t_min, double t_max, double& root) {
+	vec3 oc = r.origin() - center;
+	auto a = r.direction().length_squared();
+	auto half_b = dot(oc, r.direction());
+	auto c = oc.length_squared() - radius * radius;
+
+	auto discriminant = half_b * half_b - a * c;
+	if (discriminant < 0) return false;
+	auto sqrtd = sqrt(discriminant);
+
+	root = (-half_b - sqrtd) / a;
+	if (root < t_min || t_max < root) {
+		root = (-half_b + sqrtd) / a;
+		if (root < t_min || t_max < root)
+			return false;
+	}
+	return true;
+}
+
+// Closest hit. Leaf prims are dispatched with a switch; the hit_record attributes are
+// only computed once, for the final closest prim.
+bool compiled_scene::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	if (nodes.empty())
+		return false;
+
+	float o[3], inv_d[3];
+	for (int a = 0; a < 3; a++) {
+		o[a] = static_cast<float>(r.origin()[a]);
+		inv_d[a] = 1.0f / static_cast<float>(r.direction()[a]);
+	}
+	float box_t_min = static_cast<float>(t_min);
+
+	double closest = t_max;
+	int closest_prim = -1;
+	double closest_a = 0, closest_b = 0;	//quad plane coordinates
+
+	traversal_tally tally;
+	int stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		const flat_bvh_node& n = nodes[stack[--top]];
+		tally.box_tests++;
+		if (!flat_node_hit(n, o, inv_d, box_t_min, closest < infinity ? static_cast<float>(closest) : float_infinity))
+			continue;
+		tally.node_visits++;
+		if (n.count > 0) {
+			tally.primitive_tests += n.count;
+			for (int i = n.offset; i < n.offset + n.count; i++) {
+				const compiled_prim& prim = prims[i];
+				double root;
+				switch (prim.kind) {
+				case prim_sphere:
+					if (sphere_root(r, prim.center, prim.radius, t_min, closest, root)) {
+						closest = root;
+						closest_prim = i;
+					}
+					break;
+				case prim_moving_sphere:
+					if (sphere_root(r, prim.center_at(r.time()), prim.radius, t_min, closest, root)) {
+						closest = root;
+						closest_prim = i;
+					}
+					break;
+				case prim_quad: {
+					const compiled_quad& q = quads[prim.object];
+					double a, b;
+					if (intersect_parallelogram(q.Q, q.u, q.v, q.normal, q.D, q.w, r, t_min, closest, root, a, b)) {
+						closest = root;
+						closest_prim = i;
+						closest_a = a;
+						closest_b = b;
+					}
+					break;
+				}
+				default:
+					if (objects[prim.object]->hit(r, t_min, closest, rec)) {
+						closest = rec.t;
+						closest_prim = i;
+						rec.mat_id = -1;
+					}
+					break;
+				}
+			}
+		}
+		else {
+			int left = static_cast<int>(&n - &nodes[0]) + 1;
+			if (r.direction()[-n.count - 1] < 0) {
+				stack[top++] = left;
+				stack[top++] = n.offset;
+			}
+			else {
+				stack[top++] = n.offset;
+				stack[top++] = left;
+			}
+		}
+	}
+
+	if (closest_prim < 0)
+		return false;
+
+	const compiled_prim& prim = prims[closest_prim];
+	rec.light = prim.light;
+	if (prim.kind == prim_generic)
+		return true;	//the object filled in rec itself
+
+	rec.mat_id = prim.material;
+	if (prim.kind == prim_quad) {
+		const compiled_quad& q = quads[prim.object];
+		rec.t = closest;
+		rec.p = r.at(closest);
+		rec.u = closest_a;
+		rec.v = closest_b;
+		rec.set_face_normal(r, q.normal);
+		rec.dpdu = q.u;
+		rec.dpdv = q.v;
+		rec.dndu = rec.dndv = vec3();
+		return true;
+	}
+
+	point3 center = prim.kind == prim_moving_sphere ? prim.center_at(r.time()) : prim.center;
+	rec.t = closest;
+	rec.p = r.at(closest);
+	vec3 outward_normal = (rec.p - center) / prim.radius;
+	rec.set_face_normal(r, outward_normal);
+	auto theta = acos(-outward_normal.y());
+	auto phi = atan2(-outward_normal.z(), outward_normal.x()) + pi;
+	rec.u = phi / (2 * pi);
+	rec.v = theta / pi;
+	sphere::get_sphere_partials(outward_normal, prim.radius, rec);
+	return true;
+}
+
+bool compiled_scene::occluded(const ray& r, double t_min, double t_max) const {
+	if (nodes.empty())
+		return false;
+
+	float o[3], inv_d[3];
+	for (int a = 0; a < 3; a++) {
+		o[a] = static_cast<float>(r.origin()[a]);
+		inv_d[a] = 1.0f / static_cast<float>(r.direction()[a]);
+	}
+	float box_t_min = static_cast<float>(t_min);
+	float box_t_max = t_max < infinity ? static_cast<float>(t_max) : float_infinity;
+
+	traversal_tally tally;
+	int stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		const flat_bvh_node& n = nodes[stack[--top]];
+		tally.box_tests++;
+		if (!flat_node_hit(n, o, inv_d, box_t_min, box_t_max))
+			continue;
+		tally.node_visits++;
+		if (n.count > 0) {
+			for (int i = n.offset; i < n.offset + n.count; i++) {
+				tally.primitive_tests++;
+				const compiled_prim& prim = prims[i];
+				double root;
+				switch (prim.kind) {
+				case prim_sphere:
+					if (sphere_root(r, prim.center, prim.radius, t_min, t_max, root))
+						return true;
+					break;
+				case prim_moving_sphere:
+					if (sphere_root(r, prim.center_at(r.time()), prim.radius, t_min, t_max, root))
+						return true;
+					break;
+				case prim_quad: {
+					const compiled_quad& q = quads[prim.object];
+					double a, b;
+					if (intersect_parallelogram(q.Q, q.u, q.v, q.normal, q.D, q.w, r, t_min, t_max, root, a, b))
+						return true;
+					break;
+				}
+				default:
+					if (objects[prim.object]->occluded(r, t_min, t_max))
+						return true;
+					break;
+				}
+			}
+		}
+		else {
+			stack[top++] = n.offset;
+			stack[top++] = static_cast<int>(&n - &nodes[0]) + 1;
+		}
+	}
+	return false;
+}
+
+color compiled_scene::texture_value(int index, double u, double v, const point3& p, const texture_footprint& footprint) const {
+	while (true) {
+		const compiled_texture& t = textures[index];
+		switch (t.kind) {
+		case tex_solid:
+			return t.value;
+		case tex_checker: {
+			double w = checker_odd_weight(p, footprint);
+			if (w > 0 && w < 1)
+				return w * texture_value(t.odd, u, v, p, footprint) + (1 - w) * texture_value(t.even, u, v, p, footprint);
+			index = w >= 1 ? t.odd : t.even;
+			break;
+		}
+		case tex_image:
+			if (t.object < 0)
+				return color(0, 1, 1);
+			return texture_cache::global().sample(t.object, u, v, footprint);
+		default:
+			return generic_textures[t.object]->filtered_value(u, v, p, footprint);
+		}
+	}
+}
+
+// Same sampling as the material classes, selected by tag.
+bool compiled_scene::scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const {
+	if (rec.mat_id < 0)
+		return rec.mat_ptr->scatter(r_in, rec, attenuation, scattered);
+
+	const compiled_material& m = materials[rec.mat_id];
+	switch (m.kind) {
+	case mat_lambertian: {
+		auto scatter_direction = rec.normal + random_unit_vector();
+		if (scatter_direction.near_zero())
+			scatter_direction = rec.normal;
+		scattered = ray(rec.p, scatter_direction, r_in.time());
+		attenuation = texture_value(m.texture, rec.u, rec.v, rec.p, rec.footprint);
+		return true;
+	}
+	case mat_metal: {
+		vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
+		scattered = ray(rec.p, reflected + m.fuzz * random_in_unit_sphere(), r_in.time());
+		reflect_differentials(r_in, rec, scattered);
+		attenuation = m.albedo;
+		return dot(scattered.direction(), rec.normal) > 0;
+	}
+	case mat_dielectric: {
+		attenuation = color(1.0, 1.0, 1.0);
+		double refraction_ratio = rec.front_face ? (1.0 / m.ir) : m.ir;
+
+		vec3 unit_direction = unit_vector(r_in.direction());
+		double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
+		double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+
+		auto r0 = (1 - refraction_ratio) / (1 + refraction_ratio);
+		r0 = r0 * r0;
+		auto reflectance = r0 + (1 - r0) * pow((1 - cos_theta), 5);
+
+		if (refraction_ratio * sin_theta > 1.0 || reflectance > random_double()) {
+			scattered = ray(rec.p, reflect(unit_direction, rec.normal), r_in.time());
+			reflect_differentials(r_in, rec, scattered);
+		}
+		else {
+			scattered = ray(rec.p, refract(unit_direction, rec.normal, refraction_ratio), r_in.time());
+			refract_differentials(r_in, rec, refraction_ratio, scattered);
+		}
+		return true;
+	}
+	case mat_light:
+		return false;
+	default:
+		return generic_materials[m.object]->scatter(r_in, rec, attenuation, scattered);
+	}
+}
+
+color compiled_scene::emitted(const ray& r_in, const hit_record& rec) const {
+	if (rec.mat_id < 0)
+		return rec.mat_ptr->emitted(r_in, rec);
+	const compiled_material& m = materials[rec.mat_id];
+	switch (m.kind) {
+	case mat_light:
+		return rec.front_face ? texture_value(m.texture, rec.u, rec.v, rec.p, rec.footprint) : color(0, 0, 0);
+	case mat_generic:
+		return generic_materials[m.object]->emitted(r_in, rec);
+	default:
+		return color(0, 0, 0);
+	}
+}
+
+double compiled_scene::scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
+	if (rec.mat_id < 0)
+		return rec.mat_ptr->scattering_pdf(r_in, rec, scattered);
+	const compiled_material& m = materials[rec.mat_id];
+	switch (m.kind) {
+	case mat_lambertian: {
+		auto cosine = dot(rec.normal, unit_vector(scattered.direction()));
+		return cosine < 0 ? 0 : cosine / pi;
+	}
+	case mat_generic:
+		return generic_materials[m.object]->scattering_pdf(r_in, rec, scattered);
+	default:
+		return 0;
+	}
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RT_DENOISE_SSE 1
+#endif
+
+#include "rtweekend.h"
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) with the variance guided
+// luminance weight of SVGF (Schied et al. 2017). The color is divided by the first hit albedo
+// so textures are not blurred, then smoothed by a 5x5 B3 spline kernel whose taps spread
+// 1, 2, 4, ... pixels apart. A tap loses weight when its normal or albedo differ from the
+// center pixel, or when its luminance differs by more than the center's noise explains; the
+// variance is filtered along with the color so later passes trust the smoothed values more.
+// Rows are split across threads and a pixel is one float4 (color and variance), so the
+// per-tap arithmetic is a handful of SSE instructions.
+
+struct denoise_settings {
+	int iterations = 5;
+	float sigma_luminance = 4.0f;	//in standard deviations of the center pixel
+	float sigma_normal = 0.3f;
+	float sigma_albedo = 0.1f;
+};
+
+namespace denoise_detail {
+
+	struct alignas(16) pixel4 {
+		float v[4];		//rgb, and the variance of the luminance in color pixels
+	};
+
+	const float albedo_epsilon = 1e-3f;
+
+	inline float luminance(const float* v) {
+		return 0.2126f * v[0] + 0.7152f * v[1] + 0.0722f * v[2];
+	}
+
+	// one a-trous pass over rows [y0, y1) with taps step pixels apart
+	inline void filter_rows(const pixel4* in, const pixel4* normal, const pixel4* albedo, pixel4* out,
+		int width, int height, int y0, int y1, int step, const denoise_settings& s)
+	{
+		static const float kernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+		float inv_normal = 1.0f / (s.sigma_normal * s.sigma_normal);
+		float inv_albedo = 1.0f / (s.sigma_albedo * s.sigma_albedo);
+		for (int y = y0; y < y1; y++) {
+			for (int x = 0; x < width; x++) {
+				size_t center = size_t(y) * width + x;
+				const pixel4& c = in[center];
+				float l_center = luminance(c.v);
+				// the variance of a few samples is noisy itself, so the weight uses a 3x3 blur of it
+				float blurred = 0, blur_total = 0;
+				for (int j = -1; j <= 1; j++) {
+					for (int i = -1; i <= 1; i++) {
+						int qx = x + i, qy = y + j;
+						if (qx < 0 || qx >= width || qy < 0 || qy >= height)
+							continue;
+						float w = (i == 0 ? 0.5f : 0.25f) * (j == 0 ? 0.5f : 0.25f);
+						blurred += w * in[size_t(qy) * width + qx].v[3];
+						blur_total += w;
+					}
+				}
+				float inv_luminance = 1.0f / (s.sigma_luminance * std::sqrt(std::max(blurred / blur_total, 0.0f)) + 1e-4f);
+#ifdef RT_DENOISE_SSE
+				const __m128 rgb_mask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+				const __m128 cn = _mm_load_ps(normal[center].v), ca = _mm_load_ps(albedo[center].v);
+				__m128 sum = _mm_setzero_ps();
+				auto squared_length = [](__m128 d) {
+					__m128 sq = _mm_mul_ps(d, d);
+					__m128 shuf = _mm_shuffle_ps(sq, sq, _MM_SHUFFLE(2, 3, 0, 1));
+					__m128 sums = _mm_add_ps(sq, shuf);
+					shuf = _mm_movehl_ps(shuf, sums);
+					return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+				};
+#else
+				float sum[3] = { 0, 0, 0 };
+				auto squared_distance = [](const pixel4& a, const pixel4& b) {
+					float dx = a.v[0] - b.v[0], dy = a.v[1] - b.v[1], dz = a.v[2] - b.v[2];
+					return dx * dx + dy * dy + dz * dz;
+				};
+#endif
+				float total = 0, variance = 0;
+				for (int j = -2; j <= 2; j++) {
+					int qy = y + j * step;
+					if (qy < 0 || qy >= height)
+						continue;
+					for (int i = -2; i <= 2; i++) {
+						int qx = x + i * step;
+						if (qx < 0 || qx >= width)
+							continue;
+						size_t q = size_t(qy) * width + qx;
+						float dl = std::fabs(luminance(in[q].v) - l_center) * inv_luminance;
+#ifdef RT_DENOISE_SSE
+						float dn = squared_length(_mm_sub_ps(_mm_load_ps(normal[q].v), cn));
+						float da = squared_length(_mm_sub_ps(_mm_load_ps(albedo[q].v), ca));
+						float w = kernel[i + 2] * kernel[j + 2] * std::exp(-(dl + dn * inv_normal + da * inv_albedo));
+						sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(w), _mm_and_ps(_mm_load_ps(in[q].v), rgb_mask)));
+#else
+						float dn = squared_distance(normal[q], normal[center]);
+						float da = squared_distance(albedo[q], albedo[center]);
+						float w = kernel[i + 2] * kernel[j + 2] * std::exp(-(dl + dn * inv_normal + da * inv_albedo));
+						for (int k = 0; k < 3; k++)
+							sum[k] += w * in[q].v[k];
+#endif
+						variance += w * w * in[q].v[3];
+						total += w;
+					}
+				}
+				// the center tap always contributes, so total > 0
+#ifdef RT_DENOISE_SSE
+				_mm_store_ps(out[center].v, _mm_mul_ps(sum, _mm_set1_ps(1.0f / total)));
+#else
+				for (int k = 0; k < 3; k++)
+					out[center].v[k] = sum[k] / total;
+#endif
+				out[center].v[3] = variance / (total * total);
+			}
+		}
+	}
+
+	inline pixel4 to_pixel(const vec3& v, float w = 0.0f) {
+		pixel4 p = { { static_cast<float>(v.x()), static_cast<float>(v.y()), static_cast<float>(v.z()), w } };
+		return p;
+	}
+}
+
+// Denoises width * height linear colors using the first hit albedo and normal of each pixel
+// (averaged over its samples) and the variance of each pixel's mean luminance. Writes the
+// result to output, which may alias image.
+void denoise(const std::vector<color>& image, const std::vector<color>& albedo, const std::vector<vec3>& normal,
+	const std::vector<float>& variance, int width, int height, std::vector<color>& output,
+	const denoise_settings& settings = denoise_settings(), unsigned threads = std::thread::hardware_concurrency())
+{
+	using namespace denoise_detail;
+	size_t count = size_t(width) * height;
+	std::vector<pixel4> a(count), b(count), n(count), alb(count);
+	for (size_t i = 0; i < count; i++) {
+		alb[i] = to_pixel(albedo[i]);
+		n[i] = to_pixel(normal[i]);
+		color demodulated;
+		for (int k = 0; k < 3; k++) {
+			double value = image[i][k] / (albedo[i][k] + albedo_epsilon);
+			demodulated[k] = std::isfinite(value) ? value : 0.0;
+		}
+		double scale = ::luminance(albedo[i]) + albedo_epsilon;
+		double v = variance[i] / (scale * scale);
+		a[i] = to_pixel(demodulated, std::isfinite(v) ? static_cast<float>(v) : 0.0f);
+	}
+
+	int slices = std::max(1, std::min(static_cast<int>(threads ? threads : 1), height / 8));
+	for (int pass = 0; pass < settings.iterations; pass++) {
+		int step = 1 << pass;
+		if (slices == 1) {
+			filter_rows(a.data(), n.data(), alb.data(), b.data(), width, height, 0, height, step, settings);
+		}
+		else {
+			std::vector<std::thread> workers;
+			for (int t = 0; t < slices; t++) {
+				workers.emplace_back(filter_rows, a.data(), n.data(), alb.data(), b.data(), width, height,
+					height * t / slices, height * (t + 1) / slices, step, std::cref(settings));
+			}
+			for (auto& worker : workers)
+				worker.join();
+		}
+		std::swap(a, b);
+	}
+
+	output.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		color filtered(a[i].v[0], a[i].v[1], a[i].v[2]);
+		output[i] = filtered * (albedo[i] + color(albedo_epsilon, albedo_epsilon, albedo_epsilon));
+	}
+}
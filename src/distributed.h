@@ -0,0 +1,606 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// One image rendered by several processes. A coordinator listens on a TCP port or a Unix
+// socket; workers connect whenever they like, get the job (scene, size, samples, seed) and
+// then tiles, each a rectangle of pixels and a range of samples, and send back the color
+// sums of the tile's pixels as floats. A worker holds up to two tiles, so the next one is
+// already there while it sends a result. The tiles of a worker that goes away go back to the
+// queue; once the queue is empty an idle worker is also given the oldest tile still out and
+// whichever result arrives first is kept, which covers a worker that hangs without closing
+// its connection as well as a slow last tile. Every sample draws from its own random
+// stream, so where a tile is traced does not change its pixels.
+//
+// A message is its type and payload size, then the payload. Numbers go in the byte order
+// of the machine, so coordinator and workers are expected to run on the same kind of cpu.
+
+#ifdef _WIN32
+typedef SOCKET socket_handle;
+static const socket_handle no_socket = INVALID_SOCKET;
+#else
+typedef int socket_handle;
+static const socket_handle no_socket = -1;
+#endif
+
+namespace net_detail {
+
+#ifdef _WIN32
+	inline bool startup() {
+		static const bool ok = [] {
+			WSADATA data;
+			return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+		}();
+		return ok;
+	}
+	inline void close_handle(socket_handle s) { closesocket(s); }
+	inline int poll_handles(pollfd* fds, size_t count, int ms) { return WSAPoll(fds, static_cast<ULONG>(count), ms); }
+	static const int send_flags = 0;
+#else
+	inline bool startup() { return true; }
+	inline void close_handle(socket_handle s) { ::close(s); }
+	inline int poll_handles(pollfd* fds, size_t count, int ms) { return ::poll(fds, static_cast<nfds_t>(count), ms); }
+	static const int send_flags = MSG_NOSIGNAL;	//a worker that went away is an error, not SIGPIPE
+#endif
+
+	inline double now() {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+}
+
+// Owns a connected or listening socket.
+class net_socket {
+public:
+	net_socket() = default;
+	explicit net_socket(socket_handle h) : handle(h) {}
+	net_socket(net_socket&& o) noexcept : handle(o.handle) { o.handle = no_socket; }
+	net_socket& operator=(net_socket&& o) noexcept {
+		std::swap(handle, o.handle);
+		return *this;
+	}
+	net_socket(const net_socket&) = delete;
+	net_socket& operator=(const net_socket&) = delete;
+	~net_socket() { close(); }
+
+	bool valid() const { return handle != no_socket; }
+	socket_handle get() const { return handle; }
+
+	void close() {
+		if (handle != no_socket)
+			net_detail::close_handle(handle);
+		handle = no_socket;
+	}
+
+	bool send_all(const void* data, size_t size) {
+		const char* p = static_cast<const char*>(data);
+		while (size > 0) {
+			int n = static_cast<int>(::send(handle, p, static_cast<int>(std::min<size_t>(size, 1 << 20)), net_detail::send_flags));
+			if (n <= 0)
+				return false;
+			p += n;
+			size -= n;
+		}
+		return true;
+	}
+
+	bool recv_all(void* data, size_t size) {
+		char* p = static_cast<char*>(data);
+		while (size > 0) {
+			int n = recv_some(p, size);
+			if (n <= 0)
+				return false;
+			p += n;
+			size -= n;
+		}
+		return true;
+	}
+
+	// what one recv() returns: bytes read, 0 once the peer closed, negative on errors
+	int recv_some(void* data, size_t size) {
+		return static_cast<int>(::recv(handle, static_cast<char*>(data), static_cast<int>(std::min<size_t>(size, 1 << 20)), 0));
+	}
+
+private:
+	socket_handle handle = no_socket;
+};
+
+namespace net_detail {
+
+	// "unix:/path", "host:port" or just "port"; a listening socket without a host takes
+	// connections on every interface, a connecting one goes to this machine.
+	inline net_socket open(const std::string& address, bool listening, std::string& error) {
+		if (!startup()) {
+			error = "cannot start the socket library";
+			return net_socket();
+		}
+		if (address.compare(0, 5, "unix:") == 0) {
+#ifdef _WIN32
+			error = "unix sockets are not supported here";
+			return net_socket();
+#else
+			sockaddr_un addr = {};
+			addr.sun_family = AF_UNIX;
+			std::string path = address.substr(5);
+			if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+				error = "bad unix socket path " + path;
+				return net_socket();
+			}
+			memcpy(addr.sun_path, path.c_str(), path.size());
+			net_socket s(::socket(AF_UNIX, SOCK_STREAM, 0));
+			if (listening)
+				unlink(path.c_str());	//left over by an earlier coordinator
+			bool ok = s.valid() && (listening ? ::bind(s.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 && ::listen(s.get(), 64) == 0
+				: ::connect(s.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+			if (!ok) {
+				error = std::string(listening ? "cannot listen on " : "cannot connect to ") + address;
+				return net_socket();
+			}
+			return s;
+#endif
+		}
+		size_t colon = address.rfind(':');
+		std::string host = colon == std::string::npos ? "" : address.substr(0, colon);
+		std::string port = colon == std::string::npos ? address : address.substr(colon + 1);
+		addrinfo hints = {}, *found = nullptr;
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = listening ? AI_PASSIVE : 0;
+		if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found) != 0) {
+			error = "cannot resolve " + address;
+			return net_socket();
+		}
+		net_socket s;
+		for (addrinfo* a = found; a && !s.valid(); a = a->ai_next) {
+			net_socket candidate(::socket(a->ai_family, a->ai_socktype, a->ai_protocol));
+			if (!candidate.valid())
+				continue;
+			int on = 1;
+			if (listening) {
+				setsockopt(candidate.get(), SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&on), sizeof(on));
+				if (::bind(candidate.get(), a->ai_addr, static_cast<int>(a->ai_addrlen)) == 0 && ::listen(candidate.get(), 64) == 0)
+					s = std::move(candidate);
+			}
+			else if (::connect(candidate.get(), a->ai_addr, static_cast<int>(a->ai_addrlen)) == 0) {
+				setsockopt(candidate.get(), IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&on), sizeof(on));	//tiles are small messages
+				s = std::move(candidate);
+			}
+		}
+		freeaddrinfo(found);
+		if (!s.valid())
+			error = std::string(listening ? "cannot listen on " : "cannot connect to ") + address;
+		return s;
+	}
+}
+
+enum farm_message_type : uint32_t {
+	farm_hello_message = 1,		//worker: threads
+	farm_job_message,			//coordinator: farm_job
+	farm_tile_message,			//coordinator: farm_tile
+	farm_result_message,		//worker: job, tile, rays, paths, then the color sums
+};
+
+struct farm_message {
+	uint32_t type = 0;
+	std::vector<char> data;
+
+	template <typename T>
+	void put(const T& v) {
+		const char* p = reinterpret_cast<const char*>(&v);
+		data.insert(data.end(), p, p + sizeof(T));
+	}
+
+	void put_string(const std::string& s) {
+		put(static_cast<uint32_t>(s.size()));
+		data.insert(data.end(), s.begin(), s.end());
+	}
+};
+
+// Reads the payload of a farm_message in the order it was written; ok() turns false when
+// it runs past the end.
+class farm_reader {
+public:
+	farm_reader(const char* data, size_t size) : p(data), end(data + size) {}
+
+	template <typename T>
+	T get() {
+		T v{};
+		if (size_t(end - p) < sizeof(T)) {
+			good = false;
+			return v;
+		}
+		memcpy(&v, p, sizeof(T));
+		p += sizeof(T);
+		return v;
+	}
+
+	std::string get_string() {
+		uint32_t n = get<uint32_t>();
+		if (size_t(end - p) < n) {
+			good = false;
+			return std::string();
+		}
+		std::string s(p, n);
+		p += n;
+		return s;
+	}
+
+	const char* rest() const { return p; }
+	size_t left() const { return size_t(end - p); }
+	bool ok() const { return good; }
+
+private:
+	const char* p;
+	const char* end;
+	bool good = true;
+};
+
+static const uint32_t farm_max_message = 1u << 28;
+
+inline bool send_farm_message(net_socket& s, const farm_message& m) {
+	uint32_t header[2] = { m.type, static_cast<uint32_t>(m.data.size()) };
+	return s.send_all(header, sizeof(header)) && (m.data.empty() || s.send_all(m.data.data(), m.data.size()));
+}
+
+inline bool recv_farm_message(net_socket& s, farm_message& m) {
+	uint32_t header[2];
+	if (!s.recv_all(header, sizeof(header)) || header[1] > farm_max_message)
+		return false;
+	m.type = header[0];
+	m.data.resize(header[1]);
+	return header[1] == 0 || s.recv_all(m.data.data(), header[1]);
+}
+
+// What the workers render; scene is a name the coordinator and its workers agree on.
+struct farm_job {
+	uint32_t id = 0;
+	std::string scene;
+	int width = 0, height = 0;
+	int samples = 0;		//per pixel over all tiles
+	uint32_t seed = 0;
+};
+
+struct farm_tile {
+	uint32_t job = 0, id = 0;
+	int x0 = 0, y0 = 0, x1 = 0, y1 = 0;		//pixels, the end excluded
+	int first_sample = 0, samples = 0;
+};
+
+struct farm_stats {
+	double seconds = 0;		//from the first tile sent to the last result
+	long long rays = 0, paths = 0;
+	int tiles = 0;
+	int workers = 0;		//that returned a tile
+	int requeued = 0;		//tiles of workers that went away
+	int duplicated = 0;		//tiles also given to an idle worker
+};
+
+// The coordinator's side: hands out the tiles of one job after another to whoever is
+// connected. Workers stay connected between jobs and are let go when it is destroyed.
+class tile_coordinator {
+public:
+	bool listen(const std::string& address, std::string& error) {
+		listener = net_detail::open(address, true, error);
+		return listener.valid();
+	}
+
+	// Splits the job into tile by tile pixel tiles of sample_chunk samples (all of them with 0)
+	// and blocks until every one came back; sums gets the color sums, three per pixel, row by
+	// row from y 0. The tiles are handed out once min_workers workers are connected.
+	farm_stats run(const farm_job& job, int tile, int sample_chunk, int min_workers, std::vector<double>& sums) {
+		tile = std::max(1, tile);
+		int chunk = sample_chunk > 0 ? std::min(sample_chunk, job.samples) : job.samples;
+		tiles.clear();
+		for (int y = 0; y < job.height; y += tile) {
+			for (int x = 0; x < job.width; x += tile) {
+				for (int s = 0; s < job.samples; s += chunk) {
+					tile_state t;
+					t.tile = { job.id, static_cast<uint32_t>(tiles.size()), x, y, std::min(x + tile, job.width), std::min(y + tile, job.height),
+						s, std::min(chunk, job.samples - s) };
+					tiles.push_back(t);
+				}
+			}
+		}
+		pending.clear();
+		for (size_t k = 0; k < tiles.size(); k++)
+			pending.push_back(static_cast<int>(k));
+		for (auto& w : workers)
+			w->tiles.clear();	//duplicates of the last job still out; their results are dropped
+		sums.assign(size_t(job.width) * job.height * 3, 0.0);
+
+		farm_stats stats;
+		stats.tiles = static_cast<int>(tiles.size());
+		int left = stats.tiles;
+		started = -1;
+		bool waiting_noted = false;
+		while (left > 0) {
+			int ready = 0;
+			for (auto& w : workers)
+				ready += w->ready;
+			if (ready >= min_workers || started >= 0) {
+				for (size_t k = 0; k < workers.size(); k++) {
+					if (workers[k]->ready && !feed(*workers[k], job))
+						drop(k--);
+				}
+			}
+			else if (!waiting_noted) {
+				waiting_noted = true;
+				if (waiting)
+					waiting(ready, min_workers);
+			}
+
+			std::vector<pollfd> fds(workers.size() + 1);
+			fds[0].fd = listener.get();
+			fds[0].events = POLLIN;
+			for (size_t k = 0; k < workers.size(); k++) {
+				fds[k + 1].fd = workers[k]->socket.get();
+				fds[k + 1].events = POLLIN;
+			}
+			if (net_detail::poll_handles(fds.data(), fds.size(), 1000) <= 0)
+				continue;
+			if (fds[0].revents & POLLIN) {
+				net_socket s(::accept(listener.get(), nullptr, nullptr));
+				if (s.valid()) {
+					int on = 1;
+					setsockopt(s.get(), IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&on), sizeof(on));	//fails harmlessly on unix sockets
+					workers.push_back(std::make_unique<worker>());
+					workers.back()->socket = std::move(s);
+					workers.back()->id = next_worker++;
+				}
+			}
+			for (size_t k = fds.size() - 1; k >= 1; k--) {
+				if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR)))
+					continue;
+				worker& w = *workers[k - 1];
+				if (!receive(w, job, sums, stats, left))
+					drop(k - 1);
+			}
+		}
+		stats.seconds = started >= 0 ? net_detail::now() - started : 0.0;
+		stats.requeued = requeued;
+		requeued = 0;
+		stats.duplicated = duplicated;
+		duplicated = 0;
+		stats.workers = static_cast<int>(contributors.size());
+		contributors.clear();
+		return stats;
+	}
+
+	int connected() const { return static_cast<int>(workers.size()); }
+
+	// called once per job while fewer than min_workers are connected: (connected, wanted)
+	void (*waiting)(int, int) = nullptr;
+
+private:
+	struct tile_state {
+		farm_tile tile;
+		int holders = 0;		//workers it was sent to that have not answered
+		bool done = false;
+		double sent = 0;		//when it was last handed out
+	};
+
+	struct worker {
+		net_socket socket;
+		int id = 0;
+		bool ready = false;		//said hello
+		uint32_t job = 0;		//the last job it was sent
+		std::vector<int> tiles;	//sent and not answered yet
+		std::vector<char> inbox;	//bytes of messages not complete yet
+	};
+
+	net_socket listener;
+	std::vector<std::unique_ptr<worker>> workers;
+	std::vector<tile_state> tiles;
+	std::deque<int> pending;
+	std::vector<int> contributors;
+	int next_worker = 0;
+	int requeued = 0, duplicated = 0;
+	double started = -1;	//when the job's first tile went out
+
+	static const int tiles_in_flight = 2;
+
+	// Tops the worker up to tiles_in_flight tiles; false if it could not be written to.
+	bool feed(worker& w, const farm_job& job) {
+		if (w.job != job.id) {
+			farm_message m;
+			m.type = farm_job_message;
+			m.put(job.id);
+			m.put_string(job.scene);
+			m.put(job.width);
+			m.put(job.height);
+			m.put(job.samples);
+			m.put(job.seed);
+			if (!send_farm_message(w.socket, m))
+				return false;
+			w.job = job.id;
+		}
+		while (static_cast<int>(w.tiles.size()) < tiles_in_flight) {
+			int k = -1;
+			if (!pending.empty()) {
+				k = pending.front();
+				pending.pop_front();
+			}
+			else if (w.tiles.empty()) {
+				// nothing left to hand out: race the worker that has had a tile the longest
+				for (size_t t = 0; t < tiles.size(); t++) {
+					if (!tiles[t].done && tiles[t].holders == 1 && (k < 0 || tiles[t].sent < tiles[k].sent))
+						k = static_cast<int>(t);
+				}
+				duplicated += k >= 0;
+			}
+			if (k < 0)
+				return true;
+			const farm_tile& t = tiles[k].tile;
+			farm_message m;
+			m.type = farm_tile_message;
+			m.put(t);
+			tiles[k].holders++;
+			tiles[k].sent = net_detail::now();
+			if (started < 0)
+				started = tiles[k].sent;
+			w.tiles.push_back(k);
+			if (!send_farm_message(w.socket, m))
+				return false;
+		}
+		return true;
+	}
+
+	// Reads what the worker sent; false once it closed the connection or sent garbage.
+	bool receive(worker& w, const farm_job& job, std::vector<double>& sums, farm_stats& stats, int& left) {
+		char buffer[1 << 16];
+		int n = w.socket.recv_some(buffer, sizeof(buffer));
+		if (n <= 0)
+			return false;
+		w.inbox.insert(w.inbox.end(), buffer, buffer + n);
+		size_t used = 0;
+		while (w.inbox.size() - used >= 8) {
+			uint32_t header[2];
+			memcpy(header, w.inbox.data() + used, sizeof(header));
+			if (header[1] > farm_max_message)
+				return false;
+			if (w.inbox.size() - used - 8 < header[1])
+				break;
+			farm_reader r(w.inbox.data() + used + 8, header[1]);
+			used += 8 + header[1];
+			if (header[0] == farm_hello_message) {
+				r.get<int>();
+				w.ready = true;
+			}
+			else if (header[0] == farm_result_message && !take_result(w, job, r, sums, stats, left)) {
+				return false;
+			}
+		}
+		w.inbox.erase(w.inbox.begin(), w.inbox.begin() + used);
+		return true;
+	}
+
+	bool take_result(worker& w, const farm_job& job, farm_reader& r, std::vector<double>& sums, farm_stats& stats, int& left) {
+		uint32_t job_id = r.get<uint32_t>(), id = r.get<uint32_t>();
+		long long rays = r.get<long long>(), paths = r.get<long long>();
+		if (!r.ok())
+			return false;
+		if (job_id != job.id || id >= tiles.size())
+			return true;	//a duplicate of an earlier job
+		auto held = std::find(w.tiles.begin(), w.tiles.end(), static_cast<int>(id));
+		if (held != w.tiles.end()) {
+			w.tiles.erase(held);
+			tiles[id].holders--;
+		}
+		tile_state& t = tiles[id];
+		if (t.done)
+			return true;	//the other worker was faster
+		int width = t.tile.x1 - t.tile.x0, height = t.tile.y1 - t.tile.y0;
+		if (r.left() != size_t(width) * height * 3 * sizeof(float))
+			return false;
+		const char* p = r.rest();
+		for (int j = 0; j < height; j++) {
+			for (int i = 0; i < width * 3; i++) {
+				float v;
+				memcpy(&v, p + (size_t(j) * width * 3 + i) * sizeof(float), sizeof(float));
+				sums[(size_t(t.tile.y0 + j) * job.width + t.tile.x0) * 3 + i] += v;
+			}
+		}
+		t.done = true;
+		left--;
+		stats.rays += rays;
+		stats.paths += paths;
+		if (std::find(contributors.begin(), contributors.end(), w.id) == contributors.end())
+			contributors.push_back(w.id);
+		return true;
+	}
+
+	// Forgets worker k; its tiles that nobody else has go to the front of the queue.
+	void drop(size_t k) {
+		for (int t : workers[k]->tiles) {
+			if (--tiles[t].holders == 0 && !tiles[t].done) {
+				pending.push_front(t);
+				requeued++;
+			}
+		}
+		workers.erase(workers.begin() + k);
+	}
+};
+
+// The worker's side: connects to the coordinator at address, retrying for wait_seconds
+// while it is not up yet, and renders tiles until the coordinator closes the connection.
+// setup(job) prepares a job and render(job, tile, rgb, rays, paths) traces a tile into rgb,
+// three floats per pixel row by row from y0. Returns false if it could not connect or set
+// up a job.
+template <typename Setup, typename Render>
+bool run_tile_worker(const std::string& address, int threads, double wait_seconds, Setup setup, Render render, std::string& error) {
+	net_socket s;
+	double give_up = net_detail::now() + wait_seconds;
+	while (!(s = net_detail::open(address, false, error)).valid()) {
+		if (net_detail::now() > give_up)
+			return false;
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	}
+	error.clear();
+	farm_message hello;
+	hello.type = farm_hello_message;
+	hello.put(threads);
+	if (!send_farm_message(s, hello)) {
+		error = "lost the coordinator";
+		return false;
+	}
+	farm_job job;
+	std::vector<float> rgb;
+	farm_message m;
+	while (recv_farm_message(s, m)) {
+		farm_reader r(m.data.data(), m.data.size());
+		if (m.type == farm_job_message) {
+			job.id = r.get<uint32_t>();
+			job.scene = r.get_string();
+			job.width = r.get<int>();
+			job.height = r.get<int>();
+			job.samples = r.get<int>();
+			job.seed = r.get<uint32_t>();
+			if (!r.ok() || !setup(job)) {
+				error = "cannot set up job " + job.scene;
+				return false;
+			}
+		}
+		else if (m.type == farm_tile_message) {
+			farm_tile t = r.get<farm_tile>();
+			if (!r.ok() || t.job != job.id)
+				continue;
+			long long rays = 0, paths = 0;
+			render(job, t, rgb, rays, paths);
+			farm_message result;
+			result.type = farm_result_message;
+			result.put(t.job);
+			result.put(t.id);
+			result.put(rays);
+			result.put(paths);
+			const char* p = reinterpret_cast<const char*>(rgb.data());
+			result.data.insert(result.data.end(), p, p + rgb.size() * sizeof(float));
+			if (!send_farm_message(s, result))
+				break;
+		}
+	}
+	return true;	//the coordinator is done with us
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "stb_image.h"
+#include "rtweekend.h"
+
+// Equirectangular environment image, usually HDR. Row 0 looks straight up and u runs like
+// sphere::get_sphere_uv, so a map lines up with an image textured globe. An alias table over
+// all pixels, weighted by luminance and the solid angle of their row, lets sample() draw
+// directions in proportion to the light arriving from them in constant time.
+class environment_map {
+public:
+	// Loads any image stb_image reads (Radiance .hdr keeps its range, LDR files are linearized).
+	bool load(const std::string& path);
+	// Takes width * height RGB floats, row major from the top, and builds the sampling table.
+	void set_pixels(int w, int h, std::vector<float> rgb);
+
+	color value(const vec3& direction) const;
+	// Unit direction drawn with probability proportional to the table, and its solid angle density.
+	vec3 sample(double& pdf) const;
+	double pdf(const vec3& direction) const;
+
+	int width = 0, height = 0;
+
+private:
+	int pixel_index(const vec3& direction) const;
+
+	std::vector<float> pixels;
+	std::vector<float> pmf;			//probability of each pixel
+	std::vector<float> probability;	//alias table: keep the pixel with this probability,
+	std::vector<int> alias;			//otherwise take this one
+};
+
+bool environment_map::load(const std::string& path) {
+	int w, h, n;
+	float* data = stbi_loadf(path.c_str(), &w, &h, &n, 3);
+	if (!data) {
+		std::cerr << "environment_map: cannot read " << path << ": " << stbi_failure_reason() << "\n";
+		return false;
+	}
+	set_pixels(w, h, std::vector<float>(data, data + size_t(w) * h * 3));
+	stbi_image_free(data);
+	return true;
+}
+
+void environment_map::set_pixels(int w, int h, std::vector<float> rgb) {
+	width = w;
+	height = h;
+	pixels = std::move(rgb);
+
+	size_t count = size_t(w) * h;
+	std::vector<double> weight(count);
+	double total = 0;
+	for (int pass = 0; pass < 2 && total <= 0; pass++) {
+		// a black map falls back to sampling by solid angle alone
+		for (int y = 0; y < h; y++) {
+			double sin_theta = sin(pi * (y + 0.5) / h);
+			for (int x = 0; x < w; x++) {
+				size_t i = size_t(y) * w + x;
+				double l = pass == 0 ? luminance(color(pixels[3 * i], pixels[3 * i + 1], pixels[3 * i + 2])) : 1.0;
+				weight[i] = std::isfinite(l) && l > 0 ? l * sin_theta : 0.0;
+				total += weight[i];
+			}
+		}
+	}
+
+	// Vose's method: pair each under-full pixel with an over-full one that tops it up
+	pmf.resize(count);
+	probability.assign(count, 1.0f);
+	alias.resize(count);
+	std::vector<double> scaled(count);
+	std::vector<int> small, large;
+	for (size_t i = 0; i < count; i++) {
+		pmf[i] = static_cast<float>(weight[i] / total);
+		scaled[i] = weight[i] / total * count;
+		alias[i] = static_cast<int>(i);
+		(scaled[i] < 1 ? small : large).push_back(static_cast<int>(i));
+	}
+	while (!small.empty() && !large.empty()) {
+		int s = small.back(), l = large.back();
+		small.pop_back();
+		probability[s] = static_cast<float>(scaled[s]);
+		alias[s] = l;
+		scaled[l] -= 1 - scaled[s];
+		if (scaled[l] < 1) {
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+	// whatever is left is full up to rounding
+}
+
+int environment_map::pixel_index(const vec3& direction) const {
+	vec3 d = unit_vector(direction);
+	double u = (atan2(-d.z(), d.x()) + pi) / (2 * pi);
+	double t = acos(clamp(d.y(), -1.0, 1.0)) / pi;
+	int x = std::min(static_cast<int>(u * width), width - 1);
+	int y = std::min(static_cast<int>(t * height), height - 1);
+	return y * width + x;
+}
+
+color environment_map::value(const vec3& direction) const {
+	if (pixels.empty())
+		return color(0, 0, 0);
+	size_t i = pixel_index(direction);
+	return color(pixels[3 * i], pixels[3 * i + 1], pixels[3 * i + 2]);
+}
+
+vec3 environment_map::sample(double& pdf) const {
+	pdf = 0;
+	if (pmf.empty())
+		return vec3(0, 1, 0);
+	size_t count = pmf.size();
+	double r = random_double() * count;
+	size_t i = std::min(static_cast<size_t>(r), count - 1);
+	if (r - i >= probability[i])
+		i = alias[i];
+
+	// uniform inside the pixel
+	double u = (i % width + random_double()) / width;
+	double t = (i / width + random_double()) / height;
+	double phi = 2 * pi * u - pi, theta = pi * t;
+	double sin_theta = sin(theta);
+	if (sin_theta <= 0)
+		return vec3(0, 1, 0);
+	pdf = pmf[i] * count / (2 * pi * pi * sin_theta);
+	return vec3(sin_theta * cos(phi), cos(theta), -sin_theta * sin(phi));
+}
+
+double environment_map::pdf(const vec3& direction) const {
+	if (pmf.empty())
+		return 0;
+	vec3 d = unit_vector(direction);
+	double sin_theta = sqrt(fmax(0.0, 1 - d.y() * d.y()));
+	if (sin_theta <= 0)
+		return 0;
+	return pmf[pixel_index(d)] * pmf.size() / (2 * pi * pi * sin_theta);
+}
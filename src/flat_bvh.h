@@ -0,0 +1,214 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <thread>
+#include <vector>
+
+// Linear BVH shared by the acceleration structures that own their primitives
+// (triangle_mesh, compiled_scene). Nodes are stored depth first: the left child of an
+// inner node directly follows it, so only the right child index is kept. Trees are at most
+// flat_bvh_max_depth deep, which keeps the traversal stacks of 64 entries from overflowing;
+// a leaf at that depth holds whatever primitives are left, possibly more than max_leaf.
+// The subtrees under the top few splits are built on threads of their own.
+
+const float float_infinity = std::numeric_limits<float>::infinity();
+const int flat_bvh_max_depth = 60;
+
+struct flat_bvh_node {
+	float bmin[3];
+	float bmax[3];
+	int offset;		//leaf: first primitive, inner: index of the right child
+	int count;		//leaf: primitive count, inner: -1 - split axis
+};
+
+struct bvh_build_ref {
+	float bmin[3], bmax[3], centroid[3];
+	int id;
+};
+
+inline bool flat_node_hit(const flat_bvh_node& n, const float o[3], const float inv_d[3], float t_min, float t_max) {
+	for (int a = 0; a < 3; a++) {
+		float t0 = (n.bmin[a] - o[a]) * inv_d[a];
+		float t1 = (n.bmax[a] - o[a]) * inv_d[a];
+		if (inv_d[a] < 0.0f)
+			std::swap(t0, t1);
+		t_min = t0 > t_min ? t0 : t_min;
+		t_max = t1 < t_max ? t1 : t_max;
+		if (t_max < t_min)
+			return false;
+	}
+	return true;
+}
+
+namespace flat_bvh_detail {
+
+	inline float half_area(const float lo[3], const float hi[3]) {
+		float dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+		return dx * dy + dy * dz + dz * dx;
+	}
+
+	// Splits with fewer refs than this are not worth a thread.
+	const int parallel_min_span = 1 << 14;
+
+	// Appends a subtree built into a vector of its own; returns the index of its root.
+	inline int splice(std::vector<flat_bvh_node>& nodes, const std::vector<flat_bvh_node>& subtree) {
+		int base = static_cast<int>(nodes.size());
+		for (flat_bvh_node n : subtree) {
+			if (n.count < 0)
+				n.offset += base;
+			nodes.push_back(n);
+		}
+		return base;
+	}
+
+	// Binned SAH split of refs[start, end); returns the node index. Splits above
+	// parallel_depth build their left subtree on another thread, into a vector that is
+	// spliced in afterwards, which gives the same nodes as building it in place.
+	inline int build(std::vector<bvh_build_ref>& refs, int start, int end, int depth, int max_leaf,
+		int parallel_depth, std::vector<flat_bvh_node>& nodes)
+	{
+		const int bin_count = 12;
+
+		int index = static_cast<int>(nodes.size());
+		nodes.push_back(flat_bvh_node());
+
+		float bmin[3] = { float_infinity, float_infinity, float_infinity }, bmax[3] = { -float_infinity, -float_infinity, -float_infinity };
+		float cmin[3] = { float_infinity, float_infinity, float_infinity }, cmax[3] = { -float_infinity, -float_infinity, -float_infinity };
+		for (int i = start; i < end; i++) {
+			for (int k = 0; k < 3; k++) {
+				bmin[k] = std::min(bmin[k], refs[i].bmin[k]);
+				bmax[k] = std::max(bmax[k], refs[i].bmax[k]);
+				cmin[k] = std::min(cmin[k], refs[i].centroid[k]);
+				cmax[k] = std::max(cmax[k], refs[i].centroid[k]);
+			}
+		}
+		for (int k = 0; k < 3; k++) {
+			nodes[index].bmin[k] = bmin[k];
+			nodes[index].bmax[k] = bmax[k];
+		}
+
+		int span = end - start;
+		if (span <= max_leaf || depth >= flat_bvh_max_depth) {
+			nodes[index].offset = start;
+			nodes[index].count = span;
+			return index;
+		}
+
+		// pick the cheapest bin boundary over all three axes
+		int best_axis = -1, best_split = 0;
+		float best_cost = float_infinity;
+		for (int axis = 0; axis < 3; axis++) {
+			float extent = cmax[axis] - cmin[axis];
+			if (extent <= 0.0f)
+				continue;
+			int counts[bin_count] = {};
+			float lo[bin_count][3], hi[bin_count][3];
+			for (int b = 0; b < bin_count; b++) {
+				for (int k = 0; k < 3; k++) {
+					lo[b][k] = float_infinity;
+					hi[b][k] = -float_infinity;
+				}
+			}
+			float scale = bin_count / extent;
+			for (int i = start; i < end; i++) {
+				int b = std::min(bin_count - 1, static_cast<int>((refs[i].centroid[axis] - cmin[axis]) * scale));
+				counts[b]++;
+				for (int k = 0; k < 3; k++) {
+					lo[b][k] = std::min(lo[b][k], refs[i].bmin[k]);
+					hi[b][k] = std::max(hi[b][k], refs[i].bmax[k]);
+				}
+			}
+
+			float right_area[bin_count];
+			int right_count[bin_count];
+			float rlo[3] = { float_infinity, float_infinity, float_infinity }, rhi[3] = { -float_infinity, -float_infinity, -float_infinity };
+			int rc = 0;
+			for (int b = bin_count - 1; b > 0; b--) {
+				rc += counts[b];
+				for (int k = 0; k < 3; k++) {
+					rlo[k] = std::min(rlo[k], lo[b][k]);
+					rhi[k] = std::max(rhi[k], hi[b][k]);
+				}
+				right_count[b] = rc;
+				right_area[b] = rc ? half_area(rlo, rhi) : 0.0f;
+			}
+
+			float llo[3] = { float_infinity, float_infinity, float_infinity }, lhi[3] = { -float_infinity, -float_infinity, -float_infinity };
+			int lc = 0;
+			for (int b = 0; b < bin_count - 1; b++) {
+				lc += counts[b];
+				for (int k = 0; k < 3; k++) {
+					llo[k] = std::min(llo[k], lo[b][k]);
+					lhi[k] = std::max(lhi[k], hi[b][k]);
+				}
+				if (lc == 0 || right_count[b + 1] == 0)
+					continue;
+				float cost = lc * half_area(llo, lhi) + right_count[b + 1] * right_area[b + 1];
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_axis = axis;
+					best_split = b + 1;
+				}
+			}
+		}
+
+		int mid;
+		if (best_axis < 0) {
+			// centroids coincide: median split on the widest axis
+			best_axis = 0;
+			for (int k = 1; k < 3; k++) {
+				if (cmax[k] - cmin[k] > cmax[best_axis] - cmin[best_axis])
+					best_axis = k;
+			}
+			mid = start + span / 2;
+			std::nth_element(refs.begin() + start, refs.begin() + mid, refs.begin() + end,
+				[&](const bvh_build_ref& a, const bvh_build_ref& b) { return a.centroid[best_axis] < b.centroid[best_axis]; });
+		}
+		else {
+			float scale = bin_count / (cmax[best_axis] - cmin[best_axis]);
+			float axis_min = cmin[best_axis];
+			auto it = std::partition(refs.begin() + start, refs.begin() + end, [&](const bvh_build_ref& ref) {
+				return std::min(bin_count - 1, static_cast<int>((ref.centroid[best_axis] - axis_min) * scale)) < best_split;
+			});
+			mid = static_cast<int>(it - refs.begin());
+			if (mid == start || mid == end)
+				mid = start + span / 2;
+		}
+
+		int right;
+		if (depth < parallel_depth && span >= parallel_min_span) {
+			// the two halves touch disjoint ranges of refs
+			std::vector<flat_bvh_node> left_nodes, right_nodes;
+			std::thread left_worker([&] { build(refs, start, mid, depth + 1, max_leaf, parallel_depth, left_nodes); });
+			build(refs, mid, end, depth + 1, max_leaf, parallel_depth, right_nodes);
+			left_worker.join();
+			splice(nodes, left_nodes);
+			right = splice(nodes, right_nodes);
+		}
+		else {
+			build(refs, start, mid, depth + 1, max_leaf, parallel_depth, nodes);
+			right = build(refs, mid, end, depth + 1, max_leaf, parallel_depth, nodes);
+		}
+		nodes[index].offset = right;
+		nodes[index].count = -1 - best_axis;
+		return index;
+	}
+}
+
+// Builds nodes over refs with a binned SAH on up to about threads threads; the nodes do
+// not depend on the thread count. refs is reordered so every leaf covers the range
+// [offset, offset + count) of it.
+inline void build_flat_bvh(std::vector<bvh_build_ref>& refs, int max_leaf, std::vector<flat_bvh_node>& nodes,
+	unsigned threads = std::thread::hardware_concurrency())
+{
+	nodes.clear();
+	if (refs.empty())
+		return;
+	nodes.reserve(2 * refs.size() / max_leaf + 1);
+	// splits down to this depth run both halves at once, a subtree per thread below it
+	int parallel_depth = 0;
+	while ((1u << parallel_depth) < threads)
+		parallel_depth++;
+	flat_bvh_detail::build(refs, 0, static_cast<int>(refs.size()), 0, max_leaf, parallel_depth, nodes);
+}
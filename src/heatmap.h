@@ -0,0 +1,61 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "rtweekend.h"
+
+// False color images of per-pixel values, and their export. Values are scaled to [0, 1]
+// by the largest one and colored with Turbo (Mikhailov 2019): dark blue for little, through
+// green and yellow, to dark red for the maximum.
+
+// polynomial fit of the Turbo colormap, t in [0, 1]
+inline color turbo(double t) {
+	t = clamp(t, 0.0, 1.0);
+	double r = 0.13572138 + t * (4.61539260 + t * (-42.66032258 + t * (132.13108234 + t * (-152.94239396 + t * 59.28637943))));
+	double g = 0.09140261 + t * (2.19418839 + t * (4.84296658 + t * (-14.18503333 + t * (4.27729857 + t * 2.82956604))));
+	double b = 0.10667330 + t * (12.64194608 + t * (-60.58204836 + t * (110.36276771 + t * (-89.90310912 + t * 27.34824973))));
+	return color(clamp(r, 0.0, 1.0), clamp(g, 0.0, 1.0), clamp(b, 0.0, 1.0));
+}
+
+inline float heatmap_max(const std::vector<float>& values) {
+	float m = 0;
+	for (float v : values)
+		m = std::max(m, v);
+	return m;
+}
+
+// rgba of each value, rows in the order of values
+inline void heatmap_colors(const std::vector<float>& values, std::vector<uint8_t>& rgba) {
+	float m = heatmap_max(values);
+	double scale = m > 0 ? 1.0 / m : 0.0;
+	rgba.resize(values.size() * 4);
+	for (size_t i = 0; i < values.size(); i++) {
+		color c = turbo(values[i] * scale);
+		for (int k = 0; k < 3; k++)
+			rgba[i * 4 + k] = static_cast<uint8_t>(255.99 * c[k]);
+		rgba[i * 4 + 3] = 255;
+	}
+}
+
+// Binary PPM of an rgba image whose first row is the bottom one, as the render buffer is.
+inline bool write_ppm_bottom_up(const std::string& path, const uint8_t* rgba, int width, int height) {
+	std::ofstream f(path, std::ios::binary);
+	f << "P6\n" << width << " " << height << "\n255\n";
+	for (int j = height - 1; j >= 0; j--) {
+		for (int i = 0; i < width; i++)
+			f.write(reinterpret_cast<const char*>(rgba + (size_t(j) * width + i) * 4), 3);
+	}
+	return bool(f);
+}
+
+// Grayscale PFM of the raw values, bottom row first as the format wants.
+inline bool write_pfm(const std::string& path, const std::vector<float>& values, int width, int height) {
+	std::ofstream f(path, std::ios::binary);
+	f << "Pf\n" << width << " " << height << "\n-1\n";	//negative scale: little endian
+	f.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(float));
+	return bool(f);
+}
@@ -4,6 +4,7 @@
 #include "ray.h"
 #include "rtweekend.h"
 #include "aabb.h"
+#include "texture_footprint.h"
 
 class material;
 
@@ -15,17 +16,71 @@ struct hit_record {
     double u;   //texture u v surface coordinates of the ray hit point
     double v;
     bool front_face;
+    int mat_id = -1;    //material index in the compiled scene, -1 when mat_ptr is the material
+    int light = -1;     //compiled scene: index of the hit primitive in its light_set, -1 if not a sampled light
+
+    // surface partials w.r.t. u and v for the outward normal side; primitives without a
+    // uv parameterization leave them zero
+    vec3 dpdu, dpdv;
+    vec3 dndu, dndv;
+    texture_footprint footprint;    //filled by compute_differentials()
 
     inline void set_face_normal(const ray& r, const vec3& outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal : -outward_normal;
     }
+
+    // Intersects the ray's differentials with the tangent plane at p and solves for the
+    // uv derivatives (least squares over dpdu, dpdv). No-op for rays without differentials.
+    void compute_differentials(const ray& r) {
+        footprint = texture_footprint();
+        if (!r.has_differentials)
+            return;
+        double d = dot(normal, p);
+        double nx = dot(normal, r.rx_direction), ny = dot(normal, r.ry_direction);
+        if (nx == 0 || ny == 0)
+            return;
+        double tx = (d - dot(normal, r.rx_origin)) / nx;
+        double ty = (d - dot(normal, r.ry_origin)) / ny;
+        footprint.dpdx = r.rx_origin + tx * r.rx_direction - p;
+        footprint.dpdy = r.ry_origin + ty * r.ry_direction - p;
+
+        double a00 = dot(dpdu, dpdu), a01 = dot(dpdu, dpdv), a11 = dot(dpdv, dpdv);
+        double det = a00 * a11 - a01 * a01;
+        if (!(fabs(det) > 1e-20))
+            return;
+        double inv_det = 1 / det;
+        double bx0 = dot(dpdu, footprint.dpdx), bx1 = dot(dpdv, footprint.dpdx);
+        double by0 = dot(dpdu, footprint.dpdy), by1 = dot(dpdv, footprint.dpdy);
+        footprint.dudx = (a11 * bx0 - a01 * bx1) * inv_det;
+        footprint.dvdx = (a00 * bx1 - a01 * bx0) * inv_det;
+        footprint.dudy = (a11 * by0 - a01 * by1) * inv_det;
+        footprint.dvdy = (a00 * by1 - a01 * by0) * inv_det;
+    }
 };
 
 class hittable {
 public:
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
     virtual bool bounding_box(double time0 , double time1,aabb& output_box) const = 0;   //˶壬ͼt0t1ʱİΧ
+
+    // Any-hit query for shadow/AO/visibility rays: returns as soon as anything lies in
+    // (t_min, t_max) and never fills in a hit_record. Primitives override it with a cheaper test.
+    virtual bool occluded(const ray& r, double t_min, double t_max) const {
+        hit_record rec;
+        return hit(r, t_min, t_max, rec);
+    }
+
+    // Batch variant, returns how many of the rays are blocked. blocked may be null.
+    int occluded(const ray* rays, int count, double t_min, double t_max, bool* blocked = nullptr) const {
+        int n = 0;
+        for (int i = 0; i < count; i++) {
+            bool b = occluded(rays[i], t_min, t_max);
+            if (blocked) blocked[i] = b;
+            n += b;
+        }
+        return n;
+    }
 };
 
 #endif
\ No newline at end of file
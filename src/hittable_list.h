@@ -20,6 +20,8 @@ public:
     virtual bool hit(
         const ray& r, double t_min, double t_max, hit_record& rec) const override;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+    using hittable::occluded;
 
 public:
     std::vector<shared_ptr<hittable>> objects;
@@ -41,6 +43,14 @@ bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& re
     return hit_anything;
 }
 
+bool hittable_list::occluded(const ray& r, double t_min, double t_max) const {
+    for (const auto& object : objects) {
+        if (object->occluded(r, t_min, t_max))
+            return true;
+    }
+    return false;
+}
+
 bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) const
 {
     if (objects.empty()) {
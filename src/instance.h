@@ -0,0 +1,63 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "transform.h"
+
+// Placed copy of a shared object (typically a bvh_node or triangle_mesh acting as the
+// bottom-level BVH). Rays are moved into object space, so N instances of one mesh
+// cost one copy of its geometry plus a transform each.
+class instance : public hittable {
+public:
+	instance() {}
+	instance(shared_ptr<hittable> obj, const transform& xf) : object(obj) {
+		has_box = object->bounding_box(0, 1, object_box);
+		set_transform(xf);
+	}
+
+	void set_transform(const transform& xf) {
+		object_to_world = xf;
+		if (has_box)
+			world_box = xf.box(object_box);
+	}
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+	using hittable::occluded;
+
+public:
+	shared_ptr<hittable> object;
+	transform object_to_world;
+	aabb world_box;
+
+private:
+	aabb object_box;
+	bool has_box = false;
+};
+
+//the direction is not renormalized, so t is the same in both spaces
+bool instance::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	ray local(object_to_world.inverse_point(r.origin()), object_to_world.inverse_vector(r.direction()), r.time());
+	if (!object->hit(local, t_min, t_max, rec))
+		return false;
+
+	rec.p = r.at(rec.t);
+	vec3 outward_normal = unit_vector(object_to_world.normal(rec.front_face ? rec.normal : -rec.normal));
+	rec.set_face_normal(r, outward_normal);
+	rec.dpdu = object_to_world.vector(rec.dpdu);
+	rec.dpdv = object_to_world.vector(rec.dpdv);
+	rec.dndu = object_to_world.normal(rec.dndu);
+	rec.dndv = object_to_world.normal(rec.dndv);
+	return true;
+}
+
+bool instance::occluded(const ray& r, double t_min, double t_max) const {
+	ray local(object_to_world.inverse_point(r.origin()), object_to_world.inverse_vector(r.direction()), r.time());
+	return object->occluded(local, t_min, t_max);
+}
+
+bool instance::bounding_box(double time0, double time1, aabb& output_box) const {
+	output_box = world_box;
+	return has_box;
+}
@@ -0,0 +1,517 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh_node.h"
+#include "sphere.h"
+#include "quad.h"
+#include "material.h"
+#include "environment_map.h"
+
+// Explicit light sampling. Spheres and quads with a diffuse_light material are collected
+// into a light_set; shading points pick one through a light BVH (pbrt-v4's
+// BVHLightSampler: each node bounds the position, power and emission directions of its
+// lights, and the traversal descends stochastically by estimated contribution) and then
+// sample a point on it. Other emitters are only found by BSDF sampling. An environment map
+// is sampled separately through its own table.
+
+// What rays that leave the scene see.
+struct environment {
+	bool sky = true;	//ground to blue gradient (white to blue in the book), otherwise flat
+	color flat;
+	color ground = color(1, 1, 1);
+	shared_ptr<const environment_map> map;	//replaces the gradient when set
+	double intensity = 1;
+
+	color value(const ray& r) const {
+		if (!sky)
+			return flat;
+		if (map)
+			return intensity * map->value(r.direction());
+		vec3 unit_direction = unit_vector(r.direction());
+		auto t = 0.5 * (unit_direction.y() + 1.0);
+		return (1.0 - t) * ground + t * color(0.5, 0.7, 1.0);
+	}
+
+	// Only maps are sampled; the gradient is smooth enough for BSDF sampling.
+	bool sampled() const { return sky && map; }
+	vec3 sample(double& pdf) const { return map->sample(pdf); }
+	double pdf(const vec3& direction) const { return map->pdf(direction); }
+};
+
+struct light_sample {
+	point3 p;
+	vec3 normal;
+	vec3 wi;			//unit direction from the shading point
+	double distance;
+	double pdf;			//solid angle, including the probability of picking this light
+	double u, v;
+	int light;
+};
+
+// Cone of directions: axis w, half angle acos(cos_theta).
+struct direction_cone {
+	vec3 w = vec3(0, 0, 1);
+	double cos_theta = 1;
+	bool empty = true;
+
+	static direction_cone entire_sphere() {
+		direction_cone c;
+		c.cos_theta = -1;
+		c.empty = false;
+		return c;
+	}
+
+	static direction_cone merge(const direction_cone& a, const direction_cone& b) {
+		if (a.empty) return b;
+		if (b.empty) return a;
+		double theta_a = acos(clamp(a.cos_theta, -1.0, 1.0)), theta_b = acos(clamp(b.cos_theta, -1.0, 1.0));
+		double theta_d = acos(clamp(dot(a.w, b.w), -1.0, 1.0));
+		if (fmin(theta_d + theta_b, pi) <= theta_a) return a;
+		if (fmin(theta_d + theta_a, pi) <= theta_b) return b;
+
+		double theta_o = (theta_a + theta_d + theta_b) / 2;
+		if (theta_o >= pi)
+			return entire_sphere();
+		vec3 axis = cross(a.w, b.w);
+		if (axis.length_squared() < 1e-20)
+			return entire_sphere();
+		axis = unit_vector(axis);
+		double theta_r = theta_o - theta_a;
+		direction_cone c;
+		c.w = a.w * cos(theta_r) + cross(axis, a.w) * sin(theta_r) + axis * dot(axis, a.w) * (1 - cos(theta_r));
+		c.cos_theta = cos(theta_o);
+		c.empty = false;
+		return c;
+	}
+};
+
+class light_set {
+public:
+	enum kind { quad_light, sphere_light };
+
+	struct light {
+		int kind;
+		point3 origin;		//quad corner or sphere center
+		vec3 u, v;			//quad edges
+		vec3 normal;		//quad front face
+		double radius;
+		double area;
+		double power;
+		aabb box;
+		const material* mat;
+	};
+
+	// Per node bounds of the lights below it. Nodes are stored depth first, so the left
+	// child of an inner node follows it; leaves hold exactly one light.
+	struct node {
+		point3 bmin, bmax;
+		double phi;
+		direction_cone emission;	//normals of the emitting surfaces
+		double cos_theta_e;			//how far past the normal cone light leaves
+		int offset;					//leaf: light index, inner: right child
+		bool leaf;
+	};
+
+	void clear() {
+		lights.clear();
+		nodes.clear();
+		trails.clear();
+	}
+
+	bool empty() const { return lights.empty(); }
+	size_t size() const { return lights.size(); }
+
+	// Adds object if it is a sphere or quad with a diffuse_light, returns its index or -1.
+	int add(const hittable& object);
+	int add_sphere(const point3& center, double radius, const material* mat);
+	int add_quad(const point3& Q, const vec3& u, const vec3& v, const material* mat);
+	// Walks lists and bvh_nodes and adds every light found.
+	void collect(const shared_ptr<hittable>& object);
+	// Builds the light BVH, call after the last add().
+	void build();
+
+	// Picks a light for the shading point p (normal n, zero for none) and a point on it.
+	bool sample(const point3& p, const vec3& n, light_sample& s) const;
+	// Solid angle density of sample() producing the point x on light index from p.
+	double pdf(const point3& p, const vec3& n, int index, const point3& x) const;
+	// Emitted radiance of a sample towards the shading point.
+	color radiance(const light_sample& s, const ray& shadow) const;
+	// Index of the light whose surface contains rec.p, for scenes that cannot tag hits.
+	int find(const hit_record& rec) const;
+
+	bool use_bvh = true;	//pick lights by the BVH estimate, otherwise uniformly
+
+private:
+	int push(light& l, const point3& middle);
+	double pmf(const point3& p, const vec3& n, int index) const;
+	double importance(const node& nd, const point3& p, const vec3& n) const;
+	int build(std::vector<int>& order, int start, int end, uint64_t trail, int depth);
+
+	std::vector<light> lights;
+	std::vector<node> nodes;
+	std::vector<uint64_t> trails;	//bit i set: the light is in the right subtree at depth i
+
+	friend class scene_cache;
+};
+
+int light_set::add(const hittable& object) {
+	if (auto s = dynamic_cast<const sphere*>(&object))
+		return add_sphere(s->center, s->radius, s->mat_ptr.get());
+	if (auto q = dynamic_cast<const quad*>(&object))
+		return add_quad(q->Q, q->u, q->v, q->mat_ptr.get());
+	return -1;
+}
+
+int light_set::add_sphere(const point3& center, double radius, const material* mat) {
+	if (!dynamic_cast<const diffuse_light*>(mat))
+		return -1;
+	light l = {};
+	l.kind = sphere_light;
+	l.origin = center;
+	l.radius = radius;
+	l.area = 4 * pi * radius * radius;
+	l.mat = mat;
+	l.box = aabb(center - vec3(radius, radius, radius), center + vec3(radius, radius, radius));
+	return push(l, center);
+}
+
+int light_set::add_quad(const point3& Q, const vec3& u, const vec3& v, const material* mat) {
+	if (!dynamic_cast<const diffuse_light*>(mat))
+		return -1;
+	quad shape(Q, u, v, nullptr);
+	light l = {};
+	l.kind = quad_light;
+	l.origin = Q;
+	l.u = u;
+	l.v = v;
+	l.normal = shape.normal;
+	l.area = shape.area;
+	l.mat = mat;
+	shape.bounding_box(0, 1, l.box);
+	return push(l, shape.point_at(0.5, 0.5));
+}
+
+// measures the power at the middle of the light and stores it
+int light_set::push(light& l, const point3& middle) {
+	hit_record probe;
+	probe.front_face = true;
+	probe.u = probe.v = 0.5;
+	probe.p = middle;
+	l.power = luminance(l.mat->emitted(ray(), probe)) * l.area * pi;
+	lights.push_back(l);
+	return static_cast<int>(lights.size()) - 1;
+}
+
+void light_set::collect(const shared_ptr<hittable>& object) {
+	if (auto list = dynamic_cast<const hittable_list*>(object.get())) {
+		for (const auto& child : list->objects)
+			collect(child);
+		return;
+	}
+	if (auto node = dynamic_cast<const bvh_node*>(object.get())) {
+		collect(node->left);
+		if (node->right != node->left)
+			collect(node->right);
+		return;
+	}
+	add(*object);
+}
+
+void light_set::build() {
+	nodes.clear();
+	trails.assign(lights.size(), 0);
+	if (lights.empty())
+		return;
+	std::vector<int> order(lights.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = static_cast<int>(i);
+	nodes.reserve(2 * lights.size());
+	build(order, 0, static_cast<int>(order.size()), 0, 0);
+}
+
+// Median split on the widest centroid axis (pbrt uses a surface area and orientation cost;
+// the median keeps the trail depth logarithmic, which the 64 bit trails rely on).
+int light_set::build(std::vector<int>& order, int start, int end, uint64_t trail, int depth) {
+	int index = static_cast<int>(nodes.size());
+	nodes.push_back(node());
+	if (end - start == 1) {
+		const light& l = lights[order[start]];
+		node& nd = nodes[index];
+		nd.bmin = l.box._min;
+		nd.bmax = l.box._max;
+		nd.phi = l.power;
+		if (l.kind == quad_light) {
+			nd.emission.w = l.normal;
+			nd.emission.cos_theta = 1;
+			nd.emission.empty = false;
+		}
+		else {
+			nd.emission = direction_cone::entire_sphere();
+		}
+		nd.cos_theta_e = 0;	//diffuse emitters light the whole hemisphere
+		nd.offset = order[start];
+		nd.leaf = true;
+		trails[order[start]] = trail;
+		return index;
+	}
+
+	point3 cmin(infinity), cmax(-infinity);
+	for (int i = start; i < end; i++) {
+		const aabb& b = lights[order[i]].box;
+		point3 c = 0.5 * (b._min + b._max);
+		for (int k = 0; k < 3; k++) {
+			cmin.e[k] = fmin(cmin.e[k], c.e[k]);
+			cmax.e[k] = fmax(cmax.e[k], c.e[k]);
+		}
+	}
+	int axis = 0;
+	for (int k = 1; k < 3; k++) {
+		if (cmax.e[k] - cmin.e[k] > cmax.e[axis] - cmin.e[axis])
+			axis = k;
+	}
+	int mid = (start + end) / 2;
+	std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end, [&](int a, int b) {
+		return lights[a].box._min.e[axis] + lights[a].box._max.e[axis] < lights[b].box._min.e[axis] + lights[b].box._max.e[axis];
+	});
+
+	int left = build(order, start, mid, trail, depth + 1);
+	int right = build(order, mid, end, trail | (uint64_t(1) << depth), depth + 1);
+	node& nd = nodes[index];
+	const node& l = nodes[left];
+	const node& r = nodes[right];
+	for (int k = 0; k < 3; k++) {
+		nd.bmin.e[k] = fmin(l.bmin.e[k], r.bmin.e[k]);
+		nd.bmax.e[k] = fmax(l.bmax.e[k], r.bmax.e[k]);
+	}
+	nd.phi = l.phi + r.phi;
+	nd.emission = direction_cone::merge(l.emission, r.emission);
+	nd.cos_theta_e = fmin(l.cos_theta_e, r.cos_theta_e);
+	nd.offset = right;
+	nd.leaf = false;
+	return index;
+}
+
+// pbrt-v4 LightBounds::Importance: power over squared distance, times bounds on the
+// emission and incidence cosines over every direction the node's box subtends from p.
+double light_set::importance(const node& nd, const point3& p, const vec3& n) const {
+	auto cos_sub_clamped = [](double sin_a, double cos_a, double sin_b, double cos_b) {
+		return cos_a > cos_b ? 1.0 : cos_a * cos_b + sin_a * sin_b;
+	};
+	auto sin_sub_clamped = [](double sin_a, double cos_a, double sin_b, double cos_b) {
+		return cos_a > cos_b ? 0.0 : sin_a * cos_b - cos_a * sin_b;
+	};
+	auto safe_sqrt = [](double x) { return sqrt(fmax(0.0, x)); };
+
+	point3 pc = 0.5 * (nd.bmin + nd.bmax);
+	vec3 diagonal = nd.bmax - nd.bmin;
+	double d2 = (p - pc).length_squared();
+	d2 = fmax(d2, diagonal.length() / 2);
+
+	vec3 wi = unit_vector(p - pc);
+	double cos_w = dot(nd.emission.w, wi);
+	double sin_w = safe_sqrt(1 - cos_w * cos_w);
+
+	// cone the box subtends from p, everything when p is inside its bounding sphere
+	double radius2 = diagonal.length_squared() / 4;
+	double cos_b = (p - pc).length_squared() < radius2 ? -1.0 : safe_sqrt(1 - radius2 / (p - pc).length_squared());
+	double sin_b = safe_sqrt(1 - cos_b * cos_b);
+
+	double cos_o = nd.emission.cos_theta;
+	double sin_o = safe_sqrt(1 - cos_o * cos_o);
+	double cos_x = cos_sub_clamped(sin_w, cos_w, sin_o, cos_o);
+	double sin_x = sin_sub_clamped(sin_w, cos_w, sin_o, cos_o);
+	double cos_p = cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+	if (cos_p <= nd.cos_theta_e)
+		return 0;
+
+	double result = nd.phi * cos_p / d2;
+	if (n.length_squared() > 0) {
+		double cos_i = fabs(dot(wi, n));
+		double sin_i = safe_sqrt(1 - cos_i * cos_i);
+		result *= cos_sub_clamped(sin_i, cos_i, sin_b, cos_b);
+	}
+	return fmax(result, 0.0);
+}
+
+double light_set::pmf(const point3& p, const vec3& n, int index) const {
+	if (!use_bvh)
+		return 1.0 / lights.size();
+	uint64_t trail = trails[index];
+	double result = 1;
+	int i = 0;
+	while (!nodes[i].leaf) {
+		double i0 = importance(nodes[i + 1], p, n);
+		double i1 = importance(nodes[nodes[i].offset], p, n);
+		if (i0 + i1 <= 0)
+			return 0;
+		if (trail & 1) {
+			result *= i1 / (i0 + i1);
+			i = nodes[i].offset;
+		}
+		else {
+			result *= i0 / (i0 + i1);
+			i = i + 1;
+		}
+		trail >>= 1;
+	}
+	return i == 0 && importance(nodes[0], p, n) <= 0 ? 0 : result;
+}
+
+bool light_set::sample(const point3& p, const vec3& n, light_sample& s) const {
+	if (lights.empty())
+		return false;
+
+	int index;
+	double pick;
+	if (!use_bvh) {
+		index = std::min(static_cast<int>(random_double() * lights.size()), static_cast<int>(lights.size()) - 1);
+		pick = 1.0 / lights.size();
+	}
+	else {
+		int i = 0;
+		pick = 1;
+		while (!nodes[i].leaf) {
+			double i0 = importance(nodes[i + 1], p, n);
+			double i1 = importance(nodes[nodes[i].offset], p, n);
+			if (i0 + i1 <= 0)
+				return false;
+			double p0 = i0 / (i0 + i1);
+			if (random_double() < p0) {
+				pick *= p0;
+				i = i + 1;
+			}
+			else {
+				pick *= 1 - p0;
+				i = nodes[i].offset;
+			}
+		}
+		if (i == 0 && importance(nodes[0], p, n) <= 0)
+			return false;
+		index = nodes[i].offset;
+	}
+
+	const light& l = lights[index];
+	s.light = index;
+	if (l.kind == quad_light) {
+		s.u = random_double();
+		s.v = random_double();
+		s.p = l.origin + s.u * l.u + s.v * l.v;
+		s.normal = l.normal;
+		vec3 d = s.p - p;
+		s.distance = d.length();
+		if (s.distance <= 0)
+			return false;
+		s.wi = d / s.distance;
+		double cos_l = -dot(s.normal, s.wi);
+		if (cos_l <= 0)
+			return false;	//back of a one sided light
+		s.pdf = pick * s.distance * s.distance / (cos_l * l.area);
+		return true;
+	}
+
+	vec3 to_center = l.origin - p;
+	double d2 = to_center.length_squared();
+	double r2 = l.radius * l.radius;
+	if (d2 <= r2 * (1 + 1e-6)) {
+		// inside (or on) the sphere: uniform over its area
+		s.normal = random_unit_vector();
+		s.p = l.origin + l.radius * s.normal;
+		vec3 d = s.p - p;
+		s.distance = d.length();
+		if (s.distance <= 0)
+			return false;
+		s.wi = d / s.distance;
+		double cos_l = fabs(dot(s.normal, s.wi));
+		if (cos_l <= 0)
+			return false;
+		s.pdf = pick * s.distance * s.distance / (cos_l * l.area);
+	}
+	else {
+		// uniform over the cone the sphere subtends
+		double cos_max = sqrt(1 - r2 / d2);
+		double z = 1 + random_double() * (cos_max - 1);
+		double phi = 2 * pi * random_double();
+		double sin_z = sqrt(fmax(0.0, 1 - z * z));
+		vec3 w = to_center / sqrt(d2);
+		vec3 a = fabs(w.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+		vec3 t = unit_vector(cross(w, a));
+		vec3 b = cross(w, t);
+		s.wi = unit_vector(cos(phi) * sin_z * t + sin(phi) * sin_z * b + z * w);
+
+		double half_b = dot(-to_center, s.wi);
+		double disc = half_b * half_b - (d2 - r2);
+		s.distance = disc > 0 ? -half_b - sqrt(disc) : -half_b;
+		s.p = p + s.distance * s.wi;
+		s.normal = (s.p - l.origin) / l.radius;
+		s.pdf = pick / (2 * pi * (1 - cos_max));
+	}
+	sphere::get_sphere_uv(s.normal, s.u, s.v);
+	return s.pdf > 0;
+}
+
+double light_set::pdf(const point3& p, const vec3& n, int index, const point3& x) const {
+	const light& l = lights[index];
+	double pick = pmf(p, n, index);
+	if (pick <= 0)
+		return 0;
+	vec3 d = x - p;
+	double dist2 = d.length_squared();
+	if (l.kind == quad_light) {
+		double cos_l = fabs(dot(l.normal, d)) / sqrt(dist2);
+		return cos_l > 0 ? pick * dist2 / (cos_l * l.area) : 0;
+	}
+	double d2 = (l.origin - p).length_squared();
+	double r2 = l.radius * l.radius;
+	if (d2 <= r2 * (1 + 1e-6)) {
+		vec3 normal = (x - l.origin) / l.radius;
+		double cos_l = fabs(dot(normal, d)) / sqrt(dist2);
+		return cos_l > 0 ? pick * dist2 / (cos_l * l.area) : 0;
+	}
+	double cos_max = sqrt(1 - r2 / d2);
+	return pick / (2 * pi * (1 - cos_max));
+}
+
+color light_set::radiance(const light_sample& s, const ray& shadow) const {
+	hit_record rec;
+	rec.p = s.p;
+	rec.u = s.u;
+	rec.v = s.v;
+	rec.set_face_normal(shadow, s.normal);
+	return lights[s.light].mat->emitted(shadow, rec);
+}
+
+int light_set::find(const hit_record& rec) const {
+	if (nodes.empty())
+		return -1;
+	const double eps = 1e-4;
+	int stack[128];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		const node& nd = nodes[stack[--top]];
+		bool inside = true;
+		for (int k = 0; k < 3; k++)
+			inside = inside && rec.p.e[k] >= nd.bmin.e[k] - eps && rec.p.e[k] <= nd.bmax.e[k] + eps;
+		if (!inside)
+			continue;
+		if (!nd.leaf) {
+			if (top + 2 > 128)
+				return -1;
+			stack[top++] = nd.offset;
+			stack[top++] = static_cast<int>(&nd - &nodes[0]) + 1;
+			continue;
+		}
+		const light& l = lights[nd.offset];
+		if (l.mat != rec.mat_ptr.get())
+			continue;
+		double off = l.kind == quad_light ? dot(l.normal, rec.p - l.origin) : (rec.p - l.origin).length() - l.radius;
+		if (fabs(off) < eps * fmax(1.0, l.radius))
+			return nd.offset;
+	}
+	return -1;
+}
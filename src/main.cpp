@@ -64,6 +64,9 @@ int main(int argc, char* argv[]) {
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, renderTexture, 0);
 
 	bool showResult = false;
+	bool navigating = false;	//a drag that started on the result image
+	bvh_quality bvh_report;
+	bool have_bvh_report = false;
 
 	int inputSize[2]{ image_width, image_height };
 
@@ -90,18 +93,74 @@ int main(int argc, char* argv[]) {
 		ImGui::InputInt2("size", inputSize);
 		ImGui::InputInt("samples", &samples_per_pixel);
 		ImGui::InputInt("picture id", &pic_id);
+		ImGui::Checkbox("scene arena", &use_scene_arena);
+		ImGui::SameLine();
+		ImGui::Checkbox("compiled scene", &use_compiled_scene);
+		ImGui::Checkbox("ray differentials", &use_ray_differentials);
+		ImGui::Checkbox("progressive", &progressive);
+		ImGui::SameLine();
+		ImGui::Checkbox("reprojection", &temporal_reprojection);
+		ImGui::SameLine();
+		ImGui::Checkbox("denoise", &denoise_output);
+		if (denoise_output)
+			ImGui::SliderInt("denoise passes", &denoise_iterations, 1, 8);
+		if (pic_id == 3)
+			ImGui::InputText("obj file", obj_path, sizeof(obj_path));
+		if (pic_id == 4)
+		{
+			ImGui::InputInt("forest size", &forest_size);
+			ImGui::InputFloat("forest spacing", &forest_spacing);
+			ImGui::SliderFloat("forest rotation", &forest_rotation, -180.0f, 180.0f);
+		}
+		if (pic_id == 5)
+			ImGui::InputText("image file", image_path, sizeof(image_path));
+		if (pic_id == 8)
+		{
+			ImGui::InputText("scene file", scene_path, sizeof(scene_path));
+			if (ImGui::Button("save binary copy"))
+				write_scene_binary(scene_path, std::string(scene_path) + ".rtsb");
+			ImGui::Checkbox("scene cache", &use_scene_cache);
+		}
+		ImGui::InputInt("texture budget (MB)", &texture_budget_mb);
 		ImGui::Separator();
 		InputDouble3("lookfrom", (double*)&lookfrom);
 		InputDouble3("lookat", (double*)&lookat);
 		InputDouble3("groundColor",(double*)&ground);
+		ImGui::InputText("environment map", env_path, sizeof(env_path));
+		ImGui::InputFloat("environment intensity", &env_intensity);
 		ImGui::InputFloat("vfov", &vfov);
 		ImGui::InputFloat("aperture", &aperture);
 		ImGui::InputFloat("focus distance", &dist_to_focus);
+		ImGui::Separator();
+		ImGui::Combo("mode", &render_mode, "path tracing\0ambient occlusion\0");
+		ImGui::Combo("light sampling", &light_sampling, "bsdf only\0uniform light\0light bvh\0");
+		ImGui::Combo("tile order", &tile_order, "columns\0hilbert\0spiral\0");
+		ImGui::InputInt("tile size", &tileSize);	//0: from the image size and thread count
+		tileSize = std::max(0, tileSize);
+		ImGui::Checkbox("split tiles", &split_tiles);
+		ImGui::Combo("numa placement", &numa_placement, "off\0pin threads\0pin + node copies\0");
+		// false color cost of the finished render in the result window; switching needs no new render
+		if (ImGui::Combo("heatmap", &heatmap, "image\0bvh nodes per camera ray\0primitive tests per sample\0samples per pixel\0tile time\0"))
+			rt.redisplay();
+		ImGui::SameLine();
+		if (ImGui::Button("save heatmaps"))	//heatmap_<name>.ppm and .pfm of every kind
+			rt.save_heatmaps("heatmap");
+		if (ImGui::InputInt("bvh box depth", &bvh_box_depth))	//wireframe of the nodes at this depth, -1 for none
+		{
+			bvh_box_depth = std::max(-1, bvh_box_depth);
+			rt.redisplay();
+		}
+		if (render_mode == 1)
+		{
+			ImGui::InputInt("ao samples", &ao_samples);
+			ImGui::InputFloat("ao distance", &ao_distance);
+		}
 		if (ImGui::Button("render"))
 		{
 			image_width = inputSize[0];
 			image_height = inputSize[1];
 
+			rt.cancel();	//tiles in flight still write the old buffer
 			if (pixels != nullptr)
 				delete[] pixels;
 			pixels = new uint8_t[image_width * image_height * 4];	//申请了一块新空间用于存储图片
@@ -116,6 +175,7 @@ int main(int argc, char* argv[]) {
 			image_width = inputSize[0];
 			image_height = inputSize[1];
 
+			rt.cancel();	//tiles in flight still write the old buffer
 			if (pixels != nullptr)
 				delete[] pixels;
 			pixels = new uint8_t[image_width * image_height * 4];
@@ -124,6 +184,18 @@ int main(int argc, char* argv[]) {
 
 			showResult = true;
 		}
+		ImGui::SameLine();
+		if (ImGui::Button("rebuild scene"))	//the next render rebuilds even if no scene setting changed
+			rt.invalidate_scene();
+		if (profiling_enabled)
+		{
+			ImGui::SameLine();
+			if (ImGui::Button("save trace"))	//the zones of the renders so far, for chrome://tracing
+			{
+				rt.wait();
+				write_profile_trace("raytracer_trace.json");
+			}
+		}
 		ImGui::End();
 
 		if (showResult)
@@ -132,12 +204,101 @@ int main(int argc, char* argv[]) {
 			ImGui::Begin("result", &showResult);
 
 			glBindTexture(GL_TEXTURE_2D, renderTexture);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image_width, image_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);	//将pixels图像数据绑定为texture
+			{
+				RT_PROFILE_ZONE("upload");
+				glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image_width, image_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);	//将pixels图像数据绑定为texture
+			}
 
 			ImGui::Image((ImTextureID)(intptr_t)renderTexture, ImVec2((float)image_width, (float)image_height), ImVec2(0, 1), ImVec2(1, 0));
+
+			// camera navigation: left drag orbits around lookat, right drag turns the view, the
+			// wheel dollies and W/A/S/D/Q/E fly. Every change restarts the render from the new view,
+			// reusing the samples that reproject into it.
+			bool hovered = ImGui::IsItemHovered();
+			bool moved = false;
+			if (hovered && (ImGui::IsMouseClicked(ImGuiMouseButton_Left) || ImGui::IsMouseClicked(ImGuiMouseButton_Right)))
+				navigating = true;
+			if (!ImGui::IsMouseDown(ImGuiMouseButton_Left) && !ImGui::IsMouseDown(ImGuiMouseButton_Right))
+				navigating = false;
+			if (navigating && (io.MouseDelta.x != 0 || io.MouseDelta.y != 0))
+			{
+				double yaw = -0.005 * io.MouseDelta.x, pitch = -0.005 * io.MouseDelta.y;
+				if (ImGui::IsMouseDown(ImGuiMouseButton_Left))
+					orbit_camera(lookfrom, lookat, vup, yaw, pitch);
+				else
+					turn_camera(lookfrom, lookat, vup, yaw, pitch);
+				moved = true;
+			}
+			if (hovered && io.MouseWheel != 0)
+			{
+				dolly_camera(lookfrom, lookat, 0.1 * io.MouseWheel);
+				moved = true;
+			}
+			if (ImGui::IsWindowFocused())
+			{
+				double step = 0.5 * (lookat - lookfrom).length() * io.DeltaTime;	//half the view distance per second
+				double forward = step * (ImGui::IsKeyDown(GLFW_KEY_W) - ImGui::IsKeyDown(GLFW_KEY_S));
+				double right = step * (ImGui::IsKeyDown(GLFW_KEY_D) - ImGui::IsKeyDown(GLFW_KEY_A));
+				double lift = step * (ImGui::IsKeyDown(GLFW_KEY_E) - ImGui::IsKeyDown(GLFW_KEY_Q));
+				if (forward != 0 || right != 0 || lift != 0)
+				{
+					move_camera(lookfrom, lookat, vup, forward, right, lift);
+					moved = true;
+				}
+			}
+			if (moved && pixels != nullptr)
+				rt.render(pixels, true);
 			ImGui::End();
 		}
 
+		// counters of the last finished render, to judge the BVH (tests per ray) and the sampler (path lengths)
+		ImGui::Begin("stats");
+		render_stats last = rt.last_stats();
+		if (last.trace_seconds <= 0)
+		{
+			ImGui::Text("no finished render");
+		}
+		else
+		{
+			const ray_stats& c = last.counters;
+			double rays = c.rays() > 0 ? double(c.rays()) : 1.0;
+			long long closest = c.closest_rays();
+			ImGui::Text("build %.3fs, trace %.3fs on %d threads", last.build_seconds, last.trace_seconds, last.threads);
+			ImGui::Text("last 5%% of tiles %.3fs", last.tail_seconds);
+			ImGui::Text("%.2f Mrays/s, %.0f paths/s", c.rays() / last.trace_seconds * 1e-6, last.paths / last.trace_seconds);
+			ImGui::Text("rays %lld: %lld closest hit (%.1f%% hit), %lld shadow", c.rays(), closest,
+				closest > 0 ? 100.0 * c.hits / closest : 0.0, c.shadow_rays);
+			ImGui::Text("per ray: %.1f box tests, %.1f nodes visited, %.2f primitive tests",
+				c.box_tests / rays, c.node_visits / rays, c.primitive_tests / rays);
+			ImGui::Text("paths ended: %lld by roulette, %lld at max depth", c.roulette_kills, c.depth_limit);
+			float depths[ray_stats::depth_buckets];
+			for (int d = 0; d < ray_stats::depth_buckets; d++)
+				depths[d] = static_cast<float>(c.rays_by_depth[d]);
+			ImGui::PlotHistogram("rays by bounce", depths, ray_stats::depth_buckets, 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 80));
+			std::string legend = rt.heatmap_range();
+			if (!legend.empty())
+				ImGui::Text("heatmap: %s, dark blue to dark red", legend.c_str());
+		}
+		ImGui::Separator();
+		if (ImGui::Button("analyze bvh"))	//of the scene built by the last render
+		{
+			bvh_report = rt.scene_bvh_quality();
+			have_bvh_report = true;
+			write_bvh_quality(std::cout, bvh_report);
+		}
+		if (have_bvh_report)
+		{
+			const bvh_quality& q = bvh_report;
+			ImGui::Text("%lld nodes (%zuKB), %lld leaves over %lld primitives", q.nodes, q.bytes / 1024, q.leaves, q.primitives);
+			ImGui::Text("depth %d, leaves at %.1f on average", q.depth, q.mean_leaf_depth);
+			ImGui::Text("sah cost %.2f, epo %.3f, sibling overlap %.3f", q.sah_cost, q.epo, q.sibling_overlap);
+			float sizes[bvh_quality::leaf_size_buckets];
+			for (int k = 0; k < bvh_quality::leaf_size_buckets; k++)
+				sizes[k] = static_cast<float>(q.leaf_sizes[k]);
+			ImGui::PlotHistogram("leaves by size", sizes, bvh_quality::leaf_size_buckets, 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 60));
+		}
+		ImGui::End();
+
 		ImGui::Render();
 		ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 
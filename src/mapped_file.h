@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <random>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only memory mapping of a whole file.
+class mapped_file {
+public:
+	mapped_file() {}
+	explicit mapped_file(const std::string& path) { open(path); }
+	~mapped_file() { close(); }
+
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	bool open(const std::string& path) {
+		close();
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER file_size;
+		GetFileSizeEx(file, &file_size);
+		size = static_cast<size_t>(file_size.QuadPart);
+		if (size == 0)
+			return true;
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping == NULL)
+			return false;
+		base = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+		fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0)
+			return false;
+		size = static_cast<size_t>(st.st_size);
+		if (size == 0)
+			return true;
+		void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED)
+			return false;
+		base = static_cast<const char*>(p);
+#endif
+		return base != nullptr;
+	}
+
+	void close() {
+#ifdef _WIN32
+		if (base) UnmapViewOfFile(base);
+		if (mapping) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (base) munmap(const_cast<char*>(base), size);
+		if (fd >= 0) ::close(fd);
+		fd = -1;
+#endif
+		base = nullptr;
+		size = 0;
+	}
+
+	const char* data() const { return base; }
+	size_t length() const { return size; }
+
+private:
+	const char* base = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#else
+	int fd = -1;
+#endif
+};
+
+// A name next to path to write it under before renaming it into place. It holds the process
+// id, a per process random value and a counter, so writers of the same file in other
+// processes or threads never share one.
+inline std::string unique_temp_path(const std::string& path) {
+	static std::atomic<unsigned> counter{ 0 };
+	static const unsigned salt = std::random_device()();
+#ifdef _WIN32
+	unsigned long pid = GetCurrentProcessId();
+#else
+	unsigned long pid = static_cast<unsigned long>(getpid());
+#endif
+	char suffix[64];
+	snprintf(suffix, sizeof(suffix), ".%lu.%08x.%u.tmp", pid, salt, counter++);
+	return path + suffix;
+}
@@ -3,19 +3,80 @@
 
 #include "rtweekend.h"
 #include "texture.h"
-
-struct hit_record;
+#include "hittable.h"
+
+// Ray differentials through perfect specular events (Igehy 1999, as in pbrt). Both take
+// the already sampled scattered ray and add the offsets of its neighbours, so fuzz or a
+// Fresnel choice made on the main ray carries over.
+inline void reflect_differentials(const ray& r_in, const hit_record& rec, ray& scattered) {
+    if (!r_in.has_differentials)
+        return;
+    const vec3& n = rec.normal;
+    double sign = rec.front_face ? 1 : -1;
+    vec3 wo = -unit_vector(r_in.direction());
+    vec3 wi = unit_vector(scattered.direction());
+    const texture_footprint& fp = rec.footprint;
+    vec3 dndx = sign * (fp.dudx * rec.dndu + fp.dvdx * rec.dndv);
+    vec3 dndy = sign * (fp.dudy * rec.dndu + fp.dvdy * rec.dndv);
+    vec3 dwodx = -r_in.rx_direction - wo, dwody = -r_in.ry_direction - wo;
+    double dcdx = dot(dwodx, n) + dot(wo, dndx);
+    double dcdy = dot(dwody, n) + dot(wo, dndy);
+    double c = dot(wo, n);
+    scattered.set_differentials(
+        rec.p + fp.dpdx, wi - dwodx + 2 * (c * dndx + dcdx * n),
+        rec.p + fp.dpdy, wi - dwody + 2 * (c * dndy + dcdy * n));
+}
+
+// eta is the ratio of the indices (incident over transmitted), rec.normal faces r_in.
+inline void refract_differentials(const ray& r_in, const hit_record& rec, double eta, ray& scattered) {
+    if (!r_in.has_differentials)
+        return;
+    const vec3& n = rec.normal;
+    double sign = rec.front_face ? 1 : -1;
+    vec3 wo = -unit_vector(r_in.direction());
+    vec3 wi = unit_vector(scattered.direction());
+    const texture_footprint& fp = rec.footprint;
+    vec3 dndx = sign * (fp.dudx * rec.dndu + fp.dvdx * rec.dndv);
+    vec3 dndy = sign * (fp.dudy * rec.dndu + fp.dvdy * rec.dndv);
+    vec3 dwodx = -r_in.rx_direction - wo, dwody = -r_in.ry_direction - wo;
+    double dcdx = dot(dwodx, n) + dot(wo, dndx);
+    double dcdy = dot(dwody, n) + dot(wo, dndy);
+
+    double c = dot(wo, n);
+    double k = fabs(dot(wi, n));
+    if (k < 1e-6) {
+        scattered.has_differentials = false;
+        return;
+    }
+    double mu = eta * c - k;
+    double dmu = eta - eta * eta * c / k;
+    scattered.set_differentials(
+        rec.p + fp.dpdx, wi - eta * dwodx + mu * dndx + dmu * dcdx * n,
+        rec.p + fp.dpdy, wi - eta * dwody + mu * dndy + dmu * dcdy * n);
+}
 
 class material {
 public:
     virtual bool scatter(
         const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
     ) const = 0;
+
+    // radiance leaving the surface by itself
+    virtual color emitted(const ray& r_in, const hit_record& rec) const {
+        return color(0, 0, 0);
+    }
+
+    // Density scatter() samples the direction of scattered with (solid angle). Zero means the
+    // material is specular or unknown, so it is never light sampled. For the materials that
+    // return a density, attenuation * scattering_pdf is the BRDF times the cosine.
+    virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
+        return 0;
+    }
 };
 
 class lambertian : public material {
 public:
-    lambertian(const color& a) : albedo(make_shared<solid_color>(a)) {}
+    lambertian(const color& a) : albedo(scene_make_shared<solid_color>(a)) {}
     lambertian(shared_ptr<texture> a) : albedo(a) {}
 
     virtual bool scatter(
@@ -28,10 +89,15 @@ public:
             scatter_direction = rec.normal;
 
         scattered = ray(rec.p, scatter_direction,r_in.time());
-        attenuation = albedo->value(rec.u,rec.v,rec.p);
+        attenuation = albedo->filtered_value(rec.u, rec.v, rec.p, rec.footprint);
         return true;
     }
 
+    virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override {
+        auto cosine = dot(rec.normal, unit_vector(scattered.direction()));
+        return cosine < 0 ? 0 : cosine / pi;
+    }
+
 public:
     shared_ptr<texture> albedo;
 };
@@ -45,6 +111,7 @@ public:
     ) const override {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
         scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(),r_in.time());
+        reflect_differentials(r_in, rec, scattered);
         attenuation = albedo;
         return (dot(scattered.direction(), rec.normal) > 0);    //ɢ߷  ߷ һ >0
     }
@@ -69,13 +136,14 @@ public:
         double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
 
         bool cannot_refract = refraction_ratio * sin_theta > 1.0;
-        vec3 direction;
-        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
-            direction = reflect(unit_direction, rec.normal);
-        else
-            direction = refract(unit_direction, rec.normal, refraction_ratio);
-
-        scattered = ray(rec.p, direction , r_in.time());
+        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double()) {
+            scattered = ray(rec.p, reflect(unit_direction, rec.normal), r_in.time());
+            reflect_differentials(r_in, rec, scattered);
+        }
+        else {
+            scattered = ray(rec.p, refract(unit_direction, rec.normal, refraction_ratio), r_in.time());
+            refract_differentials(r_in, rec, refraction_ratio, scattered);
+        }
         return true;
     }
 
@@ -91,4 +159,26 @@ private:
     }
 };
 
+// Area light: emits emit from the front face and absorbs everything that hits it.
+class diffuse_light : public material {
+public:
+    diffuse_light(shared_ptr<texture> a) : emit(a) {}
+    diffuse_light(color c) : emit(scene_make_shared<solid_color>(c)) {}
+
+    virtual bool scatter(
+        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+    ) const override {
+        return false;
+    }
+
+    virtual color emitted(const ray& r_in, const hit_record& rec) const override {
+        if (!rec.front_face)
+            return color(0, 0, 0);
+        return emit->filtered_value(rec.u, rec.v, rec.p, rec.footprint);
+    }
+
+public:
+    shared_ptr<texture> emit;
+};
+
 #endif
\ No newline at end of file
@@ -12,6 +12,8 @@ class moving_sphere : public hittable {
 
 		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
 		virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+		virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+		using hittable::occluded;
 		point3 center(double time) const;
 
 	public:
@@ -46,11 +48,32 @@ inline bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_rec
 	rec.p = r.at(rec.t);
 	auto outward_normal = (rec.p - center(r.time())) / radius;
 	rec.set_face_normal(r,outward_normal);
+	rec.dpdu = rec.dpdv = rec.dndu = rec.dndv = vec3();	//no uv parameterization
 	rec.mat_ptr = mat_ptr;
 
 	return true;
 }
  
+inline bool moving_sphere::occluded(const ray& r, double t_min, double t_max) const
+{
+	vec3 oc = r.origin() - center(r.time());
+	auto a = r.direction().length_squared();
+	auto half_b = dot(oc, r.direction());
+	auto c = oc.length_squared() - radius * radius;
+
+	auto discriminant = half_b * half_b - a * c;
+	if (discriminant < 0) {
+		return false;
+	}
+	auto sqrtd = sqrt(discriminant);
+	auto root = (-half_b - sqrtd) / a;
+	if (root >= t_min && root <= t_max) {
+		return true;
+	}
+	root = (-half_b + sqrtd) / a;
+	return root >= t_min && root <= t_max;
+}
+
 point3 moving_sphere::center(double time) const {
 	return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0);
 }
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+// NUMA placement without libnuma. The nodes and their cpus are read from sysfs on Linux;
+// elsewhere, or when sysfs cannot be read, the machine is one node. Memory is placed by
+// first touch, the default policy of Linux and Windows: a page lands on the node of the
+// thread that first writes it, so data meant for a node is allocated and filled by a
+// thread pinned to one of its cpus.
+
+struct numa_topology {
+	std::vector<std::vector<int>> node_cpus;	//cpu ids of each node with cpus
+
+	int nodes() const { return static_cast<int>(node_cpus.size()); }
+
+	int cpus() const {
+		int n = 0;
+		for (const auto& c : node_cpus)
+			n += static_cast<int>(c.size());
+		return n;
+	}
+};
+
+namespace numa_detail {
+
+	// "0-3,8-11" to 0 1 2 3 8 9 10 11, for cpu and node lists
+	inline std::vector<int> parse_list(const std::string& list) {
+		std::vector<int> cpus;
+		std::istringstream in(list);
+		std::string range;
+		while (std::getline(in, range, ',')) {
+			if (range.empty())
+				continue;
+			size_t dash = range.find('-');
+			int first = std::stoi(range.substr(0, dash));
+			int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+			for (int c = first; c <= last; c++)
+				cpus.push_back(c);
+		}
+		return cpus;
+	}
+
+	inline numa_topology discover() {
+		numa_topology t;
+#ifdef __linux__
+		std::ifstream online("/sys/devices/system/node/online");
+		std::string nodes;
+		std::getline(online, nodes);
+		for (int node : parse_list(nodes)) {
+			std::ifstream f("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+			std::string list;
+			std::getline(f, list);
+			std::vector<int> cpus = parse_list(list);
+			if (!cpus.empty())	//memory only nodes run no workers
+				t.node_cpus.push_back(cpus);
+		}
+#endif
+		if (t.node_cpus.empty()) {
+			int n = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+			t.node_cpus.emplace_back();
+			for (int c = 0; c < n; c++)
+				t.node_cpus[0].push_back(c);
+		}
+		return t;
+	}
+}
+
+inline const numa_topology& numa_nodes() {
+	static const numa_topology t = numa_detail::discover();
+	return t;
+}
+
+// node of the cpu the calling thread is pinned to, -1 while it is not pinned
+inline int& thread_numa_node() {
+	thread_local int node = -1;
+	return node;
+}
+
+namespace numa_detail {
+
+	// the cpu the calling thread is pinned to, -1 while the os places it
+	inline int& pinned_cpu() {
+		thread_local int cpu = -1;
+		return cpu;
+	}
+
+	// what the calling thread was allowed to run on before it was first pinned
+#ifdef __linux__
+	inline cpu_set_t& original_affinity() {
+		thread_local cpu_set_t set;
+		return set;
+	}
+#elif defined(_WIN32)
+	inline DWORD_PTR& original_affinity() {
+		thread_local DWORD_PTR mask = 0;
+		return mask;
+	}
+#endif
+}
+
+// Pins the calling thread to one cpu of the given node. False where affinity cannot be set.
+inline bool pin_thread(int node, int cpu) {
+	int& pinned = numa_detail::pinned_cpu();
+	if (pinned == cpu)
+		return true;
+#ifdef __linux__
+	if (pinned < 0 && pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &numa_detail::original_affinity()) != 0)
+		return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		return false;
+#elif defined(_WIN32)
+	DWORD_PTR previous = cpu < 64 ? SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) : 0;
+	if (previous == 0)
+		return false;
+	if (pinned < 0)
+		numa_detail::original_affinity() = previous;
+#else
+	(void)cpu;
+	return false;
+#endif
+	pinned = cpu;
+	thread_numa_node() = node;
+	return true;
+}
+
+// Undoes pin_thread(): the calling thread may run on the cpus it had before and belongs to no node.
+inline void unpin_thread() {
+	int& pinned = numa_detail::pinned_cpu();
+	if (pinned < 0)
+		return;
+#ifdef __linux__
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &numa_detail::original_affinity());
+#elif defined(_WIN32)
+	SetThreadAffinityMask(GetCurrentThread(), numa_detail::original_affinity());
+#endif
+	pinned = -1;
+	thread_numa_node() = -1;
+}
+
+// Where the worker of each slot runs: slots go round robin over the nodes, so any thread
+// count uses every node's memory bandwidth, and over each node's cpus in order.
+struct worker_placement {
+	int node = 0, cpu = 0;
+};
+
+inline std::vector<worker_placement> place_workers(int threads, int nodes) {
+	const numa_topology& t = numa_nodes();
+	nodes = std::max(1, std::min(nodes, t.nodes()));
+	std::vector<worker_placement> slots(threads);
+	for (int w = 0; w < threads; w++) {
+		int node = w % nodes;
+		const std::vector<int>& cpus = t.node_cpus[node];
+		slots[w].node = node;
+		slots[w].cpu = cpus[(w / nodes) % cpus.size()];
+	}
+	return slots;
+}
+
+// Per pixel array whose pages are placed by whoever clears them: allocation leaves them
+// untouched, clear_range() zeroes (and so first touches) a range of pixels.
+template <typename T>
+class first_touch_buffer {
+	static_assert(std::is_trivially_copyable<T>::value, "cleared with memset");
+
+public:
+	void allocate(size_t count) {
+		if (count != n) {
+			data_.reset(static_cast<T*>(::operator new(count * sizeof(T))));
+			n = count;
+		}
+	}
+
+	void clear_range(size_t first, size_t last) {
+		std::memset(static_cast<void*>(data_.get() + first), 0, (last - first) * sizeof(T));
+	}
+
+	size_t size() const { return n; }
+	T& operator[](size_t i) { return data_.get()[i]; }
+	const T& operator[](size_t i) const { return data_.get()[i]; }
+
+private:
+	struct release {
+		void operator()(T* p) const { ::operator delete(p); }
+	};
+	std::unique_ptr<T, release> data_;
+	size_t n = 0;
+};
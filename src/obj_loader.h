@@ -0,0 +1,256 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mapped_file.h"
+#include "triangle_mesh.h"
+
+namespace obj_detail {
+
+	inline const char* skip_space(const char* p, const char* end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+			p++;
+		return p;
+	}
+
+	inline const char* next_line(const char* p, const char* end) {
+		while (p < end && *p != '\n')
+			p++;
+		return p < end ? p + 1 : end;
+	}
+
+	// locale-independent float parser, much faster than strtod for OBJ style numbers
+	inline const char* parse_double(const char* p, const char* end, double& out) {
+		p = skip_space(p, end);
+		bool neg = false;
+		if (p < end && (*p == '-' || *p == '+')) {
+			neg = *p == '-';
+			p++;
+		}
+		double value = 0;
+		while (p < end && *p >= '0' && *p <= '9')
+			value = value * 10 + (*p++ - '0');
+		if (p < end && *p == '.') {
+			p++;
+			double scale = 0.1;
+			while (p < end && *p >= '0' && *p <= '9') {
+				value += (*p++ - '0') * scale;
+				scale *= 0.1;
+			}
+		}
+		if (p < end && (*p == 'e' || *p == 'E')) {
+			p++;
+			bool eneg = false;
+			if (p < end && (*p == '-' || *p == '+')) {
+				eneg = *p == '-';
+				p++;
+			}
+			int e = 0;
+			while (p < end && *p >= '0' && *p <= '9')
+				e = e * 10 + (*p++ - '0');
+			value *= pow(10.0, eneg ? -e : e);
+		}
+		out = neg ? -value : value;
+		return p;
+	}
+
+	inline const char* parse_int(const char* p, const char* end, int& out) {
+		bool neg = false;
+		if (p < end && *p == '-') {
+			neg = true;
+			p++;
+		}
+		int value = 0;
+		while (p < end && *p >= '0' && *p <= '9')
+			value = value * 10 + (*p++ - '0');
+		out = neg ? -value : value;
+		return p;
+	}
+
+	// Everything one thread parsed from its slice of the file. Face indices are made
+	// zero based; relative (negative) indices are stored against the chunk's local counts
+	// and listed in relative_* so they can be shifted once the chunk offsets are known.
+	struct chunk {
+		std::vector<point3> positions;
+		std::vector<vec3> normals;
+		std::vector<vec3> uvs;
+		std::vector<int> position_indices, normal_indices, uv_indices;
+		std::vector<size_t> relative_position, relative_normal, relative_uv;
+		bool has_normals = false;
+		bool has_uvs = false;
+	};
+
+	inline void parse_chunk(const char* p, const char* end, chunk& c) {
+		std::vector<int> face_v, face_t, face_n;
+		while (p < end) {
+			p = skip_space(p, end);
+			if (p + 1 < end && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+				double x, y, z;
+				p = parse_double(p + 2, end, x);
+				p = parse_double(p, end, y);
+				p = parse_double(p, end, z);
+				c.positions.push_back(point3(x, y, z));
+			}
+			else if (p + 2 < end && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t')) {
+				double x, y, z;
+				p = parse_double(p + 3, end, x);
+				p = parse_double(p, end, y);
+				p = parse_double(p, end, z);
+				c.normals.push_back(vec3(x, y, z));
+			}
+			else if (p + 2 < end && p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t')) {
+				double u, v;
+				p = parse_double(p + 3, end, u);
+				p = parse_double(p, end, v);
+				c.uvs.push_back(vec3(u, v, 0));
+			}
+			else if (p + 1 < end && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+				face_v.clear();
+				face_t.clear();
+				face_n.clear();
+				p += 2;
+				while (true) {
+					p = skip_space(p, end);
+					if (p >= end || *p == '\n' || *p == '#')
+						break;
+					int v = 0, t = 0, n = 0;
+					p = parse_int(p, end, v);
+					if (p < end && *p == '/') {
+						p++;
+						if (p < end && *p != '/')
+							p = parse_int(p, end, t);
+						if (p < end && *p == '/')
+							p = parse_int(p + 1, end, n);
+					}
+					if (v == 0)
+						break;
+					face_v.push_back(v);
+					face_t.push_back(t);
+					face_n.push_back(n);
+					// skip anything unexpected up to the next separator
+					while (p < end && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+						p++;
+				}
+
+				// triangulate polygons as a fan
+				for (size_t k = 1; k + 1 < face_v.size(); k++) {
+					size_t corners[3] = { 0, k, k + 1 };
+					for (size_t corner : corners) {
+						auto add = [](int index, int local_count, std::vector<int>& out, std::vector<size_t>& relative) {
+							if (index < 0) {
+								relative.push_back(out.size());
+								out.push_back(local_count + index);
+							}
+							else {
+								out.push_back(index - 1);
+							}
+						};
+						add(face_v[corner], static_cast<int>(c.positions.size()), c.position_indices, c.relative_position);
+						add(face_t[corner], static_cast<int>(c.uvs.size()), c.uv_indices, c.relative_uv);
+						add(face_n[corner], static_cast<int>(c.normals.size()), c.normal_indices, c.relative_normal);
+						c.has_uvs |= face_t[corner] != 0;
+						c.has_normals |= face_n[corner] != 0;
+					}
+				}
+			}
+			p = next_line(p, end);
+		}
+	}
+}
+
+// Loads the triangles of an OBJ file (v, vt, vn, f; polygons are fan triangulated, materials
+// and groups are ignored). The file is memory mapped and split into line-aligned slices that
+// are parsed on separate threads. Returns nullptr on failure.
+shared_ptr<mesh_data> load_obj(const std::string& path, unsigned threads = std::thread::hardware_concurrency()) {
+	mapped_file file;
+	if (!file.open(path)) {
+		std::cerr << "load_obj: cannot open " << path << "\n";
+		return nullptr;
+	}
+	const char* begin = file.data();
+	const char* end = begin + file.length();
+
+	// keep slices large enough that thread startup does not dominate small files
+	const size_t min_slice = 1 << 20;
+	size_t slice_count = std::max<size_t>(1, std::min<size_t>(threads ? threads : 1, file.length() / min_slice));
+	std::vector<const char*> bounds(slice_count + 1, end);
+	bounds[0] = begin;
+	for (size_t i = 1; i < slice_count; i++) {
+		const char* p = begin + file.length() * i / slice_count;
+		bounds[i] = std::max(bounds[i - 1], obj_detail::next_line(p, end));
+	}
+
+	std::vector<obj_detail::chunk> chunks(slice_count);
+	if (slice_count == 1) {
+		obj_detail::parse_chunk(begin, end, chunks[0]);
+	}
+	else {
+		std::vector<std::thread> workers;
+		for (size_t i = 0; i < slice_count; i++)
+			workers.emplace_back(obj_detail::parse_chunk, bounds[i], bounds[i + 1], std::ref(chunks[i]));
+		for (auto& worker : workers)
+			worker.join();
+	}
+
+	// merge the slices in file order
+	auto mesh = make_shared<mesh_data>();
+	size_t vcount = 0, ncount = 0, tcount = 0, icount = 0;
+	bool has_normals = false, has_uvs = false;
+	for (const auto& c : chunks) {
+		vcount += c.positions.size();
+		ncount += c.normals.size();
+		tcount += c.uvs.size();
+		icount += c.position_indices.size();
+		has_normals |= c.has_normals;
+		has_uvs |= c.has_uvs;
+	}
+	mesh->positions.reserve(vcount);
+	mesh->normals.reserve(ncount);
+	mesh->uvs.reserve(tcount);
+	mesh->position_indices.reserve(icount);
+	if (has_normals) mesh->normal_indices.reserve(icount);
+	if (has_uvs) mesh->uv_indices.reserve(icount);
+
+	int vbase = 0, nbase = 0, tbase = 0;
+	for (auto& c : chunks) {
+		for (size_t k : c.relative_position) c.position_indices[k] += vbase;
+		for (size_t k : c.relative_normal) c.normal_indices[k] += nbase;
+		for (size_t k : c.relative_uv) c.uv_indices[k] += tbase;
+
+		mesh->positions.insert(mesh->positions.end(), c.positions.begin(), c.positions.end());
+		mesh->normals.insert(mesh->normals.end(), c.normals.begin(), c.normals.end());
+		mesh->uvs.insert(mesh->uvs.end(), c.uvs.begin(), c.uvs.end());
+		mesh->position_indices.insert(mesh->position_indices.end(), c.position_indices.begin(), c.position_indices.end());
+		if (has_normals) mesh->normal_indices.insert(mesh->normal_indices.end(), c.normal_indices.begin(), c.normal_indices.end());
+		if (has_uvs) mesh->uv_indices.insert(mesh->uv_indices.end(), c.uv_indices.begin(), c.uv_indices.end());
+
+		vbase += static_cast<int>(c.positions.size());
+		nbase += static_cast<int>(c.normals.size());
+		tbase += static_cast<int>(c.uvs.size());
+		c = obj_detail::chunk();
+	}
+
+	// reject meshes with out of range vertex indices; out of range normal and uv indices
+	// are dropped (set to -1), which leaves their triangles the face normal or no uv
+	int vmax = static_cast<int>(mesh->positions.size());
+	for (int i : mesh->position_indices) {
+		if (i < 0 || i >= vmax) {
+			std::cerr << "load_obj: " << path << " has out of range vertex indices\n";
+			return nullptr;
+		}
+	}
+	auto check_optional = [](std::vector<int>& indices, size_t count) {
+		for (int& i : indices) {
+			if (i < 0 || i >= static_cast<int>(count))
+				i = -1;
+		}
+	};
+	check_optional(mesh->normal_indices, mesh->normals.size());
+	check_optional(mesh->uv_indices, mesh->uvs.size());
+
+	return mesh;
+}
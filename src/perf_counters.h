@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware event counters for the calling thread, read through perf_event_open on Linux.
+// Events the kernel or the VM does not expose report -1; on other platforms all do.
+class perf_counters {
+public:
+	enum event { cycles, instructions, branches, branch_misses, event_count };
+
+	perf_counters() {
+		for (int e = 0; e < event_count; e++) {
+			fd[e] = -1;
+			counts[e] = -1;
+		}
+#ifdef __linux__
+		const unsigned long long configs[event_count] = {
+			PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_BRANCH_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES };
+		for (int e = 0; e < event_count; e++) {
+			perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = configs[e];
+			attr.disabled = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			fd[e] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+		}
+#endif
+	}
+
+	~perf_counters() {
+#ifdef __linux__
+		for (int e = 0; e < event_count; e++) {
+			if (fd[e] >= 0)
+				close(fd[e]);
+		}
+#endif
+	}
+
+	perf_counters(const perf_counters&) = delete;
+	perf_counters& operator=(const perf_counters&) = delete;
+
+	void start() {
+#ifdef __linux__
+		for (int e = 0; e < event_count; e++) {
+			if (fd[e] < 0)
+				continue;
+			ioctl(fd[e], PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd[e], PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+	}
+
+	void stop() {
+#ifdef __linux__
+		for (int e = 0; e < event_count; e++) {
+			if (fd[e] < 0)
+				continue;
+			ioctl(fd[e], PERF_EVENT_IOC_DISABLE, 0);
+			long long value = -1;
+			if (read(fd[e], &value, sizeof(value)) != sizeof(value))
+				value = -1;
+			counts[e] = value;
+		}
+#endif
+	}
+
+	bool available(event e) const { return fd[e] >= 0; }
+	long long value(event e) const { return counts[e]; }
+
+	static const char* name(event e) {
+		static const char* names[event_count] = { "cycles", "instructions", "branches", "branch_misses" };
+		return names[e];
+	}
+
+private:
+	int fd[event_count];
+	long long counts[event_count];
+};
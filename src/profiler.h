@@ -0,0 +1,185 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+
+#ifdef RT_PROFILE
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#endif
+
+// Scoped profiling zones, exported as a Chrome trace (chrome://tracing or ui.perfetto.dev).
+// Compiled with RT_PROFILE=1, RT_PROFILE_ZONE("name") records when the enclosing scope
+// started and how long it took into a ring buffer owned by the calling thread: recording
+// takes no lock, and once a buffer is full its oldest events are overwritten. RT_PROFILE=2
+// adds the RT_PROFILE_PATH_ZONE()s inside ray_color(), one per bounce phase, which fill
+// the buffers within a few tiles. Without RT_PROFILE both macros expand to nothing and
+// write_profile_trace() fails.
+//
+// The buffers are read while no zone is open on another thread, i.e. between renders.
+
+#ifdef RT_PROFILE
+
+namespace profile_detail {
+
+	struct event {
+		const char* name;	//a string literal
+		long long start;	//ns since the first event of the process
+		long long duration;
+	};
+
+	const size_t ring_size = size_t(1) << 18;
+
+	struct ring {
+		std::unique_ptr<event[]> events{ new event[ring_size] };
+		std::atomic<unsigned long long> written{ 0 };
+		int thread = 0;
+	};
+
+	struct registry {
+		std::mutex mutex;
+		std::vector<std::shared_ptr<ring>> rings;	//kept after their thread exits
+	};
+
+	inline registry& rings() {
+		static registry r;
+		return r;
+	}
+
+	inline long long now_ns() {
+		static const auto epoch = std::chrono::steady_clock::now();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+	}
+
+	// registers the calling thread's buffer on its first zone
+	inline ring& thread_ring() {
+		thread_local std::shared_ptr<ring> mine = [] {
+			auto r = std::make_shared<ring>();
+			registry& all = rings();
+			std::lock_guard<std::mutex> lock(all.mutex);
+			r->thread = static_cast<int>(all.rings.size());
+			all.rings.push_back(r);
+			return r;
+		}();
+		return *mine;
+	}
+
+	inline void record(const char* name, long long start, long long end) {
+		ring& r = thread_ring();
+		unsigned long long n = r.written.load(std::memory_order_relaxed);
+		r.events[n % ring_size] = { name, start, end - start };
+		r.written.store(n + 1, std::memory_order_release);
+	}
+
+	class zone {
+	public:
+		explicit zone(const char* name) : name(name), start(now_ns()) {}
+		~zone() { record(name, start, now_ns()); }
+		zone(const zone&) = delete;
+		zone& operator=(const zone&) = delete;
+
+	private:
+		const char* name;
+		long long start;
+	};
+
+	// the events still in each buffer, oldest first
+	template <class F>
+	void for_each_event(F&& f) {
+		registry& all = rings();
+		std::lock_guard<std::mutex> lock(all.mutex);
+		for (const auto& r : all.rings) {
+			unsigned long long n = r->written.load(std::memory_order_acquire);
+			unsigned long long first = n > ring_size ? n - ring_size : 0;
+			for (unsigned long long k = first; k < n; k++)
+				f(r->thread, r->events[k % ring_size]);
+		}
+	}
+}
+
+#define RT_PROFILE_CONCAT_(a, b) a##b
+#define RT_PROFILE_CONCAT(a, b) RT_PROFILE_CONCAT_(a, b)
+#define RT_PROFILE_ZONE(name) profile_detail::zone RT_PROFILE_CONCAT(profile_zone_, __LINE__)(name)
+#if RT_PROFILE >= 2
+#define RT_PROFILE_PATH_ZONE(name) RT_PROFILE_ZONE(name)
+#else
+#define RT_PROFILE_PATH_ZONE(name)
+#endif
+
+const bool profiling_enabled = true;
+
+// Drops the recorded events.
+inline void clear_profile() {
+	auto& all = profile_detail::rings();
+	std::lock_guard<std::mutex> lock(all.mutex);
+	for (const auto& r : all.rings)
+		r->written = 0;
+}
+
+// Writes the recorded events as Chrome trace-event JSON, one complete ("X") event per zone.
+inline bool write_profile_trace(const std::string& path) {
+	std::ofstream out(path);
+	if (!out) {
+		std::cerr << "profiler: cannot write " << path << std::endl;
+		return false;
+	}
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	bool first = true;
+	int threads = 0;
+	profile_detail::for_each_event([&](int thread, const profile_detail::event& e) {
+		out << (first ? "" : ",\n") << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread
+			<< ",\"ts\":" << e.start / 1000 << "." << (e.start % 1000) / 100 << ",\"dur\":" << e.duration / 1000 << "."
+			<< (e.duration % 1000) / 100 << "}";
+		first = false;
+		threads = std::max(threads, thread + 1);
+	});
+	for (int t = 0; t < threads; t++) {
+		out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t
+			<< ",\"args\":{\"name\":\"thread " << t << "\"}}";
+		first = false;
+	}
+	out << "\n]}\n";
+	return bool(out);
+}
+
+// Total time, count and mean of every zone name in the buffers, longest total first. Zones
+// nest (a tile holds its paths), so the totals include the zones inside.
+inline void write_profile_summary(std::ostream& out) {
+	struct total { long long ns = 0, count = 0; };
+	std::map<std::string, total> totals;
+	profile_detail::for_each_event([&](int, const profile_detail::event& e) {
+		total& t = totals[e.name];
+		t.ns += e.duration;
+		t.count++;
+	});
+	std::vector<std::pair<std::string, total>> sorted(totals.begin(), totals.end());
+	std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.second.ns > b.second.ns; });
+	for (const auto& entry : sorted) {
+		out << entry.first << ": " << entry.second.ns * 1e-6 << "ms in " << entry.second.count << " zones, "
+			<< double(entry.second.ns) / entry.second.count << "ns each\n";
+	}
+}
+
+#else
+
+#define RT_PROFILE_ZONE(name)
+#define RT_PROFILE_PATH_ZONE(name)
+
+const bool profiling_enabled = false;
+
+inline void clear_profile() {}
+
+inline bool write_profile_trace(const std::string&) {
+	return false;
+}
+
+inline void write_profile_summary(std::ostream&) {}
+
+#endif
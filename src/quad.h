@@ -0,0 +1,121 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+// Ray against the parallelogram Q + a*u + b*v with unit normal, plane offset D = dot(normal, Q)
+// and w = cross(u, v) / |cross(u, v)|^2; gives the hit distance and the plane coordinates.
+inline bool intersect_parallelogram(const point3& Q, const vec3& u, const vec3& v, const vec3& normal, double D, const vec3& w,
+	const ray& r, double t_min, double t_max, double& t, double& a, double& b)
+{
+	auto denom = dot(normal, r.direction());
+	if (fabs(denom) < 1e-8)
+		return false;
+	t = (D - dot(normal, r.origin())) / denom;
+	if (t < t_min || t > t_max)
+		return false;
+	vec3 planar = r.at(t) - Q;
+	a = dot(w, cross(planar, v));
+	b = dot(w, cross(u, planar));
+	return a >= 0 && a <= 1 && b >= 0 && b <= 1;
+}
+
+// Parallelogram Q + a*u + b*v with a, b in [0, 1]; (a, b) are its texture coordinates.
+// The front face is the side cross(u, v) points to, which is also the side an area light emits from.
+class quad : public hittable {
+public:
+	quad() {}
+	quad(const point3& _Q, const vec3& _u, const vec3& _v, shared_ptr<material> m)
+		: Q(_Q), u(_u), v(_v), mat_ptr(m)
+	{
+		vec3 n = cross(u, v);
+		area = n.length();
+		normal = n / area;
+		D = dot(normal, Q);
+		w = n / dot(n, n);
+	}
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+	using hittable::occluded;
+
+	point3 point_at(double a, double b) const { return Q + a * u + b * v; }
+
+private:
+	//plane hit inside the parallelogram, returns the plane coordinates
+	bool intersect(const ray& r, double t_min, double t_max, double& t, double& a, double& b) const;
+
+public:
+	point3 Q;
+	vec3 u, v;
+	shared_ptr<material> mat_ptr;
+	vec3 normal;
+	double D;
+	vec3 w;		//cross(u, v) / |cross(u, v)|^2, turns plane offsets into (a, b)
+	double area;
+};
+
+inline bool quad::intersect(const ray& r, double t_min, double t_max, double& t, double& a, double& b) const {
+	return intersect_parallelogram(Q, u, v, normal, D, w, r, t_min, t_max, t, a, b);
+}
+
+bool quad::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	double t, a, b;
+	if (!intersect(r, t_min, t_max, t, a, b))
+		return false;
+	rec.t = t;
+	rec.p = r.at(t);
+	rec.u = a;
+	rec.v = b;
+	rec.set_face_normal(r, normal);
+	rec.dpdu = u;
+	rec.dpdv = v;
+	rec.dndu = rec.dndv = vec3();
+	rec.mat_ptr = mat_ptr;
+	return true;
+}
+
+bool quad::occluded(const ray& r, double t_min, double t_max) const {
+	double t, a, b;
+	return intersect(r, t_min, t_max, t, a, b);
+}
+
+bool quad::bounding_box(double time0, double time1, aabb& output_box) const {
+	point3 lo = Q, hi = Q;
+	point3 corners[3] = { Q + u, Q + v, Q + u + v };
+	for (const auto& c : corners) {
+		for (int k = 0; k < 3; k++) {
+			lo.e[k] = fmin(lo.e[k], c.e[k]);
+			hi.e[k] = fmax(hi.e[k], c.e[k]);
+		}
+	}
+	//axis aligned quads would give a flat box, which the slab test never hits
+	for (int k = 0; k < 3; k++) {
+		if (hi.e[k] - lo.e[k] < 1e-4) {
+			lo.e[k] -= 5e-5;
+			hi.e[k] += 5e-5;
+		}
+	}
+	output_box = aabb(lo, hi);
+	return true;
+}
+
+// The six sides of the box with opposite corners a and b, facing outwards.
+inline shared_ptr<hittable_list> make_box(const point3& a, const point3& b, shared_ptr<material> mat) {
+	auto sides = scene_make_shared<hittable_list>();
+	point3 lo(fmin(a.x(), b.x()), fmin(a.y(), b.y()), fmin(a.z(), b.z()));
+	point3 hi(fmax(a.x(), b.x()), fmax(a.y(), b.y()), fmax(a.z(), b.z()));
+	vec3 dx(hi.x() - lo.x(), 0, 0);
+	vec3 dy(0, hi.y() - lo.y(), 0);
+	vec3 dz(0, 0, hi.z() - lo.z());
+
+	sides->add(scene_make_shared<quad>(point3(lo.x(), lo.y(), hi.z()), dx, dy, mat));	//front
+	sides->add(scene_make_shared<quad>(point3(hi.x(), lo.y(), hi.z()), -dz, dy, mat));	//right
+	sides->add(scene_make_shared<quad>(point3(hi.x(), lo.y(), lo.z()), -dx, dy, mat));	//back
+	sides->add(scene_make_shared<quad>(point3(lo.x(), lo.y(), lo.z()), dz, dy, mat));	//left
+	sides->add(scene_make_shared<quad>(point3(lo.x(), hi.y(), hi.z()), dx, -dz, mat));	//top
+	sides->add(scene_make_shared<quad>(point3(lo.x(), lo.y(), lo.z()), dx, dz, mat));	//bottom
+	return sides;
+}
@@ -18,10 +18,23 @@ public:
         return orig + t * dir;
     }
 
+    // offset rays one pixel step to the right (x) and up (y), used to estimate texture footprints
+    void set_differentials(const point3& ox, const vec3& dx, const point3& oy, const vec3& dy) {
+        has_differentials = true;
+        rx_origin = ox;
+        rx_direction = dx;
+        ry_origin = oy;
+        ry_direction = dy;
+    }
+
 public:
     point3 orig;
     vec3 dir;
     double tm;
+
+    bool has_differentials = false;
+    point3 rx_origin, ry_origin;
+    vec3 rx_direction, ry_direction;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <ostream>
+
+// Ray and traversal counters of one thread. ray_color() and the BVH traversals bump the
+// calling thread's copy, which nothing else touches; a render tile starts from zero and
+// adds its counts to the frame total when it ends. Objects below a BVH leaf (a mesh, an
+// instance) count as one primitive test each, their own traversal is not counted.
+struct ray_stats {
+	static const int depth_buckets = 16;	//the last bucket holds every deeper bounce
+
+	long long rays_by_depth[depth_buckets] = {};	//closest hit rays of ray_color() by bounce
+	long long shadow_rays = 0;		//any hit rays: light samples and ambient occlusion
+	long long hits = 0;				//closest hit rays that found a surface
+	long long box_tests = 0;		//bvh node bounds tested
+	long long node_visits = 0;		//nodes whose bounds the ray hit, leaves included
+	long long primitive_tests = 0;
+	long long roulette_kills = 0;	//paths ended by russian roulette
+	long long depth_limit = 0;		//paths cut off at max_depth
+
+	long long closest_rays() const {
+		long long n = 0;
+		for (long long d : rays_by_depth)
+			n += d;
+		return n;
+	}
+
+	long long rays() const { return closest_rays() + shadow_rays; }
+
+	void add(const ray_stats& o) {
+		for (int d = 0; d < depth_buckets; d++)
+			rays_by_depth[d] += o.rays_by_depth[d];
+		shadow_rays += o.shadow_rays;
+		hits += o.hits;
+		box_tests += o.box_tests;
+		node_visits += o.node_visits;
+		primitive_tests += o.primitive_tests;
+		roulette_kills += o.roulette_kills;
+		depth_limit += o.depth_limit;
+	}
+
+	static int depth_bucket(int bounce) { return bounce < depth_buckets ? bounce : depth_buckets - 1; }
+};
+
+inline ray_stats& thread_ray_stats() {
+	thread_local ray_stats stats;
+	return stats;
+}
+
+// Counts of one traversal kept in registers, added to the thread's stats when it returns.
+struct traversal_tally {
+	long long box_tests = 0, node_visits = 0, primitive_tests = 0;
+
+	~traversal_tally() {
+		ray_stats& s = thread_ray_stats();
+		s.box_tests += box_tests;
+		s.node_visits += node_visits;
+		s.primitive_tests += primitive_tests;
+	}
+};
+
+// One line per group: rays, traversal work per ray, path ends, and the bounce histogram.
+inline void write_ray_stats(std::ostream& out, const ray_stats& s) {
+	double rays = s.rays() > 0 ? double(s.rays()) : 1.0;
+	long long closest = s.closest_rays();
+	out << "rays: " << s.rays() << " (" << closest << " closest hit, " << s.shadow_rays << " shadow), "
+		<< (closest > 0 ? 100.0 * s.hits / closest : 0.0) << "% hit\n";
+	out << "per ray: " << s.box_tests / rays << " box tests, " << s.node_visits / rays << " nodes visited, "
+		<< s.primitive_tests / rays << " primitive tests\n";
+	out << "paths ended by roulette: " << s.roulette_kills << ", at max depth: " << s.depth_limit << "\n";
+	out << "rays by bounce:";
+	int last = ray_stats::depth_buckets - 1;
+	while (last > 0 && s.rays_by_depth[last] == 0)
+		last--;
+	for (int d = 0; d <= last; d++)
+		out << " " << s.rays_by_depth[d];
+	out << (last == ray_stats::depth_buckets - 1 ? " (last one and deeper)\n" : "\n");
+}
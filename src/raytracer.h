@@ -1,5 +1,9 @@
 #pragma once
 
+#include <atomic>
+#include <filesystem>
+#include <sstream>
+
 #include "rtweekend.h"
 #include "hittable_list.h"
 #include "sphere.h"
@@ -7,25 +11,180 @@
 #include "material.h"
 #include "moving_sphere.h"
 #include "bvh_node.h"
+#include "triangle_mesh.h"
+#include "obj_loader.h"
+#include "instance.h"
+#include "top_level_bvh.h"
+#include "compiled_scene.h"
+#include "lights.h"
+#include "quad.h"
+#include "denoiser.h"
+#include "scene_file.h"
+#include "scene_cache.h"
+#include "profiler.h"
+#include "ray_stats.h"
+#include "heatmap.h"
+#include "bvh_quality.h"
+#include "numa.h"
 #include "ThreadPool.h"
 
-color ray_color(const ray& r, const hittable& world, int depth) {
-	hit_record rec;
+// What the first hit of a camera ray saw, for the denoiser and temporal reprojection.
+struct first_hit {
+	color albedo = color(1, 1, 1);
+	vec3 normal;
+	point3 position;
+	bool hit = false;	//false for rays that left the scene
+	int nodes = 0;		//bvh nodes the camera ray visited
+};
 
-	// If we've exceeded the ray bounce limit, no more light is gathered.
-	if (depth <= 0)
-		return color(0, 0, 0);
+// power heuristic (beta = 2) weight of a sampling strategy with density a against one with density b
+inline double power_heuristic(double a, double b) {
+	double a2 = a * a, b2 = b * b;
+	return a2 + b2 > 0 ? a2 / (a2 + b2) : 0;
+}
+
+// Path tracer. scene_type is compiled_scene or polymorphic_scene, both resolved at compile time.
+// When the scene has a light list, diffuse vertices also sample a light directly (next event
+// estimation) and both that sample and emitters found by the BSDF ray are weighted by MIS.
+// An importance sampled environment map is handled the same way with a sample of its own.
+template <class scene_type>
+color ray_color(const ray& camera_ray, const scene_type& world, int depth, first_hit* features = nullptr) {
+	const light_set* lights = world.light_list();
+	const environment* env_light = world.environment_light();
+	color radiance(0, 0, 0);
+	color throughput(1, 1, 1);
+	ray r = camera_ray;
+	bool specular = true;	//emitters seen from the camera or through mirrors are not light sampled
+	double bsdf_pdf = 0;
+	point3 prev_p;
+	vec3 prev_n;
+
+	// depth bounds the number of bounces as before
+	ray_stats& stats = thread_ray_stats();
+	RT_PROFILE_PATH_ZONE("path");
+	for (int bounce = 0; bounce < depth; bounce++) {
+		random_bounce(bounce);
+		hit_record rec;
+		stats.rays_by_depth[ray_stats::depth_bucket(bounce)]++;
+		bool found;
+		{
+			RT_PROFILE_PATH_ZONE("intersect");
+			long long nodes_before = stats.node_visits;
+			found = world.hit(r, 0.001, infinity, rec);
+			if (bounce == 0 && features)
+				features->nodes = static_cast<int>(stats.node_visits - nodes_before);
+		}
+		if (!found) {
+			double weight = env_light && !specular ? power_heuristic(bsdf_pdf, env_light->pdf(r.direction())) : 1.0;
+			radiance += weight * throughput * world.background(r);
+			if (bounce == 0 && features)
+				features->albedo = world.background(r);
+			break;
+		}
+		stats.hits++;
+		RT_PROFILE_PATH_ZONE("shade");
+		rec.compute_differentials(r);
+
+		color emitted = world.emitted(r, rec);
+		if (emitted.x() > 0 || emitted.y() > 0 || emitted.z() > 0) {
+			int light = lights && !specular ? world.light_index(rec) : -1;
+			double weight = light < 0 ? 1.0 : power_heuristic(bsdf_pdf, lights->pdf(prev_p, prev_n, light, rec.p));
+			radiance += weight * throughput * emitted;
+		}
 
-	if (world.hit(r, 0.001, infinity, rec)) {
 		ray scattered;
 		color attenuation;
-		if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-			return attenuation * ray_color(scattered, world, depth - 1);
+		bool scatters = world.scatter(r, rec, attenuation, scattered);
+		if (bounce == 0 && features) {
+			features->albedo = scatters ? attenuation : emitted;
+			features->normal = rec.normal;
+			features->position = rec.p;
+			features->hit = true;
+		}
+		if (!scatters)
+			break;
+		double pdf = world.scattering_pdf(r, rec, scattered);
+
+		RT_PROFILE_PATH_ZONE("direct light");
+		if (lights && pdf > 0) {
+			light_sample ls;
+			if (lights->sample(rec.p, rec.normal, ls)) {
+				ray shadow(rec.p, ls.wi, r.time());
+				double light_bsdf_pdf = world.scattering_pdf(r, rec, shadow);
+				stats.shadow_rays += light_bsdf_pdf > 0;
+				if (light_bsdf_pdf > 0 && !world.occluded(shadow, 0.001, ls.distance * (1 - 1e-6) - 0.001)) {
+					color le = lights->radiance(ls, shadow);
+					radiance += power_heuristic(ls.pdf, light_bsdf_pdf) * (light_bsdf_pdf / ls.pdf) * throughput * attenuation * le;
+				}
+			}
+		}
+		if (env_light && pdf > 0) {
+			double env_pdf;
+			ray shadow(rec.p, env_light->sample(env_pdf), r.time());
+			double env_bsdf_pdf = env_pdf > 0 ? world.scattering_pdf(r, rec, shadow) : 0.0;
+			stats.shadow_rays += env_bsdf_pdf > 0;
+			if (env_bsdf_pdf > 0 && !world.occluded(shadow, 0.001, infinity)) {
+				color le = world.background(shadow);
+				radiance += power_heuristic(env_pdf, env_bsdf_pdf) * (env_bsdf_pdf / env_pdf) * throughput * attenuation * le;
+			}
+		}
+
+		throughput = throughput * attenuation;
+		specular = pdf <= 0;
+		bsdf_pdf = pdf;
+		prev_p = rec.p;
+		prev_n = rec.normal;
+		r = scattered;
+
+		// russian roulette once the path has had a few bounces
+		if (bounce >= 3) {
+			double q = fmin(0.95, fmax(throughput.x(), fmax(throughput.y(), throughput.z())));
+			if (random_double() >= q) {
+				stats.roulette_kills++;
+				break;
+			}
+			throughput = throughput / q;
+		}
+		if (bounce + 1 == depth)
+			stats.depth_limit++;
+	}
+
+	// one bad sample (a degenerate pdf) would otherwise stick out as a white pixel
+	if (!std::isfinite(radiance.x()) || !std::isfinite(radiance.y()) || !std::isfinite(radiance.z()))
 		return color(0, 0, 0);
+	return radiance;
+}
+
+// Ambient occlusion preview: one closest hit, then cosine-distributed any-hit rays
+// around the normal; the pixel is the fraction of them that escape within max_dist.
+const int max_ao_samples = 64;
+
+template <class scene_type>
+color ray_color_ao(const ray& r, const scene_type& world, int samples, double max_dist, first_hit* features = nullptr) {
+	hit_record rec;
+
+	ray_stats& stats = thread_ray_stats();
+	stats.rays_by_depth[0]++;
+	long long nodes_before = stats.node_visits;
+	bool found = world.hit(r, 0.001, infinity, rec);
+	if (features)
+		features->nodes = static_cast<int>(stats.node_visits - nodes_before);
+	if (!found)
+		return world.background(r);
+	stats.hits++;
+
+	samples = samples < 1 ? 1 : (samples > max_ao_samples ? max_ao_samples : samples);
+	ray ao_rays[max_ao_samples];
+	for (int i = 0; i < samples; i++) {
+		auto direction = rec.normal + random_unit_vector();
+		if (direction.near_zero())
+			direction = rec.normal;
+		ao_rays[i] = ray(rec.p, unit_vector(direction), r.time());
 	}
-	vec3 unit_direction = unit_vector(r.direction());
-	auto t = 0.5 * (unit_direction.y() + 1.0);
-	return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
+
+	stats.shadow_rays += samples;
+	int blocked = world.occluded(ao_rays, samples, 0.001, max_dist);
+	return color(1.0 - double(blocked) / samples);
 }
 
 // screen
@@ -38,6 +197,66 @@ const int max_depth = 50;
 //picture id
 int pic_id = 0;
 
+// render mode: 0 path tracing, 1 ambient occlusion preview
+int render_mode = 0;
+
+// False color view of where the last render spent its work, shown instead of the image
+// once the render is done: bvh nodes visited per camera ray, primitive tests per sample
+// (all rays of the path), samples per pixel (reprojected history included) and the time
+// each tile took over all passes.
+enum heatmap_kind { heatmap_none, heatmap_nodes, heatmap_primitives, heatmap_samples, heatmap_tile_time, heatmap_count };
+int heatmap = heatmap_none;
+// depth of the bvh nodes whose boxes are drawn over the finished image or heatmap, -1 for none
+int bvh_box_depth = -1;
+int ao_samples = 16;
+float ao_distance = 1.0f;
+
+// traverse the compiled (tagged, switch dispatched) scene instead of the virtual hittables
+bool use_compiled_scene = true;
+
+// direct lighting: 0 only by BSDF sampling, 1 next event estimation with a uniformly
+// picked light, 2 next event estimation through the light BVH
+int light_sampling = 2;
+
+// trace ray differentials from the camera so textures filter over the pixel footprint
+bool use_ray_differentials = true;
+
+// run the a-trous denoiser on the finished frame, guided by first hit albedo and normals
+bool denoise_output = false;
+int denoise_iterations = 5;
+
+// show a quarter and a half resolution preview first, then refine in full resolution
+// passes whose samples add up to samples_per_pixel
+bool progressive = true;
+
+// tile workers, 0 for one per hardware thread; a change applies from the next render
+int render_threads = 0;
+
+// when only the camera moved, carry each pixel's accumulated color over from the previous
+// view if its first hit shows the same surface there
+bool temporal_reprojection = true;
+int history_limit = 64;	//samples' worth of history a pixel keeps, lower follows view dependent shading faster
+
+// mesh scene (pic_id 3)
+char obj_path[256] = "";
+
+// place scene objects in the raytracer's arena instead of individual heap allocations
+bool use_scene_arena = true;
+
+// scene file (pic_id 8), JSON or binary
+char scene_path[256] = "scene.json";
+// map the compiled scene and its BVH from the temp directory after the first load
+bool use_scene_cache = true;
+
+// image texture scene (pic_id 5) and the shared texture cache budget
+char image_path[256] = "earthmap.jpg";
+int texture_budget_mb = 256;
+
+// instanced forest (pic_id 4)
+int forest_size = 32;
+float forest_spacing = 3.0f;
+float forest_rotation = 0.0f;
+
 // camera
 point3 lookfrom(13, 2, 3);
 point3 lookat(0, 0, 0);
@@ -45,36 +264,225 @@ vec3 vup(0, 1, 0);
 float vfov = 20;
 float dist_to_focus = 10.0f;
 float aperture = 0.1f;
-color ground(1.0,1.0,1.0);
+color ground(1.0,1.0,1.0);	//bottom of the sky gradient
+// equirectangular (HDR) environment map replacing the gradient, empty for none
+char env_path[256] = "";
+float env_intensity = 1.0f;
 // multi-threading
-ThreadPool pool(std::thread::hardware_concurrency());	//̳߳أ̳߳صĴСΪӲĲ
 std::mutex tile_mutex;	//˻󣨶߳±֤ٽȫͬƣ
 int finishedTileCount = 0;
 int totalTileCount = 0;
 double startTime = 0;
-int tileSize = 16;	//ÿС
+int tileSize = 0;	//ÿС, 0 picks it from the image size and thread count
+// Order the tiles of a pass are handed out in: by columns, along a Hilbert curve (neighbouring
+// tiles share BVH nodes and texture tiles in the caches) or in rings out from the center.
+enum tile_order_kind { tile_order_columns, tile_order_hilbert, tile_order_spiral, tile_order_count };
+int tile_order = tile_order_hilbert;
+// threads that find no tile left take rows of the running tile with the most left, so a few
+// slow tiles at the end of a pass are shared instead of leaving threads idle
+bool split_tiles = true;
+// NUMA placement: 0 leaves the worker threads to the OS, 1 pins them round robin over the
+// nodes, 2 also gives every node its own copy of the compiled scene and its own band of
+// image rows, whose frame buffers it first touches and whose tiles its workers take first
+int numa_placement = 0;
+
+// Where the time of the last render went, filled when its last pass finishes.
+struct render_stats {
+	double build_seconds = 0;	//0 when the scene was reused
+	double trace_seconds = 0;	//from the first tile queued to the last one done
+	double denoise_seconds = 0;
+	long long rays = 0;			//camera, bounce and shadow rays
+	long long paths = 0;		//camera samples, previews included
+	int threads = 0;
+	double tail_seconds = 0;	//from 95% of the last pass's tiles done to all of them
+	ray_stats counters;			//summed over the tiles of every pass
+};
+
+// What the world and its acceleration structures are built from. render() only rebuilds
+// when these differ from the last build, so camera, film, sampling and lighting changes
+// restart sampling on the scene that is already there.
+struct scene_settings {
+	int pic = 0;
+	bool arena = false, compiled = false;
+	std::string file;			//obj, image or scene file the picture reads
+	long long file_time = 0;	//scene file modification time, an edited file is reloaded
+	int forest_size = 0;
+	float forest_spacing = 0, forest_rotation = 0;
+
+	bool operator==(const scene_settings& o) const {
+		return pic == o.pic && arena == o.arena && compiled == o.compiled && file == o.file && file_time == o.file_time
+			&& forest_size == o.forest_size && forest_spacing == o.forest_spacing && forest_rotation == o.forest_rotation;
+	}
+	bool operator!=(const scene_settings& o) const { return !(*this == o); }
+};
+
+inline scene_settings current_scene_settings() {
+	scene_settings s;
+	s.pic = pic_id;
+	s.arena = use_scene_arena;
+	s.compiled = use_compiled_scene || pic_id == 8;
+	switch (pic_id) {
+	case 3:
+		s.file = obj_path;
+		break;
+	case 4:
+		s.forest_size = forest_size;
+		s.forest_spacing = forest_spacing;
+		s.forest_rotation = forest_rotation;
+		break;
+	case 5:
+		s.file = image_path;
+		break;
+	case 8: {
+		s.file = scene_path;
+		std::error_code ec;
+		s.file_time = static_cast<long long>(std::filesystem::last_write_time(s.file, ec).time_since_epoch().count());
+		break;
+	}
+	}
+	return s;
+}
 
 class raytracer {
+	scene_arena arena;	//primitives, materials, textures and bvh nodes of the current scene, declared first so it is freed last
 	hittable_list hworld;
 	camera cam;
 	uint8_t* pixels = nullptr;
+	std::vector<color> frame;			//linear pixel colors of the last render
+	std::vector<color> frame_albedo;	//first hit features, averaged over each pixel's samples
+	std::vector<vec3> frame_normal;
+	std::vector<float> frame_variance;	//of each pixel's mean luminance
+	// Per pixel sums over the full resolution passes so far, cleared by clear_sums() before
+	// the first pass; their pages belong to the node whose band they are in.
+	first_touch_buffer<color> color_sum, albedo_sum;
+	first_touch_buffer<vec3> normal_sum;
+	first_touch_buffer<double> luminance_sum, luminance_squares;
+	first_touch_buffer<int> sample_count;		//full resolution samples traced, a cancelled pass may stop partway
+	first_touch_buffer<vec3> position_sum;		//of the first hits
+	first_touch_buffer<int> hit_count;			//samples whose first ray hit a surface
+	first_touch_buffer<float> history_weight;	//samples' worth of reprojected history in color_sum
+
+	// The previous view's accumulation, kept by render() when only the camera moved.
+	camera history_camera;
+	bool reprojecting = false;
+	std::vector<color> history_color;
+	std::vector<point3> history_position;
+	std::vector<vec3> history_normal;
+	std::vector<float> history_samples;	//0 where the pixel has no usable history
+	std::vector<int> splat_source;		//history pixel shown in each pixel until it is traced, or -1
 	bvh_node bvh;
+	compiled_scene scene;	//what the tiles actually traverse when use_compiled_scene is set
+	bool traverse_compiled = true;	//use_compiled_scene, or a scene file which only exists compiled
+	light_set poly_lights;	//lights of the bvh path, the compiled scene keeps its own
+	environment env;
+	shared_ptr<environment_map> env_map;	//kept across scenes, reloaded when env_path changes
+	std::string env_map_path;
+	std::vector<std::future<void>> tile_futures;	//guarded by tile_mutex, finishing passes queue the next one
+	std::unique_ptr<ThreadPool> pool;
+	int pool_size = 0;
+	render_stats stats;
+	double trace_start = 0;
+	ray_stats frame_counters;	//guarded by tile_mutex
+	first_touch_buffer<float> node_sum, primitive_sum;	//per pixel over its samples, for the heatmaps
+	std::vector<double> tile_seconds;	//per tile over all passes, guarded by tile_mutex
+	std::vector<uint8_t> image_pixels;	//the finished image while a heatmap is shown
+	bool frame_done = false;			//guarded by tile_mutex
+	std::string heatmap_legend;
+	bvh_outline outline;		//of the current scene's bvh, copied on first use, guarded by tile_mutex
+	bool outline_built = false;
+	long long paths_traced = 0;	//guarded by tile_mutex
+
+	// One sweep over all tiles. The next pass is queued when the last tile of the previous one finishes.
+	struct render_pass {
+		int scale;		//side of the pixel blocks sharing one sample, 1 for full resolution
+		int samples;	//per pixel or block
+		int total;		//full resolution samples per pixel once the pass is done
+	};
+	std::vector<render_pass> passes;
+
+	// One tile of one pass. Its rows (of preview blocks in a preview pass) are claimed one at
+	// a time, so threads without a tile of their own can join it.
+	struct tile_job {
+		int x0 = 0, y0 = 0, x1 = 0, y1 = 0;	//pixels, the end excluded
+		int cell = 0;		//index in tile_seconds
+		int rows = 0;
+		std::atomic<int> next_row{ 0 };
+		int workers = 0;	//threads on it, guarded by tile_mutex
+		bool done = false;	//guarded by tile_mutex
+	};
+	// The tiles of a pass grouped by band, each band in tile_order.
+	struct tile_queue {
+		std::unique_ptr<tile_job[]> tiles;
+		int count = 0;
+		int bands = 1;
+		std::vector<int> band_begin;	//tiles of band b are [band_begin[b], band_begin[b + 1])
+		std::unique_ptr<std::atomic<int>[]> band_next;	//first tile of each band nobody has claimed
+	};
+	std::vector<std::unique_ptr<tile_queue>> tile_queues;	//one per pass
+	std::vector<worker_placement> placement;	//of each worker slot, used with numa_placement
+	int bands = 1;				//nodes with their own band of rows, 1 without numa_placement 2
+	std::vector<std::unique_ptr<compiled_scene>> node_scenes;	//per node copies of scene, numa_placement 2
+	bool node_scenes_stale = true;
+	int tile_size = 16;			//tileSize, or the one chosen for this render
+	int x_tiles = 0, y_tiles = 0;
+	double tail_start = 0;
+	std::atomic<unsigned> generation{ 0 };	//bumped to drop the tiles of a stale render
+
+	scene_settings built;	//what the current scene was built from
+	bool scene_built = false;
+	bool scene_dirty = false;
+	vec3 view_up = vup;			//camera up and shutter interval of the current scene
+	double shutter_open = 0, shutter_close = 1;
+
+	shared_ptr<hittable> tree;	//bottom level shared by every forest instance
+	shared_ptr<top_level_bvh> forest;
+
+	//side of a (possibly truncated) cone around the y axis
+	static void add_cone(mesh_data& mesh, double y0, double y1, double r0, double r1, int segments) {
+		int base = static_cast<int>(mesh.positions.size());
+		for (int i = 0; i < segments; i++) {
+			auto phi = 2 * pi * i / segments;
+			mesh.positions.push_back(point3(r0 * cos(phi), y0, r0 * sin(phi)));
+			mesh.positions.push_back(point3(r1 * cos(phi), y1, r1 * sin(phi)));
+		}
+		for (int i = 0; i < segments; i++) {
+			int a = base + 2 * i, b = base + 2 * ((i + 1) % segments);
+			int corners[6] = { a, a + 1, b + 1, a, b + 1, b };
+			mesh.position_indices.insert(mesh.position_indices.end(), corners, corners + 6);
+		}
+	}
 
 public:
 
+	void update_environment_map() {
+		if (env_map_path == env_path)
+			return;
+		env_map_path = env_path;
+		env_map.reset();
+		if (env_map_path.empty())
+			return;
+		double start = seconds_now();
+		auto map = make_shared<environment_map>();
+		if (map->load(env_map_path)) {
+			env_map = map;
+			std::cout << "environment map: " << map->width << "x" << map->height << " loaded in " << seconds_now() - start << "s" << std::endl;
+		}
+	}
+
 	bvh_node setBVH() {
+		RT_PROFILE_ZONE("bvh build");
 		bvh_node _bvh = bvh_node(hworld,0.0,1.0);
 		return _bvh;
 	}
 
-	void write_color(color pixel_color, int i, int j)
+	void write_color(color pixel_color, int i, int j, double samples = samples_per_pixel)
 	{
 		auto r = pixel_color.x();
 		auto g = pixel_color.y();
 		auto b = pixel_color.z();
 
 		// Divide the color by the number of samples and gamma-correct for gamma=2.0.
-		auto scale = 1.0 / samples_per_pixel;
+		auto scale = 1.0 / samples;
 		r = sqrt(scale * r);
 		g = sqrt(scale * g);
 		b = sqrt(scale * b);
@@ -87,24 +495,197 @@ public:
 		pixels[index * 4 + 3] = 255;
 	}
 
+	template <class scene_type>
+	color sample(const ray& r, const scene_type& world, first_hit* features = nullptr) const {
+		return render_mode == 1 ? ray_color_ao(r, world, ao_samples, ao_distance, features) : ray_color(r, world, max_depth, features);
+	}
+
+	// Filters the finished frame of the render numbered gen and writes it over the noisy pixels.
+	// Called with tile_mutex held, which is let go while the filter runs on copies of the frame
+	// buffers so last_stats() and the window don't wait for it. False if another render started
+	// meanwhile.
+	bool denoise_frame(unsigned gen, std::unique_lock<std::mutex>& lock) {
+		RT_PROFILE_ZONE("denoise");
+		double start = seconds_now();
+		std::vector<color> image = frame, albedo = frame_albedo;
+		std::vector<vec3> normal = frame_normal;
+		std::vector<float> variance = frame_variance;
+		int width = image_width, height = image_height;
+		denoise_settings settings;
+		settings.iterations = denoise_iterations;
+		std::vector<color> result;
+		lock.unlock();
+		denoise(image, albedo, normal, variance, width, height, result, settings);
+		lock.lock();
+		if (generation != gen)
+			return false;
+		for (int j = 0; j < height; j++) {
+			for (int i = 0; i < width; i++)
+				write_color(result[size_t(j) * width + i], i, j, 1);
+		}
+		stats.denoise_seconds = seconds_now() - start;
+		std::cout << "denoised in " << stats.denoise_seconds << "s." << std::endl;
+		return true;
+	}
+
 	hittable_list two_sphere() {
 		hittable_list objects;
-		auto checker = make_shared<checker_texture>(color(0.2,0.3,0.1) , color(0.9));
+		auto checker = scene_make_shared<checker_texture>(color(0.2,0.3,0.1) , color(0.9));
 
-		objects.add(make_shared<sphere>(point3(0.-10.0), 10,make_shared<lambertian>(checker)));
-		objects.add(make_shared<sphere>(point3(0,10,0),10,make_shared<lambertian>(checker)));
+		objects.add(scene_make_shared<sphere>(point3(0.-10.0), 10,scene_make_shared<lambertian>(checker)));
+		objects.add(scene_make_shared<sphere>(point3(0,10,0),10,scene_make_shared<lambertian>(checker)));
 
 		return objects;
 	}
 
+	//a loaded OBJ mesh standing on the checker ground, scaled to fit a 2 unit box
+	hittable_list mesh_scene() {
+		hittable_list objects;
+		auto checker = scene_make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+		objects.add(scene_make_shared<sphere>(point3(0, -1000, 0), 1000, scene_make_shared<lambertian>(checker)));
+
+		auto mesh = load_obj(obj_path);
+		if (mesh) {
+			mesh->fit_to_box(point3(0, 1, 0), 2.0);
+			objects.add(scene_make_shared<triangle_mesh>(mesh, scene_make_shared<lambertian>(color(0.6, 0.6, 0.6))));
+			std::cout << "loaded " << obj_path << ": " << mesh->triangle_count() << " triangles" << std::endl;
+		}
+
+		return objects;
+	}
+
+	//an image mapped globe, as in the book, plus a tiled copy on the ground to exercise the mip levels
+	hittable_list earth_scene() {
+		hittable_list objects;
+		auto image = scene_make_shared<image_texture>(image_path);
+		auto ground = make_shared<mesh_data>();
+		const double half = 100, repeat = 40;
+		ground->positions = { point3(-half, 0, -half), point3(half, 0, -half), point3(half, 0, half), point3(-half, 0, half) };
+		ground->uvs = { vec3(0, 0, 0), vec3(repeat, 0, 0), vec3(repeat, repeat, 0), vec3(0, repeat, 0) };
+		ground->position_indices = { 0, 2, 1, 0, 3, 2 };
+		ground->uv_indices = ground->position_indices;
+		objects.add(scene_make_shared<triangle_mesh>(ground, scene_make_shared<lambertian>(image)));
+		objects.add(scene_make_shared<sphere>(point3(0, 2, 0), 2, scene_make_shared<lambertian>(image)));
+		return objects;
+	}
+
+	//the book's Cornell box: five walls, a ceiling light and two rotated boxes
+	hittable_list cornell_box() {
+		hittable_list objects;
+		auto red = scene_make_shared<lambertian>(color(.65, .05, .05));
+		auto white = scene_make_shared<lambertian>(color(.73, .73, .73));
+		auto green = scene_make_shared<lambertian>(color(.12, .45, .15));
+		auto light = scene_make_shared<diffuse_light>(color(15, 15, 15));
+
+		objects.add(scene_make_shared<quad>(point3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
+		objects.add(scene_make_shared<quad>(point3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
+		objects.add(scene_make_shared<quad>(point3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), light));
+		objects.add(scene_make_shared<quad>(point3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
+		objects.add(scene_make_shared<quad>(point3(555, 555, 555), vec3(-555, 0, 0), vec3(0, 0, -555), white));
+		objects.add(scene_make_shared<quad>(point3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
+
+		auto tall = make_box(point3(0, 0, 0), point3(165, 330, 165), white);
+		objects.add(scene_make_shared<instance>(tall, transform::translate(vec3(265, 0, 295)) * transform::rotate_y(15)));
+		auto small = make_box(point3(0, 0, 0), point3(165, 165, 165), white);
+		objects.add(scene_make_shared<instance>(small, transform::translate(vec3(130, 0, 65)) * transform::rotate_y(-18)));
+		return objects;
+	}
+
+	//a few thousand small downward facing lamps over a floor with some spheres, for the light BVH;
+	//the camera looks from above, so the lamps are only seen through what they light
+	hittable_list light_field() {
+		hittable_list objects;
+		auto floor_material = scene_make_shared<lambertian>(color(0.6, 0.6, 0.6));
+		objects.add(scene_make_shared<quad>(point3(-40, 0, 40), vec3(80, 0, 0), vec3(0, 0, -80), floor_material));
+
+		const int n = 48;
+		const double size = 0.15;
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < n; j++) {
+				point3 corner(-12 + 24.0 * (i + 0.8 * random_double()) / n, 2.5 + random_double(), -12 + 24.0 * (j + 0.8 * random_double()) / n);
+				auto lamp = scene_make_shared<diffuse_light>(8.0 * color::random(0.2, 1));
+				objects.add(scene_make_shared<quad>(corner, vec3(size, 0, 0), vec3(0, 0, size), lamp));
+			}
+		}
+		auto gray = scene_make_shared<lambertian>(color(0.5, 0.5, 0.5));
+		for (int k = 0; k < 12; k++) {
+			double angle = 2 * pi * k / 12;
+			objects.add(scene_make_shared<sphere>(point3(6 * cos(angle), 1, 6 * sin(angle)), 1, gray));
+		}
+		objects.add(scene_make_shared<sphere>(point3(0, 2, 0), 2, scene_make_shared<metal>(color(0.8, 0.8, 0.8), 0.05)));
+		return objects;
+	}
+
+	//low poly tree: trunk and foliage meshes under one bvh_node
+	shared_ptr<hittable> make_tree() {
+		auto trunk = make_shared<mesh_data>();
+		add_cone(*trunk, 0.0, 1.0, 0.15, 0.12, 12);
+		auto foliage = make_shared<mesh_data>();
+		add_cone(*foliage, 0.8, 2.0, 0.9, 0.5, 24);
+		add_cone(*foliage, 1.8, 3.2, 0.7, 0.0, 24);
+
+		hittable_list parts;
+		parts.add(make_shared<triangle_mesh>(trunk, make_shared<lambertian>(color(0.35, 0.2, 0.1))));
+		parts.add(make_shared<triangle_mesh>(foliage, make_shared<lambertian>(color(0.1, 0.4, 0.15))));
+		return make_shared<bvh_node>(parts, 0.0, 1.0);
+	}
+
+	//(re)place the forest instances from the ui parameters and rebuild only the top level
+	void update_forest() {
+		int n = forest_size < 1 ? 1 : forest_size;
+		if (forest->instances.size() != size_t(n) * n) {
+			forest->clear();
+			for (int k = 0; k < n * n; k++)
+				forest->add(make_shared<instance>(tree, transform()));
+		}
+
+		auto jitter = [](int i, int j, int k) {	//stable pseudo random value in [0,1) per tree
+			unsigned h = unsigned(i) * 73856093u ^ unsigned(j) * 19349663u ^ unsigned(k) * 83492791u;
+			h ^= h >> 13; h *= 0x5bd1e995u; h ^= h >> 15;
+			return (h & 0xffffff) / double(0x1000000);
+		};
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < n; j++) {
+				auto offset = (n - 1) * 0.5;
+				point3 position((i - offset + 0.6 * (jitter(i, j, 0) - 0.5)) * forest_spacing, 0,
+					(j - offset + 0.6 * (jitter(i, j, 1) - 0.5)) * forest_spacing);
+				auto xf = transform::translate(position) * transform::rotate_y(360 * jitter(i, j, 2) + forest_rotation)
+					* transform::scale(0.7 + 0.6 * jitter(i, j, 3));
+				forest->instances[i * n + j]->set_transform(xf);
+			}
+		}
+
+		auto start = seconds_now();
+		forest->rebuild();
+		std::cout << "forest: " << n * n << " instances, top level rebuilt in "
+			<< (seconds_now() - start) * 1000.0 << "ms" << std::endl;
+	}
+
+	hittable_list forest_scene() {
+		{
+			arena_scope heap(nullptr);	//the shared tree and the instances outlive the per-render arena
+			if (!forest) {
+				tree = make_tree();
+				forest = make_shared<top_level_bvh>();
+			}
+			update_forest();
+		}
+
+		hittable_list objects;
+		auto checker = scene_make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+		objects.add(scene_make_shared<sphere>(point3(0, -1000, 0), 1000, scene_make_shared<lambertian>(checker)));
+		objects.add(forest);
+		return objects;
+	}
+
 	hittable_list init_render()
 	{
 		hittable_list world;
 		// World
 		auto R = cos(pi / 4);
 
-		auto checker = make_shared<checker_texture>(color(0.2,0.3,0.1) , color(0.9,0.9,0.9));
-		world.add(make_shared<sphere>(point3(0, -1000, 0), 1000,make_shared<lambertian>(checker)));
+		auto checker = scene_make_shared<checker_texture>(color(0.2,0.3,0.1) , color(0.9,0.9,0.9));
+		world.add(scene_make_shared<sphere>(point3(0, -1000, 0), 1000,scene_make_shared<lambertian>(checker)));
 
 		for (int a = -11; a < 11; a++) {
 			for (int b = -11; b < 11; b++) {
@@ -117,44 +698,635 @@ public:
 					if (choose_mat < 0.8) {
 						// diffuse
 						auto albedo = color::random() * color::random();
-						sphere_material = make_shared<lambertian>(albedo);
+						sphere_material = scene_make_shared<lambertian>(albedo);
 						auto center2 = center + vec3(0, random_double(0, .5), 0);
-						world.add(make_shared<moving_sphere>(center , center2, 0.0, 1.0,0.2, sphere_material));
+						world.add(scene_make_shared<moving_sphere>(center , center2, 0.0, 1.0,0.2, sphere_material));
 					}
 					else if (choose_mat < 0.95) {
 						// metal
 						auto albedo = color::random(0.5, 1);
 						auto fuzz = random_double(0, 0.5);
-						sphere_material = make_shared<metal>(albedo, fuzz);
-						world.add(make_shared<sphere>(center, 0.2, sphere_material));
+						sphere_material = scene_make_shared<metal>(albedo, fuzz);
+						world.add(scene_make_shared<sphere>(center, 0.2, sphere_material));
 					}
 					else {
 						// glass
-						sphere_material = make_shared<dielectric>(1.5);
-						world.add(make_shared<sphere>(center, 0.2, sphere_material));
+						sphere_material = scene_make_shared<dielectric>(1.5);
+						world.add(scene_make_shared<sphere>(center, 0.2, sphere_material));
 					}
 				}
 			}
 		}
 
-		auto material1 = make_shared<dielectric>(1.5);
-		world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+		auto material1 = scene_make_shared<dielectric>(1.5);
+		world.add(scene_make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
 
-		auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-		world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+		auto material2 = scene_make_shared<lambertian>(color(0.4, 0.2, 0.1));
+		world.add(scene_make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
 
-		auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-		world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+		auto material3 = scene_make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
+		world.add(scene_make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
 
 		// Camera
 		cam.init(lookfrom, lookat, vup, vfov, aspect_ratio , aperture, dist_to_focus , 0.0,1.0);
 		return world;
 	}
 
-	void render(uint8_t* _pixels)
-	{
-		pixels = _pixels;
-		startTime = glfwGetTime();
+	~raytracer() {
+		cancel();
+	}
+
+	//block until every pass of the current render has finished
+	void wait() {
+		while (true) {
+			std::vector<std::future<void>> pending;
+			{
+				std::lock_guard<std::mutex> lock(tile_mutex);
+				pending.swap(tile_futures);
+			}
+			if (pending.empty())
+				return;
+			for (auto& tile : pending)
+				tile.wait();
+		}
+	}
+
+	//stop the current render: queued tiles return right away, running ones after their current row
+	void cancel() {
+		generation++;
+		wait();
+	}
+
+	// Quarter and half resolution previews with one sample, then full resolution passes of
+	// 1, 1, 2, 4, ... (at most 32) samples until samples_per_pixel is reached.
+	static std::vector<render_pass> progressive_passes(int samples, bool previews) {
+		std::vector<render_pass> list;
+		if (previews)
+			list = { { 4, 1, 0 }, { 2, 1, 0 } };
+		int total = 0, chunk = 1;
+		while (total < samples) {
+			int n = std::min(chunk, samples - total);
+			total += n;
+			list.push_back({ 1, n, total });
+			if (total > 1)
+				chunk = std::min(2 * chunk, 32);
+		}
+		return list;
+	}
+
+	// tileSize rounded up to whole preview blocks, or with 0 the largest power of two from 8
+	// to 64 that still gives each thread 16 tiles
+	int choose_tile_size(int threads) const {
+		if (tileSize > 0)
+			return (tileSize + 3) / 4 * 4;
+		int size = 64;
+		while (size > 8 && double(image_width) * image_height < 16.0 * threads * size * size)
+			size /= 2;
+		return size;
+	}
+
+	// x, y of the d-th cell of a Hilbert curve over an n by n grid, n a power of two
+	static void hilbert_cell(int n, int d, int& x, int& y) {
+		x = y = 0;
+		for (int s = 1; s < n; s *= 2) {
+			int rx = 1 & (d / 2), ry = 1 & (d ^ rx);
+			if (ry == 0) {
+				if (rx == 1) {
+					x = s - 1 - x;
+					y = s - 1 - y;
+				}
+				std::swap(x, y);
+			}
+			x += s * rx;
+			y += s * ry;
+			d /= 4;
+		}
+	}
+
+	// the tiles of a columns by rows grid in the given order
+	static std::vector<std::pair<int, int>> tile_sequence(int columns, int rows, int order) {
+		std::vector<std::pair<int, int>> cells;
+		if (order == tile_order_hilbert) {
+			int n = 1;
+			while (n < columns || n < rows)
+				n *= 2;
+			for (int d = 0; d < n * n; d++) {
+				int x, y;
+				hilbert_cell(n, d, x, y);
+				if (x < columns && y < rows)
+					cells.push_back({ x, y });
+			}
+			return cells;
+		}
+		for (int x = 0; x < columns; x++) {
+			for (int y = 0; y < rows; y++)
+				cells.push_back({ x, y });
+		}
+		if (order == tile_order_spiral) {
+			// ring by ring from the center, each ring counterclockwise
+			auto key = [&](const std::pair<int, int>& c) {
+				double dx = c.first + 0.5 - columns * 0.5, dy = c.second + 0.5 - rows * 0.5;
+				return std::make_pair(floor(fmax(fabs(dx), fabs(dy))), atan2(dy, dx));
+			};
+			std::stable_sort(cells.begin(), cells.end(), [&](const auto& a, const auto& b) { return key(a) < key(b); });
+		}
+		return cells;
+	}
+
+	// Splits the image into tiles and queues them for every pass; called before the first pass starts.
+	void queue_tiles(int threads) {
+		tile_size = choose_tile_size(threads);
+		x_tiles = (image_width + tile_size - 1) / tile_size;
+		y_tiles = (image_height + tile_size - 1) / tile_size;
+		tile_seconds.assign(size_t(x_tiles) * y_tiles, 0.0);
+		std::vector<std::pair<int, int>> cells = tile_sequence(x_tiles, y_tiles, tile_order);
+		auto band_of = [&](const std::pair<int, int>& cell) { return cell.second * bands / y_tiles; };
+		std::stable_sort(cells.begin(), cells.end(), [&](const auto& a, const auto& b) { return band_of(a) < band_of(b); });
+		tile_queues.clear();
+		for (const render_pass& pass : passes) {
+			auto queue = std::make_unique<tile_queue>();
+			queue->count = static_cast<int>(cells.size());
+			queue->tiles.reset(new tile_job[cells.size()]);
+			queue->bands = bands;
+			queue->band_begin.assign(bands + 1, queue->count);
+			queue->band_next.reset(new std::atomic<int>[bands]);
+			for (int b = bands - 1; b >= 0; b--) {
+				for (int k = 0; k < queue->count; k++) {
+					if (band_of(cells[k]) == b) {
+						queue->band_begin[b] = k;
+						break;
+					}
+				}
+				queue->band_begin[b] = std::min(queue->band_begin[b], queue->band_begin[b + 1]);
+				queue->band_next[b] = queue->band_begin[b];
+			}
+			for (size_t k = 0; k < cells.size(); k++) {
+				tile_job& job = queue->tiles[k];
+				job.x0 = cells[k].first * tile_size;
+				job.y0 = cells[k].second * tile_size;
+				job.x1 = std::min(job.x0 + tile_size, image_width);
+				job.y1 = std::min(job.y0 + tile_size, image_height);
+				job.cell = cells[k].second * x_tiles + cells[k].first;
+				job.rows = (job.y1 - job.y0 + pass.scale - 1) / pass.scale;
+			}
+			tile_queues.push_back(std::move(queue));
+		}
+	}
+
+	// the copy of the compiled scene on the calling worker's node, or the scene itself
+	const compiled_scene& node_scene() const {
+		int node = thread_numa_node();
+		return node >= 0 && node < static_cast<int>(node_scenes.size()) ? *node_scenes[node] : scene;
+	}
+
+	// Runs f(node) on a worker pinned to each node with a band and waits for all of them.
+	template <typename F>
+	void on_each_node(F f) {
+		std::vector<std::future<void>> done;
+		for (int node = 0; node < bands; node++) {
+			done.push_back(pool->enqueue([this, node, f] {
+				pin_thread(placement[node].node, placement[node].cpu);	//slots 0 to nodes - 1 are one per node, in order
+				f(node);
+			}));
+		}
+		for (auto& d : done)
+			d.wait();
+	}
+
+	// Zeroes the per pixel sums, each band of rows from its own node.
+	void clear_sums() {
+		auto clear = [this](size_t first, size_t last) {
+			color_sum.clear_range(first, last);
+			albedo_sum.clear_range(first, last);
+			normal_sum.clear_range(first, last);
+			luminance_sum.clear_range(first, last);
+			luminance_squares.clear_range(first, last);
+			sample_count.clear_range(first, last);
+			position_sum.clear_range(first, last);
+			hit_count.clear_range(first, last);
+			history_weight.clear_range(first, last);
+			node_sum.clear_range(first, last);
+			primitive_sum.clear_range(first, last);
+		};
+		if (bands == 1) {
+			clear(0, frame.size());
+			return;
+		}
+		// the rows of the tiles in each band
+		on_each_node([&](int node) {
+			int first_row = std::min(image_height, (node * y_tiles + bands - 1) / bands * tile_size);
+			int last_row = std::min(image_height, ((node + 1) * y_tiles + bands - 1) / bands * tile_size);
+			clear(size_t(first_row) * image_width, size_t(last_row) * image_width);
+		});
+	}
+
+	// Traces row j (of blocks, in a preview pass) of the tile; returns the camera samples taken.
+	long long render_row(const render_pass& pass, const tile_job& job, int j, double ds, double dt) {
+		const compiled_scene& world = node_scene();
+		long long paths = 0;
+		for (int i = job.x0; i < job.x1; i += pass.scale)
+		{
+			if (pass.scale > 1) {
+				// preview: one color for the whole block, not accumulated
+				color block_color(0, 0, 0);
+				for (int s = 0; s < pass.samples; s++) {
+					random_sample(size_t(j) * image_width + i, s);
+					auto u = (i + random_double() * pass.scale) / (image_width - 1);
+					auto v = (j + random_double() * pass.scale) / (image_height - 1);
+					ray r = use_ray_differentials ? cam.get_ray(u, v, ds, dt) : cam.get_ray(u, v);
+					block_color += traverse_compiled ? sample(r, world) : sample(r, polymorphic_scene{ bvh, &poly_lights, &env, light_sampling > 0 });
+				}
+				for (int y = j; y < std::min(j + pass.scale, image_height); y++) {
+					for (int x = i; x < std::min(i + pass.scale, image_width); x++)
+						write_color(block_color, x, y, pass.samples);
+				}
+				paths += pass.samples;
+				continue;
+			}
+
+			size_t index = size_t(j) * image_width + i;
+			long long primitives_before = thread_ray_stats().primitive_tests;
+			for (int s = 0; s < pass.samples; s++) {	//һؽжβ
+				random_sample(index, pass.total - pass.samples + s);	//the same numbers whatever the pass layout
+				auto u = (i + random_double()) / (image_width - 1);	//uvֵ0~1֮䣬һΪһڽ
+				auto v = (j + random_double()) / (image_height - 1);	//-1Ϊ±Ǵ0ʼģimageĿҪ-1ͬ
+				ray r = use_ray_differentials ? cam.get_ray(u, v, ds, dt) : cam.get_ray(u, v);	//һ
+				first_hit features;
+				color sample_color = traverse_compiled ? sample(r, world, &features) : sample(r, polymorphic_scene{ bvh, &poly_lights, &env, light_sampling > 0 }, &features);	//ɫֵ+һƽ
+				color_sum[index] += sample_color;
+				double l = luminance(sample_color);
+				luminance_sum[index] += l;
+				luminance_squares[index] += l * l;
+				albedo_sum[index] += features.albedo;
+				normal_sum[index] += features.normal;
+				if (features.hit) {
+					position_sum[index] += features.position;
+					hit_count[index]++;
+				}
+				node_sum[index] += features.nodes;
+			}
+			primitive_sum[index] += static_cast<float>(thread_ray_stats().primitive_tests - primitives_before);
+			sample_count[index] += pass.samples;
+			paths += pass.samples;
+			if (reprojecting && pass.total == pass.samples)
+				reuse_history(index);
+			write_color(color_sum[index], i, j, pass.total + history_weight[index]);
+		}
+		return paths;
+	}
+
+	// Traces rows of one tile of passes[pass_index] for the render numbered gen until none is
+	// left; other threads may be claiming rows of the same tile. The thread that leaves a
+	// tile last completes it.
+	void render_tile(unsigned gen, int pass_index, tile_job& job) {
+		const render_pass& pass = passes[pass_index];
+		RT_PROFILE_ZONE(pass.scale > 1 ? "preview tile" : "tile");
+		{
+			std::lock_guard<std::mutex> lock(tile_mutex);
+			job.workers++;
+		}
+		thread_ray_stats() = ray_stats();
+		long long paths = 0;
+		double tile_start = seconds_now();
+		// one pixel (or preview block) step in camera coordinates, narrowed for the samples that share the pixel
+		double spread = use_ray_differentials ? fmax(0.125, 1.0 / sqrt(double(samples_per_pixel))) * pass.scale : 0.0;
+		double ds = spread / (image_width - 1), dt = spread / (image_height - 1);
+		for (int row = job.next_row++; row < job.rows; row = job.next_row++) {
+			if (generation != gen)
+				return;
+			paths += render_row(pass, job, job.y0 + row * pass.scale, ds, dt);
+		}
+
+		std::unique_lock<std::mutex> lock(tile_mutex);
+		if (generation != gen)
+			return;
+		frame_counters.add(thread_ray_stats());
+		paths_traced += paths;
+		double now = seconds_now();
+		tile_seconds[job.cell] += now - tile_start;
+		if (--job.workers > 0 || job.done)
+			return;
+		job.done = true;
+		finishedTileCount++;
+		if (pass_index + 1 == static_cast<int>(passes.size()) && finishedTileCount == (totalTileCount * 95 + 99) / 100)
+			tail_start = now;
+		if (finishedTileCount < totalTileCount)
+			return;
+		if (pass_index + 1 < static_cast<int>(passes.size()))
+			start_pass(gen, pass_index + 1);
+		else
+			finish_frame(gen, lock);
+	}
+
+	// The running tile with the most rows left, for a thread that found the queue empty.
+	static tile_job* busiest_tile(tile_queue& queue) {
+		tile_job* busiest = nullptr;
+		int most = 0;
+		for (int k = 0; k < queue.count; k++) {
+			int left = queue.tiles[k].rows - queue.tiles[k].next_row;
+			if (left > most) {
+				most = left;
+				busiest = &queue.tiles[k];
+			}
+		}
+		return busiest;
+	}
+
+	// The next tile nobody has claimed, from the home band first.
+	static tile_job* claim_tile(tile_queue& queue, int home) {
+		for (int b = 0; b < queue.bands; b++) {
+			int band = (home + b) % queue.bands;
+			if (queue.band_next[band] >= queue.band_begin[band + 1])
+				continue;
+			int k = queue.band_next[band]++;
+			if (k < queue.band_begin[band + 1])
+				return &queue.tiles[k];
+		}
+		return nullptr;
+	}
+
+	// One worker's share of passes[pass_index]: tiles of its node's band, then of the other
+	// bands, then with split_tiles the rows left in the busiest running tile, until the pass
+	// has nothing left to claim.
+	void render_pass_tiles(unsigned gen, int pass_index, int slot) {
+		if (numa_placement > 0)
+			pin_thread(placement[slot].node, placement[slot].cpu);
+		else
+			unpin_thread();	//pinned by an earlier render, and would still pick a node's scene copy
+		int home = bands > 1 ? placement[slot].node : 0;
+		tile_queue& queue = *tile_queues[pass_index];
+		while (generation == gen) {
+			tile_job* job = claim_tile(queue, home);
+			if (!job && split_tiles)
+				job = busiest_tile(queue);
+			if (!job)
+				return;
+			render_tile(gen, pass_index, *job);
+		}
+	}
+
+	// Queues a worker per thread (or per tile, if fewer) for passes[pass_index]; called with tile_mutex held.
+	void start_pass(unsigned gen, int pass_index) {
+		totalTileCount = tile_queues[pass_index]->count;	//ܹжٿ
+		finishedTileCount = 0;	//ѾС
+		int workers = std::min(pool_size, totalTileCount);
+		for (int w = 0; w < workers; w++)
+			tile_futures.push_back(pool->enqueue(&raytracer::render_pass_tiles, this, gen, pass_index, w));
+	}
+
+	// Turns the current accumulation into history for a render from a new view. Pixels whose
+	// samples did not all hit a surface (the background, silhouettes) get none; pixels a
+	// cancelled render never reached keep the history splatted into them, so quick
+	// successive moves do not lose it.
+	void keep_history() {
+		size_t count = color_sum.size();
+		std::vector<color> colors(count, color(0, 0, 0));
+		std::vector<point3> positions(count, point3(0, 0, 0));
+		std::vector<vec3> normals(count, vec3(0, 0, 0));
+		std::vector<float> samples(count, 0.0f);
+		for (size_t index = 0; index < count; index++) {
+			int n = sample_count[index];
+			int q = index < splat_source.size() ? splat_source[index] : -1;
+			if (n == 0 && q >= 0) {
+				colors[index] = history_color[q];
+				positions[index] = history_position[q];
+				normals[index] = history_normal[q];
+				samples[index] = history_samples[q];
+			}
+			if (n == 0 || hit_count[index] != n)
+				continue;
+			double total = n + history_weight[index];
+			colors[index] = color_sum[index] / total;
+			positions[index] = position_sum[index] / n;
+			normals[index] = normal_sum[index] / n;
+			samples[index] = static_cast<float>(total);
+		}
+		history_color.swap(colors);
+		history_position.swap(positions);
+		history_normal.swap(normals);
+		history_samples.swap(samples);
+		history_camera = cam;
+	}
+
+	// Splats the history into the new view so the display moves with the camera at once;
+	// the first full resolution pass then replaces it pixel by pixel.
+	void show_history() {
+		std::vector<double> depth(history_samples.size(), infinity);
+		splat_source.assign(history_samples.size(), -1);
+		for (size_t q = 0; q < history_samples.size(); q++) {
+			double s, t;
+			if (history_samples[q] <= 0 || !cam.project(history_position[q], s, t))
+				continue;
+			int i = static_cast<int>(floor(s * (image_width - 1))), j = static_cast<int>(floor(t * (image_height - 1)));
+			if (i < 0 || i >= image_width || j < 0 || j >= image_height)
+				continue;
+			size_t index = size_t(j) * image_width + i;
+			double d = (history_position[q] - cam.position()).length_squared();
+			if (d < depth[index]) {
+				depth[index] = d;
+				splat_source[index] = static_cast<int>(q);
+				write_color(history_color[q], i, j, 1);
+			}
+		}
+	}
+
+	// Adds the history of a pixel once its first samples are in: its mean first hit is
+	// looked up in the previous view, and that pixel's color is reused if it saw the same
+	// surface (positions within 1% of the distance, normals within about 25 degrees). The
+	// weight is capped at history_limit so view dependent shading catches up.
+	void reuse_history(size_t index) {
+		int n = sample_count[index];
+		if (hit_count[index] != n)
+			return;
+		point3 p = position_sum[index] / n;
+		double s, t;
+		if (!history_camera.project(p, s, t))
+			return;
+		int hi = static_cast<int>(floor(s * (image_width - 1))), hj = static_cast<int>(floor(t * (image_height - 1)));
+		if (hi < 0 || hi >= image_width || hj < 0 || hj >= image_height)
+			return;
+		size_t q = size_t(hj) * image_width + hi;
+		if (history_samples[q] <= 0)
+			return;
+		if ((history_position[q] - p).length() > 0.01 * (p - history_camera.position()).length())
+			return;
+		vec3 a = normal_sum[index] / n, b = history_normal[q];
+		if (dot(a, b) < 0.9 * a.length() * b.length())
+			return;
+		float w = std::min(history_samples[q], static_cast<float>(std::max(0, history_limit)));
+		color_sum[index] += w * history_color[q];
+		history_weight[index] = w;
+	}
+
+	// Averages the sums into the frame buffers after the last pass of the render numbered gen;
+	// called with tile_mutex held, which denoise_frame() lets go of for a while.
+	void finish_frame(unsigned gen, std::unique_lock<std::mutex>& lock) {
+		RT_PROFILE_ZONE("finish frame");
+		double n = passes.back().total;
+		for (size_t index = 0; index < frame.size(); index++) {
+			frame[index] = color_sum[index] / (n + history_weight[index]);
+			frame_albedo[index] = albedo_sum[index] / n;
+			frame_normal[index] = normal_sum[index] / n;
+			double mean_luminance = luminance_sum[index] / n;
+			frame_variance[index] = static_cast<float>(fmax(0.0, luminance_squares[index] / n - mean_luminance * mean_luminance) / n);
+		}
+		stats.trace_seconds = seconds_now() - trace_start;
+		stats.tail_seconds = seconds_now() - tail_start;
+		stats.counters = frame_counters;
+		stats.rays = frame_counters.rays();
+		stats.paths = paths_traced;
+		std::cout << "render async finished, spent " << seconds_now() - startTime << "s, the last 5% of tiles took "
+			<< stats.tail_seconds << "s." << std::endl;
+		write_ray_stats(std::cout, frame_counters);
+		if (denoise_output && !denoise_frame(gen, lock))
+			return;
+		texture_cache_stats ts = texture_cache::global().stats();
+		if (ts.textures > 0)
+			std::cout << "textures: " << ts.hits << " tile hits, " << ts.misses << " misses, " << ts.evictions
+				<< " evictions, " << ts.resident_bytes / 1024 << "KB of " << ts.budget_bytes / 1024 << "KB resident" << std::endl;
+		image_pixels.assign(pixels, pixels + frame.size() * 4);
+		frame_done = true;
+		present();
+	}
+
+	// The tree the tiles traverse in the layout bvh_quality.h reads; called with tile_mutex held.
+	const bvh_outline& scene_outline() {
+		if (!outline_built) {
+			if (traverse_compiled)
+				outline = outline_bvh(scene.nodes.data, scene.nodes.size(), scene.prims.size(),
+					[&](size_t i) { return scene.prim_box(i, shutter_open, shutter_close); });
+			else
+				outline = outline_bvh(bvh, 0.0, 1.0);
+			outline_built = true;
+		}
+		return outline;
+	}
+
+	// Values of a heatmap of the last render per pixel, bottom row first like the image.
+	std::vector<float> heatmap_values(int kind) const {
+		std::vector<float> values(sample_count.size(), 0.0f);
+		for (size_t index = 0; index < values.size(); index++) {
+			int n = sample_count[index];
+			switch (kind) {
+			case heatmap_nodes:
+				values[index] = n > 0 ? node_sum[index] / n : 0.0f;
+				break;
+			case heatmap_primitives:
+				values[index] = n > 0 ? primitive_sum[index] / n : 0.0f;
+				break;
+			case heatmap_samples:
+				values[index] = n + history_weight[index];
+				break;
+			case heatmap_tile_time: {
+				int i = static_cast<int>(index % image_width), j = static_cast<int>(index / image_width);
+				values[index] = static_cast<float>(1000 * tile_seconds[size_t(j / tile_size) * x_tiles + i / tile_size]);
+				break;
+			}
+			}
+		}
+		return values;
+	}
+
+	static const char* heatmap_name(int kind) {
+		static const char* names[heatmap_count] = { "image", "nodes", "primitives", "samples", "tile_time" };
+		return kind >= 0 && kind < heatmap_count ? names[kind] : "";
+	}
+
+	// Shows the image or the selected heatmap with the selected bvh boxes over it; called with
+	// tile_mutex held once the frame is done.
+	void present() {
+		if (heatmap > heatmap_none && heatmap < heatmap_count) {
+			show_heatmap();
+		}
+		else {
+			std::copy(image_pixels.begin(), image_pixels.end(), pixels);
+			heatmap_legend.clear();
+		}
+		if (bvh_box_depth >= 0)
+			draw_bvh_boxes(scene_outline(), bvh_box_depth, cam, pixels, image_width, image_height);
+	}
+
+	// Writes the selected heatmap over the image.
+	void show_heatmap() {
+		static const char* units[heatmap_count] = { "", "bvh nodes per camera ray", "primitive tests per sample",
+			"samples per pixel", "ms per tile" };
+		std::vector<float> values = heatmap_values(heatmap);
+		std::vector<uint8_t> rgba;
+		heatmap_colors(values, rgba);
+		std::copy(rgba.begin(), rgba.end(), pixels);
+		std::ostringstream legend;
+		legend << "0 to " << heatmap_max(values) << " " << units[heatmap];
+		heatmap_legend = legend.str();
+		std::cout << "heatmap: " << heatmap_legend << std::endl;
+	}
+
+	// Shows the heatmap and bvh boxes selected after the render finished; nothing while one runs.
+	void redisplay() {
+		std::lock_guard<std::mutex> lock(tile_mutex);
+		if (frame_done && image_pixels.size() == size_t(image_width) * image_height * 4)
+			present();
+	}
+
+	// Depth, leaf sizes, SAH cost, overlap and size of the bvh of the current scene.
+	bvh_quality scene_bvh_quality() {
+		std::lock_guard<std::mutex> lock(tile_mutex);
+		return analyze_bvh(scene_outline());
+	}
+
+	// range and unit of the heatmap on display, empty for the image
+	std::string heatmap_range() const {
+		std::lock_guard<std::mutex> lock(tile_mutex);
+		return heatmap_legend;
+	}
+
+	// Saves every heatmap of the last render as <base>_<name>.ppm (false color) and .pfm
+	// (the values). False if no render has finished or a file cannot be written.
+	bool save_heatmaps(const std::string& base) const {
+		std::lock_guard<std::mutex> lock(tile_mutex);
+		if (!frame_done)
+			return false;
+		bool ok = true;
+		for (int kind = heatmap_none + 1; kind < heatmap_count; kind++) {
+			std::vector<float> values = heatmap_values(kind);
+			std::vector<uint8_t> rgba;
+			heatmap_colors(values, rgba);
+			std::string path = base + "_" + heatmap_name(kind);
+			ok = write_ppm_bottom_up(path + ".ppm", rgba.data(), image_width, image_height)
+				&& write_pfm(path + ".pfm", values, image_width, image_height) && ok;
+		}
+		if (!ok)
+			std::cerr << "heatmap: cannot write " << base << "_*" << std::endl;
+		return ok;
+	}
+
+	//drop the previous scene, then bulk free everything it put in the arena
+	void release_scene() {
+		hworld.clear();
+		bvh = bvh_node();
+		scene.clear();
+		node_scenes.clear();
+		node_scenes_stale = true;
+		outline = bvh_outline();
+		outline_built = false;
+		poly_lights.clear();
+		arena.reset();
+	}
+
+	// Replaces the world with the one of pic_id, builds what the tiles traverse and resets
+	// the camera to the scene's default view.
+	void build_scene() {
+		RT_PROFILE_ZONE("build scene");
+		double start = seconds_now();
+		release_scene();
+		long long heap_allocations = heap_stats().allocations;
+		long long heap_live = heap_stats().live_bytes;
+		heap_stats().reset_peak();
+		arena_scope scope(use_scene_arena ? &arena : nullptr);
+
+		env = environment();
+		view_up = vup;
+		shutter_open = 0;
+		shutter_close = 1;
 
 		switch (pic_id) {
 			case 1:
@@ -163,7 +1335,6 @@ public:
 				lookat = point3(0);
 				vfov = 20.0;
 				aperture = 0.1;
-				cam.init(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
 				break;
 			case 2:
 				hworld = two_sphere();
@@ -171,65 +1342,298 @@ public:
 				lookat = point3(0);
 				vfov = 20.0;
 				aperture = 0.0;
-				cam.init(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
 				break;
+			case 3:
+				hworld = mesh_scene();
+				lookfrom = point3(6, 3, 6);
+				lookat = point3(0, 1, 0);
+				vfov = 30.0;
+				aperture = 0.0;
+				break;
+			case 4:
+				hworld = forest_scene();
+				lookfrom = point3(60, 25, 60);
+				lookat = point3(0, 0, 0);
+				vfov = 35.0;
+				aperture = 0.0;
+				break;
+			case 5:
+				hworld = earth_scene();
+				lookfrom = point3(13, 3, 3);
+				lookat = point3(0, 1.5, 0);
+				vfov = 25.0;
+				aperture = 0.0;
+				break;
+			case 6:
+				hworld = cornell_box();
+				env.sky = false;
+				lookfrom = point3(278, 278, -800);
+				lookat = point3(278, 278, 0);
+				vfov = 40.0;
+				aperture = 0.0;
+				break;
+			case 7:
+				hworld = light_field();
+				env.sky = false;
+				lookfrom = point3(0, 14, 18);
+				lookat = point3(0, 0, 0);
+				vfov = 40.0;
+				aperture = 0.0;
+				break;
+			case 8: {
+				compiled_scene_builder file(scene);
+				bool cached = false;
+				if (use_scene_cache)
+					load_scene_file_cached(scene_path, scene, file, &cached);
+				else
+					load_scene_file(scene_path, scene, file);
+				const scene_camera& view = file.view;
+				lookfrom = view.lookfrom;
+				lookat = view.lookat;
+				vfov = static_cast<float>(view.vfov);
+				aperture = static_cast<float>(view.aperture);
+				dist_to_focus = static_cast<float>(view.focus_distance);
+				if (file.has_environment) {
+					env.sky = file.env.sky;
+					env.flat = file.env.flat;
+					ground = file.env.ground;
+					snprintf(env_path, sizeof(env_path), "%s", file.env.map.c_str());
+					env_intensity = static_cast<float>(file.env.intensity);
+				}
+				view_up = view.vup;
+				shutter_open = view.time0;
+				shutter_close = view.time1;
+				std::cout << "loaded " << scene_path << (cached ? " from the scene cache" : "") << ": " << scene.prims.size()
+					<< " prims, " << scene.materials.size() << " materials in " << seconds_now() - start << "s" << std::endl;
+				break;
+			}
 		}
 
-		// world and camera
-		bvh = setBVH();
+		// a scene file is loaded straight into the compiled scene
+		traverse_compiled = use_compiled_scene || pic_id == 8;
+		if (pic_id != 8 && use_compiled_scene) {
+			RT_PROFILE_ZONE("compile scene");
+			scene.compile(hworld, 0.0, 1.0);
+		}
+		else if (!traverse_compiled) {
+			bvh = setBVH();
+			RT_PROFILE_ZONE("light build");
+			for (const auto& object : hworld.objects)
+				poly_lights.collect(object);
+			poly_lights.build();
+		}
 
-		int xTiles = (image_width + tileSize - 1) / tileSize;	// ΪС飬+Сsize-1Ϊһʣಿ
-		int yTiles = (image_height + tileSize - 1) / tileSize;
+		std::cout << "scene build: " << seconds_now() - start << "s";
+		if (use_scene_arena)
+			std::cout << ", arena: " << arena.allocation_count() << " objects in "
+				<< arena.bytes_reserved() / 1024 << "KB (" << arena.block_count() << " blocks)";
+#ifdef RT_TRACK_ALLOCATIONS
+		std::cout << ", heap: " << heap_stats().allocations - heap_allocations << " allocations, peak +"
+			<< (heap_stats().peak_bytes - heap_live) / 1024 << "KB";
+#else
+		(void)heap_allocations;
+		(void)heap_live;
+#endif
+		std::cout << std::endl;
+	}
 
-		totalTileCount = xTiles * yTiles;	//ܹжٿ
-		finishedTileCount = 0;	//ѾС
+	// complete once the last pass of the render has finished
+	render_stats last_stats() const {
+		std::lock_guard<std::mutex> lock(tile_mutex);
+		return stats;
+	}
 
-		//renderTileÿεãڲȾһС顣·enqueueݺ
-		auto renderTile = [&](int xTile, int yTile) {	//lambdaȾһС飬صʹ
-			int xStart = xTile * tileSize;
-			int yStart = yTile * tileSize;
-			for (int j = yStart; j < yStart + tileSize; j++)	//ʼһС
-			{
-				for (int i = xStart; i < xStart + tileSize; i++)
-				{
-					// bounds check
-					if (i >= image_width || j >= image_height)	//ǰС鳬ͼƬͲȾbreakΪˣ߻û꣩
-						continue;
-
-					color pixel_color(0, 0, 0);
-					for (int s = 0; s < samples_per_pixel; s++) {	//һؽжβ
-						auto u = (i + random_double()) / (image_width - 1);	//uvֵ0~1֮䣬һΪһڽ
-						auto v = (j + random_double()) / (image_height - 1);	//-1Ϊ±Ǵ0ʼģimageĿҪ-1ͬ
-						ray r = cam.get_ray(u, v);	//һ
-						pixel_color += ray_color(r, bvh, max_depth);	//ɫֵ+һƽ
-					}
+	// The next render() rebuilds the scene even if its settings did not change.
+	void invalidate_scene() {
+		scene_dirty = true;
+	}
 
-					write_color(pixel_color, i, j);
-				}
-			}
-			{
-				std::lock_guard<std::mutex> lock(tile_mutex);
-				finishedTileCount++;
-				if (finishedTileCount == totalTileCount)
-				{
-					std::cout << "render async finished, spent " << glfwGetTime() - startTime << "s." << std::endl;
-				}
+	// picture id 0 keeps whatever scene is loaded
+	bool scene_outdated(const scene_settings& settings) const {
+		return pic_id >= 1 && pic_id <= 8 && (!scene_built || scene_dirty || settings != built);
+	}
+
+	// Rebuilds the scene if asked to and applies the camera, lighting and sampling settings,
+	// which every render takes afresh; returns the build time, 0 when the scene was reused.
+	double update_scene(bool rebuild, const scene_settings& settings) {
+		double build_seconds = 0;
+		if (rebuild) {
+			double start = seconds_now();
+			build_scene();
+			build_seconds = seconds_now() - start;
+			built = settings;
+			scene_built = true;
+			scene_dirty = false;
+		}
+		texture_cache::global().set_budget(size_t(texture_budget_mb > 1 ? texture_budget_mb : 1) << 20);
+		texture_cache::global().reset_stats();
+
+		aspect_ratio = double(image_width) / image_height;
+		cam.init(lookfrom, lookat, view_up, vfov, aspect_ratio, aperture, dist_to_focus, shutter_open, shutter_close);
+		update_environment_map();
+		env.ground = ground;
+		env.map = env_map;
+		env.intensity = env_intensity;
+		scene.env = env;
+		scene.sample_lights = light_sampling > 0;
+		scene.lights.use_bvh = light_sampling == 2;
+		poly_lights.use_bvh = light_sampling == 2;
+		return build_seconds;
+	}
+
+	// Makes the pool render_threads threads (every core with 0) big; returns that count.
+	int resize_pool() {
+		int threads = render_threads > 0 ? render_threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+		if (!pool || pool_size != threads) {
+			pool.reset();	//joins the idle workers of the old size
+			pool.reset(new ThreadPool(threads));
+			pool_size = threads;
+		}
+		return threads;
+	}
+
+	// camera_moved: nothing but the camera changed since the last render, which lets
+	// temporal reprojection carry the accumulated samples over.
+	void render(uint8_t* _pixels, bool camera_moved = false)
+	{
+		cancel();	//tiles still in flight would write the frame below, or read a scene about to be rebuilt
+
+		// picture id 0 keeps whatever scene is loaded
+		scene_settings settings = current_scene_settings();
+		bool rebuild = scene_outdated(settings);
+		reprojecting = camera_moved && temporal_reprojection && render_mode == 0 && scene_built && !rebuild
+			&& sample_count.size() == size_t(image_width) * image_height && _pixels == pixels;
+		if (reprojecting)
+			keep_history();
+
+		pixels = _pixels;
+		startTime = seconds_now();
+		frame.assign(size_t(image_width) * image_height, color(0, 0, 0));
+		frame_albedo.assign(frame.size(), color(0, 0, 0));
+		frame_normal.assign(frame.size(), vec3(0, 0, 0));
+		frame_variance.assign(frame.size(), 0.0f);
+		color_sum.allocate(frame.size());	//cleared once the workers are placed
+		albedo_sum.allocate(frame.size());
+		normal_sum.allocate(frame.size());
+		luminance_sum.allocate(frame.size());
+		luminance_squares.allocate(frame.size());
+		sample_count.allocate(frame.size());
+		position_sum.allocate(frame.size());
+		hit_count.allocate(frame.size());
+		history_weight.allocate(frame.size());
+		node_sum.allocate(frame.size());
+		primitive_sum.allocate(frame.size());
+		frame_done = false;
+
+		stats = render_stats();
+		if (!rebuild && !scene_built) {
+			std::cout << "no scene loaded, choose a picture id from 1 to 8" << std::endl;
+			for (size_t i = 0; i < frame.size(); i++) {
+				pixels[i * 4] = pixels[i * 4 + 1] = pixels[i * 4 + 2] = 0;
+				pixels[i * 4 + 3] = 255;
 			}
-		};
+			return;
+		}
+		stats.build_seconds = update_scene(rebuild, settings);
 
-		for (int i = 0; i < xTiles; i++)
-		{
-			for (int j = 0; j < yTiles; j++)
-			{
-				pool.enqueue(renderTile, i, j);	//enqueueĺΪһָĲ
+		int samples = std::max(1, samples_per_pixel);
+		passes = progressive ? progressive_passes(samples, !reprojecting) : std::vector<render_pass>{ { 1, samples, samples } };
+		if (reprojecting)
+			show_history();
+		else
+			splat_source.clear();
+
+		int threads = resize_pool();
+		stats.threads = threads;
+		placement = place_workers(threads, numa_nodes().nodes());
+		bands = numa_placement >= 2 ? std::min(numa_nodes().nodes(), threads) : 1;
+		queue_tiles(threads);
+		clear_sums();
+		if (bands > 1 && traverse_compiled) {
+			if (node_scenes_stale || node_scenes.size() != size_t(bands)) {
+				node_scenes.clear();
+				node_scenes.resize(bands);
+				on_each_node([this](int node) {
+					node_scenes[node] = std::make_unique<compiled_scene>();
+					node_scenes[node]->copy_from(scene);
+				});
+				node_scenes_stale = false;
 			}
+			for (auto& copy : node_scenes) {
+				copy->env = scene.env;
+				copy->sample_lights = scene.sample_lights;
+				copy->lights.use_bvh = scene.lights.use_bvh;
+			}
+		}
+		else {
+			node_scenes.clear();
+		}
+		frame_counters = ray_stats();
+		paths_traced = 0;
+		trace_start = seconds_now();
+		std::lock_guard<std::mutex> lock(tile_mutex);
+		start_pass(generation, 0);
+	}
+
+	// Traces samples [first_sample, first_sample + samples) of the pixels in [x0, x1) x [y0, y1)
+	// on the pool and waits for them; rgb gets the sum of each pixel's colors, three floats
+	// per pixel, row by row from y0. Only the region is touched: the frame buffers, passes
+	// and finish_frame() of render() are left out. The samples are numbered as in a full
+	// render, so regions and sample ranges covering the image add up to its color sums.
+	render_stats render_region(int x0, int y0, int x1, int y1, int first_sample, int samples, std::vector<float>& rgb) {
+		cancel();	//a render in flight shares the scene and the pool
+		render_stats region_stats;
+		int width = std::max(0, x1 - x0), height = std::max(0, y1 - y0);
+		rgb.assign(size_t(width) * height * 3, 0.0f);
+		scene_settings settings = current_scene_settings();
+		bool rebuild = scene_outdated(settings);
+		if (!rebuild && !scene_built)
+			return region_stats;
+		region_stats.build_seconds = update_scene(rebuild, settings);
+		region_stats.threads = resize_pool();
+
+		double start = seconds_now();
+		double spread = use_ray_differentials ? fmax(0.125, 1.0 / sqrt(double(samples_per_pixel))) : 0.0;
+		double ds = spread / (image_width - 1), dt = spread / (image_height - 1);
+		std::atomic<int> next_row{ std::max(0, y0) };
+		int last_row = std::min(y1, image_height), first_column = std::max(0, x0), last_column = std::min(x1, image_width);
+		std::mutex counters_mutex;
+		std::vector<std::future<void>> done;
+		for (int w = 0; w < std::min(region_stats.threads, height); w++) {
+			done.push_back(pool->enqueue([&] {
+				thread_ray_stats() = ray_stats();
+				for (int j = next_row++; j < last_row; j = next_row++) {
+					for (int i = first_column; i < last_column; i++) {
+						size_t index = size_t(j) * image_width + i;
+						color sum(0, 0, 0);
+						for (int s = 0; s < samples; s++) {	//as render_row() draws them
+							random_sample(index, first_sample + s);
+							auto u = (i + random_double()) / (image_width - 1);
+							auto v = (j + random_double()) / (image_height - 1);
+							ray r = use_ray_differentials ? cam.get_ray(u, v, ds, dt) : cam.get_ray(u, v);
+							sum += traverse_compiled ? sample(r, scene) : sample(r, polymorphic_scene{ bvh, &poly_lights, &env, light_sampling > 0 });
+						}
+						float* out = &rgb[(size_t(j - y0) * width + (i - x0)) * 3];
+						for (int k = 0; k < 3; k++)
+							out[k] = static_cast<float>(sum[k]);
+					}
+				}
+				std::lock_guard<std::mutex> lock(counters_mutex);
+				region_stats.counters.add(thread_ray_stats());
+			}));
 		}
+		for (auto& d : done)
+			d.wait();
+		region_stats.trace_seconds = seconds_now() - start;
+		region_stats.rays = region_stats.counters.rays();
+		region_stats.paths = static_cast<long long>(std::max(0, last_column - first_column)) * std::max(0, last_row - std::max(0, y0)) * std::max(0, samples);
+		return region_stats;
 	}
 
 	void render_sync(uint8_t* _pixels)	//ͬ
 	{
 		//pixels = _pixels;
-		//startTime = glfwGetTime();
+		//startTime = seconds_now();
 
 		//// world and camera
 		//init_render();
@@ -249,6 +1653,6 @@ public:
 		//		write_color(pixel_color, i, j);
 		//	}
 		//}
-		std::cout << "render sync finished, spent " << glfwGetTime() - startTime << "s." << std::endl;
+		std::cout << "render sync finished, spent " << seconds_now() - startTime << "s." << std::endl;
 	}
 };
\ No newline at end of file
@@ -1,6 +1,7 @@
 #ifndef RTWEEKEND_H
 #define RTWEEKEND_H
 
+#include <chrono>
 #include <cmath>
 #include <limits>
 #include <memory>
@@ -23,11 +24,76 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
-//һʵ0~1
+// Random numbers come from a small generator per thread (PCG32, O'Neill 2014). Render
+// tiles restart it for every camera sample and bounce from a key of (seed, pixel, sample,
+// bounce), so a pixel draws the same numbers whichever thread traces it and in whatever
+// order: renders repeat bit for bit across runs and thread counts. Elsewhere, as while a
+// scene is built, the calling thread's sequence just continues from seed_random().
+struct pcg32 {
+    unsigned long long state = 0x853c49e6748fea9bULL;
+    unsigned long long inc = 0xda3e39cb94b95bdbULL;    //selects the stream, always odd
+
+    void seed(unsigned long long s, unsigned long long stream = 0) {
+        state = 0;
+        inc = (stream << 1) | 1;
+        next();
+        state += s;
+        next();
+    }
+
+    unsigned next() {
+        unsigned long long old = state;
+        state = old * 6364136223846793005ULL + inc;
+        unsigned xorshifted = static_cast<unsigned>(((old >> 18) ^ old) >> 27);
+        unsigned rot = static_cast<unsigned>(old >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+    }
+};
+
+inline pcg32& random_generator() {
+    thread_local pcg32 generator;
+    return generator;
+}
+
+inline unsigned& random_seed() {
+    static unsigned seed = 0;
+    return seed;
+}
+
+// key of the camera sample the calling thread is tracing
+inline unsigned long long& random_sample_key() {
+    thread_local unsigned long long key = 0;
+    return key;
+}
+
+// splitmix64 finalizer, spreads neighbouring pixels and samples over the whole key space
+inline unsigned long long mix_random_key(unsigned long long x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// sets the seed of the per-sample keys and restarts the calling thread's sequence
+inline void seed_random(unsigned seed) {
+    random_seed() = seed;
+    random_generator().seed(seed);
+}
+
+// Restarts the calling thread's numbers for sample number sample of pixel; the camera
+// ray draws from stream 0 and bounce b from stream b + 1 (see random_bounce()).
+inline void random_sample(unsigned long long pixel, unsigned long long sample) {
+    random_sample_key() = mix_random_key(mix_random_key(mix_random_key(random_seed()) + pixel) + sample);
+    random_generator().seed(random_sample_key(), 0);
+}
+
+inline void random_bounce(int bounce) {
+    random_generator().seed(random_sample_key(), static_cast<unsigned long long>(bounce) + 1);
+}
+
+// Returns a random real in [0,1).
 inline double random_double() {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);   //0~1֮ʵ
-    static std::mt19937 generator;  //һα
-    return distribution(generator);
+    return random_generator().next() * (1.0 / 4294967296.0);
 }
 
 
@@ -40,6 +106,11 @@ inline int random_int(int min, int max) {
     return static_cast<int>(random_double(min,max+1));
 }
 
+//monotonic wall clock in seconds, for timing reports
+inline double seconds_now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 inline double clamp(double x, double min, double max) {
     if (x < min) return min;
     if (x > max) return max;
@@ -48,6 +119,7 @@ inline double clamp(double x, double min, double max) {
 
 // Common Headers
 
+#include "arena.h"
 #include "ray.h"
 #include "vec3.h"
 
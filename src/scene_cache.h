@@ -0,0 +1,356 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "rtweekend.h"
+#include "mapped_file.h"
+#include "texture_cache.h"
+#include "compiled_scene.h"
+#include "scene_file.h"
+
+// Startup cache for scene files. The first load of a scene file writes the finished
+// compiled_scene (prims in BVH leaf order, the flat BVH, quads, materials, textures and the
+// light tree) together with the file's camera and environment to the temp directory. Later
+// loads, in this process or another one, map that file and point the scene's prim, node and
+// quad arrays straight into the mapping, so nothing is parsed and no BVH is built. Sections
+// are addressed by offsets from the start of the file and hold indices only, never
+// pointers, so the mapping may land anywhere. The name hashes the scene file's path, size
+// and modification time like the texture cache does; the header also records the cache
+// version and the size of every stored struct, and a file written by a different build is
+// rebuilt rather than misread. Scenes holding generic prims, materials or textures (meshes,
+// or classes outside the compiled set) cannot be written out and are always loaded normally.
+
+namespace scene_cache_detail {
+
+	const char cache_magic[4] = { 'R', 'T', 'S', 'C' };
+	const uint32_t cache_version = 1;
+	const uint64_t section_alignment = 64;
+
+	enum section_id {
+		sec_prims, sec_nodes, sec_quads, sec_materials, sec_textures,
+		sec_lights, sec_light_materials, sec_light_nodes, sec_light_trails,
+		sec_strings,	//image texture paths in texture order (empty for other kinds), then the environment map
+		section_count
+	};
+
+	struct section {
+		uint64_t offset;
+		uint64_t count;
+	};
+
+	struct file_header {
+		char magic[4];
+		uint32_t version;
+		uint64_t key;
+		uint32_t element_size[section_count];
+		uint32_t has_camera, has_environment;
+		section sections[section_count];
+		scene_camera camera;
+		color ground, flat;		//environment, its map path is the last string
+		double intensity;
+		uint32_t sky, pad;
+	};
+
+	static_assert(std::is_trivially_copyable<file_header>::value, "the header is written as raw bytes");
+	static_assert(std::is_trivially_copyable<compiled_prim>::value && std::is_trivially_copyable<flat_bvh_node>::value
+		&& std::is_trivially_copyable<compiled_quad>::value, "mapped sections are used in place");
+
+	inline void element_sizes(uint32_t* sizes) {
+		sizes[sec_prims] = sizeof(compiled_prim);
+		sizes[sec_nodes] = sizeof(flat_bvh_node);
+		sizes[sec_quads] = sizeof(compiled_quad);
+		sizes[sec_materials] = sizeof(compiled_material);
+		sizes[sec_textures] = sizeof(compiled_texture);
+		sizes[sec_lights] = sizeof(light_set::light);
+		sizes[sec_light_materials] = sizeof(int32_t);
+		sizes[sec_light_nodes] = sizeof(light_set::node);
+		sizes[sec_light_trails] = sizeof(uint64_t);
+		sizes[sec_strings] = 1;
+	}
+}
+
+class scene_cache {
+public:
+	// Cache file for a scene file and the key stored in it; empty if the scene file is missing.
+	static std::string cache_path(const std::string& scene_path, uint64_t& key);
+	// Whether save() can write the scene: no generic prims, materials or textures.
+	static bool cacheable(const compiled_scene& scene);
+
+	// Replaces scene with the cached one and sets the camera and environment of builder.
+	// Fails, leaving scene empty, if the file is missing, truncated or written for another key or build.
+	static bool load(const std::string& path, uint64_t key, compiled_scene& scene, compiled_scene_builder& builder);
+	static bool save(const std::string& path, uint64_t key, const compiled_scene& scene, const compiled_scene_builder& builder);
+
+	static std::string directory() {
+		std::error_code ec;
+		return (std::filesystem::temp_directory_path(ec) / "myraytracer_scenes").string();
+	}
+};
+
+std::string scene_cache::cache_path(const std::string& scene_path, uint64_t& key) {
+	namespace fs = std::filesystem;
+	using texture_cache_detail::fnv1a;
+	std::error_code ec;
+	auto size = fs::file_size(scene_path, ec);
+	if (ec)
+		return std::string();
+	auto mtime = fs::last_write_time(scene_path, ec).time_since_epoch().count();
+	std::string source = fs::absolute(scene_path, ec).string();
+	uint32_t version = scene_cache_detail::cache_version;
+
+	key = fnv1a(source.data(), source.size());
+	key = fnv1a(&size, sizeof(size), key);
+	key = fnv1a(&mtime, sizeof(mtime), key);
+	key = fnv1a(&version, sizeof(version), key);
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.rtsc", static_cast<unsigned long long>(key));
+	return (fs::path(directory()) / name).string();
+}
+
+bool scene_cache::cacheable(const compiled_scene& scene) {
+	return scene.objects.empty() && scene.generic_materials.empty() && scene.generic_textures.empty();
+}
+
+bool scene_cache::load(const std::string& path, uint64_t key, compiled_scene& scene, compiled_scene_builder& builder) {
+	using namespace scene_cache_detail;
+	scene.clear();
+	auto file = make_shared<mapped_file>();
+	if (!file->open(path) || file->length() < sizeof(file_header))
+		return false;
+	file_header header;
+	memcpy(&header, file->data(), sizeof(header));
+	uint32_t sizes[section_count];
+	element_sizes(sizes);
+	if (memcmp(header.magic, cache_magic, 4) != 0 || header.version != cache_version || header.key != key
+		|| memcmp(header.element_size, sizes, sizeof(sizes)) != 0)
+		return false;
+	for (int i = 0; i < section_count; i++) {
+		const section& s = header.sections[i];
+		if (s.offset % section_alignment != 0 || s.offset > file->length() || s.count > (file->length() - s.offset) / sizes[i])
+			return false;
+	}
+	auto at = [&](int i) { return file->data() + header.sections[i].offset; };
+	auto count = [&](int i) { return static_cast<size_t>(header.sections[i].count); };
+
+	// the strings come first: image textures are opened by path
+	std::vector<std::string> strings;
+	const char* text = at(sec_strings);
+	const char* text_end = text + count(sec_strings);
+	while (text < text_end) {
+		const char* end = static_cast<const char*>(memchr(text, 0, text_end - text));
+		if (!end)
+			return false;
+		strings.emplace_back(text, end);
+		text = end + 1;
+	}
+	if (strings.size() != count(sec_textures) + 1)
+		return false;
+
+	// materials and textures are few: copy them, and rebuild the objects lights evaluate
+	scene.textures.resize(count(sec_textures));
+	memcpy(scene.textures.data(), at(sec_textures), count(sec_textures) * sizeof(compiled_texture));
+	scene.materials.resize(count(sec_materials));
+	memcpy(scene.materials.data(), at(sec_materials), count(sec_materials) * sizeof(compiled_material));
+	std::vector<shared_ptr<texture>> textures;
+	for (size_t i = 0; i < scene.textures.size(); i++) {
+		compiled_texture& t = scene.textures[i];
+		if ((t.kind == tex_checker && (t.odd < 0 || t.odd >= static_cast<int>(i) || t.even < 0 || t.even >= static_cast<int>(i)))
+			|| t.kind == tex_generic)
+		{
+			scene.clear();
+			return false;
+		}
+		switch (t.kind) {
+		case tex_checker:
+			textures.push_back(make_shared<checker_texture>(textures[t.even], textures[t.odd]));
+			break;
+		case tex_image: {
+			auto image = make_shared<image_texture>(strings[i]);
+			t.object = image->handle;
+			textures.push_back(image);
+			break;
+		}
+		default:
+			textures.push_back(make_shared<solid_color>(t.value));
+			break;
+		}
+	}
+	for (const compiled_material& m : scene.materials) {
+		bool textured = m.kind == mat_lambertian || m.kind == mat_light;
+		if (m.kind == mat_generic || (textured && (m.texture < 0 || m.texture >= static_cast<int>(textures.size())))) {
+			scene.clear();
+			return false;
+		}
+		switch (m.kind) {
+		case mat_lambertian:
+			scene.material_sources.push_back(make_shared<lambertian>(textures[m.texture]));
+			break;
+		case mat_metal:
+			scene.material_sources.push_back(make_shared<metal>(m.albedo, m.fuzz));
+			break;
+		case mat_dielectric:
+			scene.material_sources.push_back(make_shared<dielectric>(m.ir));
+			break;
+		default:
+			scene.material_sources.push_back(make_shared<diffuse_light>(textures[m.texture]));
+			break;
+		}
+	}
+
+	light_set& lights = scene.lights;
+	lights.lights.resize(count(sec_lights));
+	memcpy(lights.lights.data(), at(sec_lights), count(sec_lights) * sizeof(light_set::light));
+	if (count(sec_light_materials) != lights.lights.size() || count(sec_light_trails) != lights.lights.size()) {
+		scene.clear();
+		return false;
+	}
+	const char* light_materials = at(sec_light_materials);
+	for (size_t i = 0; i < lights.lights.size(); i++) {
+		int32_t m;
+		memcpy(&m, light_materials + i * sizeof(m), sizeof(m));
+		if (m < 0 || m >= static_cast<int32_t>(scene.material_sources.size())) {
+			scene.clear();
+			return false;
+		}
+		lights.lights[i].mat = scene.material_sources[m].get();
+	}
+	lights.nodes.resize(count(sec_light_nodes));
+	memcpy(lights.nodes.data(), at(sec_light_nodes), count(sec_light_nodes) * sizeof(light_set::node));
+	lights.trails.resize(count(sec_light_trails));
+	memcpy(lights.trails.data(), at(sec_light_trails), count(sec_light_trails) * sizeof(uint64_t));
+
+	// the big arrays are used in place
+	scene.prims = array_view<compiled_prim>{ reinterpret_cast<const compiled_prim*>(at(sec_prims)), count(sec_prims) };
+	scene.nodes = array_view<flat_bvh_node>{ reinterpret_cast<const flat_bvh_node*>(at(sec_nodes)), count(sec_nodes) };
+	scene.quads = array_view<compiled_quad>{ reinterpret_cast<const compiled_quad*>(at(sec_quads)), count(sec_quads) };
+	scene.mapping = file;
+
+	builder.view = header.camera;
+	builder.has_camera = header.has_camera != 0;
+	builder.has_environment = header.has_environment != 0;
+	builder.env.sky = header.sky != 0;
+	builder.env.ground = header.ground;
+	builder.env.flat = header.flat;
+	builder.env.intensity = header.intensity;
+	builder.env.map = strings.back();
+	return true;
+}
+
+bool scene_cache::save(const std::string& path, uint64_t key, const compiled_scene& scene, const compiled_scene_builder& builder) {
+	using namespace scene_cache_detail;
+	if (!cacheable(scene))
+		return false;
+
+	std::vector<int32_t> light_materials;
+	for (const auto& l : scene.lights.lights) {
+		int32_t index = -1;
+		for (size_t m = 0; m < scene.material_sources.size() && index < 0; m++) {
+			if (scene.material_sources[m].get() == l.mat)
+				index = static_cast<int32_t>(m);
+		}
+		if (index < 0)
+			return false;
+		light_materials.push_back(index);
+	}
+	std::string strings;
+	for (const compiled_texture& t : scene.textures) {
+		if (t.kind == tex_image && t.object >= 0)
+			strings += texture_cache::global().path(t.object);
+		strings.push_back('\0');
+	}
+	strings += builder.env.map;
+	strings.push_back('\0');
+
+	file_header header = {};
+	memcpy(header.magic, cache_magic, 4);
+	header.version = cache_version;
+	header.key = key;
+	element_sizes(header.element_size);
+	header.has_camera = builder.has_camera;
+	header.has_environment = builder.has_environment;
+	header.camera = builder.view;
+	header.ground = builder.env.ground;
+	header.flat = builder.env.flat;
+	header.intensity = builder.env.intensity;
+	header.sky = builder.env.sky;
+
+	const void* data[section_count] = {
+		scene.prims.data, scene.nodes.data, scene.quads.data, scene.materials.data(), scene.textures.data(),
+		scene.lights.lights.data(), light_materials.data(), scene.lights.nodes.data(), scene.lights.trails.data(), strings.data()
+	};
+	size_t counts[section_count] = {
+		scene.prims.size(), scene.nodes.size(), scene.quads.size(), scene.materials.size(), scene.textures.size(),
+		scene.lights.lights.size(), light_materials.size(), scene.lights.nodes.size(), scene.lights.trails.size(), strings.size()
+	};
+	uint64_t offset = sizeof(file_header);
+	for (int i = 0; i < section_count; i++) {
+		offset = (offset + section_alignment - 1) / section_alignment * section_alignment;
+		header.sections[i].offset = offset;
+		header.sections[i].count = counts[i];
+		offset += counts[i] * header.element_size[i];
+	}
+
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+	// written under a name of its own so a concurrent run never maps a half written file
+	std::string temp_path = unique_temp_path(path);
+	{
+		std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+		if (!out) {
+			std::cerr << "scene_cache: cannot write " << temp_path << "\n";
+			return false;
+		}
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		uint64_t written = sizeof(header);
+		const char zeros[section_alignment] = {};
+		for (int i = 0; i < section_count; i++) {
+			out.write(zeros, header.sections[i].offset - written);
+			size_t bytes = counts[i] * header.element_size[i];
+			if (bytes)
+				out.write(static_cast<const char*>(data[i]), bytes);
+			written = header.sections[i].offset + bytes;
+		}
+		if (!out) {
+			std::cerr << "scene_cache: cannot write " << temp_path << "\n";
+			out.close();
+			std::filesystem::remove(temp_path, ec);
+			return false;
+		}
+	}
+	// a rename that fails (on Windows, over a file another process has mapped) lost the race
+	// to a writer of the same scene, whose file stays
+	std::filesystem::rename(temp_path, path, ec);
+	if (ec) {
+		std::filesystem::remove(temp_path, ec);
+		return false;
+	}
+	return true;
+}
+
+// load_scene_file() through the cache: maps the cached scene if there is a current one,
+// otherwise loads the file and writes the cache for next time. cached tells which happened.
+bool load_scene_file_cached(const std::string& path, compiled_scene& scene, compiled_scene_builder& builder,
+	bool* cached = nullptr)
+{
+	if (cached)
+		*cached = false;
+	uint64_t key = 0;
+	std::string cache = scene_cache::cache_path(path, key);
+	if (!cache.empty() && scene_cache::load(cache, key, scene, builder)) {
+		if (cached)
+			*cached = true;
+		return true;
+	}
+	if (!load_scene_file(path, scene, builder))
+		return false;
+	if (!cache.empty() && scene_cache::cacheable(scene))
+		scene_cache::save(cache, key, scene, builder);
+	return true;
+}
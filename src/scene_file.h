@@ -0,0 +1,1064 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "rtweekend.h"
+#include "mapped_file.h"
+#include "obj_loader.h"
+#include "compiled_scene.h"
+#include "quad.h"
+
+// Scene files. The text form is JSON:
+//
+//   { "camera": { "lookfrom": [13, 2, 3], "lookat": [0, 0, 0], "vfov": 20, "aperture": 0.1 },
+//     "environment": { "sky": true, "ground": [1, 1, 1], "map": "sky.hdr", "intensity": 1 },
+//     "textures": [ { "name": "dark", "type": "solid", "color": [0.2, 0.3, 0.1] },
+//                   { "name": "board", "type": "checker", "odd": "dark", "even": "light" },
+//                   { "name": "earth", "type": "image", "file": "earthmap.jpg" } ],
+//     "materials": [ { "name": "ground", "type": "lambertian", "texture": "board" },
+//                    { "name": "red", "type": "lambertian", "albedo": [0.7, 0.1, 0.1] },
+//                    { "name": "steel", "type": "metal", "albedo": [0.8, 0.8, 0.8], "fuzz": 0.1 },
+//                    { "name": "glass", "type": "dielectric", "ir": 1.5 },
+//                    { "name": "lamp", "type": "light", "emit": [4, 4, 4] } ],
+//     "objects": [ { "type": "sphere", "center": [0, 1, 0], "radius": 1, "material": "glass" },
+//                  { "type": "moving_sphere", "center0": [...], "center1": [...], "time0": 0, "time1": 1, "radius": 0.2, "material": 3 },
+//                  { "type": "quad", "corner": [...], "u": [...], "v": [...], "material": "lamp" },
+//                  { "type": "box", "min": [...], "max": [...], "material": "red" },
+//                  { "type": "mesh", "file": "bunny.obj", "center": [0, 1, 0], "size": 2, "material": "red" } ] }
+//
+// Sections are read in file order, and a reference (a name or an index) has to point at
+// something defined earlier. Section entries are flat objects of numbers, strings, booleans
+// and number arrays. The reader never builds a document tree: every entry is handed to a
+// scene_sink as soon as it is parsed, and the compiled scene sink writes spheres straight
+// into the renderer's prim arrays. The binary form holds the same records (see
+// scene_file_detail::record_type); spheres are packed in blocks.
+
+struct scene_camera {
+	point3 lookfrom = point3(13, 2, 3);
+	point3 lookat = point3(0, 0, 0);
+	vec3 vup = vec3(0, 1, 0);
+	double vfov = 20, aperture = 0, focus_distance = 10;
+	double time0 = 0, time1 = 1;
+};
+
+struct scene_environment {
+	bool sky = true;
+	color ground = color(1, 1, 1);
+	color flat = color(0, 0, 0);
+	std::string map;
+	double intensity = 1;
+};
+
+struct scene_texture {
+	int kind = tex_solid;	//tex_solid, tex_checker or tex_image
+	int odd = -1, even = -1;
+	color value;
+	std::string file;
+};
+
+struct scene_material {
+	int kind = mat_lambertian;	//mat_lambertian, mat_metal, mat_dielectric or mat_light
+	int texture = -1;	//lambertian albedo or light emission, otherwise the constant below
+	color albedo;		//or emission
+	double fuzz = 0, ir = 1.5;
+};
+
+struct scene_sphere {
+	point3 center;
+	double radius;
+	int material;
+};
+
+struct scene_moving_sphere {
+	point3 center0, center1;
+	double time0, time1, radius;
+	int material;
+};
+
+struct scene_quad {
+	point3 corner;
+	vec3 u, v;
+	int material;
+};
+
+struct scene_box {
+	point3 min, max;
+	int material;
+};
+
+struct scene_mesh {
+	std::string file;
+	point3 center;
+	double size = 0;	//fit into a box of this size around center, 0 keeps the file's coordinates
+	int material;
+};
+
+// Receives the records of a scene file in order. Texture and material indices count the
+// texture() and material() calls so far.
+class scene_sink {
+public:
+	virtual ~scene_sink() {}
+	virtual void camera(const scene_camera& c) = 0;
+	virtual void environment(const scene_environment& e) = 0;
+	virtual void texture(const scene_texture& t) = 0;
+	virtual void material(const scene_material& m) = 0;
+	virtual void spheres(const scene_sphere* s, size_t count) = 0;
+	virtual void moving_sphere(const scene_moving_sphere& s) = 0;
+	virtual void quad(const scene_quad& q) = 0;
+	virtual void box(const scene_box& b) = 0;
+	virtual void mesh(const scene_mesh& m) = 0;
+};
+
+// Builds the records into a compiled_scene; call scene.clear() before and scene.finish() after.
+class compiled_scene_builder : public scene_sink {
+public:
+	compiled_scene_builder(compiled_scene& s) : scene(s) {}
+
+	virtual void camera(const scene_camera& c) override {
+		view = c;
+		has_camera = true;
+	}
+
+	virtual void environment(const scene_environment& e) override {
+		env = e;
+		has_environment = true;
+	}
+
+	virtual void texture(const scene_texture& t) override {
+		switch (t.kind) {
+		case tex_checker:
+			textures.push_back(scene_make_shared<checker_texture>(textures[t.even], textures[t.odd]));
+			break;
+		case tex_image:
+			textures.push_back(scene_make_shared<image_texture>(t.file));
+			break;
+		default:
+			textures.push_back(scene_make_shared<solid_color>(t.value));
+			break;
+		}
+	}
+
+	virtual void material(const scene_material& m) override {
+		shared_ptr<::material> result;
+		switch (m.kind) {
+		case mat_metal:
+			result = scene_make_shared<metal>(m.albedo, m.fuzz);
+			break;
+		case mat_dielectric:
+			result = scene_make_shared<dielectric>(m.ir);
+			break;
+		case mat_light:
+			result = m.texture >= 0 ? scene_make_shared<diffuse_light>(textures[m.texture]) : scene_make_shared<diffuse_light>(m.albedo);
+			break;
+		default:
+			result = m.texture >= 0 ? scene_make_shared<lambertian>(textures[m.texture]) : scene_make_shared<lambertian>(m.albedo);
+			break;
+		}
+		materials.push_back(scene.add_material(result));
+	}
+
+	virtual void spheres(const scene_sphere* s, size_t count) override {
+		for (size_t i = 0; i < count; i++)
+			scene.add_sphere(s[i].center, s[i].radius, materials[s[i].material]);
+	}
+
+	virtual void moving_sphere(const scene_moving_sphere& s) override {
+		scene.add_moving_sphere(s.center0, s.center1, s.time0, s.time1, s.radius, materials[s.material], view.time0, view.time1);
+	}
+
+	virtual void quad(const scene_quad& q) override {
+		scene.add_quad(q.corner, q.u, q.v, materials[q.material]);
+	}
+
+	virtual void box(const scene_box& b) override {
+		scene.add_object(make_box(b.min, b.max, source(b.material)), view.time0, view.time1);
+	}
+
+	virtual void mesh(const scene_mesh& m) override {
+		auto data = load_obj(m.file);
+		if (!data)
+			return;
+		if (m.size > 0)
+			data->fit_to_box(m.center, m.size);
+		scene.add_object(scene_make_shared<triangle_mesh>(data, source(m.material)), view.time0, view.time1);
+	}
+
+	scene_camera view;
+	bool has_camera = false;
+	scene_environment env;
+	bool has_environment = false;
+
+private:
+	shared_ptr<::material> source(int index) const { return scene.material_sources[materials[index]]; }
+
+	compiled_scene& scene;
+	std::vector<shared_ptr<::texture>> textures;
+	std::vector<int> materials;	//file index to compiled index
+};
+
+namespace scene_file_detail {
+
+	const char binary_magic[4] = { 'R', 'T', 'S', 'B' };
+	const uint32_t binary_version = 1;
+
+	enum record_type : uint32_t {
+		record_end, record_camera, record_environment, record_texture, record_material,
+		record_spheres, record_moving_sphere, record_quad, record_box, record_mesh
+	};
+
+	const size_t sphere_block = 4096;	//spheres per record, and per spheres() call
+
+	// Checks the references of the records passing through, shared by both readers.
+	struct reference_check {
+		int textures = 0, materials = 0;
+		bool texture(int i) const { return i >= 0 && i < textures; }
+		bool material(int i) const { return i >= 0 && i < materials; }
+	};
+
+	// ---- text -------------------------------------------------------------------------
+
+	enum value_type { value_number, value_string, value_bool, value_array, value_null };
+
+	struct field {
+		std::string key;
+		int type;
+		double number;
+		bool flag;
+		std::string text;
+		std::vector<double> numbers;
+	};
+
+	// A flat JSON object; fields are reused from one entry to the next to avoid allocations.
+	struct flat_object {
+		std::vector<field> fields;
+		size_t count = 0;
+
+		const field* find(const char* key) const {
+			for (size_t i = 0; i < count; i++) {
+				if (fields[i].key == key)
+					return &fields[i];
+			}
+			return nullptr;
+		}
+	};
+
+	class json_reader {
+	public:
+		json_reader(const char* begin, const char* end) : start(begin), p(begin), end(end) {}
+
+		bool failed() const { return !message.empty(); }
+		const std::string& error() const { return message; }
+
+		bool fail(const std::string& what) {
+			if (message.empty()) {
+				int line = 1;
+				for (const char* q = start; q < p && q < end; q++)
+					line += *q == '\n';
+				message = "line " + std::to_string(line) + ": " + what;
+			}
+			return false;
+		}
+
+		void skip_space() {
+			while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+				p++;
+		}
+
+		bool peek(char c) {
+			skip_space();
+			return p < end && *p == c;
+		}
+
+		bool expect(char c) {
+			skip_space();
+			if (p < end && *p == c) {
+				p++;
+				return true;
+			}
+			return fail(std::string("expected '") + c + "'");
+		}
+
+		// the separator of an object or array: false at its closing bracket
+		bool next(char close, bool first) {
+			skip_space();
+			if (p < end && *p == close) {
+				p++;
+				return false;
+			}
+			if (!first && !expect(','))
+				return false;
+			return true;
+		}
+
+		bool string(std::string& out) {
+			if (!expect('"'))
+				return false;
+			out.clear();
+			while (p < end && *p != '"') {
+				if (*p == '\\' && p + 1 < end) {
+					p++;
+					char c = *p;
+					out.push_back(c == 'n' ? '\n' : c == 't' ? '\t' : c);	//\uXXXX is not needed for paths and names
+				}
+				else {
+					out.push_back(*p);
+				}
+				p++;
+			}
+			if (p >= end)
+				return fail("unterminated string");
+			p++;
+			return true;
+		}
+
+		bool number(double& out) {
+			skip_space();
+			const char* before = p;
+			p = obj_detail::parse_double(p, end, out);
+			return p != before ? true : fail("expected a number");
+		}
+
+		bool literal(const char* word) {
+			size_t n = strlen(word);
+			if (size_t(end - p) >= n && memcmp(p, word, n) == 0) {
+				p += n;
+				return true;
+			}
+			return false;
+		}
+
+		bool value(field& f) {
+			skip_space();
+			if (p >= end)
+				return fail("unexpected end of file");
+			if (*p == '"') {
+				f.type = value_string;
+				return string(f.text);
+			}
+			if (*p == '[') {
+				f.type = value_array;
+				f.numbers.clear();
+				p++;
+				for (bool first = true; next(']', first); first = false) {
+					double x;
+					if (!number(x))
+						return false;
+					f.numbers.push_back(x);
+				}
+				return !failed();
+			}
+			if (literal("true") || literal("false")) {
+				f.type = value_bool;
+				f.flag = p[-2] == 'u';	//tr(u)e, fal(s)e
+				return true;
+			}
+			if (literal("null")) {
+				f.type = value_null;
+				return true;
+			}
+			f.type = value_number;
+			return number(f.number);
+		}
+
+		bool object(flat_object& obj) {
+			obj.count = 0;
+			if (!expect('{'))
+				return false;
+			for (bool first = true; next('}', first); first = false) {
+				if (obj.count == obj.fields.size())
+					obj.fields.emplace_back();
+				field& f = obj.fields[obj.count++];
+				if (!string(f.key) || !expect(':') || !value(f))
+					return false;
+			}
+			return !failed();
+		}
+
+		// anything, nested or not, for top level keys this reader does not know
+		bool skip() {
+			skip_space();
+			if (p < end && (*p == '{' || *p == '[')) {
+				char close = *p == '{' ? '}' : ']';
+				bool is_object = *p == '{';
+				p++;
+				for (bool first = true; next(close, first); first = false) {
+					if (is_object) {
+						std::string key;
+						if (!string(key) || !expect(':'))
+							return false;
+					}
+					if (!skip())
+						return false;
+				}
+				return !failed();
+			}
+			field f;
+			return value(f);
+		}
+
+		bool at_end() {
+			skip_space();
+			return p >= end;
+		}
+
+	private:
+		const char* start;
+		const char* p;
+		const char* end;
+		std::string message;
+	};
+
+	// Turns flat objects into records, resolving names and checking indices.
+	class json_scene {
+	public:
+		json_scene(json_reader& r, scene_sink& s) : in(r), sink(s) {}
+
+		bool read() {
+			if (!in.expect('{'))
+				return false;
+			for (bool first = true; in.next('}', first); first = false) {
+				std::string key;
+				if (!in.string(key) || !in.expect(':'))
+					return false;
+				bool ok;
+				if (key == "camera")
+					ok = in.object(obj) && camera();
+				else if (key == "environment")
+					ok = in.object(obj) && environment();
+				else if (key == "textures")
+					ok = section(&json_scene::texture);
+				else if (key == "materials")
+					ok = section(&json_scene::material);
+				else if (key == "objects")
+					ok = section(&json_scene::object) && flush();
+				else
+					ok = in.skip();
+				if (!ok)
+					return false;
+			}
+			if (in.failed())
+				return false;
+			return in.at_end() ? true : in.fail("trailing characters after the scene");
+		}
+
+	private:
+		bool section(bool (json_scene::*entry)()) {
+			if (!in.expect('['))
+				return false;
+			for (bool first = true; in.next(']', first); first = false) {
+				if (!in.object(obj) || !(this->*entry)())
+					return false;
+			}
+			return !in.failed();
+		}
+
+		double number(const char* key, double fallback) const {
+			const field* f = obj.find(key);
+			return f && f->type == value_number ? f->number : fallback;
+		}
+
+		bool flag(const char* key, bool fallback) const {
+			const field* f = obj.find(key);
+			return f && f->type == value_bool ? f->flag : fallback;
+		}
+
+		std::string text(const char* key) const {
+			const field* f = obj.find(key);
+			return f && f->type == value_string ? f->text : std::string();
+		}
+
+		bool vector(const char* key, vec3& out, bool required) {
+			const field* f = obj.find(key);
+			if (!f)
+				return required ? in.fail(std::string("missing \"") + key + "\"") : true;
+			if (f->type == value_number) {
+				out = vec3(f->number, f->number, f->number);
+				return true;
+			}
+			if (f->type != value_array || f->numbers.size() != 3)
+				return in.fail(std::string("\"") + key + "\" should be an array of 3 numbers");
+			out = vec3(f->numbers[0], f->numbers[1], f->numbers[2]);
+			return true;
+		}
+
+		// a name or an index into names, -1 when absent
+		bool reference(const char* key, const std::unordered_map<std::string, int>& names, int count, int& out, bool required) {
+			const field* f = obj.find(key);
+			out = -1;
+			if (!f)
+				return required ? in.fail(std::string("missing \"") + key + "\"") : true;
+			if (f->type == value_number) {
+				// checked before the cast, which is undefined for NaN or out of range values
+				double n = f->number;
+				if (!std::isfinite(n) || n != std::floor(n) || n < 0 || n >= count)
+					return in.fail(std::string("\"") + key + "\" does not refer to an earlier entry");
+				out = static_cast<int>(n);
+			}
+			else if (f->type == value_string) {
+				auto found = names.find(f->text);
+				if (found == names.end())
+					return in.fail("unknown name \"" + f->text + "\"");
+				out = found->second;
+			}
+			if (out < 0 || out >= count)
+				return in.fail(std::string("\"") + key + "\" does not refer to an earlier entry");
+			return true;
+		}
+
+		void name(std::unordered_map<std::string, int>& names, int index) {
+			const field* f = obj.find("name");
+			if (f && f->type == value_string)
+				names[f->text] = index;
+		}
+
+		bool camera() {
+			scene_camera c;
+			if (!vector("lookfrom", c.lookfrom, false) || !vector("lookat", c.lookat, false) || !vector("vup", c.vup, false))
+				return false;
+			c.vfov = number("vfov", c.vfov);
+			c.aperture = number("aperture", c.aperture);
+			c.focus_distance = number("focus_distance", c.focus_distance);
+			c.time0 = number("time0", c.time0);
+			c.time1 = number("time1", c.time1);
+			sink.camera(c);
+			return true;
+		}
+
+		bool environment() {
+			scene_environment e;
+			e.sky = flag("sky", e.sky);
+			if (!vector("ground", e.ground, false) || !vector("color", e.flat, false))
+				return false;
+			e.map = text("map");
+			e.intensity = number("intensity", e.intensity);
+			sink.environment(e);
+			return true;
+		}
+
+		bool texture() {
+			scene_texture t;
+			std::string type = text("type");
+			if (type == "checker") {
+				t.kind = tex_checker;
+				if (!reference("odd", texture_names, refs.textures, t.odd, true) || !reference("even", texture_names, refs.textures, t.even, true))
+					return false;
+			}
+			else if (type == "image") {
+				t.kind = tex_image;
+				t.file = text("file");
+			}
+			else if (type == "solid" || type.empty()) {
+				if (!vector("color", t.value, true))
+					return false;
+			}
+			else {
+				return in.fail("unknown texture type \"" + type + "\"");
+			}
+			name(texture_names, refs.textures++);
+			sink.texture(t);
+			return true;
+		}
+
+		bool material() {
+			scene_material m;
+			std::string type = text("type");
+			if (type == "lambertian" || type.empty()) {
+				m.kind = mat_lambertian;
+				if (!reference("texture", texture_names, refs.textures, m.texture, false))
+					return false;
+				if (m.texture < 0 && !vector("albedo", m.albedo, true))
+					return false;
+			}
+			else if (type == "metal") {
+				m.kind = mat_metal;
+				if (!vector("albedo", m.albedo, true))
+					return false;
+				m.fuzz = number("fuzz", 0);
+			}
+			else if (type == "dielectric") {
+				m.kind = mat_dielectric;
+				m.ir = number("ir", 1.5);
+			}
+			else if (type == "light") {
+				m.kind = mat_light;
+				if (!reference("texture", texture_names, refs.textures, m.texture, false))
+					return false;
+				if (m.texture < 0 && !vector("emit", m.albedo, true))
+					return false;
+			}
+			else {
+				return in.fail("unknown material type \"" + type + "\"");
+			}
+			name(material_names, refs.materials++);
+			sink.material(m);
+			return true;
+		}
+
+		bool object() {
+			std::string type = text("type");
+			int mat;
+			if (!reference("material", material_names, refs.materials, mat, true))
+				return false;
+			if (type == "sphere") {
+				scene_sphere s;
+				s.material = mat;
+				s.radius = number("radius", 1);
+				if (!vector("center", s.center, true))
+					return false;
+				pending.push_back(s);
+				return pending.size() < sphere_block || flush();
+			}
+			if (!flush())
+				return false;
+			if (type == "moving_sphere") {
+				scene_moving_sphere s;
+				s.material = mat;
+				s.radius = number("radius", 1);
+				s.time0 = number("time0", 0);
+				s.time1 = number("time1", 1);
+				if (!vector("center0", s.center0, true) || !vector("center1", s.center1, true))
+					return false;
+				if (s.time1 == s.time0)
+					return in.fail("moving_sphere needs time1 != time0");
+				sink.moving_sphere(s);
+			}
+			else if (type == "quad") {
+				scene_quad q;
+				q.material = mat;
+				if (!vector("corner", q.corner, true) || !vector("u", q.u, true) || !vector("v", q.v, true))
+					return false;
+				sink.quad(q);
+			}
+			else if (type == "box") {
+				scene_box b;
+				b.material = mat;
+				if (!vector("min", b.min, true) || !vector("max", b.max, true))
+					return false;
+				sink.box(b);
+			}
+			else if (type == "mesh") {
+				scene_mesh m;
+				m.material = mat;
+				m.file = text("file");
+				m.size = number("size", 0);
+				if (!vector("center", m.center, false))
+					return false;
+				sink.mesh(m);
+			}
+			else {
+				return in.fail("unknown object type \"" + type + "\"");
+			}
+			return true;
+		}
+
+		bool flush() {
+			if (!pending.empty())
+				sink.spheres(pending.data(), pending.size());
+			pending.clear();
+			return true;
+		}
+
+		json_reader& in;
+		scene_sink& sink;
+		flat_object obj;
+		reference_check refs;
+		std::unordered_map<std::string, int> texture_names, material_names;
+		std::vector<scene_sphere> pending;
+	};
+
+	// ---- binary -----------------------------------------------------------------------
+
+	// Appends little endian fields to a record payload.
+	struct record_writer {
+		std::vector<char> bytes;
+
+		template <class T> void put(const T& value) {
+			const char* b = reinterpret_cast<const char*>(&value);
+			bytes.insert(bytes.end(), b, b + sizeof(T));
+		}
+		void put(const vec3& v) {
+			for (int k = 0; k < 3; k++)
+				put(v[k]);
+		}
+		void put(const std::string& s) {
+			put(static_cast<uint32_t>(s.size()));
+			bytes.insert(bytes.end(), s.begin(), s.end());
+		}
+	};
+
+	// Reads record payload fields, failing (and returning zeros) past the end.
+	struct record_reader {
+		const char* p;
+		const char* end;
+		bool ok = true;
+
+		template <class T> T get() {
+			T value = T();
+			if (size_t(end - p) < sizeof(T)) {
+				ok = false;
+				return value;
+			}
+			memcpy(&value, p, sizeof(T));
+			p += sizeof(T);
+			return value;
+		}
+		vec3 get_vec3() {
+			double x = get<double>(), y = get<double>(), z = get<double>();
+			return vec3(x, y, z);
+		}
+		std::string get_string() {
+			uint32_t n = get<uint32_t>();
+			if (!ok || size_t(end - p) < n) {
+				ok = false;
+				return std::string();
+			}
+			std::string s(p, n);
+			p += n;
+			return s;
+		}
+	};
+
+	const size_t packed_sphere_size = 4 * sizeof(double) + sizeof(int32_t);
+}
+
+// Writes the records it receives as a binary scene file.
+class binary_scene_writer : public scene_sink {
+public:
+	bool open(const std::string& path) {
+		out.open(path, std::ios::binary | std::ios::trunc);
+		if (!out)
+			return false;
+		out.write(scene_file_detail::binary_magic, 4);
+		uint32_t version = scene_file_detail::binary_version;
+		out.write(reinterpret_cast<const char*>(&version), sizeof(version));
+		return bool(out);
+	}
+
+	bool close() {
+		flush();
+		record(scene_file_detail::record_end);
+		out.close();
+		return !out.fail();
+	}
+
+	virtual void camera(const scene_camera& c) override {
+		flush();
+		w.put(c.lookfrom);
+		w.put(c.lookat);
+		w.put(c.vup);
+		w.put(c.vfov);
+		w.put(c.aperture);
+		w.put(c.focus_distance);
+		w.put(c.time0);
+		w.put(c.time1);
+		record(scene_file_detail::record_camera);
+	}
+
+	virtual void environment(const scene_environment& e) override {
+		flush();
+		w.put(static_cast<uint32_t>(e.sky));
+		w.put(e.ground);
+		w.put(e.flat);
+		w.put(e.intensity);
+		w.put(e.map);
+		record(scene_file_detail::record_environment);
+	}
+
+	virtual void texture(const scene_texture& t) override {
+		flush();
+		w.put(static_cast<int32_t>(t.kind));
+		w.put(static_cast<int32_t>(t.odd));
+		w.put(static_cast<int32_t>(t.even));
+		w.put(t.value);
+		w.put(t.file);
+		record(scene_file_detail::record_texture);
+	}
+
+	virtual void material(const scene_material& m) override {
+		flush();
+		w.put(static_cast<int32_t>(m.kind));
+		w.put(static_cast<int32_t>(m.texture));
+		w.put(m.albedo);
+		w.put(m.fuzz);
+		w.put(m.ir);
+		record(scene_file_detail::record_material);
+	}
+
+	virtual void spheres(const scene_sphere* s, size_t count) override {
+		pending.insert(pending.end(), s, s + count);
+		if (pending.size() >= scene_file_detail::sphere_block)
+			flush();
+	}
+
+	virtual void moving_sphere(const scene_moving_sphere& s) override {
+		flush();
+		w.put(s.center0);
+		w.put(s.center1);
+		w.put(s.time0);
+		w.put(s.time1);
+		w.put(s.radius);
+		w.put(static_cast<int32_t>(s.material));
+		record(scene_file_detail::record_moving_sphere);
+	}
+
+	virtual void quad(const scene_quad& q) override {
+		flush();
+		w.put(q.corner);
+		w.put(q.u);
+		w.put(q.v);
+		w.put(static_cast<int32_t>(q.material));
+		record(scene_file_detail::record_quad);
+	}
+
+	virtual void box(const scene_box& b) override {
+		flush();
+		w.put(b.min);
+		w.put(b.max);
+		w.put(static_cast<int32_t>(b.material));
+		record(scene_file_detail::record_box);
+	}
+
+	virtual void mesh(const scene_mesh& m) override {
+		flush();
+		w.put(m.center);
+		w.put(m.size);
+		w.put(static_cast<int32_t>(m.material));
+		w.put(m.file);
+		record(scene_file_detail::record_mesh);
+	}
+
+private:
+	void record(uint32_t type) {
+		uint32_t size = static_cast<uint32_t>(w.bytes.size());
+		out.write(reinterpret_cast<const char*>(&type), sizeof(type));
+		out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+		out.write(w.bytes.data(), w.bytes.size());
+		w.bytes.clear();
+	}
+
+	// spheres go out in blocks: a count, then center, radius and material of each
+	void flush() {
+		for (size_t start = 0; start < pending.size(); start += scene_file_detail::sphere_block) {
+			size_t n = std::min(scene_file_detail::sphere_block, pending.size() - start);
+			w.put(static_cast<uint32_t>(n));
+			for (size_t i = start; i < start + n; i++) {
+				w.put(pending[i].center);
+				w.put(pending[i].radius);
+				w.put(static_cast<int32_t>(pending[i].material));
+			}
+			record(scene_file_detail::record_spheres);
+		}
+		pending.clear();
+	}
+
+	std::ofstream out;
+	scene_file_detail::record_writer w;
+	std::vector<scene_sphere> pending;
+};
+
+// Reads a scene file into sink; binary files are recognized by their magic, anything else
+// is parsed as JSON. Prints the problem and returns false on a malformed file, in which case
+// sink may have received part of the scene.
+bool read_scene_file(const std::string& path, scene_sink& sink) {
+	using namespace scene_file_detail;
+	mapped_file file;
+	if (!file.open(path)) {
+		std::cerr << "scene_file: cannot open " << path << "\n";
+		return false;
+	}
+	const char* begin = file.data();
+	const char* end = begin + file.length();
+
+	if (file.length() < 8 || memcmp(begin, binary_magic, 4) != 0) {
+		json_reader reader(begin, end);
+		json_scene scene(reader, sink);
+		if (!scene.read()) {
+			std::cerr << "scene_file: " << path << ": " << reader.error() << "\n";
+			return false;
+		}
+		return true;
+	}
+
+	uint32_t version;
+	memcpy(&version, begin + 4, 4);
+	if (version != binary_version) {
+		std::cerr << "scene_file: " << path << " has version " << version << ", expected " << binary_version << "\n";
+		return false;
+	}
+
+	reference_check refs;
+	std::vector<scene_sphere> block;
+	const char* p = begin + 8;
+	auto fail = [&](const char* what) {
+		std::cerr << "scene_file: " << path << ": " << what << " at offset " << (p - begin) << "\n";
+		return false;
+	};
+	while (true) {
+		if (size_t(end - p) < 8)
+			return fail("truncated record header");
+		uint32_t type, size;
+		memcpy(&type, p, 4);
+		memcpy(&size, p + 4, 4);
+		if (size_t(end - p - 8) < size)
+			return fail("truncated record");
+		record_reader r = { p + 8, p + 8 + size };
+		switch (type) {
+		case record_end:
+			return true;
+		case record_camera: {
+			scene_camera c;
+			c.lookfrom = r.get_vec3();
+			c.lookat = r.get_vec3();
+			c.vup = r.get_vec3();
+			c.vfov = r.get<double>();
+			c.aperture = r.get<double>();
+			c.focus_distance = r.get<double>();
+			c.time0 = r.get<double>();
+			c.time1 = r.get<double>();
+			if (r.ok)
+				sink.camera(c);
+			break;
+		}
+		case record_environment: {
+			scene_environment e;
+			e.sky = r.get<uint32_t>() != 0;
+			e.ground = r.get_vec3();
+			e.flat = r.get_vec3();
+			e.intensity = r.get<double>();
+			e.map = r.get_string();
+			if (r.ok)
+				sink.environment(e);
+			break;
+		}
+		case record_texture: {
+			scene_texture t;
+			t.kind = r.get<int32_t>();
+			t.odd = r.get<int32_t>();
+			t.even = r.get<int32_t>();
+			t.value = r.get_vec3();
+			t.file = r.get_string();
+			if (t.kind == tex_checker && (!refs.texture(t.odd) || !refs.texture(t.even)))
+				return fail("checker refers to a missing texture");
+			if (r.ok) {
+				refs.textures++;
+				sink.texture(t);
+			}
+			break;
+		}
+		case record_material: {
+			scene_material m;
+			m.kind = r.get<int32_t>();
+			m.texture = r.get<int32_t>();
+			m.albedo = r.get_vec3();
+			m.fuzz = r.get<double>();
+			m.ir = r.get<double>();
+			if (m.texture != -1 && !refs.texture(m.texture))
+				return fail("material refers to a missing texture");
+			if (r.ok) {
+				refs.materials++;
+				sink.material(m);
+			}
+			break;
+		}
+		case record_spheres: {
+			uint32_t n = r.get<uint32_t>();
+			if (!r.ok || size_t(r.end - r.p) < n * packed_sphere_size)
+				return fail("truncated sphere block");
+			block.resize(n);
+			for (uint32_t i = 0; i < n; i++) {
+				block[i].center = r.get_vec3();
+				block[i].radius = r.get<double>();
+				block[i].material = r.get<int32_t>();
+				if (!refs.material(block[i].material))
+					return fail("sphere refers to a missing material");
+			}
+			sink.spheres(block.data(), n);
+			break;
+		}
+		case record_moving_sphere: {
+			scene_moving_sphere s;
+			s.center0 = r.get_vec3();
+			s.center1 = r.get_vec3();
+			s.time0 = r.get<double>();
+			s.time1 = r.get<double>();
+			s.radius = r.get<double>();
+			s.material = r.get<int32_t>();
+			if (!refs.material(s.material) || s.time1 == s.time0)
+				return fail("bad moving sphere");
+			if (r.ok)
+				sink.moving_sphere(s);
+			break;
+		}
+		case record_quad: {
+			scene_quad q;
+			q.corner = r.get_vec3();
+			q.u = r.get_vec3();
+			q.v = r.get_vec3();
+			q.material = r.get<int32_t>();
+			if (!refs.material(q.material))
+				return fail("quad refers to a missing material");
+			if (r.ok)
+				sink.quad(q);
+			break;
+		}
+		case record_box: {
+			scene_box b;
+			b.min = r.get_vec3();
+			b.max = r.get_vec3();
+			b.material = r.get<int32_t>();
+			if (!refs.material(b.material))
+				return fail("box refers to a missing material");
+			if (r.ok)
+				sink.box(b);
+			break;
+		}
+		case record_mesh: {
+			scene_mesh m;
+			m.center = r.get_vec3();
+			m.size = r.get<double>();
+			m.material = r.get<int32_t>();
+			m.file = r.get_string();
+			if (!refs.material(m.material))
+				return fail("mesh refers to a missing material");
+			if (r.ok)
+				sink.mesh(m);
+			break;
+		}
+		default:
+			break;	//unknown records from a newer writer are skipped
+		}
+		if (!r.ok)
+			return fail("malformed record");
+		p += 8 + size;
+	}
+}
+
+// Converts a scene file (either form) to the binary form.
+bool write_scene_binary(const std::string& in, const std::string& out) {
+	binary_scene_writer writer;
+	if (!writer.open(out)) {
+		std::cerr << "scene_file: cannot write " << out << "\n";
+		return false;
+	}
+	bool ok = read_scene_file(in, writer);
+	return writer.close() && ok;
+}
+
+// Loads a scene file into scene, replacing what it held. The camera and environment the
+// file sets (if any) are returned through builder.
+bool load_scene_file(const std::string& path, compiled_scene& scene, compiled_scene_builder& builder) {
+	scene.clear();
+	if (!read_scene_file(path, builder)) {
+		scene.clear();
+		return false;
+	}
+	scene.finish();
+	return true;
+}
@@ -16,7 +16,9 @@ public:
     //sphereİΧ
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
-private:
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+    using hittable::occluded;
+
     static void get_sphere_uv(const point3& p,double& u,double& v) {
         auto theta = acos(-p.y());
         auto phi = atan2(-p.z(), p.x()) + pi;
@@ -26,6 +28,20 @@ private:
         v = theta / pi;
     }
 
+    // dp/du, dp/dv of the get_sphere_uv() parameterization at outward normal n, and the
+    // normal partials (the same divided by the radius); zero on the poles
+    static void get_sphere_partials(const vec3& n, double radius, hit_record& rec) {
+        auto sin_theta = sqrt(n.x() * n.x() + n.z() * n.z());
+        if (sin_theta < 1e-9) {
+            rec.dpdu = rec.dpdv = rec.dndu = rec.dndv = vec3();
+            return;
+        }
+        rec.dndu = 2 * pi * vec3(n.z(), 0, -n.x());
+        rec.dndv = pi * vec3(-n.x() * n.y() / sin_theta, sin_theta, -n.y() * n.z() / sin_theta);
+        rec.dpdu = radius * rec.dndu;
+        rec.dpdv = radius * rec.dndv;
+    }
+
 public:
     point3 center;
     double radius;
@@ -56,11 +72,29 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
     vec3 outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
     get_sphere_uv(outward_normal,rec.u,rec.v);  //recordеuv
+    get_sphere_partials(outward_normal, radius, rec);
     rec.mat_ptr = mat_ptr;
 
     return true;
 }
 
+//same root test as hit(), without computing the point, normal or uv
+bool sphere::occluded(const ray& r, double t_min, double t_max) const {
+    vec3 oc = r.origin() - center;
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius * radius;
+
+    auto discriminant = half_b * half_b - a * c;
+    if (discriminant < 0) return false;
+    auto sqrtd = sqrt(discriminant);
+
+    auto root = (-half_b - sqrtd) / a;
+    if (root >= t_min && root <= t_max) return true;
+    root = (-half_b + sqrtd) / a;
+    return root >= t_min && root <= t_max;
+}
+
 bool sphere::bounding_box(double time0, double time1, aabb& output_box) const {
     output_box = aabb(
         center - vec3(radius),
@@ -1,10 +1,15 @@
 #pragma once
 
 #include "rtweekend.h"
+#include "texture_cache.h"
 
 class texture {
 public:
 	virtual color value(double u,double v,const point3& p) const = 0;
+	//lookup over a pixel footprint, only image textures filter
+	virtual color filtered_value(double u, double v, const point3& p, const texture_footprint& footprint) const {
+		return value(u, v, p);
+	}
 };
 
 class solid_color : public texture {
@@ -22,10 +27,27 @@ private:
 	color color_value;
 };
 
+//Fraction of the pixel footprint around p covered by the checker's odd cells. Near a cell edge the sign of
+//the sine product is box filtered with a first order distance estimate; once cells get smaller than the
+//footprint only their average is left. Without a footprint this is the hard 0/1 choice.
+inline double checker_odd_weight(const point3& p, const texture_footprint& footprint) {
+	auto sx = sin(10 * p.x()), sy = sin(10 * p.y()), sz = sin(10 * p.z());
+	auto sines = sx * sy * sz;
+	double width = fmax(footprint.dpdx.length(), footprint.dpdy.length());
+	if (width <= 0)
+		return sines < 0 ? 1.0 : 0.0;
+
+	vec3 gradient = 10 * vec3(cos(10 * p.x()) * sy * sz, sx * cos(10 * p.y()) * sz, sx * sy * cos(10 * p.z()));
+	double weight = clamp(0.5 - sines / (gradient.length() * width + 1e-12), 0.0, 1.0);
+	double cells = width * 10 / pi;	//cells are pi/10 wide
+	double fade = clamp(cells - 0.5, 0.0, 1.0);
+	return weight + (0.5 - weight) * fade;
+}
+
 //checker texture	sinںĽʾ
 class checker_texture : public texture {
 public:
-	checker_texture(color c1,color c2) : odd(make_shared<solid_color>(c1)) , even(make_shared<solid_color>(c2)) {}
+	checker_texture(color c1,color c2) : odd(scene_make_shared<solid_color>(c1)) , even(scene_make_shared<solid_color>(c2)) {}
 	checker_texture(shared_ptr<texture> _even,shared_ptr<texture> _odd) : odd(_odd),even(_even) {}
 
 	virtual color value(double u, double v, const point3& p) const override {
@@ -39,7 +61,37 @@ public:
 		}
 	}
 
+	virtual color filtered_value(double u, double v, const point3& p, const texture_footprint& footprint) const override {
+		double w = checker_odd_weight(p, footprint);
+		if (w <= 0)
+			return even->filtered_value(u, v, p, footprint);
+		if (w >= 1)
+			return odd->filtered_value(u, v, p, footprint);
+		return w * odd->filtered_value(u, v, p, footprint) + (1 - w) * even->filtered_value(u, v, p, footprint);
+	}
+
 public:
 	shared_ptr<texture> odd;
 	shared_ptr<texture> even;
 };
+
+
+//image texture backed by the shared tiled/mipmapped texture_cache
+class image_texture : public texture {
+public:
+	image_texture() {}
+	image_texture(const std::string& filename) : handle(texture_cache::global().open(filename)) {}
+
+	virtual color value(double u, double v, const point3& p) const override {
+		return filtered_value(u, v, p, texture_footprint());
+	}
+
+	virtual color filtered_value(double u, double v, const point3& p, const texture_footprint& footprint) const override {
+		if (handle < 0)
+			return color(0, 1, 1);	//cyan for a missing image, easy to spot
+		return texture_cache::global().sample(handle, u, v, footprint);
+	}
+
+public:
+	int handle = -1;
+};
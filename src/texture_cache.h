@@ -0,0 +1,546 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "stb_image.h"
+#include "rtweekend.h"
+#include "mapped_file.h"
+#include "texture_footprint.h"
+
+// Texture cache shared by all image textures. On the first lookup a texture is decoded
+// once, box filtered into a mip pyramid and written to a tiled cache file (float or half
+// RGB) in the temp directory; later runs map that file without decoding again. Lookups
+// copy tiles out of the mapping into an LRU cache bounded by a memory budget, so only the
+// tiles rays actually touch are resident.
+
+
+struct texture_cache_stats {
+	unsigned long long hits, misses, evictions;
+	size_t resident_bytes, budget_bytes;
+	int textures;
+};
+
+namespace texture_cache_detail {
+
+	inline uint16_t float_to_half(float f) {
+		uint32_t x;
+		memcpy(&x, &f, 4);
+		uint32_t sign = (x >> 16) & 0x8000;
+		uint32_t exp_bits = (x >> 23) & 0xff;
+		uint32_t mant = x & 0x7fffff;
+		if (exp_bits == 0xff)
+			return static_cast<uint16_t>(sign | 0x7c00 | (mant ? 0x200 : 0));
+		int exp = static_cast<int>(exp_bits) - 127 + 15;
+		if (exp >= 31)
+			return static_cast<uint16_t>(sign | 0x7c00);
+		if (exp <= 0) {
+			if (exp < -10)
+				return static_cast<uint16_t>(sign);
+			mant |= 0x800000;
+			int shift = 14 - exp;
+			uint32_t h = mant >> shift;
+			if ((mant >> (shift - 1)) & 1)
+				h++;
+			return static_cast<uint16_t>(sign | h);
+		}
+		uint32_t h = sign | (static_cast<uint32_t>(exp) << 10) | (mant >> 13);
+		if (mant & 0x1000)
+			h++;	//a carry rolls over into the exponent, which is still correct
+		return static_cast<uint16_t>(h);
+	}
+
+	inline float half_to_float(uint16_t h) {
+		uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+		uint32_t exp = (h >> 10) & 0x1f;
+		uint32_t mant = h & 0x3ff;
+		uint32_t x;
+		if (exp == 0) {
+			float f = mant * (1.0f / 16777216.0f);
+			return sign ? -f : f;
+		}
+		if (exp == 31)
+			x = sign | 0x7f800000 | (mant << 13);
+		else
+			x = sign | ((exp + 112) << 23) | (mant << 13);
+		float f;
+		memcpy(&f, &x, 4);
+		return f;
+	}
+
+	inline uint64_t fnv1a(const void* data, size_t size, uint64_t h = 14695981039346656037ull) {
+		const unsigned char* p = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < size; i++) {
+			h ^= p[i];
+			h *= 1099511628211ull;
+		}
+		return h;
+	}
+
+	const char cache_magic[4] = { 'R', 'T', 'T', 'X' };
+	const uint32_t cache_version = 1;
+
+	struct file_header {
+		char magic[4];
+		uint32_t version;
+		uint32_t width, height, levels;
+		uint32_t tile_size, half;
+		uint32_t pad;
+	};
+
+	struct level_header {
+		uint32_t width, height, tiles_x, tiles_y;
+		uint64_t offset;	//first tile, tiles are stored row by row
+	};
+}
+
+class texture_cache {
+public:
+	static const int tile_size = 64;
+
+	static texture_cache& global() {
+		static texture_cache cache;
+		return cache;
+	}
+
+	// Registers a texture and reads its size from the file header; nothing is decoded
+	// yet. Returns a handle, or -1 if the file is missing or not an image. Not safe to
+	// call while other threads are sampling.
+	int open(const std::string& path);
+
+	int width(int handle) const { return textures[handle].width; }
+	int height(int handle) const { return textures[handle].height; }
+	const std::string& path(int handle) const { return textures[handle].path; }
+
+	// Trilinear lookup with repeat wrapping; v = 0 is the bottom row as in the book.
+	color sample(int handle, double u, double v, const texture_footprint& footprint);
+	color sample_level(int handle, double u, double v, int level);
+
+	// Resident tile memory limit; shrinking it evicts right away.
+	void set_budget(size_t bytes);
+	size_t budget() const { return budget_bytes; }
+	// Store newly prepared textures as half floats (default) or as 32 bit floats.
+	void set_half_float(bool on) { half_float = on; }
+	void set_cache_directory(const std::string& dir) { cache_dir = dir; }
+
+	// Drops every resident tile; textures stay registered.
+	void clear_tiles();
+	void reset_stats();
+	texture_cache_stats stats() const;
+
+private:
+	struct texture_file {
+		std::string path;
+		int width = 0, height = 0;
+		std::once_flag prepared;
+		bool ok = false;
+		bool half = false;
+		int levels = 0;
+		std::vector<texture_cache_detail::level_header> level_table;
+		mapped_file file;
+	};
+
+	struct tile {
+		std::vector<unsigned char> bytes;
+	};
+
+	struct shard {
+		std::mutex mutex;
+		std::list<std::pair<uint64_t, shared_ptr<const tile>>> lru;	//most recent first
+		std::unordered_map<uint64_t, decltype(lru)::iterator> entries;
+		size_t bytes = 0;
+	};
+	static const int shard_count = 16;
+
+	texture_cache();
+
+	bool prepare(texture_file& t);
+	bool build_cache_file(texture_file& t, const std::string& cache_path);
+	bool map_cache_file(texture_file& t, const std::string& cache_path);
+	shared_ptr<const tile> get_tile(texture_file& t, int handle, int level, int tile_index);
+	void evict(shard& s, size_t limit);
+	color texel(texture_file& t, int handle, int level, int x, int y);
+	color bilinear(texture_file& t, int handle, int level, double u, double v);
+
+	std::deque<texture_file> textures;
+	std::unordered_map<std::string, int> handles;
+	std::mutex open_mutex;
+	std::mutex prepare_mutex;	//one decode at a time keeps the peak memory to a single image
+
+	shard shards[shard_count];
+	std::atomic<size_t> budget_bytes;
+	std::atomic<size_t> resident;
+	std::atomic<unsigned long long> hit_count, miss_count, eviction_count;
+	std::atomic<unsigned> generation;
+	bool half_float = true;
+	std::string cache_dir;
+};
+
+inline texture_cache::texture_cache() : budget_bytes(size_t(256) << 20), resident(0), hit_count(0), miss_count(0),
+	eviction_count(0), generation(0)
+{
+	std::error_code ec;
+	cache_dir = (std::filesystem::temp_directory_path(ec) / "myraytracer_textures").string();
+}
+
+int texture_cache::open(const std::string& path) {
+	std::lock_guard<std::mutex> lock(open_mutex);
+	auto found = handles.find(path);
+	if (found != handles.end())
+		return found->second;
+
+	int w, h, n;
+	if (!stbi_info(path.c_str(), &w, &h, &n)) {
+		std::cerr << "texture_cache: cannot read " << path << ": " << stbi_failure_reason() << "\n";
+		return -1;
+	}
+	int handle = static_cast<int>(textures.size());
+	textures.emplace_back();
+	texture_file& t = textures.back();
+	t.path = path;
+	t.width = w;
+	t.height = h;
+	handles[path] = handle;
+	return handle;
+}
+
+// Finds or creates the tiled cache file. The name hashes everything the contents depend on.
+bool texture_cache::prepare(texture_file& t) {
+	namespace fs = std::filesystem;
+	std::error_code ec;
+	std::string source = fs::absolute(t.path, ec).string();
+	auto size = fs::file_size(t.path, ec);
+	auto mtime = fs::last_write_time(t.path, ec).time_since_epoch().count();
+	uint32_t options[3] = { texture_cache_detail::cache_version, tile_size, half_float ? 1u : 0u };
+
+	uint64_t key = texture_cache_detail::fnv1a(source.data(), source.size());
+	key = texture_cache_detail::fnv1a(&size, sizeof(size), key);
+	key = texture_cache_detail::fnv1a(&mtime, sizeof(mtime), key);
+	key = texture_cache_detail::fnv1a(options, sizeof(options), key);
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.rttx", static_cast<unsigned long long>(key));
+	fs::create_directories(cache_dir, ec);
+	std::string cache_path = (fs::path(cache_dir) / name).string();
+
+	if (map_cache_file(t, cache_path))
+		return true;
+	std::lock_guard<std::mutex> lock(prepare_mutex);
+	return build_cache_file(t, cache_path) && map_cache_file(t, cache_path);
+}
+
+bool texture_cache::map_cache_file(texture_file& t, const std::string& cache_path) {
+	using namespace texture_cache_detail;
+	if (!t.file.open(cache_path) || t.file.length() < sizeof(file_header))
+		return false;
+	file_header header;
+	memcpy(&header, t.file.data(), sizeof(header));
+	if (memcmp(header.magic, cache_magic, 4) != 0 || header.version != cache_version || header.tile_size != tile_size
+		|| static_cast<int>(header.width) != t.width || static_cast<int>(header.height) != t.height || header.levels == 0)
+		return false;
+	if (t.file.length() < sizeof(file_header) + header.levels * sizeof(level_header))
+		return false;
+
+	t.levels = header.levels;
+	t.half = header.half != 0;
+	t.level_table.resize(header.levels);
+	memcpy(t.level_table.data(), t.file.data() + sizeof(file_header), header.levels * sizeof(level_header));
+	size_t tile_bytes = size_t(tile_size) * tile_size * 3 * (t.half ? 2 : 4);
+	const level_header& last = t.level_table.back();
+	if (t.file.length() < last.offset + size_t(last.tiles_x) * last.tiles_y * tile_bytes)
+		return false;
+	return true;
+}
+
+bool texture_cache::build_cache_file(texture_file& t, const std::string& cache_path) {
+	using namespace texture_cache_detail;
+	int w, h, n;
+	// LDR images are converted to linear floats (stb's default gamma of 2.2)
+	float* pixels = stbi_loadf(t.path.c_str(), &w, &h, &n, 3);
+	if (!pixels) {
+		std::cerr << "texture_cache: cannot decode " << t.path << ": " << stbi_failure_reason() << "\n";
+		return false;
+	}
+
+	std::vector<std::vector<float>> levels;
+	std::vector<std::pair<int, int>> sizes;
+	levels.emplace_back(pixels, pixels + size_t(w) * h * 3);
+	sizes.emplace_back(w, h);
+	stbi_image_free(pixels);
+	while (sizes.back().first > 1 || sizes.back().second > 1) {
+		int pw = sizes.back().first, ph = sizes.back().second;
+		int nw = std::max(1, pw / 2), nh = std::max(1, ph / 2);
+		const std::vector<float>& src = levels.back();
+		std::vector<float> dst(size_t(nw) * nh * 3);
+		for (int y = 0; y < nh; y++) {
+			int y0 = std::min(2 * y, ph - 1), y1 = std::min(2 * y + 1, ph - 1);
+			for (int x = 0; x < nw; x++) {
+				int x0 = std::min(2 * x, pw - 1), x1 = std::min(2 * x + 1, pw - 1);
+				for (int c = 0; c < 3; c++) {
+					dst[(size_t(y) * nw + x) * 3 + c] = 0.25f * (src[(size_t(y0) * pw + x0) * 3 + c] + src[(size_t(y0) * pw + x1) * 3 + c]
+						+ src[(size_t(y1) * pw + x0) * 3 + c] + src[(size_t(y1) * pw + x1) * 3 + c]);
+				}
+			}
+		}
+		levels.push_back(std::move(dst));
+		sizes.emplace_back(nw, nh);
+	}
+
+	bool half = half_float;
+	size_t channel_bytes = half ? 2 : 4;
+	size_t tile_bytes = size_t(tile_size) * tile_size * 3 * channel_bytes;
+	file_header header = {};
+	memcpy(header.magic, cache_magic, 4);
+	header.version = cache_version;
+	header.width = w;
+	header.height = h;
+	header.levels = static_cast<uint32_t>(levels.size());
+	header.tile_size = tile_size;
+	header.half = half;
+	std::vector<level_header> table(levels.size());
+	uint64_t offset = sizeof(file_header) + table.size() * sizeof(level_header);
+	for (size_t l = 0; l < levels.size(); l++) {
+		table[l].width = sizes[l].first;
+		table[l].height = sizes[l].second;
+		table[l].tiles_x = (sizes[l].first + tile_size - 1) / tile_size;
+		table[l].tiles_y = (sizes[l].second + tile_size - 1) / tile_size;
+		table[l].offset = offset;
+		offset += uint64_t(table[l].tiles_x) * table[l].tiles_y * tile_bytes;
+	}
+
+	// write under a name of its own so a concurrent run never maps a half written file
+	std::string temp_path = unique_temp_path(cache_path);
+	{
+		std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+		if (!out) {
+			std::cerr << "texture_cache: cannot write " << temp_path << "\n";
+			return false;
+		}
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(level_header));
+		std::vector<unsigned char> block(tile_bytes);
+		for (size_t l = 0; l < levels.size(); l++) {
+			const level_header& lh = table[l];
+			for (uint32_t ty = 0; ty < lh.tiles_y; ty++) {
+				for (uint32_t tx = 0; tx < lh.tiles_x; tx++) {
+					std::fill(block.begin(), block.end(), 0);
+					for (int y = 0; y < tile_size; y++) {
+						uint32_t sy = ty * tile_size + y;
+						if (sy >= lh.height)
+							break;
+						for (int x = 0; x < tile_size; x++) {
+							uint32_t sx = tx * tile_size + x;
+							if (sx >= lh.width)
+								break;
+							const float* src = &levels[l][(size_t(sy) * lh.width + sx) * 3];
+							size_t dst = (size_t(y) * tile_size + x) * 3;
+							for (int c = 0; c < 3; c++) {
+								if (half) {
+									uint16_t v = float_to_half(src[c]);
+									memcpy(&block[(dst + c) * 2], &v, 2);
+								}
+								else {
+									memcpy(&block[(dst + c) * 4], &src[c], 4);
+								}
+							}
+						}
+					}
+					out.write(reinterpret_cast<const char*>(block.data()), block.size());
+				}
+			}
+		}
+		if (!out) {
+			std::cerr << "texture_cache: cannot write " << temp_path << "\n";
+			out.close();
+			std::error_code ec;
+			std::filesystem::remove(temp_path, ec);
+			return false;
+		}
+	}
+	// a rename that fails (on Windows, over a file another process has mapped) lost the race
+	// to a writer of the same file, which map_cache_file() then maps
+	std::error_code ec;
+	std::filesystem::rename(temp_path, cache_path, ec);
+	if (ec)
+		std::filesystem::remove(temp_path, ec);
+	return true;
+}
+
+shared_ptr<const texture_cache::tile> texture_cache::get_tile(texture_file& t, int handle, int level, int tile_index) {
+	uint64_t key = (uint64_t(handle) << 40) | (uint64_t(level) << 32) | uint32_t(tile_index);
+
+	// most lookups land in the tile of the previous one
+	struct last_tile {
+		const texture_cache* cache = nullptr;
+		unsigned generation = 0;
+		uint64_t key = ~0ull;
+		shared_ptr<const tile> data;
+	};
+	thread_local last_tile last;
+	unsigned current = generation.load(std::memory_order_relaxed);
+	if (last.cache == this && last.key == key && last.generation == current)
+		return last.data;
+
+	shard& s = shards[(key * 0x9E3779B97F4A7C15ull) >> 60];
+	size_t limit = budget_bytes / shard_count;
+	shared_ptr<const tile> result;
+	{
+		std::lock_guard<std::mutex> lock(s.mutex);
+		auto found = s.entries.find(key);
+		if (found != s.entries.end()) {
+			s.lru.splice(s.lru.begin(), s.lru, found->second);
+			result = found->second->second;
+			hit_count.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	if (!result) {
+		// copy the tile out of the mapping without holding the shard lock
+		size_t tile_bytes = size_t(tile_size) * tile_size * 3 * (t.half ? 2 : 4);
+		auto loaded = make_shared<tile>();
+		const char* src = t.file.data() + t.level_table[level].offset + size_t(tile_index) * tile_bytes;
+		loaded->bytes.assign(src, src + tile_bytes);
+		result = loaded;
+		miss_count.fetch_add(1, std::memory_order_relaxed);
+
+		std::lock_guard<std::mutex> lock(s.mutex);
+		auto found = s.entries.find(key);
+		if (found != s.entries.end()) {
+			result = found->second->second;	//another thread loaded it meanwhile
+		}
+		else {
+			s.lru.emplace_front(key, result);
+			s.entries[key] = s.lru.begin();
+			s.bytes += tile_bytes;
+			resident += tile_bytes;
+			evict(s, limit);
+		}
+	}
+
+	last.cache = this;
+	last.generation = current;
+	last.key = key;
+	last.data = result;
+	return result;
+}
+
+// Drops least recently used tiles until the shard fits; the newest tile always stays.
+// Tiles still referenced by a lookup in flight are freed when that lookup lets go.
+void texture_cache::evict(shard& s, size_t limit) {
+	while (s.bytes > limit && s.lru.size() > 1) {
+		size_t bytes = s.lru.back().second->bytes.size();
+		s.entries.erase(s.lru.back().first);
+		s.lru.pop_back();
+		s.bytes -= bytes;
+		resident -= bytes;
+		eviction_count.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void texture_cache::set_budget(size_t bytes) {
+	budget_bytes = bytes;
+	for (shard& s : shards) {
+		std::lock_guard<std::mutex> lock(s.mutex);
+		evict(s, bytes / shard_count);
+	}
+	generation++;
+}
+
+void texture_cache::clear_tiles() {
+	for (shard& s : shards) {
+		std::lock_guard<std::mutex> lock(s.mutex);
+		resident -= s.bytes;
+		s.entries.clear();
+		s.lru.clear();
+		s.bytes = 0;
+	}
+	generation++;
+}
+
+void texture_cache::reset_stats() {
+	hit_count = 0;
+	miss_count = 0;
+	eviction_count = 0;
+}
+
+texture_cache_stats texture_cache::stats() const {
+	texture_cache_stats s;
+	s.hits = hit_count;
+	s.misses = miss_count;
+	s.evictions = eviction_count;
+	s.resident_bytes = resident;
+	s.budget_bytes = budget_bytes;
+	s.textures = static_cast<int>(textures.size());
+	return s;
+}
+
+inline color texture_cache::texel(texture_file& t, int handle, int level, int x, int y) {
+	const auto& lh = t.level_table[level];
+	int tile_index = (y / tile_size) * lh.tiles_x + x / tile_size;
+	auto data = get_tile(t, handle, level, tile_index);
+	size_t i = (size_t(y % tile_size) * tile_size + x % tile_size) * 3;
+	if (t.half) {
+		uint16_t v[3];
+		memcpy(v, &data->bytes[i * 2], sizeof(v));
+		return color(texture_cache_detail::half_to_float(v[0]), texture_cache_detail::half_to_float(v[1]),
+			texture_cache_detail::half_to_float(v[2]));
+	}
+	float v[3];
+	memcpy(v, &data->bytes[i * 4], sizeof(v));
+	return color(v[0], v[1], v[2]);
+}
+
+color texture_cache::bilinear(texture_file& t, int handle, int level, double u, double v) {
+	const auto& lh = t.level_table[level];
+	int w = lh.width, h = lh.height;
+	double x = (u - floor(u)) * w - 0.5;
+	double y = (1.0 - (v - floor(v))) * h - 0.5;	//image rows run top to bottom
+	double fx = floor(x), fy = floor(y);
+	double ax = x - fx, ay = y - fy;
+	int x0 = static_cast<int>(fx), y0 = static_cast<int>(fy);
+	int x1 = x0 + 1, y1 = y0 + 1;
+	auto wrap = [](int i, int n) { i %= n; return i < 0 ? i + n : i; };
+	x0 = wrap(x0, w); x1 = wrap(x1, w);
+	y0 = wrap(y0, h); y1 = wrap(y1, h);
+	return (1 - ay) * ((1 - ax) * texel(t, handle, level, x0, y0) + ax * texel(t, handle, level, x1, y0))
+		+ ay * ((1 - ax) * texel(t, handle, level, x0, y1) + ax * texel(t, handle, level, x1, y1));
+}
+
+color texture_cache::sample_level(int handle, double u, double v, int level) {
+	texture_file& t = textures[handle];
+	std::call_once(t.prepared, [&] { t.ok = prepare(t); });
+	if (!t.ok)
+		return color(0, 1, 1);	//cyan marks a broken texture, as in the book
+	return bilinear(t, handle, std::max(0, std::min(level, t.levels - 1)), u, v);
+}
+
+color texture_cache::sample(int handle, double u, double v, const texture_footprint& footprint) {
+	texture_file& t = textures[handle];
+	std::call_once(t.prepared, [&] { t.ok = prepare(t); });
+	if (!t.ok)
+		return color(0, 1, 1);
+
+	// the longer axis of the footprint in texels picks the level
+	double w = t.width, h = t.height;
+	double lx = (footprint.dudx * w) * (footprint.dudx * w) + (footprint.dvdx * h) * (footprint.dvdx * h);
+	double ly = (footprint.dudy * w) * (footprint.dudy * w) + (footprint.dvdy * h) * (footprint.dvdy * h);
+	double width2 = std::max(lx, ly);
+	double lod = width2 > 1 ? 0.5 * log2(width2) : 0;
+	if (lod <= 0)
+		return bilinear(t, handle, 0, u, v);
+	if (lod >= t.levels - 1)
+		return bilinear(t, handle, t.levels - 1, u, v);
+	int level = static_cast<int>(lod);
+	double f = lod - level;
+	return (1 - f) * bilinear(t, handle, level, u, v) + f * bilinear(t, handle, level + 1, u, v);
+}
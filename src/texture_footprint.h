@@ -0,0 +1,12 @@
+#pragma once
+
+#include "vec3.h"
+
+// How much of the surface one pixel covers around a hit, from the ray differentials:
+// the point offsets dpdx/dpdy and the matching texture coordinate derivatives.
+// All zero means "no estimate", textures then point sample their sharpest detail.
+struct texture_footprint {
+	double dudx = 0, dvdx = 0;
+	double dudy = 0, dvdy = 0;
+	vec3 dpdx, dpdy;
+};
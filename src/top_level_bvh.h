@@ -0,0 +1,165 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "instance.h"
+
+// Top level of a two-level acceleration structure: a flat BVH over instances.
+// Instances only store a transform and a pointer to their shared bottom-level object,
+// so after moving them rebuild() only has to sort the instance boxes, which takes
+// milliseconds even for tens of thousands of instances.
+class top_level_bvh : public hittable {
+public:
+	top_level_bvh() {}
+
+	void add(shared_ptr<instance> inst) { instances.push_back(inst); }
+	void clear() { instances.clear(); nodes.clear(); order.clear(); }
+
+	//call after adding instances or changing their transforms
+	void rebuild();
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+	using hittable::occluded;
+
+public:
+	std::vector<shared_ptr<instance>> instances;
+
+private:
+	struct node {
+		aabb box;
+		int offset;	//leaf: first entry in order, inner: right child (left child is this + 1)
+		int count;	//leaf: instance count, inner: -1 - split axis
+	};
+
+	int build_recursive(std::vector<point3>& centers, int start, int end);
+
+	std::vector<node> nodes;
+	std::vector<int> order;
+};
+
+void top_level_bvh::rebuild() {
+	nodes.clear();
+	order.clear();
+	if (instances.empty())
+		return;
+
+	std::vector<point3> centers(instances.size());
+	order.resize(instances.size());
+	for (size_t i = 0; i < instances.size(); i++) {
+		const aabb& b = instances[i]->world_box;
+		centers[i] = 0.5 * (b._min + b._max);
+		order[i] = static_cast<int>(i);
+	}
+	nodes.reserve(instances.size());
+	build_recursive(centers, 0, static_cast<int>(instances.size()));
+}
+
+//median split on the widest axis of the instance centers
+int top_level_bvh::build_recursive(std::vector<point3>& centers, int start, int end) {
+	int index = static_cast<int>(nodes.size());
+	nodes.push_back(node());
+
+	aabb box = instances[order[start]]->world_box;
+	point3 lo = centers[order[start]], hi = lo;
+	for (int i = start + 1; i < end; i++) {
+		box = surrounding_box(box, instances[order[i]]->world_box);
+		const point3& c = centers[order[i]];
+		for (int a = 0; a < 3; a++) {
+			lo.e[a] = fmin(lo.e[a], c.e[a]);
+			hi.e[a] = fmax(hi.e[a], c.e[a]);
+		}
+	}
+	nodes[index].box = box;
+
+	if (end - start <= 2) {
+		nodes[index].offset = start;
+		nodes[index].count = end - start;
+		return index;
+	}
+
+	int axis = 0;
+	for (int a = 1; a < 3; a++) {
+		if (hi[a] - lo[a] > hi[axis] - lo[axis])
+			axis = a;
+	}
+	int mid = start + (end - start) / 2;
+	std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+		[&](int a, int b) { return centers[a][axis] < centers[b][axis]; });
+
+	build_recursive(centers, start, mid);
+	nodes[index].offset = build_recursive(centers, mid, end);
+	nodes[index].count = -1 - axis;
+	return index;
+}
+
+bool top_level_bvh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	if (nodes.empty())
+		return false;
+
+	bool hit_anything = false;
+	int stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		const node& n = nodes[stack[--top]];
+		if (!n.box.hit(r, t_min, t_max))
+			continue;
+		if (n.count > 0) {
+			for (int i = n.offset; i < n.offset + n.count; i++) {
+				if (instances[order[i]]->hit(r, t_min, t_max, rec)) {
+					hit_anything = true;
+					t_max = rec.t;
+				}
+			}
+		}
+		else {
+			int left = static_cast<int>(&n - &nodes[0]) + 1;
+			if (r.direction()[-n.count - 1] < 0) {
+				stack[top++] = left;
+				stack[top++] = n.offset;
+			}
+			else {
+				stack[top++] = n.offset;
+				stack[top++] = left;
+			}
+		}
+	}
+	return hit_anything;
+}
+
+bool top_level_bvh::occluded(const ray& r, double t_min, double t_max) const {
+	if (nodes.empty())
+		return false;
+
+	int stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		const node& n = nodes[stack[--top]];
+		if (!n.box.hit(r, t_min, t_max))
+			continue;
+		if (n.count > 0) {
+			for (int i = n.offset; i < n.offset + n.count; i++) {
+				if (instances[order[i]]->occluded(r, t_min, t_max))
+					return true;
+			}
+		}
+		else {
+			stack[top++] = n.offset;
+			stack[top++] = static_cast<int>(&n - &nodes[0]) + 1;
+		}
+	}
+	return false;
+}
+
+bool top_level_bvh::bounding_box(double time0, double time1, aabb& output_box) const {
+	if (nodes.empty())
+		return false;
+	output_box = nodes[0].box;
+	return true;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "aabb.h"
+
+// Affine transform stored as a 3x4 matrix together with its inverse.
+class transform {
+public:
+	transform() {
+		for (int r = 0; r < 3; r++) {
+			for (int c = 0; c < 4; c++) {
+				m[r][c] = r == c ? 1.0 : 0.0;
+				inv[r][c] = m[r][c];
+			}
+		}
+	}
+
+	static transform translate(const vec3& offset) {
+		transform t;
+		for (int r = 0; r < 3; r++) {
+			t.m[r][3] = offset[r];
+			t.inv[r][3] = -offset[r];
+		}
+		return t;
+	}
+
+	static transform scale(double s) {
+		transform t;
+		for (int r = 0; r < 3; r++) {
+			t.m[r][r] = s;
+			t.inv[r][r] = 1.0 / s;
+		}
+		return t;
+	}
+
+	//rotation around the y axis, in degrees
+	static transform rotate_y(double degrees) {
+		transform t;
+		auto radians = degrees_to_radians(degrees);
+		auto s = sin(radians), c = cos(radians);
+		t.m[0][0] = c;  t.m[0][2] = s;
+		t.m[2][0] = -s; t.m[2][2] = c;
+		t.inv[0][0] = c; t.inv[0][2] = -s;
+		t.inv[2][0] = s; t.inv[2][2] = c;
+		return t;
+	}
+
+	//apply b first, then a
+	friend transform operator*(const transform& a, const transform& b) {
+		transform t;
+		multiply(a.m, b.m, t.m);
+		multiply(b.inv, a.inv, t.inv);
+		return t;
+	}
+
+	point3 point(const point3& p) const { return apply(m, p, 1.0); }
+	vec3 vector(const vec3& v) const { return apply(m, v, 0.0); }
+	point3 inverse_point(const point3& p) const { return apply(inv, p, 1.0); }
+	vec3 inverse_vector(const vec3& v) const { return apply(inv, v, 0.0); }
+
+	//normals go through the inverse transpose
+	vec3 normal(const vec3& n) const {
+		return vec3(
+			inv[0][0] * n[0] + inv[1][0] * n[1] + inv[2][0] * n[2],
+			inv[0][1] * n[0] + inv[1][1] * n[1] + inv[2][1] * n[2],
+			inv[0][2] * n[0] + inv[1][2] * n[1] + inv[2][2] * n[2]);
+	}
+
+	//box around the eight transformed corners
+	aabb box(const aabb& b) const {
+		point3 lo(infinity), hi(-infinity);
+		for (int i = 0; i < 8; i++) {
+			point3 corner(
+				(i & 1) ? b._max.x() : b._min.x(),
+				(i & 2) ? b._max.y() : b._min.y(),
+				(i & 4) ? b._max.z() : b._min.z());
+			point3 p = point(corner);
+			for (int a = 0; a < 3; a++) {
+				lo.e[a] = fmin(lo.e[a], p.e[a]);
+				hi.e[a] = fmax(hi.e[a], p.e[a]);
+			}
+		}
+		return aabb(lo, hi);
+	}
+
+public:
+	double m[3][4];
+	double inv[3][4];
+
+private:
+	static vec3 apply(const double x[3][4], const vec3& v, double w) {
+		return vec3(
+			x[0][0] * v[0] + x[0][1] * v[1] + x[0][2] * v[2] + x[0][3] * w,
+			x[1][0] * v[0] + x[1][1] * v[1] + x[1][2] * v[2] + x[1][3] * w,
+			x[2][0] * v[0] + x[2][1] * v[1] + x[2][2] * v[2] + x[2][3] * w);
+	}
+
+	static void multiply(const double a[3][4], const double b[3][4], double out[3][4]) {
+		for (int r = 0; r < 3; r++) {
+			for (int c = 0; c < 4; c++) {
+				out[r][c] = a[r][0] * b[0][c] + a[r][1] * b[1][c] + a[r][2] * b[2][c] + (c == 3 ? a[r][3] : 0.0);
+			}
+		}
+	}
+};
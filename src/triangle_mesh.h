@@ -0,0 +1,387 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RT_TRIANGLE_SSE 1
+#endif
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "flat_bvh.h"
+
+// Indexed triangle mesh data. Positions, normals and uvs are shared arrays;
+// every triangle corner stores an index into each of them (-1 when absent).
+struct mesh_data {
+	std::vector<point3> positions;
+	std::vector<vec3> normals;
+	std::vector<vec3> uvs;	//z unused
+
+	std::vector<int> position_indices;	//3 per triangle
+	std::vector<int> normal_indices;	//empty or 3 per triangle
+	std::vector<int> uv_indices;		//empty or 3 per triangle
+
+	size_t triangle_count() const { return position_indices.size() / 3; }
+
+	//scale and move the mesh so its largest extent is size and its bounds are centered at center
+	void fit_to_box(const point3& center, double size) {
+		if (positions.empty())
+			return;
+		point3 lo = positions[0], hi = positions[0];
+		for (const auto& p : positions) {
+			for (int a = 0; a < 3; a++) {
+				lo.e[a] = fmin(lo.e[a], p.e[a]);
+				hi.e[a] = fmax(hi.e[a], p.e[a]);
+			}
+		}
+		auto extent = hi - lo;
+		auto largest = fmax(extent.x(), fmax(extent.y(), extent.z()));
+		auto scale = largest > 0 ? size / largest : 1.0;
+		auto mid = 0.5 * (lo + hi);
+		for (auto& p : positions)
+			p = center + scale * (p - mid);
+	}
+};
+
+// Four triangles in SoA float layout, pre-transformed for Moller-Trumbore (v0, e1 = v1 - v0, e2 = v2 - v0).
+// Unused lanes are zero-area and never hit.
+struct triangle4 {
+	float v0[3][4];
+	float e1[3][4];
+	float e2[3][4];
+	int id[4];
+};
+
+// Triangle mesh hittable. Triangles are the primitives of the mesh's own BVH, so a
+// million-triangle mesh is one object in the scene BVH instead of a million hittables.
+// Leaves hold a triangle4 packet (several at the BVH depth limit) tested with a 4-wide SIMD kernel.
+class triangle_mesh : public hittable {
+public:
+	triangle_mesh() {}
+	triangle_mesh(shared_ptr<mesh_data> d, shared_ptr<material> m) : data(d), mat_ptr(m) { build(); }
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+	using hittable::occluded;
+
+	size_t node_count() const { return nodes.size(); }
+
+	// Scalar reference kernel for one packet, used to validate and benchmark the SIMD path.
+	static int intersect_scalar(const triangle4& tri, const float o[3], const float d[3],
+		float t_min, float& t_max, float& bu, float& bv);
+	// Returns the lane of the closest hit in (t_min, t_max) or -1; t_max, bu, bv are updated on a hit.
+	static int intersect(const triangle4& tri, const float o[3], const float d[3],
+		float t_min, float& t_max, float& bu, float& bv);
+
+public:
+	shared_ptr<mesh_data> data;
+	shared_ptr<material> mat_ptr;
+
+private:
+	void build();
+	void fill_record(const ray& r, int id, double t, float bu, float bv, hit_record& rec) const;
+
+	std::vector<flat_bvh_node> nodes;	//leaves point at their range of packets
+	std::vector<triangle4> packets;
+	aabb box;
+};
+
+inline int triangle_mesh::intersect_scalar(const triangle4& tri, const float o[3], const float d[3],
+	float t_min, float& t_max, float& bu, float& bv)
+{
+	int lane = -1;
+	for (int k = 0; k < 4; k++) {
+		float e1[3] = { tri.e1[0][k], tri.e1[1][k], tri.e1[2][k] };
+		float e2[3] = { tri.e2[0][k], tri.e2[1][k], tri.e2[2][k] };
+		float p[3] = { d[1] * e2[2] - d[2] * e2[1], d[2] * e2[0] - d[0] * e2[2], d[0] * e2[1] - d[1] * e2[0] };
+		float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+		if (fabs(det) < 1e-12f)
+			continue;
+		float inv = 1.0f / det;
+		float s[3] = { o[0] - tri.v0[0][k], o[1] - tri.v0[1][k], o[2] - tri.v0[2][k] };
+		float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv;
+		if (u < 0.0f || u > 1.0f)
+			continue;
+		float q[3] = { s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0] };
+		float v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * inv;
+		if (v < 0.0f || u + v > 1.0f)
+			continue;
+		float t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv;
+		if (t > t_min && t < t_max) {
+			t_max = t;
+			bu = u;
+			bv = v;
+			lane = k;
+		}
+	}
+	return lane;
+}
+
+#ifdef RT_TRIANGLE_SSE
+inline int triangle_mesh::intersect(const triangle4& tri, const float o[3], const float d[3],
+	float t_min, float& t_max, float& bu, float& bv)
+{
+	const __m128 dx = _mm_set1_ps(d[0]), dy = _mm_set1_ps(d[1]), dz = _mm_set1_ps(d[2]);
+	const __m128 e1x = _mm_loadu_ps(tri.e1[0]), e1y = _mm_loadu_ps(tri.e1[1]), e1z = _mm_loadu_ps(tri.e1[2]);
+	const __m128 e2x = _mm_loadu_ps(tri.e2[0]), e2y = _mm_loadu_ps(tri.e2[1]), e2z = _mm_loadu_ps(tri.e2[2]);
+
+	// p = d x e2, det = e1 . p
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 abs_det = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+	__m128 mask = _mm_cmpge_ps(abs_det, _mm_set1_ps(1e-12f));
+	__m128 inv = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+	// s = o - v0, u = (s . p) / det
+	__m128 sx = _mm_sub_ps(_mm_set1_ps(o[0]), _mm_loadu_ps(tri.v0[0]));
+	__m128 sy = _mm_sub_ps(_mm_set1_ps(o[1]), _mm_loadu_ps(tri.v0[1]));
+	__m128 sz = _mm_sub_ps(_mm_set1_ps(o[2]), _mm_loadu_ps(tri.v0[2]));
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv);
+
+	// q = s x e1, v = (d . q) / det, t = (e2 . q) / det
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv);
+	__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv);
+
+	const __m128 zero = _mm_setzero_ps();
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+	mask = _mm_and_ps(mask, _mm_cmpgt_ps(t, _mm_set1_ps(t_min)));
+	mask = _mm_and_ps(mask, _mm_cmplt_ps(t, _mm_set1_ps(t_max)));
+
+	int bits = _mm_movemask_ps(mask);
+	if (bits == 0)
+		return -1;
+
+	alignas(16) float ts[4], us[4], vs[4];
+	_mm_store_ps(ts, t);
+	_mm_store_ps(us, u);
+	_mm_store_ps(vs, v);
+	int lane = -1;
+	for (int k = 0; k < 4; k++) {
+		if ((bits & (1 << k)) && ts[k] < t_max) {
+			t_max = ts[k];
+			lane = k;
+		}
+	}
+	bu = us[lane];
+	bv = vs[lane];
+	return lane;
+}
+#else
+inline int triangle_mesh::intersect(const triangle4& tri, const float o[3], const float d[3],
+	float t_min, float& t_max, float& bu, float& bv)
+{
+	return intersect_scalar(tri, o, d, t_min, t_max, bu, bv);
+}
+#endif
+
+void triangle_mesh::build() {
+	nodes.clear();
+	packets.clear();
+	if (!data || data->triangle_count() == 0)
+		return;
+
+	const auto& pos = data->positions;
+	const auto& idx = data->position_indices;
+	int tri_count = static_cast<int>(data->triangle_count());
+
+	std::vector<bvh_build_ref> refs(tri_count);
+	for (int i = 0; i < tri_count; i++) {
+		auto& ref = refs[i];
+		const point3& a = pos[idx[3 * i]];
+		const point3& b = pos[idx[3 * i + 1]];
+		const point3& c = pos[idx[3 * i + 2]];
+		for (int k = 0; k < 3; k++) {
+			ref.bmin[k] = static_cast<float>(fmin(a[k], fmin(b[k], c[k])));
+			ref.bmax[k] = static_cast<float>(fmax(a[k], fmax(b[k], c[k])));
+			ref.centroid[k] = 0.5f * (ref.bmin[k] + ref.bmax[k]);
+		}
+		ref.id = i;
+	}
+	build_flat_bvh(refs, 4, nodes);
+
+	// pack every leaf's triangles into triangle4s, one unless the leaf is at the depth limit
+	packets.reserve(nodes.size() / 2 + 1);
+	for (auto& n : nodes) {
+		if (n.count <= 0)
+			continue;
+		int first = static_cast<int>(packets.size());
+		for (int p = 0; p < n.count; p += 4) {
+			triangle4 packet = {};
+			for (int k = 0; k < 4; k++) {
+				packet.id[k] = -1;
+				if (p + k >= n.count)
+					continue;
+				int id = refs[n.offset + p + k].id;
+				const point3& a = pos[idx[3 * id]];
+				const point3& b = pos[idx[3 * id + 1]];
+				const point3& c = pos[idx[3 * id + 2]];
+				for (int axis = 0; axis < 3; axis++) {
+					packet.v0[axis][k] = static_cast<float>(a[axis]);
+					packet.e1[axis][k] = static_cast<float>(b[axis] - a[axis]);
+					packet.e2[axis][k] = static_cast<float>(c[axis] - a[axis]);
+				}
+				packet.id[k] = id;
+			}
+			packets.push_back(packet);
+		}
+		n.offset = first;
+		n.count = static_cast<int>(packets.size()) - first;	//now in packets
+	}
+
+	const auto& root = nodes[0];
+	box = aabb(point3(root.bmin[0], root.bmin[1], root.bmin[2]), point3(root.bmax[0], root.bmax[1], root.bmax[2]));
+}
+
+void triangle_mesh::fill_record(const ray& r, int id, double t, float bu, float bv, hit_record& rec) const {
+	const auto& pos = data->positions;
+	const int* corner = &data->position_indices[3 * id];
+	const point3& a = pos[corner[0]];
+	const point3& b = pos[corner[1]];
+	const point3& c = pos[corner[2]];
+	double w = 1.0 - bu - bv;
+
+	rec.t = t;
+	rec.p = r.at(t);
+
+	vec3 outward_normal;
+	const int* n = data->normal_indices.empty() ? nullptr : &data->normal_indices[3 * id];
+	if (n && n[0] >= 0 && n[1] >= 0 && n[2] >= 0) {
+		outward_normal = unit_vector(w * data->normals[n[0]] + bu * data->normals[n[1]] + bv * data->normals[n[2]]);
+	}
+	else {
+		outward_normal = unit_vector(cross(b - a, c - a));
+	}
+	rec.set_face_normal(r, outward_normal);
+
+	const int* uv = data->uv_indices.empty() ? nullptr : &data->uv_indices[3 * id];
+	if (uv && uv[0] >= 0 && uv[1] >= 0 && uv[2] >= 0) {
+		const vec3& t0 = data->uvs[uv[0]];
+		const vec3& t1 = data->uvs[uv[1]];
+		const vec3& t2 = data->uvs[uv[2]];
+		vec3 st = w * t0 + bu * t1 + bv * t2;
+		rec.u = st.x();
+		rec.v = st.y();
+
+		// solve the edge vectors for the partials of the texture parameterization
+		vec3 d02 = t0 - t2, d12 = t1 - t2;
+		double det = d02.x() * d12.y() - d02.y() * d12.x();
+		if (fabs(det) > 1e-12) {
+			vec3 p02 = a - c, p12 = b - c;
+			rec.dpdu = (d12.y() * p02 - d02.y() * p12) / det;
+			rec.dpdv = (d02.x() * p12 - d12.x() * p02) / det;
+		}
+		else {
+			rec.dpdu = rec.dpdv = vec3();
+		}
+	}
+	else {
+		rec.u = bu;
+		rec.v = bv;
+		rec.dpdu = b - a;
+		rec.dpdv = c - a;
+	}
+	rec.dndu = rec.dndv = vec3();	//flat for the differentials, shading normals are not differentiated
+	rec.mat_ptr = mat_ptr;
+}
+
+bool triangle_mesh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	if (nodes.empty())
+		return false;
+
+	float o[3], d[3], inv_d[3];
+	for (int a = 0; a < 3; a++) {
+		o[a] = static_cast<float>(r.origin()[a]);
+		d[a] = static_cast<float>(r.direction()[a]);
+		inv_d[a] = 1.0f / d[a];
+	}
+	float tmin = static_cast<float>(t_min);
+	float closest = t_max < infinity ? static_cast<float>(t_max) : float_infinity;
+	int hit_id = -1;
+	float hit_u = 0, hit_v = 0;
+
+	int stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		const flat_bvh_node& n = nodes[stack[--top]];
+		if (!flat_node_hit(n, o, inv_d, tmin, closest))
+			continue;
+		if (n.count > 0) {
+			for (int p = n.offset; p < n.offset + n.count; p++) {
+				int lane = intersect(packets[p], o, d, tmin, closest, hit_u, hit_v);
+				if (lane >= 0)
+					hit_id = packets[p].id[lane];
+			}
+		}
+		else {
+			// visit the near child first so the far one is culled by a shorter closest
+			int left = static_cast<int>(&n - &nodes[0]) + 1;
+			int right = n.offset;
+			if (d[-n.count - 1] < 0.0f) {
+				stack[top++] = left;
+				stack[top++] = right;
+			}
+			else {
+				stack[top++] = right;
+				stack[top++] = left;
+			}
+		}
+	}
+
+	if (hit_id < 0)
+		return false;
+	fill_record(r, hit_id, closest, hit_u, hit_v, rec);
+	return true;
+}
+
+bool triangle_mesh::occluded(const ray& r, double t_min, double t_max) const {
+	if (nodes.empty())
+		return false;
+
+	float o[3], d[3], inv_d[3];
+	for (int a = 0; a < 3; a++) {
+		o[a] = static_cast<float>(r.origin()[a]);
+		d[a] = static_cast<float>(r.direction()[a]);
+		inv_d[a] = 1.0f / d[a];
+	}
+	float tmin = static_cast<float>(t_min);
+	float tmax = t_max < infinity ? static_cast<float>(t_max) : float_infinity;
+
+	int stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		const flat_bvh_node& n = nodes[stack[--top]];
+		if (!flat_node_hit(n, o, inv_d, tmin, tmax))
+			continue;
+		if (n.count > 0) {
+			for (int p = n.offset; p < n.offset + n.count; p++) {
+				float limit = tmax, bu, bv;
+				if (intersect(packets[p], o, d, tmin, limit, bu, bv) >= 0)
+					return true;
+			}
+		}
+		else {
+			stack[top++] = n.offset;
+			stack[top++] = static_cast<int>(&n - &nodes[0]) + 1;
+		}
+	}
+	return false;
+}
+
+bool triangle_mesh::bounding_box(double time0, double time1, aabb& output_box) const {
+	if (nodes.empty())
+		return false;
+	output_box = box;
+	return true;
+}
@@ -114,6 +114,11 @@ inline vec3 unit_vector(vec3 v) {
     return v / v.length();
 }
 
+// Rec. 709 luminance of a linear color
+inline double luminance(const color& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 vec3 random_in_unit_sphere() {
     while (true) {
         auto p = vec3::random(-1, 1);